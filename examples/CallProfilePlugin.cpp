@@ -0,0 +1,355 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "CallProfilePlugin.h"
+#include "SlabMemoryManager.h"
+
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/ExecutionEngine/JITLink/x86_64.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Triple.h"
+
+#include <algorithm>
+
+using namespace llvm;
+using namespace llvm::jitlink;
+using namespace llvm::orc;
+
+/// The trampoline that counts a call: incq Counter(%rip); jmp Callee.
+static const char TrampolineContent[] = "\x48\xff\x05\0\0\0\0"
+                                        "\xe9\0\0\0\0";
+static constexpr uint64_t TrampolineSize = sizeof(TrampolineContent) - 1;
+static constexpr Edge::OffsetT CounterFixupOffset = 3;
+static constexpr Edge::OffsetT CalleeFixupOffset = 8;
+
+/// The name of the function that symbol Name belongs to: the lazy drivers
+/// and tier-up name bodies <name>$impl, <name>$2$impl, <name>$impl$tier1...
+static StringRef getFunctionName(StringRef Name) {
+  return Name.split('$').first;
+}
+
+static bool isCode(const Section &Sec) {
+  return (Sec.getMemProt() & MemProt::Exec) != MemProt::None;
+}
+
+/// Whether Sym is a named function.
+static bool isFunction(const Symbol &Sym) {
+  return Sym.hasName() && Sym.isCallable() &&
+         isCode(Sym.getBlock().getSection());
+}
+
+/// Whether Name is that of a top-level expression (see
+/// KaleidoscopeParser::parse).
+static bool isTopLevelExprName(StringRef Name) {
+  return Name.startswith("expr.");
+}
+
+CallProfilePlugin::CallProfilePlugin(SlabMemoryManager *Slab, bool Instrument)
+    : Slab(Slab), Instrument(Instrument) {
+  if (Slab)
+    Slab->setCodePlacement(
+        [this](LinkGraph &G) { return getHotNeighbour(G); });
+}
+
+CallProfilePlugin::~CallProfilePlugin() {
+  // The slab belongs to the executor process control, which outlives the
+  // linking layer and its plugins.
+  if (Slab)
+    Slab->setCodePlacement(nullptr);
+}
+
+void CallProfilePlugin::modifyPassConfig(MaterializationResponsibility &MR,
+                                         LinkGraph &G,
+                                         PassConfiguration &Config) {
+  // Calls are redirected before pruning, so that the trampolines and their
+  // counters are allocated with the graph, and the counters are found once
+  // they have addresses.
+  auto Sites = std::make_shared<std::vector<CallSite>>();
+  if (Instrument)
+    Config.PrePrunePasses.push_back(
+        [this, Sites](LinkGraph &G) { return instrument(G, *Sites); });
+  Config.PostAllocationPasses.push_back([this, &MR, Sites](LinkGraph &G) {
+    auto Code = getLinkedCode(G, *Sites);
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Pending[&MR] = std::move(Code);
+    return Error::success();
+  });
+}
+
+Error CallProfilePlugin::instrument(LinkGraph &G,
+                                    std::vector<CallSite> &Sites) {
+  if (G.getTargetTriple().getArch() != Triple::x86_64)
+    return Error::success();
+
+  // The functions in each block of code, by offset, to find the caller of
+  // each call.
+  DenseMap<Block *, SmallVector<Symbol *, 1>> FunctionsIn;
+  for (auto *Sym : G.defined_symbols())
+    if (isFunction(*Sym))
+      FunctionsIn[&Sym->getBlock()].push_back(Sym);
+  for (auto &[B, Syms] : FunctionsIn)
+    llvm::sort(Syms, [](const Symbol *LHS, const Symbol *RHS) {
+      return LHS->getOffset() < RHS->getOffset();
+    });
+
+  /// Call - A direct call by Caller, through E.
+  struct Call {
+    Symbol *Caller;
+    Edge *E;
+  };
+  std::vector<Call> Calls;
+  for (auto *B : G.blocks()) {
+    auto FI = FunctionsIn.find(B);
+    if (FI == FunctionsIn.end())
+      continue;
+    auto &Syms = FI->second;
+    for (auto &E : B->edges()) {
+      if (E.getKind() != x86_64::BranchPCRel32 || E.getAddend() != 0 ||
+          !E.getTarget().hasName())
+        continue;
+      auto I = llvm::upper_bound(Syms, E.getOffset(),
+                                 [](Edge::OffsetT Offset, const Symbol *Sym) {
+                                   return Offset < Sym->getOffset();
+                                 });
+      if (I == Syms.begin() ||
+          isTopLevelExprName(getFunctionName((*std::prev(I))->getName())))
+        continue;
+      Calls.push_back({*std::prev(I), &E});
+    }
+  }
+  if (Calls.empty())
+    return Error::success();
+
+  auto &Trampolines = G.createSection("$__CALL_TRAMPOLINES",
+                                      MemProt::Read | MemProt::Exec);
+  auto &Counters =
+      G.createSection("$__CALL_COUNTERS", MemProt::Read | MemProt::Write);
+  ArrayRef<char> Content(TrampolineContent, TrampolineSize);
+
+  // One trampoline per caller and callee.
+  DenseMap<std::pair<Symbol *, Symbol *>, Symbol *> TrampolineFor;
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (auto &C : Calls) {
+    auto &Callee = C.E->getTarget();
+    auto &Trampoline = TrampolineFor[{C.Caller, &Callee}];
+    if (!Trampoline) {
+      auto &CounterBlock =
+          G.createZeroFillBlock(Counters, sizeof(uint64_t), ExecutorAddr(),
+                                alignof(uint64_t), 0);
+      // The counter is live so that it outlives pruning, which drops the
+      // trampoline if the caller turns out to be dead.
+      auto &Counter = G.addAnonymousSymbol(CounterBlock, 0, sizeof(uint64_t),
+                                           /*IsCallable=*/false,
+                                           /*IsLive=*/true);
+      auto &B = G.createContentBlock(Trampolines, Content, ExecutorAddr(),
+                                     16, 0);
+      // The displacement is relative to the end of the instruction.
+      B.addEdge(x86_64::Delta32, CounterFixupOffset, Counter, -4);
+      B.addEdge(x86_64::BranchPCRel32, CalleeFixupOffset, Callee, 0);
+      Trampoline = &G.addAnonymousSymbol(B, 0, TrampolineSize,
+                                         /*IsCallable=*/true,
+                                         /*IsLive=*/false);
+      Sites.push_back({getEdge(getFunctionName(C.Caller->getName()),
+                               getFunctionName(Callee.getName())),
+                       &Counter});
+    }
+    C.E->setTarget(*Trampoline);
+  }
+  return Error::success();
+}
+
+CallProfilePlugin::LinkedCode
+CallProfilePlugin::getLinkedCode(LinkGraph &G, ArrayRef<CallSite> Sites) {
+  LinkedCode Code;
+  for (auto &[E, Counter] : Sites)
+    Code.Counters.push_back(
+        {E, Counter->getAddress().toPtr<const uint64_t *>()});
+  for (auto *Sym : G.defined_symbols())
+    if (isFunction(*Sym))
+      Code.Functions.push_back(
+          {getFunctionName(Sym->getName()).str(),
+           {Sym->getAddress(), Sym->getAddress() + Sym->getSize()}});
+  return Code;
+}
+
+std::optional<ExecutorAddrRange>
+CallProfilePlugin::getHotNeighbour(LinkGraph &G) {
+  std::optional<ExecutorAddrRange> Neighbour;
+  uint64_t MaxCalls = 0;
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (auto *Sym : G.defined_symbols()) {
+    if (!isFunction(*Sym))
+      continue;
+    StringRef Name = getFunctionName(Sym->getName());
+    auto I = EdgesOf.find(Name);
+    if (I == EdgesOf.end())
+      continue;
+    for (auto E : I->second) {
+      auto &[Caller, Callee] = E->first;
+      StringRef Other = Caller == Name ? Callee : Caller;
+      if (Other == Name)
+        continue;
+      auto P = Placed.find(Other);
+      if (P == Placed.end())
+        continue;
+      uint64_t Calls = getCalls(E->second);
+      if (Calls > MaxCalls) {
+        MaxCalls = Calls;
+        Neighbour = P->second;
+      }
+    }
+  }
+  return Neighbour;
+}
+
+CallProfilePlugin::CallEdgeRef CallProfilePlugin::getEdge(StringRef Caller,
+                                                          StringRef Callee) {
+  auto [E, New] = Edges.try_emplace({Caller.str(), Callee.str()});
+  if (New) {
+    EdgesOf[Caller].push_back(E);
+    if (Callee != Caller)
+      EdgesOf[Callee].push_back(E);
+  }
+  return E;
+}
+
+uint64_t CallProfilePlugin::getCalls(const CallEdge &E) {
+  // JIT'd code updates the counters without synchronization, so a count
+  // read while it runs may be a few calls behind.
+  uint64_t Calls = E.Calls;
+  for (auto *Counter : E.Counters)
+    Calls += *static_cast<const volatile uint64_t *>(Counter);
+  return Calls;
+}
+
+void CallProfilePlugin::retire(LinkedCode &Code) {
+  for (auto &[E, Counter] : Code.Counters) {
+    E->second.Calls += *Counter;
+    auto &Counters = E->second.Counters;
+    Counters.erase(llvm::find(Counters, Counter));
+  }
+  for (auto &[Name, Range] : Code.Functions) {
+    auto I = Placed.find(Name);
+    if (I != Placed.end() && I->second.Start == Range.Start)
+      Placed.erase(I);
+  }
+}
+
+Error CallProfilePlugin::notifyEmitted(MaterializationResponsibility &MR) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto I = Pending.find(&MR);
+  if (I == Pending.end())
+    return Error::success();
+  auto Code = std::move(I->second);
+  Pending.erase(I);
+
+  // Only now is the code there to stay, until it is removed.
+  return MR.withResourceKeyDo([&](ResourceKey K) {
+    for (auto &[E, Counter] : Code.Counters)
+      E->second.Counters.push_back(Counter);
+    for (auto &[Name, Range] : Code.Functions)
+      Placed[Name] = Range;
+
+    auto &KeyCode = Live[K];
+    llvm::append_range(KeyCode.Counters, Code.Counters);
+    llvm::append_range(KeyCode.Functions, Code.Functions);
+  });
+}
+
+Error CallProfilePlugin::notifyFailed(MaterializationResponsibility &MR) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Pending.erase(&MR);
+  return Error::success();
+}
+
+Error CallProfilePlugin::notifyRemovingResources(JITDylib &JD,
+                                                 ResourceKey K) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto I = Live.find(K);
+  if (I != Live.end()) {
+    retire(I->second);
+    Live.erase(I);
+  }
+  return Error::success();
+}
+
+void CallProfilePlugin::notifyTransferringResources(JITDylib &JD,
+                                                    ResourceKey DstKey,
+                                                    ResourceKey SrcKey) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto I = Live.find(SrcKey);
+  if (I == Live.end())
+    return;
+  auto Code = std::move(I->second);
+  Live.erase(I);
+  auto &DstCode = Live[DstKey];
+  llvm::append_range(DstCode.Counters, Code.Counters);
+  llvm::append_range(DstCode.Functions, Code.Functions);
+}
+
+std::vector<CallProfilePlugin::CallCount> CallProfilePlugin::getProfile() {
+  std::vector<CallCount> Profile;
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &[Names, E] : Edges)
+      if (uint64_t Calls = getCalls(E))
+        Profile.push_back({Names.first, Names.second, Calls});
+  }
+  llvm::stable_sort(Profile, [](const CallCount &LHS, const CallCount &RHS) {
+    return LHS.Calls > RHS.Calls;
+  });
+  return Profile;
+}
+
+void CallProfilePlugin::printProfile(raw_ostream &OS, size_t MaxPairs) {
+  auto Profile = getProfile();
+  uint64_t Calls = 0;
+  for (auto &C : Profile)
+    Calls += C.Calls;
+  OS << formatv("{0} calls between {1} pairs of functions\n", Calls,
+                Profile.size());
+  Profile.resize(std::min(Profile.size(), MaxPairs));
+  for (auto &C : Profile)
+    OS << formatv("  {0,12}  {1} -> {2}\n", C.Calls, C.Caller, C.Callee);
+  if (Slab)
+    OS << formatv("{0} objects placed within a page of their hottest caller "
+                  "or callee\n",
+                  Slab->getStats().Placed);
+}
+
+Error CallProfilePlugin::readProfile(StringRef Path) {
+  auto Buf = MemoryBuffer::getFile(Path);
+  if (!Buf)
+    return createFileError(Path, Buf.getError());
+
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (line_iterator I(**Buf, /*SkipBlanks=*/true); !I.is_at_end(); ++I) {
+    SmallVector<StringRef, 3> Fields;
+    I->split(Fields, ' ', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+    uint64_t Calls;
+    if (Fields.size() != 3 || Fields[0].getAsInteger(10, Calls))
+      return make_error<StringError>(
+          formatv("{0}:{1}: expected '<calls> <caller> <callee>'", Path,
+                  I.line_number())
+              .str(),
+          inconvertibleErrorCode());
+    getEdge(Fields[1], Fields[2])->second.Calls += Calls;
+  }
+  return Error::success();
+}
+
+Error CallProfilePlugin::writeProfile(StringRef Path) {
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+  if (EC)
+    return createFileError(Path, EC);
+  for (auto &C : getProfile())
+    OS << C.Calls << ' ' << C.Caller << ' ' << C.Callee << '\n';
+  OS.close();
+  if (OS.has_error())
+    return createFileError(Path, OS.error());
+  return Error::success();
+}
@@ -0,0 +1,156 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef CALL_PROFILE_PLUGIN_H
+#define CALL_PROFILE_PLUGIN_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h"
+#include "llvm/Support/Error.h"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+class raw_ostream;
+} // end namespace llvm
+
+class SlabMemoryManager;
+
+/// CallProfilePlugin - Counts the calls between JIT'd functions, and lays out
+/// the code of functions that call each other often next to each other.
+///
+/// Before each LinkGraph is pruned, the plugin points every direct call in
+/// it at a trampoline of its own, which counts the call in a counter in the
+/// graph's data and jumps on to the callee. Each pair of caller and callee
+/// in a graph shares a trampoline. Functions are known by their name in the
+/// source, without the $-suffixes that the lazy drivers and tier-up give
+/// their bodies, so the calls to and from all definitions of a function add
+/// up, and counts outlive the code that made them.
+///
+/// Given the JIT's SlabMemoryManager, the plugin places the code of every
+/// graph as close as the slab allows to the linked function that its own
+/// functions call, or are called by, most often so far (see
+/// SlabMemoryManager::setCodePlacement). That is the case for functions that
+/// are compiled lazily on their first call, redefined or tiered up, and for
+/// every function given a profile saved by an earlier session.
+///
+/// Calls from top-level expressions are not counted: each is run once and
+/// removed, so they would only add an edge per expression.
+///
+/// Without instrumentation, the plugin only lays out code, by the counts read
+/// from an earlier session's profile, and JIT'd code runs as compiled.
+///
+/// The counters are read in place, so JIT'd code has to run in process.
+/// Only x86-64 calls are counted.
+class CallProfilePlugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+public:
+  /// CallCount - How often Caller called Callee.
+  struct CallCount {
+    std::string Caller;
+    std::string Callee;
+    uint64_t Calls;
+  };
+
+  /// Lay out code in Slab, if not null, and count calls if Instrument is
+  /// set.
+  CallProfilePlugin(SlabMemoryManager *Slab, bool Instrument = true);
+  ~CallProfilePlugin() override;
+
+  void modifyPassConfig(llvm::orc::MaterializationResponsibility &MR,
+                        llvm::jitlink::LinkGraph &G,
+                        llvm::jitlink::PassConfiguration &Config) override;
+
+  llvm::Error
+  notifyEmitted(llvm::orc::MaterializationResponsibility &MR) override;
+  llvm::Error
+  notifyFailed(llvm::orc::MaterializationResponsibility &MR) override;
+  llvm::Error notifyRemovingResources(llvm::orc::JITDylib &JD,
+                                      llvm::orc::ResourceKey K) override;
+  void notifyTransferringResources(llvm::orc::JITDylib &JD,
+                                   llvm::orc::ResourceKey DstKey,
+                                   llvm::orc::ResourceKey SrcKey) override;
+
+  /// Return the pairs of functions that called each other, most calls first.
+  std::vector<CallCount> getProfile();
+  void printProfile(llvm::raw_ostream &OS, size_t MaxPairs = 20);
+
+  /// Add the counts in a profile written by writeProfile to this one.
+  llvm::Error readProfile(llvm::StringRef Path);
+
+  /// Write the profile to Path, one "<calls> <caller> <callee>" per line.
+  llvm::Error writeProfile(llvm::StringRef Path);
+
+private:
+  /// CallEdge - The calls from one function to another.
+  struct CallEdge {
+    uint64_t Calls = 0; // Made by code that is no longer linked.
+    /// The counters in linked code, which JIT'd code updates as it runs.
+    llvm::SmallVector<const uint64_t *, 1> Counters;
+  };
+  using CallEdgeRef =
+      std::map<std::pair<std::string, std::string>, CallEdge>::iterator;
+
+  /// LinkedCode - What the plugin keeps track of for a linked graph.
+  struct LinkedCode {
+    std::vector<std::pair<CallEdgeRef, const uint64_t *>> Counters;
+    std::vector<std::pair<std::string, llvm::orc::ExecutorAddrRange>>
+        Functions;
+  };
+
+  /// CallSite - A trampoline added to a graph, by the symbol of its counter.
+  using CallSite = std::pair<CallEdgeRef, llvm::jitlink::Symbol *>;
+
+  /// Count the calls in G through trampolines, appending them to Sites.
+  llvm::Error instrument(llvm::jitlink::LinkGraph &G,
+                         std::vector<CallSite> &Sites);
+
+  /// Return what to keep track of for G once it has been allocated.
+  static LinkedCode getLinkedCode(llvm::jitlink::LinkGraph &G,
+                                  llvm::ArrayRef<CallSite> Sites);
+
+  /// Return the code of the linked function that calls, or is called by,
+  /// the functions in G most often.
+  std::optional<llvm::orc::ExecutorAddrRange>
+  getHotNeighbour(llvm::jitlink::LinkGraph &G);
+
+  /// Return the edge from Caller to Callee, adding it if it is new. Called
+  /// with Mutex held.
+  CallEdgeRef getEdge(llvm::StringRef Caller, llvm::StringRef Callee);
+
+  /// Stop reading the counters of Code, which is being removed, adding what
+  /// they counted to their edges. Called with Mutex held.
+  void retire(LinkedCode &Code);
+
+  static uint64_t getCalls(const CallEdge &E);
+
+  SlabMemoryManager *Slab;
+  bool Instrument;
+
+  std::mutex Mutex;
+  std::map<std::pair<std::string, std::string>, CallEdge> Edges;
+
+  /// The edges from and to each function.
+  llvm::StringMap<std::vector<CallEdgeRef>> EdgesOf;
+
+  /// The code of the latest linked definition of each function.
+  llvm::StringMap<llvm::orc::ExecutorAddrRange> Placed;
+
+  /// Code being linked, until it is emitted.
+  llvm::DenseMap<llvm::orc::MaterializationResponsibility *, LinkedCode>
+      Pending;
+
+  /// Emitted code, by the resource key that owns it.
+  llvm::DenseMap<llvm::orc::ResourceKey, LinkedCode> Live;
+};
+
+#endif // CALL_PROFILE_PLUGIN_H
@@ -0,0 +1,301 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "CompactionPlugin.h"
+#include "SlabMemoryManager.h"
+
+#include "llvm/ADT/DenseSet.h"
+
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/ExecutionEngine/JITLink/x86_64.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Triple.h"
+
+#include <memory>
+
+using namespace llvm;
+using namespace llvm::jitlink;
+using namespace llvm::orc;
+
+/// The size of the entries of constant pool section Sec, e.g. 8 for
+/// .rodata.cst8, or 0 if Sec is not one. JITLink maps all ELF data writable,
+/// so the name is all there is to go by.
+static uint64_t getConstantPoolEntrySize(const Section &Sec) {
+  StringRef Name = Sec.getName();
+  uint64_t EntrySize;
+  if (!Name.consume_front(".rodata.cst") || Name.getAsInteger(10, EntrySize))
+    return 0;
+  // Smaller entries are not worth an entry of their own.
+  return EntrySize >= 8 ? EntrySize : 0;
+}
+
+/// Whether E may refer to a constant pool entry from Bias bytes before its
+/// start: PC-relative loads are biased by the size of whatever follows the
+/// displacement in the instruction, and pointers are never biased.
+static bool isConstantReference(const Edge &E, int64_t Bias,
+                                uint64_t EntrySize) {
+  switch (E.getKind()) {
+  case x86_64::Pointer64:
+  case x86_64::Delta64:
+    return Bias == 0;
+  case x86_64::Delta32:
+  case x86_64::PCRel32:
+    return Bias <= 0 && Bias > -int64_t(EntrySize);
+  default:
+    return false;
+  }
+}
+
+void CompactionPlugin::modifyPassConfig(MaterializationResponsibility &MR,
+                                        LinkGraph &G,
+                                        PassConfiguration &Config) {
+  // The pools are split before pruning, which drops what is left of them.
+  auto R = std::make_shared<Rewrite>();
+  Config.PrePrunePasses.push_back(
+      [this, &MR, R](LinkGraph &G) { return compact(MR, G, *R); });
+  Config.PostPrunePasses.push_back([this, R](LinkGraph &G) {
+    countSavings(G, *R);
+    return Error::success();
+  });
+}
+
+Error CompactionPlugin::compact(MaterializationResponsibility &MR,
+                                LinkGraph &G, Rewrite &Rw) {
+  if (G.getTargetTriple().getArch() != Triple::x86_64)
+    return Error::success();
+
+  /// Pool - A constant pool block, which can only be split if nothing
+  /// refers to it other than through references to whole entries.
+  struct Pool {
+    uint64_t EntrySize;
+    bool Splittable = true;
+  };
+  DenseMap<Block *, Pool> Pools;
+  for (auto &Sec : G.sections()) {
+    uint64_t EntrySize = getConstantPoolEntrySize(Sec);
+    if (!EntrySize)
+      continue;
+    for (auto *B : Sec.blocks())
+      if (!B->isZeroFill() && B->edges_empty() &&
+          B->getSize() % EntrySize == 0 && B->getAlignmentOffset() == 0)
+        Pools[B] = {EntrySize};
+  }
+  if (Pools.empty())
+    return Error::success();
+
+  // Symbols that are live or visible to other graphs keep their pool whole.
+  for (auto *Sym : G.defined_symbols())
+    if (Sym->isLive() || Sym->getScope() != Scope::Local) {
+      auto I = Pools.find(&Sym->getBlock());
+      if (I != Pools.end())
+        I->second.Splittable = false;
+    }
+
+  /// Reference - Edge E, to entry Entry of a pool, Bias bytes before it.
+  struct Reference {
+    Edge *E;
+    Block *PoolBlock;
+    uint64_t Entry;
+    int64_t Bias;
+  };
+  std::vector<Reference> References;
+  for (auto *B : G.blocks())
+    for (auto &E : B->edges()) {
+      auto &Target = E.getTarget();
+      if (!Target.isDefined())
+        continue;
+      auto I = Pools.find(&Target.getBlock());
+      if (I == Pools.end())
+        continue;
+      int64_t N = I->second.EntrySize;
+      int64_t Offset = Target.getOffset() + E.getAddend();
+      int64_t Entry = Offset > -N ? (Offset + N - 1) / N : -1;
+      int64_t Bias = Offset - Entry * N;
+      if (Entry < 0 || Entry >= int64_t(I->first->getSize() / N) ||
+          !isConstantReference(E, Bias, N)) {
+        I->second.Splittable = false;
+        continue;
+      }
+      References.push_back({&E, I->first, uint64_t(Entry), Bias});
+    }
+
+  // References now go to one symbol per value: a copy of the entry in the
+  // graph or a local absolute symbol at the shared copy.
+  DenseMap<std::pair<Block *, uint64_t>, Symbol *> EntryCopies;
+  std::map<StringRef, Symbol *> ValueCopies;
+  DenseSet<Block *> SplitPools;
+  std::vector<SharedConstantRef> Used;
+
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (auto &R : References) {
+    auto &P = Pools[R.PoolBlock];
+    if (!P.Splittable)
+      continue;
+
+    auto [EntryI, NewEntry] =
+        EntryCopies.try_emplace({R.PoolBlock, R.Entry}, nullptr);
+    if (NewEntry) {
+      ++S.Constants;
+      uint64_t Offset = R.Entry * P.EntrySize;
+      ArrayRef<char> Content =
+          R.PoolBlock->getContent().slice(Offset, P.EntrySize);
+      StringRef Value(Content.data(), Content.size());
+      auto [ValueI, NewValue] = ValueCopies.try_emplace(Value, nullptr);
+      auto *&Sym = ValueI->second;
+      if (!NewValue)
+        ++S.Merged;
+      else if (auto Addr = Slab ? getSharedConstant(Value, Used)
+                                : std::nullopt)
+        Sym = &G.addAbsoluteSymbol("", *Addr, P.EntrySize, Linkage::Strong,
+                                   Scope::Local, /*IsLive=*/false);
+      else {
+        auto &EntryBlock = G.createContentBlock(
+            R.PoolBlock->getSection(), Content,
+            R.PoolBlock->getAddress() + Offset, P.EntrySize, 0);
+        Sym = &G.addAnonymousSymbol(EntryBlock, 0, P.EntrySize,
+                                    /*IsCallable=*/false, /*IsLive=*/false);
+        Rw.Copies.push_back({&EntryBlock, P.EntrySize});
+      }
+      EntryI->second = Sym;
+    }
+
+    R.E->setTarget(*EntryI->second);
+    R.E->setAddend(R.Bias);
+    if (SplitPools.insert(R.PoolBlock).second)
+      Rw.Pools.push_back({R.PoolBlock, R.PoolBlock->getSize()});
+  }
+
+  if (!Used.empty()) {
+    auto &PendingRefs = Pending[&MR];
+    PendingRefs.insert(PendingRefs.end(), Used.begin(), Used.end());
+  }
+  return Error::success();
+}
+
+std::optional<ExecutorAddr>
+CompactionPlugin::getSharedConstant(StringRef Value,
+                                    std::vector<SharedConstantRef> &Used) {
+  auto [I, Inserted] = SharedConstants.try_emplace(Value.str());
+  auto &C = I->second;
+  if (Inserted) {
+    auto Addr = Slab->allocateConstant(ArrayRef<char>(Value.data(),
+                                                      Value.size()),
+                                       Value.size());
+    if (!Addr) {
+      SharedConstants.erase(I);
+      return std::nullopt;
+    }
+    C.Addr = *Addr;
+    ++S.SharedConstants;
+    S.SharedBytes += Value.size();
+  } else {
+    ++S.Shared;
+  }
+  ++C.Users;
+  Used.push_back(I);
+  return C.Addr;
+}
+
+void CompactionPlugin::countSavings(LinkGraph &G, const Rewrite &Rw) {
+  // A split pool is only referred to through the references that compact
+  // moved, so it is pruned unless something else keeps it, and blocks that
+  // nothing referred to before are not counted.
+  DenseSet<Block *> Blocks;
+  for (auto *B : G.blocks())
+    Blocks.insert(B);
+
+  uint64_t Dropped = 0, Added = 0;
+  for (auto &[B, Size] : Rw.Pools)
+    if (!Blocks.count(B))
+      Dropped += Size;
+  for (auto &[B, Size] : Rw.Copies)
+    if (Blocks.count(B))
+      Added += Size;
+
+  std::lock_guard<std::mutex> Lock(Mutex);
+  ++S.Graphs;
+  if (Dropped > Added)
+    S.SavedBytes += Dropped - Added;
+}
+
+void CompactionPlugin::release(std::vector<SharedConstantRef> &Refs) {
+  for (auto I : Refs) {
+    if (--I->second.Users)
+      continue;
+    Slab->releaseConstant(I->second.Addr, I->first.size());
+    --S.SharedConstants;
+    S.SharedBytes -= I->first.size();
+    SharedConstants.erase(I);
+  }
+  Refs.clear();
+}
+
+Error CompactionPlugin::notifyEmitted(MaterializationResponsibility &MR) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto I = Pending.find(&MR);
+  if (I == Pending.end())
+    return Error::success();
+  auto Refs = std::move(I->second);
+  Pending.erase(I);
+
+  if (auto Err = MR.withResourceKeyDo([&](ResourceKey K) {
+        auto &KeyRefs = Live[K];
+        KeyRefs.insert(KeyRefs.end(), Refs.begin(), Refs.end());
+        Refs.clear();
+      })) {
+    release(Refs);
+    return Err;
+  }
+  return Error::success();
+}
+
+Error CompactionPlugin::notifyFailed(MaterializationResponsibility &MR) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto I = Pending.find(&MR);
+  if (I != Pending.end()) {
+    release(I->second);
+    Pending.erase(I);
+  }
+  return Error::success();
+}
+
+Error CompactionPlugin::notifyRemovingResources(JITDylib &JD, ResourceKey K) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto I = Live.find(K);
+  if (I != Live.end()) {
+    release(I->second);
+    Live.erase(I);
+  }
+  return Error::success();
+}
+
+void CompactionPlugin::notifyTransferringResources(JITDylib &JD,
+                                                   ResourceKey DstKey,
+                                                   ResourceKey SrcKey) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto I = Live.find(SrcKey);
+  if (I == Live.end())
+    return;
+  auto Refs = std::move(I->second);
+  Live.erase(I);
+  auto &DstRefs = Live[DstKey];
+  DstRefs.insert(DstRefs.end(), Refs.begin(), Refs.end());
+}
+
+CompactionPlugin::Stats CompactionPlugin::getStats() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return S;
+}
+
+void CompactionPlugin::printStats(raw_ostream &OS) {
+  auto St = getStats();
+  OS << formatv("{0} objects linked, {1} bytes of constant pools dropped "
+                "before allocation\n",
+                St.Graphs, St.SavedBytes);
+  OS << formatv("{0} constants referred to: {1} duplicates in their object, "
+                "{2} already shared\n",
+                St.Constants, St.Merged, St.Shared);
+  if (Slab)
+    OS << formatv("{0} shared constants in {1} bytes\n", St.SharedConstants,
+                  St.SharedBytes);
+}
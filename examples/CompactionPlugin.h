@@ -0,0 +1,136 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef COMPACTION_PLUGIN_H
+#define COMPACTION_PLUGIN_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/Support/Error.h"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+class raw_ostream;
+} // end namespace llvm
+
+class SlabMemoryManager;
+
+/// CompactionPlugin - Shrinks every LinkGraph before memory is allocated for
+/// it, by keeping one copy of each floating point constant and dropping
+/// whatever nothing refers to.
+///
+/// Every module that uses a floating point constant has a constant pool of
+/// its own (.rodata.cst8 for doubles), so thousands of per-line modules carry
+/// thousands of copies of 0.0, 1.0 and the like, and a page each for them
+/// with the default memory manager. Before the graph is pruned, the plugin
+/// splits each pool into its entries and points every reference to an entry
+/// at one copy of its value:
+///
+///  * Given the JIT's SlabMemoryManager, at a copy shared by all modules in
+///    the slab's read-only arena, which is freed with the last module that
+///    uses it. The graph refers to it through an anonymous local absolute
+///    symbol, which ORC does not expose, so JITLink fixes up (and range
+///    checks) the references as usual. Code linked into the slab reaches
+///    all of it with the 32-bit PC-relative references of the small code
+///    model; a graph that does not fit into the slab gets private copies
+///    from the memory manager instead.
+///
+///  * Otherwise, or once the slab has no room left, at a copy of the entry
+///    in the graph, one per value.
+///
+/// JITLink's dead-stripping then drops the original pools, and the plugin
+/// counts the bytes of the pools it dropped this way, less those of the
+/// copies it added. Only x86-64 constant pools are rewritten.
+class CompactionPlugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+public:
+  /// Stats - What the plugin did to the graphs linked so far.
+  struct Stats {
+    uint64_t Graphs = 0;
+    uint64_t Constants = 0;       // Constant pool entries referred to.
+    uint64_t Merged = 0;          // Entries with the value of an earlier one.
+    uint64_t Shared = 0;          // Entries already in the shared pool.
+    uint64_t SavedBytes = 0;      // Pool bytes dropped, less copies added.
+    uint64_t SharedConstants = 0; // Now in the shared pool.
+    uint64_t SharedBytes = 0;
+  };
+
+  /// Share constants between graphs in Slab, if not null.
+  CompactionPlugin(SlabMemoryManager *Slab) : Slab(Slab) {}
+
+  void modifyPassConfig(llvm::orc::MaterializationResponsibility &MR,
+                        llvm::jitlink::LinkGraph &G,
+                        llvm::jitlink::PassConfiguration &Config) override;
+
+  llvm::Error
+  notifyEmitted(llvm::orc::MaterializationResponsibility &MR) override;
+  llvm::Error
+  notifyFailed(llvm::orc::MaterializationResponsibility &MR) override;
+  llvm::Error notifyRemovingResources(llvm::orc::JITDylib &JD,
+                                      llvm::orc::ResourceKey K) override;
+  void notifyTransferringResources(llvm::orc::JITDylib &JD,
+                                   llvm::orc::ResourceKey DstKey,
+                                   llvm::orc::ResourceKey SrcKey) override;
+
+  Stats getStats();
+  void printStats(llvm::raw_ostream &OS);
+
+private:
+  /// SharedConstant - A constant in the slab, by value in SharedConstants.
+  struct SharedConstant {
+    llvm::orc::ExecutorAddr Addr;
+    uint64_t Users = 0;
+  };
+  using SharedConstantRef = std::map<std::string, SharedConstant>::iterator;
+
+  /// Rewrite - What compact did to a graph: the pools that it split and the
+  /// copies of their entries that it added, with their sizes.
+  struct Rewrite {
+    std::vector<std::pair<llvm::jitlink::Block *, uint64_t>> Pools;
+    std::vector<std::pair<llvm::jitlink::Block *, uint64_t>> Copies;
+  };
+
+  /// Point the references to G's constant pool entries at one copy of each
+  /// value, holding references to the shared copies used for MR, and note
+  /// what was rewritten in R.
+  llvm::Error compact(llvm::orc::MaterializationResponsibility &MR,
+                      llvm::jitlink::LinkGraph &G, Rewrite &R);
+
+  /// Count the bytes that R saved in what is left of G after pruning.
+  void countSavings(llvm::jitlink::LinkGraph &G, const Rewrite &R);
+
+  /// Return the address of the shared copy of Value, copying Value into the
+  /// slab if it is not there yet, or std::nullopt if the slab is full. The
+  /// copy is appended to Used. Called with Mutex held.
+  std::optional<llvm::orc::ExecutorAddr>
+  getSharedConstant(llvm::StringRef Value,
+                    std::vector<SharedConstantRef> &Used);
+
+  /// Drop one user of each of Refs, freeing the copies nothing uses. Called
+  /// with Mutex held.
+  void release(std::vector<SharedConstantRef> &Refs);
+
+  SlabMemoryManager *Slab;
+
+  std::mutex Mutex;
+  std::map<std::string, SharedConstant> SharedConstants;
+
+  /// Shared constants used by graphs being linked, until they are emitted.
+  llvm::DenseMap<llvm::orc::MaterializationResponsibility *,
+                 std::vector<SharedConstantRef>>
+      Pending;
+
+  /// Shared constants used by emitted code, by the resource key that owns it.
+  llvm::DenseMap<llvm::orc::ResourceKey, std::vector<SharedConstantRef>>
+      Live;
+
+  Stats S;
+};
+
+#endif // COMPACTION_PLUGIN_H
@@ -0,0 +1,121 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "DiskObjectCache.h"
+#include "Kaleidoscope.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/BLAKE3.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+
+using namespace llvm;
+
+Expected<std::unique_ptr<DiskObjectCache>>
+DiskObjectCache::Create(std::string Dir, uint64_t MaxSizeBytes,
+                        std::string Triple, unsigned OptLevel,
+                        std::string Pipeline) {
+  if (auto EC = sys::fs::create_directories(Dir))
+    return createFileError(Dir, EC);
+
+  std::unique_ptr<DiskObjectCache> Cache(
+      new DiskObjectCache(std::move(Dir), MaxSizeBytes, std::move(Triple),
+                          OptLevel, std::move(Pipeline)));
+  Cache->prune();
+  return Cache;
+}
+
+DiskObjectCache::~DiskObjectCache() { prune(); }
+
+std::unique_ptr<MemoryBuffer>
+DiskObjectCache::lookup(KaleidoscopeParser &P, const FunctionAST &FnAST) {
+  std::string Key = getKey(P, FnAST);
+  std::string Path = getPath(Key);
+
+  int FD;
+  if (!sys::fs::openFileForRead(Path, FD)) {
+    auto Obj = MemoryBuffer::getOpenFile(sys::fs::convertFDToNativeFile(FD),
+                                         Path, /*FileSize=*/-1,
+                                         /*RequiresNullTerminator=*/false);
+    // Pruning evicts the least recently accessed entries, and atime updates
+    // are often disabled, so record the access explicitly.
+    sys::fs::setLastAccessAndModificationTime(FD,
+                                              std::chrono::system_clock::now());
+    sys::Process::SafelyCloseFileDescriptor(FD);
+
+    if (Obj) {
+      P.installPrototype(FnAST);
+      return std::move(*Obj);
+    }
+  }
+
+  std::lock_guard<std::mutex> Lock(PendingMutex);
+  PendingKeys[FnAST.getName()] = std::move(Key);
+  return nullptr;
+}
+
+void DiskObjectCache::forget(StringRef FnName) {
+  std::lock_guard<std::mutex> Lock(PendingMutex);
+  PendingKeys.erase(FnName);
+}
+
+void DiskObjectCache::notifyObjectCompiled(const Module *M,
+                                           MemoryBufferRef Obj) {
+  std::string Key;
+  {
+    std::lock_guard<std::mutex> Lock(PendingMutex);
+    for (auto &F : *M) {
+      if (F.isDeclaration())
+        continue;
+      auto I = PendingKeys.find(F.getName());
+      if (I != PendingKeys.end()) {
+        Key = std::move(I->second);
+        PendingKeys.erase(I);
+        break;
+      }
+    }
+  }
+
+  // Not one of ours (e.g. a re-optimized or instrumented function).
+  if (Key.empty())
+    return;
+
+  // writeToOutput goes through a temporary file and renames it into place, so
+  // concurrent JIT processes sharing the directory never see partial objects.
+  if (auto Err = writeToOutput(getPath(Key), [&](raw_ostream &OS) {
+        OS << Obj.getBuffer();
+        return Error::success();
+      }))
+    logAllUnhandledErrors(std::move(Err), errs(), "object cache: ");
+}
+
+std::string DiskObjectCache::getKey(KaleidoscopeParser &P,
+                                    const FunctionAST &FnAST) {
+  std::string Inputs;
+  raw_string_ostream OS(Inputs);
+  OS << Triple << '\0' << OptLevel << '\0' << Pipeline << '\0';
+  P.printCodegenInputs(FnAST, OS);
+  return toHex(BLAKE3::hash(arrayRefFromStringRef(OS.str())),
+               /*LowerCase=*/true);
+}
+
+std::string DiskObjectCache::getPath(StringRef Key) {
+  // pruneCache only considers files with the "llvmcache-" prefix.
+  SmallString<128> Path(Dir);
+  sys::path::append(Path, "llvmcache-" + Key);
+  return std::string(Path);
+}
+
+void DiskObjectCache::prune() {
+  CachePruningPolicy Policy;
+  Policy.Interval = std::chrono::seconds(0); // Always scan.
+  Policy.Expiration = std::chrono::seconds(0); // Evict by size only.
+  Policy.MaxSizeBytes = MaxSizeBytes;
+  pruneCache(Dir, Policy);
+}
@@ -0,0 +1,77 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef DISK_OBJECT_CACHE_H
+#define DISK_OBJECT_CACHE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class FunctionAST;
+struct KaleidoscopeParser;
+
+/// DiskObjectCache - A persistent, content-addressed cache of the object files
+/// compiled for Kaleidoscope functions.
+///
+/// Entries are keyed by a hash of the function's AST, the prototypes of the
+/// functions it calls, the target triple and the optimization settings, so a
+/// hit can skip codegen, optimization and compilation altogether and go
+/// straight to the linker. Objects are stored by the compiler through the
+/// llvm::ObjectCache interface once a function that missed in lookup() has
+/// been compiled. The cache directory is kept under a size limit by evicting
+/// the least recently used entries.
+class DiskObjectCache : public llvm::ObjectCache {
+public:
+  static llvm::Expected<std::unique_ptr<DiskObjectCache>>
+  Create(std::string Dir, uint64_t MaxSizeBytes, std::string Triple,
+         unsigned OptLevel, std::string Pipeline);
+
+  ~DiskObjectCache() override;
+
+  /// Return the cached object for FnAST, or null on a miss. After a miss, the
+  /// object compiled for FnAST's module is stored under FnAST's key.
+  std::unique_ptr<llvm::MemoryBuffer> lookup(KaleidoscopeParser &P,
+                                             const FunctionAST &FnAST);
+
+  /// Do not store the object compiled for FnName after a miss, e.g. because
+  /// the function's module has been instrumented with process-specific
+  /// addresses.
+  void forget(llvm::StringRef FnName);
+
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef Obj) override;
+
+  /// Always null: lookups happen before codegen, through lookup().
+  std::unique_ptr<llvm::MemoryBuffer>
+  getObject(const llvm::Module *M) override {
+    return nullptr;
+  }
+
+private:
+  DiskObjectCache(std::string Dir, uint64_t MaxSizeBytes, std::string Triple,
+                  unsigned OptLevel, std::string Pipeline)
+      : Dir(std::move(Dir)), MaxSizeBytes(MaxSizeBytes),
+        Triple(std::move(Triple)), OptLevel(OptLevel),
+        Pipeline(std::move(Pipeline)) {}
+
+  std::string getKey(KaleidoscopeParser &P, const FunctionAST &FnAST);
+  std::string getPath(llvm::StringRef Key);
+  void prune();
+
+  std::string Dir;
+  uint64_t MaxSizeBytes;
+  std::string Triple;
+  unsigned OptLevel;
+  std::string Pipeline;
+
+  std::mutex PendingMutex;
+  llvm::StringMap<std::string> PendingKeys; // Function name -> key.
+};
+
+#endif // DISK_OBJECT_CACHE_H
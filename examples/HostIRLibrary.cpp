@@ -0,0 +1,170 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "HostIRLibrary.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <vector>
+
+using namespace llvm;
+
+/// isKaleidoscopeCallable - Whether Kaleidoscope code can call a function of
+/// type FT: it returns a double and takes doubles and arrays, which are passed
+/// as a pointer and an i64 length.
+static bool isKaleidoscopeCallable(FunctionType *FT) {
+  if (!FT->getReturnType()->isDoubleTy() || FT->isVarArg())
+    return false;
+  for (unsigned I = 0, E = FT->getNumParams(); I != E; ++I) {
+    Type *Ty = FT->getParamType(I);
+    if (Ty->isDoubleTy())
+      continue;
+    if (!Ty->isPointerTy() || I + 1 == E ||
+        !FT->getParamType(I + 1)->isIntegerTy(64))
+      return false;
+    ++I;
+  }
+  return true;
+}
+
+Error HostIRLibrary::addFile(StringRef Path) {
+  auto Buf = MemoryBuffer::getFile(Path);
+  if (!Buf)
+    return createFileError(Path, Buf.getError());
+  return addIR((*Buf)->getBuffer(), Path);
+}
+
+Error HostIRLibrary::addIR(StringRef IR, StringRef Name) {
+  LLVMContext Ctx;
+  SMDiagnostic Diag;
+  auto M = parseIR(MemoryBufferRef(IR, Name), Diag, Ctx);
+  if (!M) {
+    std::string Msg;
+    raw_string_ostream OS(Msg);
+    Diag.print(nullptr, OS, /*ShowColors=*/false);
+    return make_error<StringError>(OS.str(), inconvertibleErrorCode());
+  }
+  return addModule(*M, Name);
+}
+
+Error HostIRLibrary::addModule(Module &M, StringRef Name) {
+  if (!M.getDataLayout().isDefault() && M.getDataLayout() != DL)
+    return make_error<StringError>(
+        Name + ": data layout " + M.getDataLayoutStr() +
+            " does not match the JIT's",
+        inconvertibleErrorCode());
+
+  unsigned NumAdded = 0;
+  for (Function &F : M) {
+    // Functions that are not in the host's symbol table cannot back calls
+    // that are not inlined, and clang marks everything noinline at -O0.
+    if (F.isDeclaration() || !F.hasExternalLinkage() ||
+        F.hasFnAttribute(Attribute::NoInline) ||
+        !isKaleidoscopeCallable(F.getFunctionType()))
+      continue;
+
+    ValueToValueMapTy VMap;
+    auto Clone = CloneModule(
+        M, VMap, [&](const GlobalValue *GV) { return GV == &F; });
+    auto *CF = cast<Function>(VMap[&F]);
+
+    // Keep only the declarations CF uses. Those of M's private globals and
+    // functions cannot be resolved outside M, so F cannot be imported.
+    SmallPtrSet<const Value *, 8> PrivateGVs;
+    for (GlobalValue &GV : M.global_values())
+      if (GV.hasLocalLinkage())
+        PrivateGVs.insert(VMap.lookup(&GV));
+    std::vector<GlobalValue *> Decls;
+    for (GlobalValue &GV : Clone->global_values())
+      if (&GV != CF)
+        Decls.push_back(&GV);
+    bool UsesPrivate = false;
+    for (GlobalValue *GV : Decls) {
+      GV->removeDeadConstantUsers();
+      if (GV->use_empty())
+        GV->eraseFromParent();
+      else if (PrivateGVs.count(GV))
+        UsesPrivate = true;
+    }
+    if (UsesPrivate)
+      continue;
+
+    // The host's definition is what runs if the function is not inlined, and
+    // the body is compiled for the JIT's target rather than the host's.
+    CF->setLinkage(GlobalValue::AvailableExternallyLinkage);
+    CF->setComdat(nullptr);
+    CF->removeFnAttr("target-cpu");
+    CF->removeFnAttr("target-features");
+    CF->removeFnAttr("tune-cpu");
+    StripDebugInfo(*Clone);
+    std::vector<NamedMDNode *> NamedMDs;
+    for (NamedMDNode &NMD : Clone->named_metadata())
+      NamedMDs.push_back(&NMD);
+    for (NamedMDNode *NMD : NamedMDs)
+      Clone->eraseNamedMetadata(NMD);
+    Clone->setTargetTriple("");
+    Clone->setDataLayout("");
+
+    HostFunction HF;
+    raw_svector_ostream OS(HF.Bitcode);
+    WriteBitcodeToFile(*Clone, OS);
+    HF.Hash = xxHash64(StringRef(HF.Bitcode.data(), HF.Bitcode.size()));
+    Functions[F.getName()] = std::move(HF);
+    ++NumAdded;
+  }
+
+  if (!NumAdded)
+    return make_error<StringError>(
+        Name + ": defines no functions that Kaleidoscope can inline",
+        inconvertibleErrorCode());
+  return Error::success();
+}
+
+std::optional<uint64_t> HostIRLibrary::getHash(StringRef Name) const {
+  auto I = Functions.find(Name);
+  if (I == Functions.end())
+    return std::nullopt;
+  return I->second.Hash;
+}
+
+Function *HostIRLibrary::import(StringRef Name, Module &M) const {
+  auto I = Functions.find(Name);
+  if (I == Functions.end())
+    return nullptr;
+  Function *F = M.getFunction(Name);
+  if (F && !F->isDeclaration())
+    return nullptr;
+
+  auto &Bitcode = I->second.Bitcode;
+  auto Src = parseBitcodeFile(
+      MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()), Name),
+      M.getContext());
+  if (!Src) {
+    consumeError(Src.takeError());
+    return nullptr;
+  }
+  FunctionType *FT = (*Src)->getFunction(Name)->getFunctionType();
+  if (F && F->getFunctionType() != FT)
+    return nullptr;
+
+  // The linker only links an available_externally definition over an
+  // existing declaration, which it replaces.
+  if (!F)
+    Function::Create(FT, GlobalValue::ExternalLinkage, Name, M);
+  (*Src)->setDataLayout(M.getDataLayout());
+  if (Linker::linkModules(M, std::move(*Src)))
+    return nullptr;
+  return M.getFunction(Name);
+}
@@ -0,0 +1,72 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef HOST_IR_LIBRARY_H
+#define HOST_IR_LIBRARY_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/Support/Error.h"
+
+#include <cstdint>
+#include <optional>
+
+namespace llvm {
+class Function;
+class Module;
+} // end namespace llvm
+
+/// HostIRLibrary - The LLVM IR of host functions (e.g. circleArea or printd)
+/// that JIT'd code calls, so that they can be inlined into it.
+///
+/// Calls to host functions are normally resolved by the linker, which leaves
+/// the optimizer nothing to inline. When the parser generates a call to a
+/// function registered here, it links the function's IR into the module with
+/// available_externally linkage instead: the optimizer may inline it, and any
+/// calls left over still go to the host's own definition, which the IR must
+/// therefore match.
+///
+/// Only externally visible functions with Kaleidoscope's calling convention
+/// (doubles, arrays as a pointer and an i64 length, returning a double) that
+/// do not use anything private to their module are registered. Each is kept
+/// as a small bitcode module of its own, which is parsed into the module
+/// that calls it, so imports from several threads do not contend.
+class HostIRLibrary {
+public:
+  HostIRLibrary(const llvm::DataLayout &DL) : DL(DL) {}
+
+  /// Register the functions defined in the IR or bitcode file at Path, e.g.
+  /// compiled with `clang -O2 -c -emit-llvm`.
+  llvm::Error addFile(llvm::StringRef Path);
+
+  /// Register the functions defined in IR, which is LLVM assembly or
+  /// bitcode. Name is used in error messages.
+  llvm::Error addIR(llvm::StringRef IR, llvm::StringRef Name);
+
+  bool empty() const { return Functions.empty(); }
+
+  /// Return a hash of the IR registered for Name, if any. The code generated
+  /// for callers of Name depends on it.
+  std::optional<uint64_t> getHash(llvm::StringRef Name) const;
+
+  /// If Name is registered and M has no definition of it, link its IR into
+  /// M and return it. Returns null if Name is not registered or M declares
+  /// it with a different type.
+  llvm::Function *import(llvm::StringRef Name, llvm::Module &M) const;
+
+private:
+  llvm::Error addModule(llvm::Module &M, llvm::StringRef Name);
+
+  /// HostFunction - A module that only defines the function, with
+  /// declarations of whatever it uses.
+  struct HostFunction {
+    llvm::SmallVector<char, 0> Bitcode;
+    uint64_t Hash;
+  };
+
+  llvm::DataLayout DL;
+  llvm::StringMap<HostFunction> Functions;
+};
+
+#endif // HOST_IR_LIBRARY_H
@@ -0,0 +1,83 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "HotPatcher.h"
+
+#include "llvm/ADT/Twine.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+HotPatcher::HotPatcher(KaleidoscopeJIT &J, IndirectStubsManager &ISM)
+    : J(J), ISM(ISM), PatchThread(hardware_concurrency(1)) {}
+
+HotPatcher::~HotPatcher() {
+  // Patch jobs reference the JIT and the stubs manager, so let them finish.
+  PatchThread.wait();
+}
+
+bool HotPatcher::hasStub(StringRef StubName) {
+  return bool(ISM.findStub(StubName, /*ExportedStubsOnly=*/false).getAddress());
+}
+
+std::string HotPatcher::getImplName(StringRef Name) {
+  unsigned N = ++NumDefinitions[Name];
+  if (N == 1)
+    return (Name + "$impl").str();
+  return (Name + "$" + Twine(N) + "$impl").str();
+}
+
+void HotPatcher::patch(
+    std::vector<std::pair<SymbolStringPtr, SymbolStringPtr>> Patches,
+    std::vector<ResourceTrackerSP> OldRTs, ResourceTrackerSP NewRT) {
+  // A single patch thread applies patches in the order they were queued, so
+  // a stub always ends up pointing at the latest definition.
+  PatchThread.async([this, Patches = std::move(Patches),
+                     OldRTs = std::move(OldRTs),
+                     NewRT = std::move(NewRT)]() mutable {
+    // Replacing a failed redefinition also replaces the definition that it
+    // failed to replace.
+    for (size_t I = 0, E = OldRTs.size(); I != E; ++I) {
+      auto S = Superseded.find(OldRTs[I].get());
+      if (S == Superseded.end())
+        continue;
+      llvm::append_range(OldRTs, S->second);
+      Superseded.erase(S);
+    }
+
+    SymbolLookupSet ImplNames;
+    for (auto &[StubName, ImplName] : Patches)
+      ImplNames.add(ImplName);
+
+    // If the new bodies fail to compile, the stubs keep calling the old ones,
+    // so those stay until the failed definitions are replaced in turn.
+    auto Syms = J.ES->lookup(makeJITDylibSearchOrder(&J.MainJD),
+                             std::move(ImplNames));
+    if (!Syms) {
+      J.ES->reportError(Syms.takeError());
+      Superseded[NewRT.get()] = std::move(OldRTs);
+      return;
+    }
+
+    for (auto &[StubName, ImplName] : Patches)
+      if (auto Err =
+              ISM.updatePointer(*StubName, (*Syms)[ImplName].getAddress()))
+        J.ES->reportError(std::move(Err));
+
+    std::lock_guard<std::mutex> Lock(RetiredMutex);
+    Retired.insert(Retired.end(), OldRTs.begin(), OldRTs.end());
+  });
+}
+
+Error HotPatcher::releaseRetired() {
+  std::vector<ResourceTrackerSP> ToRemove;
+  {
+    std::lock_guard<std::mutex> Lock(RetiredMutex);
+    ToRemove = std::move(Retired);
+    Retired.clear();
+  }
+
+  Error Err = Error::success();
+  for (auto &RT : ToRemove)
+    Err = joinErrors(std::move(Err), RT->remove());
+  return Err;
+}
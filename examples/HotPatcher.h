@@ -0,0 +1,86 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef HOT_PATCHER_H
+#define HOT_PATCHER_H
+
+#include "Kaleidoscope.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// HotPatcher - Redefines functions for the lazy drivers without stopping the
+/// code that calls them.
+///
+/// Callers reach each function through the indirect stub that lazyReexports
+/// created for its first definition. A redefinition is added to the JIT under
+/// a new body name (<name>$<N>$impl) next to the old body, compiled on a
+/// background thread, and then the stub is pointed at it. The stub pointer is
+/// a single aligned pointer-sized store, so callers pick up the new body on
+/// their next call through the stub while calls already running finish in
+/// the old one.
+///
+/// The replaced bodies stay in the JIT until releaseRetired removes them,
+/// which must only happen when none of them can be running. If a new body
+/// fails to compile, its stub keeps pointing at the old one, which stays
+/// until a later redefinition replaces it.
+class HotPatcher {
+public:
+  HotPatcher(KaleidoscopeJIT &J, llvm::orc::IndirectStubsManager &ISM);
+  ~HotPatcher();
+
+  /// Whether the function with the (mangled) name StubName has a stub
+  /// already, i.e. whether defining it again is a redefinition.
+  bool hasStub(llvm::StringRef StubName);
+
+  /// Return the name to give the body of a new definition of Name:
+  /// <Name>$impl the first time and <Name>$<N>$impl for the Nth definition.
+  std::string getImplName(llvm::StringRef Name);
+
+  /// Compile the bodies named in Patches, which have been added to the JIT
+  /// already with NewRT, on the background thread, then point each stub in
+  /// Patches at its body. OldRTs, the trackers of the definitions being
+  /// replaced (see KaleidoscopeJIT::redefine), are retired once the stubs are
+  /// updated. If the bodies fail to compile, the error is reported and the
+  /// stubs and OldRTs are left alone.
+  void patch(std::vector<std::pair<llvm::orc::SymbolStringPtr,
+                                   llvm::orc::SymbolStringPtr>>
+                 Patches,
+             std::vector<llvm::orc::ResourceTrackerSP> OldRTs,
+             llvm::orc::ResourceTrackerSP NewRT);
+
+  /// Wait for all queued patches to be applied.
+  void wait() { PatchThread.wait(); }
+
+  /// Remove the bodies that patches have replaced from the JIT. The caller
+  /// must make sure that no thread is running JIT'd code that could still be
+  /// in one of them, e.g. by only calling this between REPL commands.
+  llvm::Error releaseRetired();
+
+private:
+  KaleidoscopeJIT &J;
+  llvm::orc::IndirectStubsManager &ISM;
+
+  llvm::StringMap<unsigned> NumDefinitions;
+
+  std::mutex RetiredMutex;
+  std::vector<llvm::orc::ResourceTrackerSP> Retired;
+
+  /// The definitions still in use because the redefinitions that were to
+  /// replace them failed, by the tracker of the failed definitions, which
+  /// KaleidoscopeJIT passes as OldRTs when they are redefined in turn. Only
+  /// used on the patch thread.
+  llvm::DenseMap<llvm::orc::ResourceTracker *,
+                 std::vector<llvm::orc::ResourceTrackerSP>>
+      Superseded;
+
+  llvm::ThreadPool PatchThread;
+};
+
+#endif // HOT_PATCHER_H
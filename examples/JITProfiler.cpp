@@ -0,0 +1,260 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "JITProfiler.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace llvm;
+using namespace llvm::jitlink;
+using namespace llvm::orc;
+
+/// ProfilingCompiler - Times an IRCompiler and remembers the name of each
+/// object it produces, so that the link event can use it.
+class JITProfiler::ProfilingCompiler : public IRCompileLayer::IRCompiler {
+public:
+  ProfilingCompiler(JITProfiler &Profiler,
+                    std::unique_ptr<IRCompileLayer::IRCompiler> Compiler)
+      : IRCompiler(Compiler->getManglingOptions()), Profiler(Profiler),
+        Compiler(std::move(Compiler)) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    std::string Name = getUnitName(M);
+    auto Start = Clock::now();
+    auto Obj = (*Compiler)(M);
+    if (!Obj)
+      return Obj.takeError();
+
+    Profiler.record(Compile, Name, Start, (*Obj)->getBufferSize());
+    std::lock_guard<std::mutex> Lock(Profiler.EventsMutex);
+    Profiler.ObjectNames[(*Obj)->getBufferIdentifier()] = std::move(Name);
+    return Obj;
+  }
+
+private:
+  JITProfiler &Profiler;
+  std::unique_ptr<IRCompileLayer::IRCompiler> Compiler;
+};
+
+/// LinkPlugin - Times each link from the start of its passes to the end of
+/// fixups (after which the memory manager only finalizes permissions).
+class JITProfiler::LinkPlugin : public ObjectLinkingLayer::Plugin {
+public:
+  LinkPlugin(JITProfiler &Profiler) : Profiler(Profiler) {}
+
+  void modifyPassConfig(MaterializationResponsibility &MR, LinkGraph &G,
+                        PassConfiguration &PassConfig) override {
+    PassConfig.PostFixupPasses.push_back(
+        [this, Start = Clock::now()](LinkGraph &G) {
+          uint64_t Size = 0;
+          for (auto *B : G.blocks())
+            Size += B->getSize();
+
+          std::string Name = G.getName();
+          {
+            std::lock_guard<std::mutex> Lock(Profiler.EventsMutex);
+            auto I = Profiler.ObjectNames.find(G.getName());
+            if (I != Profiler.ObjectNames.end()) {
+              Name = std::move(I->second);
+              Profiler.ObjectNames.erase(I);
+            }
+          }
+
+          Profiler.record(Link, std::move(Name), Start, Size);
+          return Error::success();
+        });
+  }
+
+  Error notifyFailed(MaterializationResponsibility &MR) override {
+    return Error::success();
+  }
+  Error notifyRemovingResources(JITDylib &JD, ResourceKey K) override {
+    return Error::success();
+  }
+  void notifyTransferringResources(JITDylib &JD, ResourceKey DstKey,
+                                   ResourceKey SrcKey) override {}
+
+private:
+  JITProfiler &Profiler;
+};
+
+JITProfiler::JITProfiler(size_t MaxEvents)
+    : Epoch(Clock::now()), MaxEvents(MaxEvents) {}
+
+StringRef JITProfiler::getPhaseName(Phase P) {
+  static const char *const Names[] = {"parse", "codegen", "optimize",
+                                      "compile", "link"};
+  return Names[P];
+}
+
+std::string JITProfiler::getUnitName(ArrayRef<std::string> FnNames) {
+  if (FnNames.empty())
+    return "<empty>";
+  if (FnNames.size() == 1)
+    return FnNames.front();
+  return (FnNames.front() + " (+" + Twine(FnNames.size() - 1) + ")").str();
+}
+
+std::string JITProfiler::getUnitName(const Module &M) {
+  std::vector<std::string> FnNames;
+  for (auto &F : M)
+    if (!F.isDeclaration())
+      FnNames.push_back(F.getName().str());
+  return getUnitName(FnNames);
+}
+
+void JITProfiler::record(Phase P, std::string Name, Clock::time_point Start,
+                         uint64_t Size) {
+  auto End = Clock::now();
+  Event E{P,
+          std::move(Name),
+          std::chrono::duration<double>(Start - Epoch).count(),
+          std::chrono::duration<double>(End - Start).count(),
+          Size,
+          get_threadid()};
+  std::lock_guard<std::mutex> Lock(EventsMutex);
+
+  // Every top-level expression has a name of its own, so one row per
+  // expression would only grow the table.
+  StringRef ProfileName = E.Name;
+  if (ProfileName.startswith("expr."))
+    ProfileName = "<top-level exprs>";
+  auto [I, Inserted] = ProfileIndex.try_emplace(ProfileName, Profiles.size());
+  if (Inserted) {
+    Profiles.emplace_back();
+    Profiles.back().Name = ProfileName.str();
+  }
+  auto &FP = Profiles[I->second];
+  FP.Seconds[P] += E.Duration;
+  if (P == Codegen || P == Optimize)
+    FP.IRInstructions = Size;
+  else if (P == Compile)
+    FP.ObjectBytes = Size;
+
+  if (Events.size() < MaxEvents)
+    Events.push_back(std::move(E));
+  else
+    ++NumDroppedEvents;
+}
+
+std::unique_ptr<IRCompileLayer::IRCompiler> JITProfiler::wrapCompiler(
+    std::unique_ptr<IRCompileLayer::IRCompiler> Compiler) {
+  return std::make_unique<ProfilingCompiler>(*this, std::move(Compiler));
+}
+
+std::unique_ptr<ObjectLinkingLayer::Plugin> JITProfiler::createLinkPlugin() {
+  return std::make_unique<LinkPlugin>(*this);
+}
+
+std::vector<JITProfiler::Event> JITProfiler::getEvents() {
+  std::lock_guard<std::mutex> Lock(EventsMutex);
+  return Events;
+}
+
+uint64_t JITProfiler::getNumDroppedEvents() {
+  std::lock_guard<std::mutex> Lock(EventsMutex);
+  return NumDroppedEvents;
+}
+
+double JITProfiler::FunctionProfile::getTotalSeconds() const {
+  double Total = 0;
+  for (double S : Seconds)
+    Total += S;
+  return Total;
+}
+
+std::vector<JITProfiler::FunctionProfile> JITProfiler::getFunctionProfiles() {
+  std::vector<FunctionProfile> Profiles;
+  {
+    std::lock_guard<std::mutex> Lock(EventsMutex);
+    Profiles = this->Profiles;
+  }
+
+  llvm::stable_sort(Profiles,
+                    [](const FunctionProfile &LHS, const FunctionProfile &RHS) {
+                      return LHS.getTotalSeconds() > RHS.getTotalSeconds();
+                    });
+  return Profiles;
+}
+
+void JITProfiler::printSummary(raw_ostream &OS, size_t NumFunctions) {
+  auto Profiles = getFunctionProfiles();
+
+  FunctionProfile Total;
+  Total.Name = formatv("total ({0} functions)", Profiles.size()).str();
+  for (auto &FP : Profiles) {
+    for (unsigned P = 0; P != NumPhases; ++P)
+      Total.Seconds[P] += FP.Seconds[P];
+    Total.IRInstructions += FP.IRInstructions;
+    Total.ObjectBytes += FP.ObjectBytes;
+  }
+
+  OS << formatv("{0,-24}", "function");
+  for (unsigned P = 0; P != NumPhases; ++P)
+    OS << formatv(" {0,10}", (getPhaseName(Phase(P)) + " ms").str());
+  OS << formatv(" {0,10} {1,10}\n", "IR insts", "obj bytes");
+
+  auto PrintRow = [&](const FunctionProfile &FP) {
+    OS << formatv("{0,-24}", FP.Name);
+    for (unsigned P = 0; P != NumPhases; ++P)
+      OS << formatv(" {0,10:f3}", FP.Seconds[P] * 1000);
+    OS << formatv(" {0,10} {1,10}\n", FP.IRInstructions, FP.ObjectBytes);
+  };
+
+  for (size_t I = 0; I != std::min(NumFunctions, Profiles.size()); ++I)
+    PrintRow(Profiles[I]);
+  PrintRow(Total);
+
+  if (uint64_t NumDropped = getNumDroppedEvents())
+    OS << formatv("({0} events after the first {1} are not kept for the "
+                  "trace)\n",
+                  NumDropped, MaxEvents);
+}
+
+Error JITProfiler::writeChromeTrace(StringRef Path) {
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+  if (EC)
+    return createFileError(Path, EC);
+
+  // Complete ("X") events with timestamps in microseconds.
+  json::OStream J(OS);
+  J.objectBegin();
+  J.attributeArray("traceEvents", [&]() {
+    for (auto &E : getEvents())
+      J.object([&]() {
+        J.attribute("name", E.Name);
+        J.attribute("cat", getPhaseName(E.P));
+        J.attribute("ph", "X");
+        J.attribute("ts", E.Start * 1e6);
+        J.attribute("dur", E.Duration * 1e6);
+        J.attribute("pid", 1);
+        J.attribute("tid", int64_t(E.ThreadID));
+        J.attributeObject("args", [&]() {
+          J.attribute("phase", getPhaseName(E.P));
+          J.attribute("size", int64_t(E.Size));
+        });
+      });
+  });
+  J.attribute("displayTimeUnit", "ms");
+  if (uint64_t NumDropped = getNumDroppedEvents())
+    J.attributeObject("otherData", [&]() {
+      J.attribute("droppedEvents", int64_t(NumDropped));
+    });
+  J.objectEnd();
+  OS << "\n";
+
+  if (OS.has_error())
+    return createFileError(Path, OS.error());
+  return Error::success();
+}
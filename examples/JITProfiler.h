@@ -0,0 +1,124 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef JIT_PROFILER_H
+#define JIT_PROFILER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/Support/Error.h"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class Module;
+class raw_ostream;
+} // end namespace llvm
+
+/// JITProfiler - Records how long each function spends in each phase of the
+/// Kaleidoscope JIT pipeline, and how big its IR and object code are.
+///
+/// The parser reports the parse and codegen phases, KaleidoscopeJIT::optimize
+/// the optimize phase, the IRCompiler returned by wrapCompiler the compile
+/// phase and the plugin returned by createLinkPlugin the link phase. Phases
+/// that work on a whole module (everything after parsing) are attributed to
+/// the module's first function, with "(+N)" for the N others in a batch.
+///
+/// Per-function totals are kept for the whole session, with all top-level
+/// expressions folded into one entry, but only the first MaxEvents events
+/// are kept for the trace, so that a long session does not grow without
+/// bound.
+class JITProfiler {
+public:
+  enum Phase { Parse, Codegen, Optimize, Compile, Link, NumPhases };
+
+  using Clock = std::chrono::steady_clock;
+
+  /// Event - One function (or module) going through one phase.
+  struct Event {
+    Phase P;
+    std::string Name;
+    double Start;    // Seconds since the profiler was created.
+    double Duration; // Seconds.
+    /// Parse: bytes of source. Codegen and Optimize: IR instructions after
+    /// the phase. Compile: bytes of object file. Link: bytes of linked code
+    /// and data.
+    uint64_t Size;
+    uint64_t ThreadID;
+  };
+
+  /// FunctionProfile - The total time that one function (or module) spent in
+  /// each phase, with its latest sizes.
+  struct FunctionProfile {
+    std::string Name;
+    double Seconds[NumPhases] = {};
+    uint64_t IRInstructions = 0; // After optimization, if it ran.
+    uint64_t ObjectBytes = 0;
+
+    double getTotalSeconds() const;
+  };
+
+  explicit JITProfiler(size_t MaxEvents = 100000);
+
+  static llvm::StringRef getPhaseName(Phase P);
+
+  /// Name events for a module after its first function, with "(+N)" for the
+  /// N others.
+  static std::string getUnitName(llvm::ArrayRef<std::string> FnNames);
+  static std::string getUnitName(const llvm::Module &M);
+
+  /// Record that Name spent the time from Start until now in phase P.
+  void record(Phase P, std::string Name, Clock::time_point Start,
+              uint64_t Size);
+
+  /// Wrap Compiler so that it records compile events.
+  std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>
+  wrapCompiler(std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler> Compiler);
+
+  /// Create an ObjectLinkingLayer plugin that records link events.
+  std::unique_ptr<llvm::orc::ObjectLinkingLayer::Plugin> createLinkPlugin();
+
+  /// The events kept so far, in the order they finished.
+  std::vector<Event> getEvents();
+
+  /// The number of events recorded after MaxEvents had been kept.
+  uint64_t getNumDroppedEvents();
+
+  /// Per-function totals, slowest first.
+  std::vector<FunctionProfile> getFunctionProfiles();
+
+  /// Print the per-phase totals and the NumFunctions slowest functions.
+  void printSummary(llvm::raw_ostream &OS, size_t NumFunctions = 20);
+
+  /// Write the kept events in Chrome's trace event format, which
+  /// chrome://tracing and Perfetto can load.
+  llvm::Error writeChromeTrace(llvm::StringRef Path);
+
+private:
+  class ProfilingCompiler;
+  class LinkPlugin;
+
+  Clock::time_point Epoch;
+
+  std::mutex EventsMutex;
+  size_t MaxEvents;
+  std::vector<Event> Events;
+  uint64_t NumDroppedEvents = 0;
+
+  /// Totals by function, in the order functions were first seen.
+  std::vector<FunctionProfile> Profiles;
+  llvm::StringMap<size_t> ProfileIndex;
+
+  /// Unit names of compiled objects by buffer identifier, which becomes the
+  /// link graph's name.
+  llvm::StringMap<std::string> ObjectNames;
+};
+
+#endif // JIT_PROFILER_H
@@ -3,7 +3,14 @@
 #include "Kaleidoscope.h"
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ScopeExit.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/bit.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -14,16 +21,26 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Target/TargetMachine.h"
 #include <atomic>
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -63,89 +80,172 @@ enum Token {
   tok_var = -13
 };
 
-static std::string IdentifierStr; // Filled in if tok_identifier
-static double NumVal;             // Filled in if tok_number
+/// ParseContext - The lexer and parser state for one call to
+/// KaleidoscopeParser::parse or parseScript. Keeping it out of globals lets
+/// independent parsers run concurrently.
+struct ParseContext {
+  ParseContext(KaleidoscopeParser &P, StringRef InputLine)
+      : P(P), InputLine(InputLine) {}
+
+  KaleidoscopeParser &P;
+  StringRef InputLine;       // The input not yet consumed by the lexer.
+  int LastChar = ' ';
+  StringRef IdentifierStr;   // Filled in if tok_identifier (a slice of input)
+  double NumVal = 0;         // Filled in if tok_number
+  const char *TokStart = nullptr; // Where the last token starts in the input.
+
+  /// CurTok is the current token the parser is looking at.
+  int CurTok = 0;
+
+  /// The arena of the definition or top-level expression being parsed.
+  BumpPtrAllocator *Arena = nullptr;
+
+  /// The names of the functions called from the definition or top-level
+  /// expression currently being parsed.
+  std::set<StringRef> ParsedCallees;
+
+  /// The variables assigned with '=' in the definition or top-level
+  /// expression currently being parsed.
+  SmallVector<StringRef, 4> AssignedVars;
+
+  /// Allocate an expression node in the arena.
+  template <typename T, typename... ArgTs> T *create(ArgTs &&...Args) {
+    return new (*Arena) T(std::forward<ArgTs>(Args)...);
+  }
 
-static int LastChar = ' ';
-static StringRef InputLine;
+  /// Copy Elts into the arena.
+  template <typename T> ArrayRef<T> copyArray(ArrayRef<T> Elts) {
+    T *Mem = Arena->Allocate<T>(Elts.size());
+    std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+    return ArrayRef<T>(Mem, Elts.size());
+  }
 
-void resetInputLine(StringRef NewInputLine) {
-  LastChar = ' ';
-  InputLine = NewInputLine;
-}
+  /// Intern the current identifier.
+  StringRef takeIdentifier() { return P.Identifiers.save(IdentifierStr); }
+};
 
-char getInputLineChar() {
-  if (InputLine.empty())
+static int getInputLineChar(ParseContext &Ctx) {
+  if (Ctx.InputLine.empty())
     return EOF;
 
-  char C = InputLine.front();
-  InputLine = InputLine.drop_front();
+  char C = Ctx.InputLine.front();
+  Ctx.InputLine = Ctx.InputLine.drop_front();
   return C;
 }
 
-/// gettok - Return the next token from standard input.
-static int gettok() {
+/// takeTokenWhile - Return the token that starts at LastChar and continues
+/// while Pred holds, as a slice of the input, and read the character after it
+/// into LastChar.
+template <typename PredT>
+static StringRef takeTokenWhile(ParseContext &Ctx, PredT Pred) {
+  // LastChar is always the character just before InputLine.
+  const char *Start = Ctx.InputLine.data() - 1;
+  Ctx.InputLine = Ctx.InputLine.drop_while(Pred);
+  StringRef Tok(Start, Ctx.InputLine.data() - Start);
+  Ctx.LastChar = getInputLineChar(Ctx);
+  return Tok;
+}
+
+/// getKeywordToken - Return the keyword token for identifier Id, or
+/// tok_identifier. Switching on the length and first character leaves at most
+/// one keyword to compare against.
+static int getKeywordToken(StringRef Id) {
+  auto Match = [&](StringRef Keyword, int Tok) {
+    return Id == Keyword ? Tok : tok_identifier;
+  };
+
+  switch (Id.size()) {
+  case 2:
+    if (Id[0] == 'i')
+      return Id[1] == 'f' ? tok_if : Match("in", tok_in);
+    break;
+  case 3:
+    if (Id[0] == 'd')
+      return Match("def", tok_def);
+    if (Id[0] == 'f')
+      return Match("for", tok_for);
+    return Match("var", tok_var);
+  case 4:
+    if (Id[0] == 'e')
+      return Match("else", tok_else);
+    return Match("then", tok_then);
+  case 5:
+    return Match("unary", tok_unary);
+  case 6:
+    if (Id[0] == 'b')
+      return Match("binary", tok_binary);
+    return Match("extern", tok_extern);
+  }
+  return tok_identifier;
+}
+
+/// parseNumber - Convert a numeric literal ([0-9.]+) like strtod, which stops
+/// at a second '.'. Literals with up to 15 digits take Clinger's fast path: the
+/// digits form an integer below 2^53 and dividing it by an exactly
+/// representable power of ten rounds correctly. Longer ones go to strtod.
+static double parseNumber(StringRef Num) {
+  static const double PowersOf10[] = {1e0, 1e1, 1e2,  1e3,  1e4,  1e5,
+                                      1e6, 1e7, 1e8,  1e9,  1e10, 1e11,
+                                      1e12, 1e13, 1e14, 1e15};
+  uint64_t Mantissa = 0;
+  unsigned NumDigits = 0, NumFracDigits = 0;
+  bool SeenDot = false;
+  for (char C : Num) {
+    if (C == '.') {
+      if (SeenDot)
+        break;
+      SeenDot = true;
+      continue;
+    }
+    if (++NumDigits > 15) {
+      // strtod needs a terminated string; the input is not.
+      SmallString<64> Buf(Num);
+      return strtod(Buf.c_str(), nullptr);
+    }
+    Mantissa = Mantissa * 10 + (C - '0');
+    NumFracDigits += SeenDot;
+  }
+  return double(Mantissa) / PowersOf10[NumFracDigits];
+}
+
+/// gettok - Return the next token from the input.
+static int gettok(ParseContext &Ctx) {
 
   // Skip any whitespace.
-  while (isspace(LastChar))
-    LastChar = getInputLineChar();
-
-  if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = getInputLineChar())))
-      IdentifierStr += LastChar;
-
-    if (IdentifierStr == "def")
-      return tok_def;
-    if (IdentifierStr == "extern")
-      return tok_extern;
-    if (IdentifierStr == "if")
-      return tok_if;
-    if (IdentifierStr == "then")
-      return tok_then;
-    if (IdentifierStr == "else")
-      return tok_else;
-    if (IdentifierStr == "for")
-      return tok_for;
-    if (IdentifierStr == "in")
-      return tok_in;
-    if (IdentifierStr == "binary")
-      return tok_binary;
-    if (IdentifierStr == "unary")
-      return tok_unary;
-    if (IdentifierStr == "var")
-      return tok_var;
-    return tok_identifier;
-  }
-
-  if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
-    std::string NumStr;
-    do {
-      NumStr += LastChar;
-      LastChar = getInputLineChar();
-    } while (isdigit(LastChar) || LastChar == '.');
-
-    NumVal = strtod(NumStr.c_str(), nullptr);
+  while (isspace(Ctx.LastChar))
+    Ctx.LastChar = getInputLineChar(Ctx);
+
+  // LastChar is the character just before InputLine, unless it is EOF.
+  Ctx.TokStart = Ctx.InputLine.data() - (Ctx.LastChar != EOF);
+
+  if (isalpha(Ctx.LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+    Ctx.IdentifierStr = takeTokenWhile(Ctx, isAlnum);
+    return getKeywordToken(Ctx.IdentifierStr);
+  }
+
+  if (isdigit(Ctx.LastChar) || Ctx.LastChar == '.') { // Number: [0-9.]+
+    Ctx.NumVal = parseNumber(
+        takeTokenWhile(Ctx, [](char C) { return isDigit(C) || C == '.'; }));
     return tok_number;
   }
 
-  if (LastChar == '#') {
+  if (Ctx.LastChar == '#') {
     // Comment until end of line.
-    do
-      LastChar = getInputLineChar();
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+    Ctx.InputLine = Ctx.InputLine.drop_until(
+        [](char C) { return C == '\n' || C == '\r'; });
+    Ctx.LastChar = getInputLineChar(Ctx);
 
-    if (LastChar != EOF)
-      return gettok();
+    if (Ctx.LastChar != EOF)
+      return gettok(Ctx);
   }
 
   // Check for end of "file".
-  if (LastChar == EOF)
+  if (Ctx.LastChar == EOF)
     return tok_eof;
 
   // Otherwise, just return the character as its ascii value.
-  int ThisChar = LastChar;
-  LastChar = getInputLineChar();
+  int ThisChar = Ctx.LastChar;
+  Ctx.LastChar = getInputLineChar(Ctx);
   return ThisChar;
 }
 
@@ -154,11 +254,30 @@ static int gettok() {
 //===----------------------------------------------------------------------===//
 
 /// ExprAST - Base class for all expression nodes.
+///
+/// Expression nodes are allocated in their FunctionAST's arena and are never
+/// destroyed individually, so they hold only non-owning pointers to their
+/// operands, arena-allocated arrays, and identifiers interned by the parser.
 class ExprAST {
 public:
   virtual ~ExprAST() = default;
 
   virtual Value *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) = 0;
+
+  /// Print this expression as an s-expression. The output is unambiguous, so
+  /// it also serves as a fingerprint of the expression.
+  virtual void print(raw_ostream &OS) const = 0;
+
+  /// Append this expression to an AST file being written.
+  virtual void serialize(ASTWriter &W) const = 0;
+
+  /// If this is a variable reference, return the variable's name, otherwise
+  /// an empty string.
+  virtual StringRef getVariableName() const { return StringRef(); }
+
+  /// Emit an assignment of Val to this expression, for "expr = Val".
+  virtual Value *codegenAssign(KaleidoscopeParser &P, CodeGenContext &CGCtx,
+                               Value *Val);
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -169,96 +288,133 @@ public:
   NumberExprAST(double Val) : Val(Val) {}
 
   Value *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) override;
+  void print(raw_ostream &OS) const override;
+  void serialize(ASTWriter &W) const override;
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST {
-  std::string Name;
+  StringRef Name;
 
 public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
+  VariableExprAST(StringRef Name) : Name(Name) {}
 
   Value *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) override;
-  const std::string &getName() const { return Name; }
+  void print(raw_ostream &OS) const override;
+  void serialize(ASTWriter &W) const override;
+  StringRef getVariableName() const override { return Name; }
+  Value *codegenAssign(KaleidoscopeParser &P, CodeGenContext &CGCtx,
+                       Value *Val) override;
+};
+
+/// IndexExprAST - Expression class for an array element, like "a[i]".
+class IndexExprAST : public ExprAST {
+  StringRef ArrayName;
+  ExprAST *Index;
+
+public:
+  IndexExprAST(StringRef ArrayName, ExprAST *Index)
+      : ArrayName(ArrayName), Index(Index) {}
+
+  Value *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) override;
+  void print(raw_ostream &OS) const override;
+  void serialize(ASTWriter &W) const override;
+  Value *codegenAssign(KaleidoscopeParser &P, CodeGenContext &CGCtx,
+                       Value *Val) override;
 };
 
 /// UnaryExprAST - Expression class for a unary operator.
 class UnaryExprAST : public ExprAST {
   char Opcode;
-  std::unique_ptr<ExprAST> Operand;
+  ExprAST *Operand;
 
 public:
-  UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-      : Opcode(Opcode), Operand(std::move(Operand)) {}
+  UnaryExprAST(char Opcode, ExprAST *Operand)
+      : Opcode(Opcode), Operand(Operand) {}
 
   Value *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) override;
+  void print(raw_ostream &OS) const override;
+  void serialize(ASTWriter &W) const override;
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
 class BinaryExprAST : public ExprAST {
   char Op;
-  std::unique_ptr<ExprAST> LHS, RHS;
+  ExprAST *LHS, *RHS;
 
 public:
-  BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-      : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+  BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
+      : Op(Op), LHS(LHS), RHS(RHS) {}
 
   Value *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) override;
+  void print(raw_ostream &OS) const override;
+  void serialize(ASTWriter &W) const override;
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
-  std::string Callee;
-  std::vector<std::unique_ptr<ExprAST>> Args;
+  StringRef Callee;
+  ArrayRef<ExprAST *> Args;
 
 public:
-  CallExprAST(const std::string &Callee,
-              std::vector<std::unique_ptr<ExprAST>> Args)
-      : Callee(Callee), Args(std::move(Args)) {}
+  CallExprAST(StringRef Callee, ArrayRef<ExprAST *> Args)
+      : Callee(Callee), Args(Args) {}
 
   Value *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) override;
+  void print(raw_ostream &OS) const override;
+  void serialize(ASTWriter &W) const override;
 };
 
 /// IfExprAST - Expression class for if/then/else.
 class IfExprAST : public ExprAST {
-  std::unique_ptr<ExprAST> Cond, Then, Else;
+  ExprAST *Cond, *Then, *Else;
 
 public:
-  IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-            std::unique_ptr<ExprAST> Else)
-      : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+  IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+      : Cond(Cond), Then(Then), Else(Else) {}
 
   Value *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) override;
+  void print(raw_ostream &OS) const override;
+  void serialize(ASTWriter &W) const override;
 };
 
 /// ForExprAST - Expression class for for/in.
 class ForExprAST : public ExprAST {
-  std::string VarName;
-  std::unique_ptr<ExprAST> Start, End, Step, Body;
+  StringRef VarName;
+  ExprAST *Start, *End, *Step, *Body;
 
 public:
-  ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-             std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-             std::unique_ptr<ExprAST> Body)
-      : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-        Step(std::move(Step)), Body(std::move(Body)) {}
+  ForExprAST(StringRef VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+             ExprAST *Body)
+      : VarName(VarName), Start(Start), End(End), Step(Step), Body(Body) {}
 
   Value *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) override;
+  void print(raw_ostream &OS) const override;
+  void serialize(ASTWriter &W) const override;
 };
 
 /// VarExprAST - Expression class for var/in
 class VarExprAST : public ExprAST {
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-  std::unique_ptr<ExprAST> Body;
+public:
+  /// VarDecl - One variable introduced by the var. For an array, "a[n]", Init
+  /// is the length; the elements start out as zero.
+  struct VarDecl {
+    StringRef Name;
+    ExprAST *Init;
+    bool IsArray;
+  };
+
+private:
+  ArrayRef<VarDecl> VarNames;
+  ExprAST *Body;
 
 public:
-  VarExprAST(
-      std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-      std::unique_ptr<ExprAST> Body)
-      : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+  VarExprAST(ArrayRef<VarDecl> VarNames, ExprAST *Body)
+      : VarNames(VarNames), Body(Body) {}
 
   Value *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) override;
+  void print(raw_ostream &OS) const override;
+  void serialize(ASTWriter &W) const override;
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
@@ -269,17 +425,28 @@ class PrototypeAST {
   std::vector<std::string> Args;
   bool IsOperator;
   unsigned Precedence; // Precedence if a binary op.
+  std::vector<bool> ArrayArgs; // Empty if all arguments are scalars.
 
 public:
   PrototypeAST(const std::string &Name, std::vector<std::string> Args,
-               bool IsOperator = false, unsigned Prec = 0)
+               bool IsOperator = false, unsigned Prec = 0,
+               std::vector<bool> ArrayArgs = {})
       : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
-        Precedence(Prec) {}
+        Precedence(Prec), ArrayArgs(std::move(ArrayArgs)) {}
 
   Function *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx);
+  void print(raw_ostream &OS) const;
+  void serialize(ASTWriter &W) const;
+  size_t getMemoryUsage() const;
   const std::string &getName() const { return Name; }
   void setName(std::string NewName) { Name = std::move(NewName); }
 
+  /// Arrays are passed as a pointer to their first element and an i64
+  /// length.
+  bool isArrayArg(unsigned ArgNo) const {
+    return ArgNo < ArrayArgs.size() && ArrayArgs[ArgNo];
+  }
+
   bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
   bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
 
@@ -295,36 +462,26 @@ public:
 // Parser
 //===----------------------------------------------------------------------===//
 
-/// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
-/// token the parser is looking at.  getNextToken reads another token from the
-/// lexer and updates CurTok with its results.
-static int CurTok;
-static int getNextToken() { return CurTok = gettok(); }
-
-/// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-static std::map<char, int> BinopPrecedence({
-    {'=', 2},
-    {'<', 10},
-    {'+', 20},
-    {'-', 20},
-    {'*', 40}
-  });
+/// getNextToken - Provide a simple token buffer. getNextToken reads another
+/// token from the lexer and updates Ctx.CurTok with its results.
+static int getNextToken(ParseContext &Ctx) {
+  return Ctx.CurTok = gettok(Ctx);
+}
 
 /// GetTokPrecedence - Get the precedence of the pending binary operator token.
-static int GetTokPrecedence() {
-  if (!isascii(CurTok))
+static int GetTokPrecedence(ParseContext &Ctx) {
+  if (!isascii(Ctx.CurTok))
     return -1;
 
   // Make sure it's a declared binop.
-  int TokPrec = BinopPrecedence[CurTok];
+  int TokPrec = Ctx.P.BinopPrecedence[Ctx.CurTok];
   if (TokPrec <= 0)
     return -1;
   return TokPrec;
 }
 
 /// LogError* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> LogError(const std::string &Str) {
+ExprAST *LogError(const std::string &Str) {
   fprintf(stderr, "Error: %s\n", Str.c_str());
   return nullptr;
 }
@@ -334,186 +491,206 @@ std::unique_ptr<PrototypeAST> LogErrorP(const std::string &Str) {
   return nullptr;
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
+static ExprAST *ParseExpression(ParseContext &Ctx);
 
 /// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto Result = std::make_unique<NumberExprAST>(NumVal);
-  getNextToken(); // consume the number
-  return std::move(Result);
+static ExprAST *ParseNumberExpr(ParseContext &Ctx) {
+  auto *Result = Ctx.create<NumberExprAST>(Ctx.NumVal);
+  getNextToken(Ctx); // consume the number
+  return Result;
 }
 
 /// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-  getNextToken(); // eat (.
-  auto V = ParseExpression();
+static ExprAST *ParseParenExpr(ParseContext &Ctx) {
+  getNextToken(Ctx); // eat (.
+  auto V = ParseExpression(Ctx);
   if (!V)
     return nullptr;
 
-  if (CurTok != ')')
+  if (Ctx.CurTok != ')')
     return LogError("expected ')'");
-  getNextToken(); // eat ).
+  getNextToken(Ctx); // eat ).
   return V;
 }
 
 /// identifierexpr
 ///   ::= identifier
+///   ::= identifier '[' expression ']'
 ///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
+static ExprAST *ParseIdentifierExpr(ParseContext &Ctx) {
+  StringRef IdName = Ctx.takeIdentifier();
+
+  getNextToken(Ctx); // eat identifier.
 
-  getNextToken(); // eat identifier.
+  if (Ctx.CurTok == '[') { // Array element.
+    getNextToken(Ctx); // eat [
+    auto *Index = ParseExpression(Ctx);
+    if (!Index)
+      return nullptr;
+    if (Ctx.CurTok != ']')
+      return LogError("expected ']'");
+    getNextToken(Ctx); // eat ]
+    return Ctx.create<IndexExprAST>(IdName, Index);
+  }
 
-  if (CurTok != '(') // Simple variable ref.
-    return std::make_unique<VariableExprAST>(IdName);
+  if (Ctx.CurTok != '(') // Simple variable ref.
+    return Ctx.create<VariableExprAST>(IdName);
 
   // Call.
-  getNextToken(); // eat (
-  std::vector<std::unique_ptr<ExprAST>> Args;
-  if (CurTok != ')') {
+  getNextToken(Ctx); // eat (
+  SmallVector<ExprAST *, 4> Args;
+  if (Ctx.CurTok != ')') {
     while (true) {
-      if (auto Arg = ParseExpression())
-        Args.push_back(std::move(Arg));
+      if (auto *Arg = ParseExpression(Ctx))
+        Args.push_back(Arg);
       else
         return nullptr;
 
-      if (CurTok == ')')
+      if (Ctx.CurTok == ')')
         break;
 
-      if (CurTok != ',')
+      if (Ctx.CurTok != ',')
         return LogError("Expected ')' or ',' in argument list");
-      getNextToken();
+      getNextToken(Ctx);
     }
   }
 
   // Eat the ')'.
-  getNextToken();
+  getNextToken(Ctx);
 
-  return std::make_unique<CallExprAST>(IdName, std::move(Args));
+  Ctx.ParsedCallees.insert(IdName);
+  return Ctx.create<CallExprAST>(IdName, Ctx.copyArray<ExprAST *>(Args));
 }
 
 /// ifexpr ::= 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> ParseIfExpr() {
-  getNextToken(); // eat the if.
+static ExprAST *ParseIfExpr(ParseContext &Ctx) {
+  getNextToken(Ctx); // eat the if.
 
   // condition.
-  auto Cond = ParseExpression();
+  auto Cond = ParseExpression(Ctx);
   if (!Cond)
     return nullptr;
 
-  if (CurTok != tok_then)
+  if (Ctx.CurTok != tok_then)
     return LogError("expected then");
-  getNextToken(); // eat the then
+  getNextToken(Ctx); // eat the then
 
-  auto Then = ParseExpression();
+  auto Then = ParseExpression(Ctx);
   if (!Then)
     return nullptr;
 
-  if (CurTok != tok_else)
+  if (Ctx.CurTok != tok_else)
     return LogError("expected else");
 
-  getNextToken();
+  getNextToken(Ctx);
 
-  auto Else = ParseExpression();
+  auto Else = ParseExpression(Ctx);
   if (!Else)
     return nullptr;
 
-  return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                      std::move(Else));
+  return Ctx.create<IfExprAST>(Cond, Then, Else);
 }
 
 /// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr() {
-  getNextToken(); // eat the for.
+static ExprAST *ParseForExpr(ParseContext &Ctx) {
+  getNextToken(Ctx); // eat the for.
 
-  if (CurTok != tok_identifier)
+  if (Ctx.CurTok != tok_identifier)
     return LogError("expected identifier after for");
 
-  std::string IdName = IdentifierStr;
-  getNextToken(); // eat identifier.
+  StringRef IdName = Ctx.takeIdentifier();
+  getNextToken(Ctx); // eat identifier.
 
-  if (CurTok != '=')
+  if (Ctx.CurTok != '=')
     return LogError("expected '=' after for");
-  getNextToken(); // eat '='.
+  getNextToken(Ctx); // eat '='.
 
-  auto Start = ParseExpression();
+  auto Start = ParseExpression(Ctx);
   if (!Start)
     return nullptr;
-  if (CurTok != ',')
+  if (Ctx.CurTok != ',')
     return LogError("expected ',' after for start value");
-  getNextToken();
+  getNextToken(Ctx);
 
-  auto End = ParseExpression();
+  auto End = ParseExpression(Ctx);
   if (!End)
     return nullptr;
 
   // The step value is optional.
-  std::unique_ptr<ExprAST> Step;
-  if (CurTok == ',') {
-    getNextToken();
-    Step = ParseExpression();
+  ExprAST *Step = nullptr;
+  if (Ctx.CurTok == ',') {
+    getNextToken(Ctx);
+    Step = ParseExpression(Ctx);
     if (!Step)
       return nullptr;
   }
 
-  if (CurTok != tok_in)
+  if (Ctx.CurTok != tok_in)
     return LogError("expected 'in' after for");
-  getNextToken(); // eat 'in'.
+  getNextToken(Ctx); // eat 'in'.
 
-  auto Body = ParseExpression();
+  auto Body = ParseExpression(Ctx);
   if (!Body)
     return nullptr;
 
-  return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End),
-                                       std::move(Step), std::move(Body));
+  return Ctx.create<ForExprAST>(IdName, Start, End, Step, Body);
 }
 
-/// varexpr ::= 'var' identifier ('=' expression)?
-//                    (',' identifier ('=' expression)?)* 'in' expression
-static std::unique_ptr<ExprAST> ParseVarExpr() {
-  getNextToken(); // eat the var.
+/// varexpr ::= 'var' vardecl (',' vardecl)* 'in' expression
+/// vardecl ::= identifier ('=' expression)?
+///         ::= identifier '[' expression ']'
+static ExprAST *ParseVarExpr(ParseContext &Ctx) {
+  getNextToken(Ctx); // eat the var.
 
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+  SmallVector<VarExprAST::VarDecl, 4> VarNames;
 
   // At least one variable name is required.
-  if (CurTok != tok_identifier)
+  if (Ctx.CurTok != tok_identifier)
     return LogError("expected identifier after var");
 
   while (true) {
-    std::string Name = IdentifierStr;
-    getNextToken(); // eat identifier.
+    StringRef Name = Ctx.takeIdentifier();
+    getNextToken(Ctx); // eat identifier.
 
-    // Read the optional initializer.
-    std::unique_ptr<ExprAST> Init = nullptr;
-    if (CurTok == '=') {
-      getNextToken(); // eat the '='.
+    // Read the array length or the optional initializer.
+    ExprAST *Init = nullptr;
+    bool IsArray = Ctx.CurTok == '[';
+    if (IsArray || Ctx.CurTok == '=') {
+      getNextToken(Ctx); // eat the '[' or '='.
 
-      Init = ParseExpression();
+      Init = ParseExpression(Ctx);
       if (!Init)
         return nullptr;
+
+      if (IsArray) {
+        if (Ctx.CurTok != ']')
+          return LogError("expected ']' after array length");
+        getNextToken(Ctx); // eat the ']'.
+      }
     }
 
-    VarNames.push_back(std::make_pair(Name, std::move(Init)));
+    VarNames.push_back({Name, Init, IsArray});
 
     // End of var list, exit loop.
-    if (CurTok != ',')
+    if (Ctx.CurTok != ',')
       break;
-    getNextToken(); // eat the ','.
+    getNextToken(Ctx); // eat the ','.
 
-    if (CurTok != tok_identifier)
+    if (Ctx.CurTok != tok_identifier)
       return LogError("expected identifier list after var");
   }
 
   // At this point, we have to have 'in'.
-  if (CurTok != tok_in)
+  if (Ctx.CurTok != tok_in)
     return LogError("expected 'in' keyword after 'var'");
-  getNextToken(); // eat 'in'.
+  getNextToken(Ctx); // eat 'in'.
 
-  auto Body = ParseExpression();
+  auto Body = ParseExpression(Ctx);
   if (!Body)
     return nullptr;
 
-  return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+  return Ctx.create<VarExprAST>(Ctx.copyArray<VarExprAST::VarDecl>(VarNames),
+                                Body);
 }
 
 /// primary
@@ -523,48 +700,47 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
 ///   ::= ifexpr
 ///   ::= forexpr
 ///   ::= varexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
-  switch (CurTok) {
+static ExprAST *ParsePrimary(ParseContext &Ctx) {
+  switch (Ctx.CurTok) {
   default:
     return LogError("unknown token when expecting an expression");
   case tok_identifier:
-    return ParseIdentifierExpr();
+    return ParseIdentifierExpr(Ctx);
   case tok_number:
-    return ParseNumberExpr();
+    return ParseNumberExpr(Ctx);
   case '(':
-    return ParseParenExpr();
+    return ParseParenExpr(Ctx);
   case tok_if:
-    return ParseIfExpr();
+    return ParseIfExpr(Ctx);
   case tok_for:
-    return ParseForExpr();
+    return ParseForExpr(Ctx);
   case tok_var:
-    return ParseVarExpr();
+    return ParseVarExpr(Ctx);
   }
 }
 
 /// unary
 ///   ::= primary
 ///   ::= '!' unary
-static std::unique_ptr<ExprAST> ParseUnary() {
+static ExprAST *ParseUnary(ParseContext &Ctx) {
   // If the current token is not an operator, it must be a primary expr.
-  if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
-    return ParsePrimary();
+  if (!isascii(Ctx.CurTok) || Ctx.CurTok == '(' || Ctx.CurTok == ',')
+    return ParsePrimary(Ctx);
 
   // If this is a unary operator, read it.
-  int Opc = CurTok;
-  getNextToken();
-  if (auto Operand = ParseUnary())
-    return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+  int Opc = Ctx.CurTok;
+  getNextToken(Ctx);
+  if (auto *Operand = ParseUnary(Ctx))
+    return Ctx.create<UnaryExprAST>(Opc, Operand);
   return nullptr;
 }
 
 /// binoprhs
 ///   ::= ('+' unary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
+static ExprAST *ParseBinOpRHS(ParseContext &Ctx, int ExprPrec, ExprAST *LHS) {
   // If this is a binop, find its precedence.
   while (true) {
-    int TokPrec = GetTokPrecedence();
+    int TokPrec = GetTokPrecedence(Ctx);
 
     // If this is a binop that binds at least as tightly as the current binop,
     // consume it, otherwise we are done.
@@ -572,142 +748,200 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
       return LHS;
 
     // Okay, we know this is a binop.
-    int BinOp = CurTok;
-    getNextToken(); // eat binop
+    int BinOp = Ctx.CurTok;
+    getNextToken(Ctx); // eat binop
 
     // Parse the unary expression after the binary operator.
-    auto RHS = ParseUnary();
+    auto RHS = ParseUnary(Ctx);
     if (!RHS)
       return nullptr;
 
     // If BinOp binds less tightly with RHS than the operator after RHS, let
     // the pending operator take RHS as its LHS.
-    int NextPrec = GetTokPrecedence();
+    int NextPrec = GetTokPrecedence(Ctx);
     if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+      RHS = ParseBinOpRHS(Ctx, TokPrec + 1, RHS);
       if (!RHS)
         return nullptr;
     }
 
+    // Record assignments so that codegen knows which variables need a stack
+    // slot.
+    if (BinOp == '=') {
+      StringRef Name = LHS->getVariableName();
+      if (!Name.empty() && !is_contained(Ctx.AssignedVars, Name))
+        Ctx.AssignedVars.push_back(Name);
+    }
+
     // Merge LHS/RHS.
-    LHS =
-        std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    LHS = Ctx.create<BinaryExprAST>(BinOp, LHS, RHS);
   }
 }
 
 /// expression
 ///   ::= unary binoprhs
 ///
-static std::unique_ptr<ExprAST> ParseExpression() {
-  auto LHS = ParseUnary();
+static ExprAST *ParseExpression(ParseContext &Ctx) {
+  auto *LHS = ParseUnary(Ctx);
   if (!LHS)
     return nullptr;
 
-  return ParseBinOpRHS(0, std::move(LHS));
+  return ParseBinOpRHS(Ctx, 0, LHS);
+}
+
+/// isArrayBuiltin - Whether Name is one of the array builtins, which calls
+/// of that name always refer to (see codegenArrayBuiltin).
+static bool isArrayBuiltin(StringRef Name) {
+  return Name == "len" || Name == "vadd" || Name == "vmul" || Name == "vsum";
 }
 
 /// prototype
-///   ::= id '(' id* ')'
+///   ::= id '(' arg* ')'
 ///   ::= binary LETTER number? (id, id)
 ///   ::= unary LETTER (id)
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
+/// arg ::= id
+///     ::= id '[' ']'
+static std::unique_ptr<PrototypeAST> ParsePrototype(ParseContext &Ctx) {
   std::string FnName;
 
   unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
   unsigned BinaryPrecedence = 30;
 
-  switch (CurTok) {
+  switch (Ctx.CurTok) {
   default:
     return LogErrorP("Expected function name in prototype");
   case tok_identifier:
-    FnName = IdentifierStr;
+    FnName = Ctx.IdentifierStr.str();
+    if (isArrayBuiltin(FnName))
+      return LogErrorP("Cannot define or declare the builtin " + FnName);
     Kind = 0;
-    getNextToken();
+    getNextToken(Ctx);
     break;
   case tok_unary:
-    getNextToken();
-    if (!isascii(CurTok))
+    getNextToken(Ctx);
+    if (!isascii(Ctx.CurTok))
       return LogErrorP("Expected unary operator");
     FnName = "unary";
-    FnName += (char)CurTok;
+    FnName += (char)Ctx.CurTok;
     Kind = 1;
-    getNextToken();
+    getNextToken(Ctx);
     break;
   case tok_binary:
-    getNextToken();
-    if (!isascii(CurTok))
+    getNextToken(Ctx);
+    if (!isascii(Ctx.CurTok))
       return LogErrorP("Expected binary operator");
     FnName = "binary";
-    FnName += (char)CurTok;
+    FnName += (char)Ctx.CurTok;
     Kind = 2;
-    getNextToken();
+    getNextToken(Ctx);
 
     // Read the precedence if present.
-    if (CurTok == tok_number) {
-      if (NumVal < 1 || NumVal > 100)
+    if (Ctx.CurTok == tok_number) {
+      if (Ctx.NumVal < 1 || Ctx.NumVal > 100)
         return LogErrorP("Invalid precedecnce: must be 1..100");
-      BinaryPrecedence = (unsigned)NumVal;
-      getNextToken();
+      BinaryPrecedence = (unsigned)Ctx.NumVal;
+      getNextToken(Ctx);
     }
     break;
   }
 
-  if (CurTok != '(')
+  if (Ctx.CurTok != '(')
     return LogErrorP("Expected '(' in prototype");
 
   std::vector<std::string> ArgNames;
-  while (getNextToken() == tok_identifier)
-    ArgNames.push_back(IdentifierStr);
-  if (CurTok != ')')
+  std::vector<bool> ArrayArgs;
+  bool HasArrayArgs = false;
+  getNextToken(Ctx); // eat '('.
+  while (Ctx.CurTok == tok_identifier) {
+    ArgNames.push_back(Ctx.IdentifierStr.str());
+    bool IsArray = getNextToken(Ctx) == '[';
+    if (IsArray) {
+      if (getNextToken(Ctx) != ']')
+        return LogErrorP("Expected ']' after array argument");
+      getNextToken(Ctx); // eat ']'.
+      HasArrayArgs = true;
+    }
+    ArrayArgs.push_back(IsArray);
+  }
+  if (Ctx.CurTok != ')')
     return LogErrorP("Expected ')' in prototype");
 
   // success.
-  getNextToken(); // eat ')'.
+  getNextToken(Ctx); // eat ')'.
 
   // Verify right number of names for operator.
   if (Kind && ArgNames.size() != Kind)
     return LogErrorP("Invalid number of operands for operator");
+  if (Kind && HasArrayArgs)
+    return LogErrorP("Operators cannot take array operands");
 
   return std::make_unique<PrototypeAST>(FnName, ArgNames, Kind != 0,
-                                         BinaryPrecedence);
+                                         BinaryPrecedence,
+                                         std::move(ArrayArgs));
 }
 
 /// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition(KaleidoscopeParser &P) {
-  getNextToken(); // eat def.
-  auto Proto = ParsePrototype();
+static std::unique_ptr<FunctionAST> ParseDefinition(ParseContext &Ctx) {
+  getNextToken(Ctx); // eat def.
+  std::shared_ptr<PrototypeAST> Proto = ParsePrototype(Ctx);
   if (!Proto)
     return nullptr;
 
-  if (auto E = ParseExpression()) {
-    P.FunctionProtos[Proto->getName()] = std::make_unique<PrototypeAST>(*Proto);
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+  auto Arena = std::make_unique<BumpPtrAllocator>();
+  Ctx.Arena = Arena.get();
+  Ctx.ParsedCallees.clear();
+  Ctx.AssignedVars.clear();
+  if (auto *E = ParseExpression(Ctx)) {
+    Ctx.P.FunctionProtos[Proto->getName()] = Proto;
+    auto FnAST = std::make_unique<FunctionAST>(std::move(Arena),
+                                               std::move(Proto), E);
+    FnAST->setCallees({Ctx.ParsedCallees.begin(), Ctx.ParsedCallees.end()});
+    FnAST->setAssignedVars(Ctx.copyArray<StringRef>(Ctx.AssignedVars));
+    return FnAST;
   }
   return nullptr;
 }
 
-/// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr(KaleidoscopeParser &P) {
+/// getTopLevelExprName - Return a new, unique name for the function of a
+/// top-level expression.
+static std::string getTopLevelExprName() {
   static std::atomic_uint64_t Counter = 0;
+  return ("expr." + Twine(Counter++)).str();
+}
 
-  if (auto E = ParseExpression()) {
-    // Make an anonymous proto.
-    auto Proto = std::make_unique<PrototypeAST>(
-        ("expr." + Twine(Counter++)).str(), std::vector<std::string>());
+/// isTopLevelExprName - Whether Name is the name of a top-level expression's
+/// function. Identifiers cannot contain a '.'.
+static bool isTopLevelExprName(StringRef Name) {
+  return Name.startswith("expr.");
+}
 
-    P.FunctionProtos[Proto->getName()] = std::make_unique<PrototypeAST>(*Proto);
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+/// toplevelexpr ::= expression
+static std::unique_ptr<FunctionAST> ParseTopLevelExpr(ParseContext &Ctx) {
+  auto Arena = std::make_unique<BumpPtrAllocator>();
+  Ctx.Arena = Arena.get();
+  Ctx.ParsedCallees.clear();
+  Ctx.AssignedVars.clear();
+  if (auto *E = ParseExpression(Ctx)) {
+    // Make an anonymous proto.
+    auto Proto = std::make_shared<PrototypeAST>(getTopLevelExprName(),
+                                                std::vector<std::string>());
+
+    Ctx.P.FunctionProtos[Proto->getName()] = Proto;
+    auto FnAST = std::make_unique<FunctionAST>(std::move(Arena),
+                                               std::move(Proto), E);
+    FnAST->setCallees({Ctx.ParsedCallees.begin(), Ctx.ParsedCallees.end()});
+    FnAST->setAssignedVars(Ctx.copyArray<StringRef>(Ctx.AssignedVars));
+    return FnAST;
   }
   return nullptr;
 }
 
 /// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern(KaleidoscopeParser &P) {
-  getNextToken(); // eat extern.
-  auto Proto = ParsePrototype();
-  if (Proto)
-    P.FunctionProtos[Proto->getName()] = std::make_unique<PrototypeAST>(*Proto);
-  return Proto;
+///
+/// The caller installs the prototype in FunctionProtos.
+static std::unique_ptr<PrototypeAST> ParseExtern(ParseContext &Ctx) {
+  getNextToken(Ctx); // eat extern.
+  return ParsePrototype(Ctx);
 }
 
 //===----------------------------------------------------------------------===//
@@ -725,10 +959,38 @@ struct CodeGenContext {
   std::unique_ptr<Module> TheModule =
     std::make_unique<Module>(("m." + Twine(Counter++)).str(), *TheContext);
   std::unique_ptr<IRBuilder<>> Builder = std::make_unique<IRBuilder<>>(*TheContext);
-  std::map<std::string, llvm::AllocaInst *> NamedValues;
+
+  /// VariableBinding - What a variable in scope refers to.
+  struct VariableBinding {
+    /// The stack slot of a mutable scalar, the value of an immutable one, or
+    /// the address of the first element of an array.
+    Value *V = nullptr;
+    /// The length of an array (an i64), or null for scalars.
+    Value *Len = nullptr;
+  };
+
+  StringMap<VariableBinding> NamedValues;
+
+  /// The variables assigned in the function being generated.
+  ArrayRef<StringRef> AssignedVars;
+
+  /// Return true if VarName must live in a stack slot, false if it can be
+  /// bound directly to an SSA value.
+  bool needsStackSlot(StringRef VarName) const;
 };
 
 std::atomic_uint64_t CodeGenContext::Counter = 0;
+
+static cl::opt<bool> SSABindings(
+    "ssa-bindings",
+    cl::desc("Bind variables that are never assigned directly to SSA values "
+             "instead of stack slots"),
+    cl::init(true));
+
+bool CodeGenContext::needsStackSlot(StringRef VarName) const {
+  return !SSABindings || is_contained(AssignedVars, VarName);
+}
+
 static ExitOnError ExitOnErr;
 
 Value *LogErrorV(const std::string &Str) {
@@ -736,14 +998,15 @@ Value *LogErrorV(const std::string &Str) {
   return nullptr;
 }
 
-Function *getFunction(KaleidoscopeParser &P, CodeGenContext &CGCtx, std::string Name) {
+Function *getFunction(KaleidoscopeParser &P, CodeGenContext &CGCtx,
+                      StringRef Name) {
   // First, see if the function has already been added to the current module.
   if (auto *F = CGCtx.TheModule->getFunction(Name))
     return F;
 
   // If not, check whether we can codegen the declaration from some existing
   // prototype.
-  auto FI = P.FunctionProtos.find(Name);
+  auto FI = P.FunctionProtos.find(Name.str());
   if (FI != P.FunctionProtos.end())
     return FI->second->codegen(P, CGCtx);
 
@@ -765,15 +1028,89 @@ Value *NumberExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
   return ConstantFP::get(*CGCtx.TheContext, APFloat(Val));
 }
 
+Value *ExprAST::codegenAssign(KaleidoscopeParser &P, CodeGenContext &CGCtx,
+                              Value *Val) {
+  return LogErrorV("destination of '=' must be a variable");
+}
+
 Value *VariableExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
   // Look this variable up in the function.
-  Value *V = CGCtx.NamedValues[Name];
-  if (!V)
+  auto Binding = CGCtx.NamedValues.lookup(Name);
+  if (!Binding.V)
     return LogErrorV("Unknown variable name");
+  if (Binding.Len)
+    return LogErrorV("array used as a value");
+
+  // Immutable variables are bound to their value.
+  if (!isa<AllocaInst>(Binding.V))
+    return Binding.V;
 
   // Load the value.
-  return CGCtx.Builder->CreateLoad(Type::getDoubleTy(*CGCtx.TheContext), V,
-                                   Name.c_str());
+  return CGCtx.Builder->CreateLoad(Type::getDoubleTy(*CGCtx.TheContext),
+                                   Binding.V, Name);
+}
+
+Value *VariableExprAST::codegenAssign(KaleidoscopeParser &P,
+                                      CodeGenContext &CGCtx, Value *Val) {
+  // Look up the name. The parser records every assigned variable, so it
+  // always has a stack slot.
+  auto Binding = CGCtx.NamedValues.lookup(Name);
+  if (!Binding.V)
+    return LogErrorV("Unknown variable name");
+  if (Binding.Len)
+    return LogErrorV("cannot assign to an array");
+  assert(isa<AllocaInst>(Binding.V) && "assigned variable has no stack slot");
+
+  CGCtx.Builder->CreateStore(Val, Binding.V);
+  return Val;
+}
+
+/// getArray - Return the binding of the array called Name, or an empty binding
+/// after reporting an error if there is no such array.
+static CodeGenContext::VariableBinding getArray(CodeGenContext &CGCtx,
+                                                StringRef Name) {
+  auto Binding = CGCtx.NamedValues.lookup(Name);
+  if (!Binding.Len) {
+    LogError("expected the name of an array");
+    return {};
+  }
+  return Binding;
+}
+
+/// codegenElementAddress - Emit the address of Array[Index]. Indices are not
+/// bounds-checked.
+static Value *codegenElementAddress(KaleidoscopeParser &P,
+                                    CodeGenContext &CGCtx, StringRef ArrayName,
+                                    ExprAST *Index) {
+  auto Array = getArray(CGCtx, ArrayName);
+  if (!Array.V)
+    return nullptr;
+
+  Value *IndexV = Index->codegen(P, CGCtx);
+  if (!IndexV)
+    return nullptr;
+
+  IndexV = CGCtx.Builder->CreateFPToSI(IndexV, CGCtx.Builder->getInt64Ty(),
+                                       "idx");
+  return CGCtx.Builder->CreateInBoundsGEP(CGCtx.Builder->getDoubleTy(),
+                                          Array.V, IndexV, "elt");
+}
+
+Value *IndexExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
+  Value *Addr = codegenElementAddress(P, CGCtx, ArrayName, Index);
+  if (!Addr)
+    return nullptr;
+  return CGCtx.Builder->CreateLoad(CGCtx.Builder->getDoubleTy(), Addr,
+                                   ArrayName);
+}
+
+Value *IndexExprAST::codegenAssign(KaleidoscopeParser &P,
+                                   CodeGenContext &CGCtx, Value *Val) {
+  Value *Addr = codegenElementAddress(P, CGCtx, ArrayName, Index);
+  if (!Addr)
+    return nullptr;
+  CGCtx.Builder->CreateStore(Val, Addr);
+  return Val;
 }
 
 Value *UnaryExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
@@ -791,25 +1128,13 @@ Value *UnaryExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
 Value *BinaryExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
   // Special case '=' because we don't want to emit the LHS as an expression.
   if (Op == '=') {
-    // Assignment requires the LHS to be an identifier.
-    // This assume we're building without RTTI because LLVM builds that way by
-    // default.  If you build LLVM with RTTI this can be changed to a
-    // dynamic_cast for automatic error checking.
-    VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
-    if (!LHSE)
-      return LogErrorV("destination of '=' must be a variable");
     // Codegen the RHS.
     Value *Val = RHS->codegen(P, CGCtx);
     if (!Val)
       return nullptr;
 
-    // Look up the name.
-    Value *Variable = CGCtx.NamedValues[LHSE->getName()];
-    if (!Variable)
-      return LogErrorV("Unknown variable name");
-
-    CGCtx.Builder->CreateStore(Val, Variable);
-    return Val;
+    // Assignment requires the LHS to be a variable or an array element.
+    return LHS->codegenAssign(P, CGCtx, Val);
   }
 
   Value *L = LHS->codegen(P, CGCtx);
@@ -842,22 +1167,182 @@ Value *BinaryExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
   return CGCtx.Builder->CreateCall(F, Ops, "binop");
 }
 
+/// Number of doubles processed per iteration by the vector builtins. Four
+/// doubles fill an AVX register; the backend splits or widens the vectors to
+/// whatever the target has.
+static constexpr unsigned ArrayVectorWidth = 4;
+
+/// emitCountedLoop - Emit "for (I = Begin; I < End; I += Step) Acc = Body(I,
+/// Acc)" with i64 indices, and return the final value of Acc. Acc may be null
+/// if the loop does not carry a value.
+static Value *
+emitCountedLoop(CodeGenContext &CGCtx, Value *Begin, Value *End, uint64_t Step,
+                Value *Acc, function_ref<Value *(Value *, Value *)> Body) {
+  IRBuilder<> &Builder = *CGCtx.Builder;
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+  BasicBlock *LoopBB =
+      BasicBlock::Create(*CGCtx.TheContext, "vloop", TheFunction);
+  BasicBlock *AfterBB = BasicBlock::Create(*CGCtx.TheContext, "vafterloop");
+
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Begin, End), LoopBB, AfterBB);
+
+  Builder.SetInsertPoint(LoopBB);
+  PHINode *I = Builder.CreatePHI(Builder.getInt64Ty(), 2, "i");
+  I->addIncoming(Begin, PreheaderBB);
+  PHINode *AccPN = nullptr;
+  if (Acc) {
+    AccPN = Builder.CreatePHI(Acc->getType(), 2, "acc");
+    AccPN->addIncoming(Acc, PreheaderBB);
+  }
+
+  Value *NextAcc = Body(I, AccPN);
+  Value *NextI = Builder.CreateNSWAdd(I, Builder.getInt64(Step), "nexti");
+  Builder.CreateCondBr(Builder.CreateICmpSLT(NextI, End), LoopBB, AfterBB);
+  BasicBlock *LoopEndBB = Builder.GetInsertBlock();
+  I->addIncoming(NextI, LoopEndBB);
+  if (AccPN)
+    AccPN->addIncoming(NextAcc, LoopEndBB);
+
+  TheFunction->insert(TheFunction->end(), AfterBB);
+  Builder.SetInsertPoint(AfterBB);
+  if (!Acc)
+    return nullptr;
+
+  PHINode *Result = Builder.CreatePHI(Acc->getType(), 2, "accend");
+  Result->addIncoming(Acc, PreheaderBB);
+  Result->addIncoming(NextAcc, LoopEndBB);
+  return Result;
+}
+
+/// codegenArrayBuiltin - Emit a call to one of the array builtins:
+///   len(a)         the length of a
+///   vadd(d, a, b)  d[i] = a[i] + b[i], returns 0
+///   vmul(d, a, b)  d[i] = a[i] * b[i], returns 0
+///   vsum(a)        the sum of the elements of a
+/// vadd and vmul process min(len(d), len(a), len(b)) elements; d may be a or
+/// b. The loops are emitted with explicit vector operations, so they do not
+/// depend on the loop vectorizer. vsum adds the elements in a different order
+/// than a scalar loop would, so the result can differ in the last bits.
+static Value *codegenArrayBuiltin(KaleidoscopeParser &P, CodeGenContext &CGCtx,
+                                  StringRef Name, ArrayRef<ExprAST *> Args) {
+  unsigned NumArgs = (Name == "vadd" || Name == "vmul") ? 3 : 1;
+  if (Args.size() != NumArgs)
+    return LogErrorV(("Incorrect # arguments passed to " + Name).str());
+
+  SmallVector<CodeGenContext::VariableBinding, 3> Arrays;
+  for (auto *Arg : Args) {
+    Arrays.push_back(getArray(CGCtx, Arg->getVariableName()));
+    if (!Arrays.back().V)
+      return nullptr;
+  }
+
+  IRBuilder<> &Builder = *CGCtx.Builder;
+  Type *DoubleTy = Builder.getDoubleTy();
+  if (Name == "len")
+    return Builder.CreateSIToFP(Arrays[0].Len, DoubleTy, "len");
+
+  // Process the first N & ~(ArrayVectorWidth - 1) elements a vector at a
+  // time, and the rest one by one.
+  Value *N = Arrays[0].Len;
+  for (auto &Array : drop_begin(Arrays))
+    N = Builder.CreateBinaryIntrinsic(Intrinsic::smin, N, Array.Len);
+  Value *VectorEnd =
+      Builder.CreateAnd(N, ~uint64_t(ArrayVectorWidth - 1), "vecend");
+  Type *VectorTy = FixedVectorType::get(DoubleTy, ArrayVectorWidth);
+  Value *Zero = Builder.getInt64(0);
+
+  auto Load = [&](Type *Ty, unsigned ArgNo, Value *I) {
+    Value *Addr = Builder.CreateInBoundsGEP(DoubleTy, Arrays[ArgNo].V, I);
+    return Builder.CreateAlignedLoad(Ty, Addr, Align(8));
+  };
+
+  if (Name == "vsum") {
+    Value *VectorSum =
+        emitCountedLoop(CGCtx, Zero, VectorEnd, ArrayVectorWidth,
+                        Constant::getNullValue(VectorTy),
+                        [&](Value *I, Value *Acc) {
+                          return Builder.CreateFAdd(Acc, Load(VectorTy, 0, I));
+                        });
+    Value *Sum = Builder.CreateFAddReduce(ConstantFP::getNegativeZero(DoubleTy),
+                                          VectorSum);
+    return emitCountedLoop(CGCtx, VectorEnd, N, 1, Sum,
+                           [&](Value *I, Value *Acc) {
+                             return Builder.CreateFAdd(Acc,
+                                                       Load(DoubleTy, 0, I));
+                           });
+  }
+
+  auto Store = [&](Type *Ty, Value *I) -> Value * {
+    Value *L = Load(Ty, 1, I);
+    Value *R = Load(Ty, 2, I);
+    Value *V = Name == "vadd" ? Builder.CreateFAdd(L, R)
+                              : Builder.CreateFMul(L, R);
+    Value *Addr = Builder.CreateInBoundsGEP(DoubleTy, Arrays[0].V, I);
+    Builder.CreateAlignedStore(V, Addr, Align(8));
+    return nullptr;
+  };
+  emitCountedLoop(CGCtx, Zero, VectorEnd, ArrayVectorWidth, nullptr,
+                  [&](Value *I, Value *) { return Store(VectorTy, I); });
+  emitCountedLoop(CGCtx, VectorEnd, N, 1, nullptr,
+                  [&](Value *I, Value *) { return Store(DoubleTy, I); });
+  return ConstantFP::get(DoubleTy, 0.0);
+}
+
 Value *CallExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
+  // The parser rejects functions with the builtins' names.
+  if (isArrayBuiltin(Callee))
+    return codegenArrayBuiltin(P, CGCtx, Callee, Args);
+
   // Look up the name in the global module table.
   Function *CalleeF = getFunction(P, CGCtx, Callee);
-  if (!CalleeF)
-    return LogErrorV("Unknown function " + Callee + " referenced");
-
-  // If argument mismatch error.
-  if (CalleeF->arg_size() != Args.size())
-    return LogErrorV("Incorrect # arguments passed");
 
+  // Host functions with registered IR are linked into the module for the
+  // optimizer to inline; they need no extern.
+  if (P.HostIR && (!CalleeF || CalleeF->isDeclaration()))
+    if (Function *HostF = P.HostIR->import(Callee, *CGCtx.TheModule))
+      CalleeF = HostF;
+  if (!CalleeF)
+    return LogErrorV(("Unknown function " + Callee + " referenced").str());
+
+  // Array arguments take two parameters, the address and the length. The
+  // callee's prototype says which arguments are arrays; host functions called
+  // without an extern have none, but take arrays only as a pointer followed
+  // by an i64 (see HostIRLibrary), so their parameter types say it instead.
+  auto ProtoI = P.FunctionProtos.find(Callee.str());
+  const PrototypeAST *Proto =
+      ProtoI != P.FunctionProtos.end() ? ProtoI->second.get() : nullptr;
   std::vector<Value *> ArgsV;
-  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->codegen(P, CGCtx));
+  for (unsigned Idx = 0, E = Args.size(); Idx != E; ++Idx) {
+    // If argument mismatch error.
+    if (ArgsV.size() >= CalleeF->arg_size())
+      return LogErrorV("Incorrect # arguments passed");
+
+    bool IsArray =
+        Proto ? Proto->isArrayArg(Idx)
+              : CalleeF->getArg(ArgsV.size())->getType()->isPointerTy();
+    if (IsArray) {
+      auto Array = getArray(CGCtx, Args[Idx]->getVariableName());
+      if (!Array.V)
+        return nullptr;
+      ArgsV.push_back(Array.V);
+      ArgsV.push_back(Array.Len);
+      continue;
+    }
+
+    ArgsV.push_back(Args[Idx]->codegen(P, CGCtx));
     if (!ArgsV.back())
       return nullptr;
   }
+  if (ArgsV.size() != CalleeF->arg_size())
+    return LogErrorV("Incorrect # arguments passed");
+
+  // An extern can disagree with the IR registered for the host function.
+  for (unsigned I = 0, E = ArgsV.size(); I != E; ++I)
+    if (ArgsV[I]->getType() != CalleeF->getArg(I)->getType())
+      return LogErrorV(("Arguments passed to " + Callee +
+                        " do not match its parameters")
+                           .str());
 
   return CGCtx.Builder->CreateCall(CalleeF, ArgsV, "calltmp");
 }
@@ -933,11 +1418,23 @@ Value *IfExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
 //   store nextvar -> var
 //   br endcond, loop, endloop
 // outloop:
+//
+// If the body never assigns the variable, it is a PHI node in the loop header
+// instead:
+// loop:
+//   var = phi [start, entry], [nextvar, loopend]
+//   ...
+// loopend:
+//   ...
+//   nextvar = var + step
+//   br endcond, loop, endloop
 Value *ForExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
   Function *TheFunction = CGCtx.Builder->GetInsertBlock()->getParent();
 
-  // Create an alloca for the variable in the entry block.
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+  // Create an alloca for the variable in the entry block if it is mutable.
+  AllocaInst *Alloca = nullptr;
+  if (CGCtx.needsStackSlot(VarName))
+    Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
 
   // Emit the start code first, without 'variable' in scope.
   Value *StartVal = Start->codegen(P, CGCtx);
@@ -945,10 +1442,12 @@ Value *ForExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
     return nullptr;
 
   // Store the value into the alloca.
-  CGCtx.Builder->CreateStore(StartVal, Alloca);
+  if (Alloca)
+    CGCtx.Builder->CreateStore(StartVal, Alloca);
 
   // Make the new basic block for the loop header, inserting after current
   // block.
+  BasicBlock *PreheaderBB = CGCtx.Builder->GetInsertBlock();
   BasicBlock *LoopBB = BasicBlock::Create(*CGCtx.TheContext, "loop",
                                           TheFunction);
 
@@ -958,10 +1457,19 @@ Value *ForExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
   // Start insertion in LoopBB.
   CGCtx.Builder->SetInsertPoint(LoopBB);
 
+  // Start the PHI node with an entry for Start.
+  PHINode *Variable = nullptr;
+  if (!Alloca) {
+    Variable = CGCtx.Builder->CreatePHI(Type::getDoubleTy(*CGCtx.TheContext),
+                                        2, VarName);
+    Variable->addIncoming(StartVal, PreheaderBB);
+  }
+
   // Within the loop, the variable is defined equal to the PHI node.  If it
   // shadows an existing variable, we have to restore it, so save it now.
-  AllocaInst *OldVal = CGCtx.NamedValues[VarName];
-  CGCtx.NamedValues[VarName] = Alloca;
+  auto OldVal = CGCtx.NamedValues.lookup(VarName);
+  CGCtx.NamedValues[VarName] = {Alloca ? static_cast<Value *>(Alloca)
+                                       : static_cast<Value *>(Variable)};
 
   // Emit the body of the loop.  This, like any other expr, can change the
   // current BB.  Note that we ignore the value computed by the body, but don't
@@ -987,17 +1495,20 @@ Value *ForExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
 
   // Reload, increment, and restore the alloca.  This handles the case where
   // the body of the loop mutates the variable.
-  Value *CurVar =
-    CGCtx.Builder->CreateLoad(Type::getDoubleTy(*CGCtx.TheContext), Alloca,
-                              VarName.c_str());
+  Value *CurVar = Variable;
+  if (Alloca)
+    CurVar = CGCtx.Builder->CreateLoad(Type::getDoubleTy(*CGCtx.TheContext),
+                                       Alloca, VarName);
   Value *NextVar = CGCtx.Builder->CreateFAdd(CurVar, StepVal, "nextvar");
-  CGCtx.Builder->CreateStore(NextVar, Alloca);
+  if (Alloca)
+    CGCtx.Builder->CreateStore(NextVar, Alloca);
 
   // Convert condition to a bool by comparing equal to 0.0.
   EndCond = CGCtx.Builder->CreateFCmpONE(
       EndCond, ConstantFP::get(*CGCtx.TheContext, APFloat(0.0)), "loopcond");
 
   // Create the "after loop" block and insert it.
+  BasicBlock *LoopEndBB = CGCtx.Builder->GetInsertBlock();
   BasicBlock *AfterBB =
       BasicBlock::Create(*CGCtx.TheContext, "afterloop", TheFunction);
 
@@ -1007,8 +1518,12 @@ Value *ForExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
   // Any new code will be inserted in AfterBB.
   CGCtx.Builder->SetInsertPoint(AfterBB);
 
+  // Add a new entry to the PHI node for the backedge.
+  if (Variable)
+    Variable->addIncoming(NextVar, LoopEndBB);
+
   // Restore the unshadowed variable.
-  if (OldVal)
+  if (OldVal.V)
     CGCtx.NamedValues[VarName] = OldVal;
   else
     CGCtx.NamedValues.erase(VarName);
@@ -1018,14 +1533,45 @@ Value *ForExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
 }
 
 Value *VarExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
-  std::vector<AllocaInst *> OldBindings;
+  std::vector<CodeGenContext::VariableBinding> OldBindings;
 
   Function *TheFunction = CGCtx.Builder->GetInsertBlock()->getParent();
+  IRBuilder<> &Builder = *CGCtx.Builder;
+
+  // Arrays are allocated on the stack where the var is, and freed again at
+  // the end of its body, so that a var inside a loop does not keep growing
+  // the stack.
+  Value *SavedStack = nullptr;
 
   // Register all variables and emit their initializer.
   for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
-    const std::string &VarName = VarNames[i].first;
-    ExprAST *Init = VarNames[i].second.get();
+    StringRef VarName = VarNames[i].Name;
+    ExprAST *Init = VarNames[i].Init;
+
+    if (VarNames[i].IsArray) {
+      // The length is evaluated before the array is in scope, like an
+      // initializer.
+      Value *Len = Init->codegen(P, CGCtx);
+      if (!Len)
+        return nullptr;
+      Len = Builder.CreateFPToSI(Len, Builder.getInt64Ty());
+      Len = Builder.CreateBinaryIntrinsic(Intrinsic::smax, Len,
+                                          Builder.getInt64(0), nullptr,
+                                          VarName + ".len");
+
+      if (!SavedStack)
+        SavedStack = Builder.CreateIntrinsic(Intrinsic::stacksave, {}, {});
+      AllocaInst *Array =
+          Builder.CreateAlloca(Builder.getDoubleTy(), Len, VarName);
+      Array->setAlignment(Align(8));
+      Builder.CreateMemSet(Array, Builder.getInt8(0),
+                           Builder.CreateMul(Len, Builder.getInt64(8)),
+                           MaybeAlign(8));
+
+      OldBindings.push_back(CGCtx.NamedValues.lookup(VarName));
+      CGCtx.NamedValues[VarName] = {Array, Len};
+      continue;
+    }
 
     // Emit the initializer before adding the variable to scope, this prevents
     // the initializer from referencing the variable itself, and permits stuff
@@ -1041,15 +1587,20 @@ Value *VarExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
       InitVal = ConstantFP::get(*CGCtx.TheContext, APFloat(0.0));
     }
 
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-    CGCtx.Builder->CreateStore(InitVal, Alloca);
+    // Variables that are never assigned are bound to their initial value.
+    Value *Binding = InitVal;
+    if (CGCtx.needsStackSlot(VarName)) {
+      AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+      Builder.CreateStore(InitVal, Alloca);
+      Binding = Alloca;
+    }
 
     // Remember the old variable binding so that we can restore the binding when
     // we unrecurse.
-    OldBindings.push_back(CGCtx.NamedValues[VarName]);
+    OldBindings.push_back(CGCtx.NamedValues.lookup(VarName));
 
     // Remember this binding.
-    CGCtx.NamedValues[VarName] = Alloca;
+    CGCtx.NamedValues[VarName] = {Binding};
   }
 
   // Codegen the body, now that all vars are in scope.
@@ -1057,45 +1608,91 @@ Value *VarExprAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
   if (!BodyVal)
     return nullptr;
 
+  // Free the arrays.
+  if (SavedStack)
+    Builder.CreateIntrinsic(Intrinsic::stackrestore, {}, {SavedStack});
+
   // Pop all our variables from scope.
   for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-    CGCtx.NamedValues[VarNames[i].first] = OldBindings[i];
+    CGCtx.NamedValues[VarNames[i].Name] = OldBindings[i];
 
   // Return the body computation.
   return BodyVal;
 }
 
 Function *PrototypeAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
-  // Make the function type:  double(double,double) etc.
-  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*CGCtx.TheContext));
+  // Make the function type:  double(double,double) etc. An array argument
+  // becomes a pointer and an i64 length.
+  std::vector<Type *> Params;
+  for (unsigned Idx = 0, E = Args.size(); Idx != E; ++Idx) {
+    if (isArrayArg(Idx)) {
+      Params.push_back(PointerType::getUnqual(*CGCtx.TheContext));
+      Params.push_back(Type::getInt64Ty(*CGCtx.TheContext));
+    } else
+      Params.push_back(Type::getDoubleTy(*CGCtx.TheContext));
+  }
   FunctionType *FT =
-      FunctionType::get(Type::getDoubleTy(*CGCtx.TheContext), Doubles, false);
+      FunctionType::get(Type::getDoubleTy(*CGCtx.TheContext), Params, false);
 
   Function *F =
       Function::Create(FT, Function::ExternalLinkage, Name,
                        CGCtx.TheModule.get());
 
   // Set names for all arguments.
-  unsigned Idx = 0;
-  for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
+  auto *Arg = F->arg_begin();
+  for (unsigned Idx = 0, E = Args.size(); Idx != E; ++Idx) {
+    (Arg++)->setName(Args[Idx]);
+    if (isArrayArg(Idx))
+      (Arg++)->setName(Args[Idx] + ".len");
+  }
 
   return F;
 }
 
-FunctionAST::FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                         std::unique_ptr<ExprAST> Body)
-    : Proto(std::move(Proto)), Body(std::move(Body)) {}
+/// getHeapBytes - The bytes that S has allocated outside of itself, if it
+/// does not fit in its inline buffer.
+static size_t getHeapBytes(const std::string &S) {
+  const char *Self = reinterpret_cast<const char *>(&S);
+  if (S.data() >= Self && S.data() < Self + sizeof(S))
+    return 0;
+  return S.capacity() + 1;
+}
+
+size_t PrototypeAST::getMemoryUsage() const {
+  size_t Bytes = sizeof(*this) + getHeapBytes(Name) +
+                 Args.capacity() * sizeof(std::string) +
+                 ArrayArgs.capacity() / 8;
+  for (auto &Arg : Args)
+    Bytes += getHeapBytes(Arg);
+  return Bytes;
+}
+
+FunctionAST::FunctionAST(std::unique_ptr<BumpPtrAllocator> Arena,
+                         std::shared_ptr<PrototypeAST> Proto, ExprAST *Body)
+    : Arena(std::move(Arena)), Proto(std::move(Proto)), Body(Body) {}
 FunctionAST::~FunctionAST() = default;
 
 const std::string &FunctionAST::getName() const {
   return Proto->getName();
 }
 
+const PrototypeAST &FunctionAST::getProto() const { return *Proto; }
+
 void FunctionAST::setName(std::string NewName) {
+  // The prototype may be shared with FunctionProtos under the old name.
+  Proto = std::make_shared<PrototypeAST>(*Proto);
   Proto->setName(std::move(NewName));
 }
 
+size_t FunctionAST::getMemoryUsage() const {
+  size_t Bytes = sizeof(*this) + sizeof(*Arena) + Arena->getTotalMemory() +
+                 Proto->getMemoryUsage();
+  Bytes += Callees.capacity() * sizeof(std::string);
+  for (auto &Callee : Callees)
+    Bytes += getHeapBytes(Callee);
+  return Bytes;
+}
+
 Function *FunctionAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
   Function *TheFunction = getFunction(P, CGCtx, Proto->getName());
   if (!TheFunction)
@@ -1103,9 +1700,20 @@ Function *FunctionAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
   if (!TheFunction)
     return nullptr;
 
+  // A host function of the same name that was imported for an earlier call
+  // in this module is replaced by the definition.
+  if (TheFunction->hasAvailableExternallyLinkage())
+    TheFunction->deleteBody();
+
+  // Batch mode puts several definitions in one module.
+  if (!TheFunction->empty()) {
+    LogErrorV("Function cannot be redefined.");
+    return nullptr;
+  }
+
   // If this is an operator, install it.
   if (Proto->isBinaryOp())
-    BinopPrecedence[Proto->getOperatorName()] = Proto->getBinaryPrecedence();
+    P.BinopPrecedence[Proto->getOperatorName()] = Proto->getBinaryPrecedence();
 
   // Create a new basic block to start insertion into.
   BasicBlock *BB = BasicBlock::Create(*CGCtx.TheContext, "entry", TheFunction);
@@ -1113,7 +1721,23 @@ Function *FunctionAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
 
   // Record the function arguments in the CGCtx.NamedValues map.
   CGCtx.NamedValues.clear();
-  for (auto &Arg : TheFunction->args()) {
+  CGCtx.AssignedVars = AssignedVars;
+  for (auto *ArgI = TheFunction->arg_begin(), *ArgE = TheFunction->arg_end();
+       ArgI != ArgE; ++ArgI) {
+    Argument &Arg = *ArgI;
+
+    // Array arguments are followed by their length.
+    if (Arg.getType()->isPointerTy()) {
+      CGCtx.NamedValues[Arg.getName()] = {&Arg, ++ArgI};
+      continue;
+    }
+
+    // Arguments that are never assigned are used directly.
+    if (!CGCtx.needsStackSlot(Arg.getName())) {
+      CGCtx.NamedValues[Arg.getName()] = {&Arg};
+      continue;
+    }
+
     // Create an alloca for this variable.
     AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
 
@@ -1121,7 +1745,7 @@ Function *FunctionAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
     CGCtx.Builder->CreateStore(&Arg, Alloca);
 
     // Add arguments to variable symbol table.
-    CGCtx.NamedValues[std::string(Arg.getName())] = Alloca;
+    CGCtx.NamedValues[Arg.getName()] = {Alloca};
   }
 
   if (Value *RetVal = Body->codegen(P, CGCtx)) {
@@ -1132,7 +1756,7 @@ Function *FunctionAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
     verifyFunction(*TheFunction);
 
     // Add Prototype to FunctionProtos map.
-    P.FunctionProtos[Proto->getName()] = std::make_unique<PrototypeAST>(*Proto);
+    P.FunctionProtos[Proto->getName()] = Proto;
 
     return TheFunction;
   }
@@ -1141,35 +1765,657 @@ Function *FunctionAST::codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx) {
   TheFunction->eraseFromParent();
 
   if (Proto->isBinaryOp())
-    BinopPrecedence.erase(Proto->getOperatorName());
+    P.BinopPrecedence.erase(Proto->getOperatorName());
   return nullptr;
 }
 
+//===----------------------------------------------------------------------===//
+// AST printing
+//===----------------------------------------------------------------------===//
+
+void NumberExprAST::print(raw_ostream &OS) const {
+  // Hex float notation round-trips exactly.
+  OS << format("%a", Val);
+}
+
+void VariableExprAST::print(raw_ostream &OS) const { OS << Name; }
+
+void IndexExprAST::print(raw_ostream &OS) const {
+  OS << "(index " << ArrayName << ' ';
+  Index->print(OS);
+  OS << ')';
+}
+
+void UnaryExprAST::print(raw_ostream &OS) const {
+  OS << "(unary" << Opcode << ' ';
+  Operand->print(OS);
+  OS << ')';
+}
+
+void BinaryExprAST::print(raw_ostream &OS) const {
+  OS << '(' << Op << ' ';
+  LHS->print(OS);
+  OS << ' ';
+  RHS->print(OS);
+  OS << ')';
+}
+
+void CallExprAST::print(raw_ostream &OS) const {
+  OS << "(call " << Callee;
+  for (auto &Arg : Args) {
+    OS << ' ';
+    Arg->print(OS);
+  }
+  OS << ')';
+}
+
+void IfExprAST::print(raw_ostream &OS) const {
+  OS << "(if ";
+  Cond->print(OS);
+  OS << ' ';
+  Then->print(OS);
+  OS << ' ';
+  Else->print(OS);
+  OS << ')';
+}
+
+void ForExprAST::print(raw_ostream &OS) const {
+  OS << "(for " << VarName << ' ';
+  Start->print(OS);
+  OS << ' ';
+  End->print(OS);
+  OS << ' ';
+  if (Step)
+    Step->print(OS);
+  else
+    OS << '_';
+  OS << ' ';
+  Body->print(OS);
+  OS << ')';
+}
+
+void VarExprAST::print(raw_ostream &OS) const {
+  OS << "(var (";
+  for (auto &[Name, Init, IsArray] : VarNames) {
+    OS << '(' << Name;
+    if (IsArray)
+      OS << " []";
+    if (Init) {
+      OS << ' ';
+      Init->print(OS);
+    }
+    OS << ')';
+  }
+  OS << ") ";
+  Body->print(OS);
+  OS << ')';
+}
+
+void PrototypeAST::print(raw_ostream &OS) const {
+  OS << "(proto " << Name << " (";
+  ListSeparator LS(" ");
+  for (unsigned Idx = 0, E = Args.size(); Idx != E; ++Idx) {
+    OS << LS << Args[Idx];
+    if (isArrayArg(Idx))
+      OS << "[]";
+  }
+  OS << ')';
+  if (IsOperator)
+    OS << " op " << Precedence;
+  OS << ')';
+}
+
+void FunctionAST::print(llvm::raw_ostream &OS) const {
+  OS << "(def ";
+  Proto->print(OS);
+  OS << ' ';
+  Body->print(OS);
+  OS << ')';
+}
+
+//===----------------------------------------------------------------------===//
+// AST serialization
+//===----------------------------------------------------------------------===//
+
+// See KaleidoscopeASTFile for the layout of AST files. Integers are ULEB128
+// encoded, numbers are little-endian IEEE doubles and strings are indices
+// into the file's string table.
+
+static const char ASTFileMagic[] = {'K', 'A', 'S', 'T'};
+
+namespace {
+/// ASTTag - The first byte of each encoded expression.
+enum ASTTag : uint8_t {
+  AST_Null, // An absent optional operand, like the step of a for loop.
+  AST_Number,
+  AST_Integer, // A number that is a small non-negative integer.
+  AST_Variable,
+  AST_Index,
+  AST_Unary,
+  AST_Binary,
+  AST_Call,
+  AST_If,
+  AST_For,
+  AST_Var,
+};
+} // end anonymous namespace
+
+/// ASTStringTable - The strings of an AST file being written, numbered in
+/// order of first use.
+struct ASTStringTable {
+  StringMap<unsigned> Ids;
+  std::vector<StringRef> Strings; // The keys of Ids, by number.
+
+  unsigned getId(StringRef S) {
+    auto [I, Inserted] = Ids.try_emplace(S, Strings.size());
+    if (Inserted)
+      Strings.push_back(I->getKey());
+    return I->second;
+  }
+};
+
+/// ASTWriter - Encodes ASTs to OS.
+struct ASTWriter {
+  raw_ostream &OS;
+  ASTStringTable &StrTab;
+
+  void writeByte(uint8_t B) { OS << char(B); }
+  void writeInt(uint64_t V) { encodeULEB128(V, OS); }
+  void writeDouble(double V) {
+    support::endian::write<uint64_t>(OS, bit_cast<uint64_t>(V),
+                                     support::little);
+  }
+  void writeString(StringRef S) { writeInt(StrTab.getId(S)); }
+  void writeExpr(const ExprAST *E) {
+    if (E)
+      E->serialize(*this);
+    else
+      writeByte(AST_Null);
+  }
+};
+
+void NumberExprAST::serialize(ASTWriter &W) const {
+  // Most literals are small integers, which take a byte or two as such.
+  if (Val >= 0 && Val < 0x1p53 && !std::signbit(Val) &&
+      Val == double(uint64_t(Val))) {
+    W.writeByte(AST_Integer);
+    W.writeInt(uint64_t(Val));
+    return;
+  }
+  W.writeByte(AST_Number);
+  W.writeDouble(Val);
+}
+
+void VariableExprAST::serialize(ASTWriter &W) const {
+  W.writeByte(AST_Variable);
+  W.writeString(Name);
+}
+
+void IndexExprAST::serialize(ASTWriter &W) const {
+  W.writeByte(AST_Index);
+  W.writeString(ArrayName);
+  W.writeExpr(Index);
+}
+
+void UnaryExprAST::serialize(ASTWriter &W) const {
+  W.writeByte(AST_Unary);
+  W.writeByte(Opcode);
+  W.writeExpr(Operand);
+}
+
+void BinaryExprAST::serialize(ASTWriter &W) const {
+  W.writeByte(AST_Binary);
+  W.writeByte(Op);
+  W.writeExpr(LHS);
+  W.writeExpr(RHS);
+}
+
+void CallExprAST::serialize(ASTWriter &W) const {
+  W.writeByte(AST_Call);
+  W.writeString(Callee);
+  W.writeInt(Args.size());
+  for (auto *Arg : Args)
+    W.writeExpr(Arg);
+}
+
+void IfExprAST::serialize(ASTWriter &W) const {
+  W.writeByte(AST_If);
+  W.writeExpr(Cond);
+  W.writeExpr(Then);
+  W.writeExpr(Else);
+}
+
+void ForExprAST::serialize(ASTWriter &W) const {
+  W.writeByte(AST_For);
+  W.writeString(VarName);
+  W.writeExpr(Start);
+  W.writeExpr(End);
+  W.writeExpr(Step);
+  W.writeExpr(Body);
+}
+
+void VarExprAST::serialize(ASTWriter &W) const {
+  W.writeByte(AST_Var);
+  W.writeInt(VarNames.size());
+  for (auto &[Name, Init, IsArray] : VarNames) {
+    W.writeString(Name);
+    W.writeByte(IsArray);
+    W.writeExpr(Init);
+  }
+  W.writeExpr(Body);
+}
+
+void PrototypeAST::serialize(ASTWriter &W) const {
+  W.writeString(Name);
+  W.writeByte(IsOperator);
+  W.writeInt(Precedence);
+  W.writeInt(Args.size());
+  for (unsigned Idx = 0, E = Args.size(); Idx != E; ++Idx) {
+    W.writeString(Args[Idx]);
+    W.writeByte(isArrayArg(Idx));
+  }
+}
+
+void FunctionAST::serialize(ASTWriter &W) const {
+  Proto->serialize(W);
+  W.writeInt(Callees.size());
+  for (auto &Callee : Callees)
+    W.writeString(Callee);
+  W.writeInt(AssignedVars.size());
+  for (StringRef Var : AssignedVars)
+    W.writeString(Var);
+  W.writeExpr(Body);
+}
+
+/// ASTReader - Decodes ASTs written by ASTWriter from Data, allocating
+/// expression nodes in Arena. After the first error, which takeError()
+/// returns, reads return zeros and empty strings.
+struct ASTReader {
+  ASTReader(StringRef Data, uint64_t Offset, ArrayRef<StringRef> Strings)
+      : Data(Data), Pos(Offset), Strings(Strings) {}
+
+  StringRef Data;
+  uint64_t Pos;
+  ArrayRef<StringRef> Strings;
+  BumpPtrAllocator *Arena = nullptr;
+  std::string ErrMsg;
+
+  bool ok() const { return ErrMsg.empty(); }
+
+  void fail(const Twine &Msg) {
+    if (ok())
+      ErrMsg = Msg.str();
+    Pos = Data.size();
+  }
+
+  Error takeError() {
+    if (ok())
+      return Error::success();
+    return make_error<StringError>(ErrMsg, inconvertibleErrorCode());
+  }
+
+  /// Consume N bytes and return a pointer to them, or null if there are
+  /// fewer left.
+  const uint8_t *consume(uint64_t N) {
+    if (N > Data.size() - Pos) {
+      fail("unexpected end of file at offset " + Twine(Pos));
+      return nullptr;
+    }
+    const uint8_t *Bytes = Data.bytes_begin() + Pos;
+    Pos += N;
+    return Bytes;
+  }
+
+  uint8_t readByte() {
+    const uint8_t *Bytes = consume(1);
+    return Bytes ? *Bytes : 0;
+  }
+
+  uint32_t readU32() {
+    const uint8_t *Bytes = consume(4);
+    return Bytes ? support::endian::read32le(Bytes) : 0;
+  }
+
+  double readDouble() {
+    const uint8_t *Bytes = consume(8);
+    return Bytes ? bit_cast<double>(support::endian::read64le(Bytes)) : 0;
+  }
+
+  uint64_t readInt() {
+    unsigned Size;
+    const char *Err = nullptr;
+    uint64_t V = decodeULEB128(Data.bytes_begin() + Pos, &Size,
+                               Data.bytes_end(), &Err);
+    if (Err) {
+      fail(Twine(Err) + " at offset " + Twine(Pos));
+      return 0;
+    }
+    Pos += Size;
+    return V;
+  }
+
+  StringRef readBytes(uint64_t N) {
+    const uint8_t *Bytes = consume(N);
+    return Bytes ? StringRef(reinterpret_cast<const char *>(Bytes), N)
+                 : StringRef();
+  }
+
+  /// Read the number of items in a list. Every item takes at least a byte,
+  /// which bounds the work a corrupt count can cause.
+  uint64_t readCount() {
+    uint64_t N = readInt();
+    if (N > Data.size() - Pos) {
+      fail("list of " + Twine(N) + " items is longer than the file");
+      return 0;
+    }
+    return N;
+  }
+
+  StringRef readString() {
+    uint64_t Id = readInt();
+    if (Id < Strings.size())
+      return Strings[Id];
+    fail("string " + Twine(Id) + " is not in the string table");
+    return StringRef();
+  }
+
+  template <typename T, typename... ArgTs> T *create(ArgTs &&...Args) {
+    return new (*Arena) T(std::forward<ArgTs>(Args)...);
+  }
+
+  template <typename T> ArrayRef<T> copyArray(ArrayRef<T> Elts) {
+    T *Mem = Arena->Allocate<T>(Elts.size());
+    std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+    return ArrayRef<T>(Mem, Elts.size());
+  }
+
+  ExprAST *readExpr();
+
+  /// Read an expression that must be present.
+  ExprAST *readOperand() {
+    ExprAST *E = readExpr();
+    if (!E)
+      fail("missing operand");
+    return E;
+  }
+
+  std::unique_ptr<PrototypeAST> readPrototype();
+};
+
+ExprAST *ASTReader::readExpr() {
+  // Operands are read into locals first, as the order in which function
+  // arguments are evaluated is unspecified.
+  switch (uint8_t Tag = readByte()) {
+  case AST_Null:
+    return nullptr;
+  case AST_Number:
+    return create<NumberExprAST>(readDouble());
+  case AST_Integer:
+    return create<NumberExprAST>(double(readInt()));
+  case AST_Variable:
+    return create<VariableExprAST>(readString());
+  case AST_Index: {
+    StringRef ArrayName = readString();
+    ExprAST *Index = readOperand();
+    return create<IndexExprAST>(ArrayName, Index);
+  }
+  case AST_Unary: {
+    char Opcode = readByte();
+    ExprAST *Operand = readOperand();
+    return create<UnaryExprAST>(Opcode, Operand);
+  }
+  case AST_Binary: {
+    char Op = readByte();
+    ExprAST *LHS = readOperand();
+    ExprAST *RHS = readOperand();
+    return create<BinaryExprAST>(Op, LHS, RHS);
+  }
+  case AST_Call: {
+    StringRef Callee = readString();
+    SmallVector<ExprAST *, 4> Args;
+    for (uint64_t I = 0, N = readCount(); I != N && ok(); ++I)
+      Args.push_back(readOperand());
+    return create<CallExprAST>(Callee, copyArray<ExprAST *>(Args));
+  }
+  case AST_If: {
+    ExprAST *Cond = readOperand();
+    ExprAST *Then = readOperand();
+    ExprAST *Else = readOperand();
+    return create<IfExprAST>(Cond, Then, Else);
+  }
+  case AST_For: {
+    StringRef VarName = readString();
+    ExprAST *Start = readOperand();
+    ExprAST *End = readOperand();
+    ExprAST *Step = readExpr();
+    ExprAST *Body = readOperand();
+    return create<ForExprAST>(VarName, Start, End, Step, Body);
+  }
+  case AST_Var: {
+    SmallVector<VarExprAST::VarDecl, 4> VarNames;
+    for (uint64_t I = 0, N = readCount(); I != N && ok(); ++I) {
+      StringRef Name = readString();
+      bool IsArray = readByte();
+      ExprAST *Init = readExpr();
+      VarNames.push_back({Name, Init, IsArray});
+    }
+    ExprAST *Body = readOperand();
+    return create<VarExprAST>(copyArray<VarExprAST::VarDecl>(VarNames), Body);
+  }
+  default:
+    fail("unknown expression tag " + Twine(unsigned(Tag)));
+    return nullptr;
+  }
+}
+
+std::unique_ptr<PrototypeAST> ASTReader::readPrototype() {
+  std::string Name = readString().str();
+  bool IsOperator = readByte();
+  unsigned Precedence = readInt();
+  std::vector<std::string> Args;
+  std::vector<bool> ArrayArgs;
+  for (uint64_t I = 0, N = readCount(); I != N && ok(); ++I) {
+    Args.push_back(readString().str());
+    ArrayArgs.push_back(readByte());
+  }
+  if (IsOperator && (Args.empty() || Args.size() > 2))
+    fail("operator '" + Name + "' has " + Twine(Args.size()) + " operands");
+  if (!is_contained(ArrayArgs, true))
+    ArrayArgs.clear();
+  return std::make_unique<PrototypeAST>(Name, std::move(Args), IsOperator,
+                                        Precedence, std::move(ArrayArgs));
+}
+
+Expected<std::unique_ptr<KaleidoscopeASTFile>>
+KaleidoscopeASTFile::open(StringRef Path) {
+  // Large files are memory-mapped rather than read.
+  auto Buf = MemoryBuffer::getFileOrSTDIN(Path, /*IsText=*/false,
+                                          /*RequiresNullTerminator=*/false);
+  if (!Buf)
+    return createFileError(Path, Buf.getError());
+  auto File = create(std::move(*Buf));
+  if (!File)
+    return createFileError(Path, File.takeError());
+  return File;
+}
+
+Expected<std::unique_ptr<KaleidoscopeASTFile>>
+KaleidoscopeASTFile::create(std::unique_ptr<MemoryBuffer> Buf) {
+  if (!isASTFile(Buf->getBuffer()))
+    return make_error<StringError>("not a Kaleidoscope AST file",
+                                   inconvertibleErrorCode());
+  std::unique_ptr<KaleidoscopeASTFile> File(
+      new KaleidoscopeASTFile(std::move(Buf)));
+  if (auto Err = File->index())
+    return std::move(Err);
+  return File;
+}
+
+bool KaleidoscopeASTFile::isASTFile(StringRef Buf) {
+  return Buf.startswith(StringRef(ASTFileMagic, sizeof(ASTFileMagic)));
+}
+
+Error KaleidoscopeASTFile::index() {
+  StringRef Data = Buf->getBuffer();
+  ASTReader R(Data, sizeof(ASTFileMagic), {});
+  uint32_t FileVersion = R.readU32();
+  if (FileVersion != Version)
+    R.fail("AST file version " + Twine(FileVersion) + " is not supported " +
+           "(expected version " + Twine(Version) + ")");
+
+  for (uint64_t I = 0, N = R.readCount(); I != N && R.ok(); ++I)
+    Strings.push_back(R.readBytes(R.readCount()));
+  R.Strings = Strings;
+
+  // Skip the operators and externs, which loadPrototypes reads.
+  OperatorsOffset = R.Pos;
+  for (uint64_t I = 0, N = R.readCount(); I != N && R.ok(); ++I) {
+    R.readByte();
+    R.readInt();
+  }
+  for (uint64_t I = 0, N = R.readCount(); I != N && R.ok(); ++I)
+    R.readPrototype();
+
+  // Definitions come in batch order, followed by the top-level expressions.
+  // Bodies are skipped.
+  unsigned LastBatch = 0;
+  for (uint64_t I = 0, N = R.readCount(); I != N && R.ok(); ++I) {
+    unsigned Batch = R.readInt();
+    uint64_t Size = R.readCount();
+    if (Batch && (Batch < LastBatch || Batch > LastBatch + 1))
+      R.fail("function " + Twine(I) + " is out of batch order");
+    if (Batch)
+      LastBatch = Batch;
+    Functions.push_back({Batch, R.Pos, Size});
+    R.Pos += Size;
+  }
+  if (R.ok() && R.Pos != Data.size())
+    R.fail("unexpected data after the last function");
+  return R.takeError();
+}
+
+Error KaleidoscopeASTFile::loadPrototypes(KaleidoscopeParser &P) {
+  std::lock_guard<std::mutex> Lock(P.Mutex);
+
+  // Materialized ASTs refer to identifiers interned by the parser, so that
+  // they do not keep the file alive.
+  for (auto &S : Strings)
+    S = P.Identifiers.save(S);
+  Parser = &P;
+
+  ASTReader R(Buf->getBuffer(), OperatorsOffset, Strings);
+  for (uint64_t I = 0, N = R.readCount(); I != N && R.ok(); ++I) {
+    char Op = R.readByte();
+    P.BinopPrecedence[Op] = R.readInt();
+  }
+
+  auto Install = [&](std::unique_ptr<PrototypeAST> Proto) {
+    if (R.ok())
+      P.FunctionProtos[Proto->getName()] = std::move(Proto);
+  };
+  for (uint64_t I = 0, N = R.readCount(); I != N && R.ok(); ++I)
+    Install(R.readPrototype());
+
+  // Parsing installs the prototypes of definitions right away, while those
+  // of top-level expressions are created with their fresh names.
+  for (auto &F : Functions) {
+    if (!F.Batch || !R.ok())
+      continue;
+    R.Pos = F.Offset;
+    Install(R.readPrototype());
+  }
+  return R.takeError();
+}
+
+std::optional<unsigned> KaleidoscopeASTFile::getBatch(size_t I) const {
+  if (!Functions[I].Batch)
+    return std::nullopt;
+  return Functions[I].Batch - 1;
+}
+
+StringRef KaleidoscopeASTFile::getName(size_t I) const {
+  assert(Parser && "names are not interned before loadPrototypes");
+  // Every function starts with its prototype, which starts with the name.
+  ASTReader R(Buf->getBuffer(), Functions[I].Offset, Strings);
+  return R.readString();
+}
+
+Expected<std::unique_ptr<FunctionAST>>
+KaleidoscopeASTFile::materialize(KaleidoscopeParser &P, size_t I) {
+  assert(&P == Parser && "materializing before loadPrototypes");
+  std::lock_guard<std::mutex> Lock(P.Mutex);
+  auto Start = JITProfiler::Clock::now();
+
+  // Only let the reader see this function.
+  auto &F = Functions[I];
+  ASTReader R(Buf->getBuffer().take_front(F.Offset + F.Size), F.Offset,
+              Strings);
+  auto Arena = std::make_unique<BumpPtrAllocator>();
+  R.Arena = Arena.get();
+
+  std::shared_ptr<PrototypeAST> Proto = R.readPrototype();
+  std::vector<std::string> Callees;
+  for (uint64_t N = R.readCount(); N && R.ok(); --N)
+    Callees.push_back(R.readString().str());
+  SmallVector<StringRef, 4> AssignedVars;
+  for (uint64_t N = R.readCount(); N && R.ok(); --N)
+    AssignedVars.push_back(R.readString());
+  ExprAST *Body = R.readOperand();
+  if (R.ok() && R.Pos != F.Offset + F.Size)
+    R.fail("unexpected data after function " + Twine(I));
+  if (auto Err = R.takeError())
+    return std::move(Err);
+
+  if (!F.Batch) {
+    Proto->setName(getTopLevelExprName());
+    P.FunctionProtos[Proto->getName()] = Proto;
+  }
+  auto AssignedVarsCopy = R.copyArray<StringRef>(AssignedVars);
+  auto FnAST = std::make_unique<FunctionAST>(std::move(Arena),
+                                             std::move(Proto), Body);
+  FnAST->setCallees(std::move(Callees));
+  FnAST->setAssignedVars(AssignedVarsCopy);
+  if (P.Profiler)
+    P.Profiler->record(JITProfiler::Parse, FnAST->getName(), Start, F.Size);
+  return FnAST;
+}
+
 //===----------------------------------------------------------------------===//
 // Top-Level parsing and JIT Driver
 //===----------------------------------------------------------------------===//
 
-KaleidoscopeParser::KaleidoscopeParser() = default;
+KaleidoscopeParser::KaleidoscopeParser()
+    : BinopPrecedence({{'=', 2}, {'<', 10}, {'+', 20}, {'-', 20}, {'*', 40}}) {}
+
 KaleidoscopeParser::~KaleidoscopeParser() = default;
 
 std::optional<KaleidoscopeParser::ParseResult>
 KaleidoscopeParser::parse(llvm::StringRef Code) {
-  resetInputLine(Code);
-  getNextToken();
-
-  while (!InputLine.empty()) {
-    switch (CurTok) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto Start = JITProfiler::Clock::now();
+  ParseContext Ctx(*this, Code);
+  getNextToken(Ctx);
+
+  auto RecordParse = [&](const FunctionAST &FnAST) {
+    if (Profiler)
+      Profiler->record(JITProfiler::Parse, FnAST.getName(), Start,
+                       Code.size());
+  };
+
+  while (!Ctx.InputLine.empty()) {
+    switch (Ctx.CurTok) {
     case tok_eof:
       return std::nullopt;
       break;
     case ';': // ignore top-level semicolons.
-      if (getNextToken() != tok_eof) {
+      if (getNextToken(Ctx) != tok_eof) {
         fprintf(stderr, "Error: Unexpected input after top-level semicolon\n");
         return std::nullopt;
       }
       break;
     case tok_def:
-      if (auto FnAST = ParseDefinition(*this)) {
+      if (auto FnAST = ParseDefinition(Ctx)) {
+        RecordParse(*FnAST);
         ParseResult PR;
         PR.FnAST = std::move(FnAST);
         return PR;
@@ -1179,7 +2425,7 @@ KaleidoscopeParser::parse(llvm::StringRef Code) {
       }
       break;
     case tok_extern: {
-      auto ProtoAST = ParseExtern(*this);
+      auto ProtoAST = ParseExtern(Ctx);
       if (ProtoAST) {
         FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
         return std::nullopt;
@@ -1191,7 +2437,8 @@ KaleidoscopeParser::parse(llvm::StringRef Code) {
       break;
     }
     default:
-      if (auto FnAST = ParseTopLevelExpr(*this)) {
+      if (auto FnAST = ParseTopLevelExpr(Ctx)) {
+        RecordParse(*FnAST);
         ParseResult PR;
         PR.FnAST = std::move(FnAST);
         PR.TopLevelExpr = PR.FnAST->getName();
@@ -1207,16 +2454,991 @@ KaleidoscopeParser::parse(llvm::StringRef Code) {
   return std::nullopt;
 }
 
+/// makeScriptError - Report Msg for the item that Ctx is parsing in Src.
+static Error makeScriptError(StringRef Src, const ParseContext &Ctx,
+                             const Twine &Msg) {
+  // The lexer has consumed Src up to (and one past) the current token.
+  size_t Line = Src.drop_back(Ctx.InputLine.size()).count('\n') + 1;
+  return make_error<StringError>("line " + Twine(Line) + ": " + Msg,
+                                 inconvertibleErrorCode());
+}
+
+Expected<KaleidoscopeScript>
+KaleidoscopeParser::parseScript(StringRef Src, unsigned BatchSize) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  ParseContext Ctx(*this, Src);
+  getNextToken(Ctx);
+
+  KaleidoscopeScript Script;
+  std::vector<std::unique_ptr<FunctionAST>> Batch;
+  auto AddToBatch = [&](std::unique_ptr<FunctionAST> FnAST) {
+    Batch.push_back(std::move(FnAST));
+    if (Batch.size() == BatchSize) {
+      Script.Batches.push_back(std::move(Batch));
+      Batch.clear();
+    }
+  };
+
+  auto MakeError = [&](const Twine &Msg) {
+    return makeScriptError(Src, Ctx, Msg);
+  };
+
+  // When profiling, each definition and expression is timed separately.
+  auto ItemStart = JITProfiler::Clock::now();
+  size_t ItemRemaining = Src.size();
+  auto RecordParse = [&](const FunctionAST &FnAST) {
+    if (Profiler)
+      Profiler->record(JITProfiler::Parse, FnAST.getName(), ItemStart,
+                       ItemRemaining - Ctx.InputLine.size());
+  };
+
+  while (true) {
+    if (Profiler) {
+      ItemStart = JITProfiler::Clock::now();
+      ItemRemaining = Ctx.InputLine.size();
+    }
+    switch (Ctx.CurTok) {
+    case tok_eof:
+      if (!Batch.empty())
+        Script.Batches.push_back(std::move(Batch));
+      return Script;
+    case ';': // ignore top-level semicolons.
+      getNextToken(Ctx);
+      break;
+    case tok_def: {
+      auto FnAST = ParseDefinition(Ctx);
+      if (!FnAST)
+        return MakeError("could not parse function definition");
+      RecordParse(*FnAST);
+      // Later items are parsed before this one is compiled, so install the
+      // operator now.
+      auto &Proto = FnAST->getProto();
+      if (Proto.isBinaryOp())
+        BinopPrecedence[Proto.getOperatorName()] = Proto.getBinaryPrecedence();
+      AddToBatch(std::move(FnAST));
+      break;
+    }
+    case tok_extern: {
+      auto ProtoAST = ParseExtern(Ctx);
+      if (!ProtoAST)
+        return MakeError("could not parse extern function declaration");
+      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+      break;
+    }
+    default: {
+      auto FnAST = ParseTopLevelExpr(Ctx);
+      if (!FnAST)
+        return MakeError("could not parse top-level expression");
+      RecordParse(*FnAST);
+      Script.TopLevelExprs.push_back(std::move(FnAST));
+      break;
+    }
+    }
+  }
+}
+
+size_t KaleidoscopeParser::countTokens(StringRef Src) {
+  ParseContext Ctx(*this, Src);
+  size_t NumTokens = 0;
+  while (getNextToken(Ctx) != tok_eof)
+    ++NumTokens;
+  return NumTokens;
+}
+
+void KaleidoscopeParser::printCodegenInputs(const FunctionAST &FnAST,
+                                            raw_ostream &OS) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  // The stack slot layout changes the generated code at -O0.
+  OS << (SSABindings ? "ssa " : "slots ");
+  FnAST.print(OS);
+  for (auto &Callee : FnAST.getCallees()) {
+    OS << ' ';
+    auto I = FunctionProtos.find(Callee);
+    if (I != FunctionProtos.end())
+      I->second->print(OS);
+    else
+      OS << "(unknown " << Callee << ')';
+    // Inlined host functions are part of the generated code.
+    if (HostIR)
+      if (auto Hash = HostIR->getHash(Callee))
+        OS << " (host IR " << format_hex(*Hash, 18) << ')';
+  }
+}
+
+void KaleidoscopeParser::installPrototype(const FunctionAST &FnAST) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto &Proto = FnAST.getProto();
+  FunctionProtos[Proto.getName()] = FnAST.getSharedProto();
+  if (Proto.isBinaryOp())
+    BinopPrecedence[Proto.getOperatorName()] = Proto.getBinaryPrecedence();
+}
+
 std::optional<ThreadSafeModule>
 KaleidoscopeParser::codegen(std::unique_ptr<FunctionAST> FnAST,
                             const DataLayout &DL) {
+  std::vector<std::unique_ptr<FunctionAST>> FnASTs;
+  FnASTs.push_back(std::move(FnAST));
+  return codegen(std::move(FnASTs), DL);
+}
+
+std::optional<ThreadSafeModule>
+KaleidoscopeParser::codegen(std::vector<std::unique_ptr<FunctionAST>> FnASTs,
+                            const DataLayout &DL) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto Start = JITProfiler::Clock::now();
   CodeGenContext CGCtx(DL);
-  if (!FnAST->codegen(*this, CGCtx))
-    return std::nullopt;
+  std::vector<std::string> FnNames;
+  for (auto &FnAST : FnASTs) {
+    if (!FnAST->codegen(*this, CGCtx))
+      return std::nullopt;
+    if (Profiler)
+      FnNames.push_back(FnAST->getName());
+  }
+  if (Profiler)
+    Profiler->record(JITProfiler::Codegen, JITProfiler::getUnitName(FnNames),
+                     Start, CGCtx.TheModule->getInstructionCount());
   return ThreadSafeModule(std::move(CGCtx.TheModule),
                           std::move(CGCtx.TheContext));
 }
 
+//===----------------------------------------------------------------------===//
+// Batch mode
+//===----------------------------------------------------------------------===//
+
+static cl::opt<unsigned>
+    BatchSize("batch-size",
+              cl::desc("In batch mode, compile up to this many definitions "
+                       "per module (0 = one module for the whole script)"),
+              cl::init(1024));
+
+static cl::opt<std::string>
+    SaveAST("save-ast",
+            cl::desc("In batch mode, also save the parsed script to this "
+                     "file, which can be run in place of the source and "
+                     "loads without parsing"),
+            cl::init(""));
+
+/// loadASTScript - Load the whole script in the AST file Buf.
+static Expected<KaleidoscopeScript>
+loadASTScript(KaleidoscopeParser &P, std::unique_ptr<MemoryBuffer> Buf) {
+  auto File = KaleidoscopeASTFile::create(std::move(Buf));
+  if (!File)
+    return File.takeError();
+  if (auto Err = (*File)->loadPrototypes(P))
+    return std::move(Err);
+
+  KaleidoscopeScript Script;
+  for (size_t I = 0, E = (*File)->getNumFunctions(); I != E; ++I) {
+    auto FnAST = (*File)->materialize(P, I);
+    if (!FnAST)
+      return FnAST.takeError();
+    if (auto Batch = (*File)->getBatch(I)) {
+      if (*Batch == Script.Batches.size())
+        Script.Batches.emplace_back();
+      Script.Batches[*Batch].push_back(std::move(*FnAST));
+    } else {
+      Script.TopLevelExprs.push_back(std::move(*FnAST));
+    }
+  }
+  return Script;
+}
+
+Expected<KaleidoscopeScript> KaleidoscopeScript::load(KaleidoscopeParser &P,
+                                                      StringRef Path) {
+  auto Buf = MemoryBuffer::getFileOrSTDIN(Path);
+  if (!Buf)
+    return createFileError(Path, Buf.getError());
+
+  if (KaleidoscopeASTFile::isASTFile((*Buf)->getBuffer())) {
+    auto Script = loadASTScript(P, std::move(*Buf));
+    if (!Script)
+      return createFileError(Path, Script.takeError());
+    return Script;
+  }
+
+  auto Script = P.parseScript((*Buf)->getBuffer(), BatchSize);
+  if (!Script)
+    return createFileError(Path, Script.takeError());
+  if (!SaveAST.empty())
+    if (auto Err = Script->save(P, SaveAST))
+      return std::move(Err);
+  return Script;
+}
+
+Error KaleidoscopeScript::save(KaleidoscopeParser &P, StringRef Path) const {
+  std::lock_guard<std::mutex> Lock(P.Mutex);
+  ASTStringTable StrTab;
+
+  // Encode the functions and externs first, which fills in the string table
+  // that precedes them.
+  SmallString<0> Functions, Fn;
+  raw_svector_ostream FunctionsOS(Functions);
+  size_t NumFunctions = 0;
+  StringSet<> Defined;
+  auto AddFunction = [&](const FunctionAST &FnAST, unsigned Batch) {
+    Fn.clear();
+    raw_svector_ostream FnOS(Fn);
+    ASTWriter W{FnOS, StrTab};
+    FnAST.serialize(W);
+    encodeULEB128(Batch, FunctionsOS);
+    encodeULEB128(Fn.size(), FunctionsOS);
+    FunctionsOS << Fn;
+    ++NumFunctions;
+  };
+  for (size_t B = 0, E = Batches.size(); B != E; ++B)
+    for (auto &FnAST : Batches[B]) {
+      AddFunction(*FnAST, B + 1);
+      Defined.insert(FnAST->getName());
+    }
+  for (auto &FnAST : TopLevelExprs)
+    AddFunction(*FnAST, 0);
+
+  SmallString<0> Externs;
+  raw_svector_ostream ExternsOS(Externs);
+  ASTWriter ExternsW{ExternsOS, StrTab};
+  size_t NumExterns = 0;
+  for (auto &[Name, Proto] : P.FunctionProtos)
+    if (!Defined.count(Name) && !isTopLevelExprName(Name)) {
+      Proto->serialize(ExternsW);
+      ++NumExterns;
+    }
+
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC);
+  if (EC)
+    return createFileError(Path, EC);
+  OS.write(ASTFileMagic, sizeof(ASTFileMagic));
+  support::endian::write<uint32_t>(OS, KaleidoscopeASTFile::Version,
+                                   support::little);
+  encodeULEB128(StrTab.Strings.size(), OS);
+  for (StringRef S : StrTab.Strings) {
+    encodeULEB128(S.size(), OS);
+    OS << S;
+  }
+  encodeULEB128(P.BinopPrecedence.size(), OS);
+  for (auto [Op, Precedence] : P.BinopPrecedence) {
+    OS << Op;
+    encodeULEB128(Precedence, OS);
+  }
+  encodeULEB128(NumExterns, OS);
+  OS << Externs;
+  encodeULEB128(NumFunctions, OS);
+  OS << Functions;
+
+  if (OS.has_error())
+    return createFileError(Path, OS.error());
+  return Error::success();
+}
+
+Error KaleidoscopeScript::run(KaleidoscopeParser &P, KaleidoscopeJIT &J,
+                              raw_ostream &OS) {
+  size_t ChunkSize = BatchSize ? BatchSize : TopLevelExprs.size();
+  for (size_t I = 0; I < TopLevelExprs.size(); I += ChunkSize) {
+    size_t E = std::min(I + ChunkSize, TopLevelExprs.size());
+    std::vector<std::unique_ptr<FunctionAST>> Exprs(
+        std::make_move_iterator(TopLevelExprs.begin() + I),
+        std::make_move_iterator(TopLevelExprs.begin() + E));
+
+    auto Results = J.evaluate(P, std::move(Exprs));
+    if (!Results)
+      return Results.takeError();
+    for (double Result : *Results)
+      OS << "Result = " << Result << "\n";
+  }
+  TopLevelExprs.clear();
+  return Error::success();
+}
+
+//===----------------------------------------------------------------------===//
+// Lazy batch mode
+//===----------------------------------------------------------------------===//
+
+Expected<std::unique_ptr<KaleidoscopeLazyScript>>
+KaleidoscopeLazyScript::load(KaleidoscopeParser &P, StringRef Path) {
+  auto Buf = MemoryBuffer::getFileOrSTDIN(Path);
+  if (!Buf)
+    return createFileError(Path, Buf.getError());
+
+  std::unique_ptr<KaleidoscopeLazyScript> Script(new KaleidoscopeLazyScript());
+  Error Err = Error::success();
+  if (KaleidoscopeASTFile::isASTFile((*Buf)->getBuffer())) {
+    auto File = KaleidoscopeASTFile::create(std::move(*Buf));
+    if (!File)
+      return createFileError(Path, File.takeError());
+    Script->ASTFile = std::move(*File);
+    Err = Script->indexASTFile(P);
+  } else {
+    Script->Buf = std::move(*Buf);
+    Err = Script->indexSource(P);
+  }
+  if (Err)
+    return createFileError(Path, std::move(Err));
+  Script->finishIndex();
+  return Script;
+}
+
+KaleidoscopeLazyScript::~KaleidoscopeLazyScript() = default;
+
+Error KaleidoscopeLazyScript::indexSource(KaleidoscopeParser &P) {
+  std::lock_guard<std::mutex> Lock(P.Mutex);
+  StringRef Src = Buf->getBuffer();
+  ParseContext Ctx(P, Src);
+  getNextToken(Ctx);
+
+  // Items span from their first token to the next item's, so that parsing
+  // their text again sees the same tokens.
+  auto getOffset = [&]() -> uint64_t { return Ctx.TokStart - Src.data(); };
+  StringMap<size_t> LiveDefs;
+  uint32_t Batch = 0, BatchDefs = 0;
+  while (true) {
+    uint64_t Start = getOffset();
+    switch (Ctx.CurTok) {
+    case tok_eof:
+      return Error::success();
+    case ';': // ignore top-level semicolons.
+      getNextToken(Ctx);
+      break;
+    case tok_def: {
+      auto FnAST = ParseDefinition(Ctx);
+      if (!FnAST)
+        return makeScriptError(Src, Ctx, "could not parse function definition");
+      ASTBytes += FnAST->getMemoryUsage();
+      ++NumParsedDefs;
+      auto &Proto = FnAST->getProto();
+      if (Proto.isBinaryOp())
+        P.BinopPrecedence[Proto.getOperatorName()] =
+            Proto.getBinaryPrecedence();
+      addDefinition({FnAST->getSharedProto(), Start,
+                     uint32_t(getOffset() - Start), Batch},
+                    LiveDefs);
+      if (++BatchDefs == BatchSize) {
+        ++Batch;
+        BatchDefs = 0;
+      }
+      break;
+    }
+    case tok_extern: {
+      auto ProtoAST = ParseExtern(Ctx);
+      if (!ProtoAST)
+        return makeScriptError(Src, Ctx,
+                               "could not parse extern function declaration");
+      P.FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+      break;
+    }
+    default: {
+      auto FnAST = ParseTopLevelExpr(Ctx);
+      if (!FnAST)
+        return makeScriptError(Src, Ctx,
+                               "could not parse top-level expression");
+      // The expression gets a fresh name when it is parsed again.
+      P.FunctionProtos.erase(FnAST->getName());
+      TopLevelExprs.push_back(
+          {nullptr, Start, uint32_t(getOffset() - Start), 0});
+      break;
+    }
+    }
+  }
+}
+
+Error KaleidoscopeLazyScript::indexASTFile(KaleidoscopeParser &P) {
+  if (auto Err = ASTFile->loadPrototypes(P))
+    return Err;
+
+  std::lock_guard<std::mutex> Lock(P.Mutex);
+  StringMap<size_t> LiveDefs;
+  for (size_t I = 0, E = ASTFile->getNumFunctions(); I != E; ++I) {
+    auto Batch = ASTFile->getBatch(I);
+    if (!Batch) {
+      TopLevelExprs.push_back({nullptr, I, 0, 0});
+      continue;
+    }
+    auto &Proto = P.FunctionProtos[ASTFile->getName(I).str()];
+    addDefinition({Proto, I, 0, *Batch}, LiveDefs);
+  }
+  return Error::success();
+}
+
+void KaleidoscopeLazyScript::addDefinition(Item Def,
+                                           StringMap<size_t> &LiveDefs) {
+  auto [I, Inserted] = LiveDefs.try_emplace(Def.Proto->getName(), Defs.size());
+  if (!Inserted) {
+    Defs[I->second].Proto.reset();
+    I->second = Defs.size();
+  }
+  Defs.push_back(std::move(Def));
+}
+
+void KaleidoscopeLazyScript::finishIndex() {
+  erase_if(Defs, [](const Item &Def) { return !Def.Proto; });
+  for (size_t I = 0, E = Defs.size(); I != E; ++I)
+    if (I + 1 == E || Defs[I + 1].Batch != Defs[I].Batch)
+      BatchEnds.push_back(I + 1);
+  Defs.shrink_to_fit();
+  TopLevelExprs.shrink_to_fit();
+}
+
+const std::string &KaleidoscopeLazyScript::getName(size_t I) const {
+  assert(Defs[I].Proto && "definition was already materialized");
+  return Defs[I].Proto->getName();
+}
+
+Expected<std::unique_ptr<FunctionAST>>
+KaleidoscopeLazyScript::materialize(KaleidoscopeParser &P, size_t I) {
+  assert(Defs[I].Proto && "definition was already materialized");
+  auto FnAST = materialize(P, Defs[I]);
+  // FunctionProtos keeps the prototype for callers from here on.
+  Defs[I].Proto.reset();
+  return FnAST;
+}
+
+Expected<std::unique_ptr<FunctionAST>>
+KaleidoscopeLazyScript::materialize(KaleidoscopeParser &P, const Item &It) {
+  if (ASTFile)
+    return ASTFile->materialize(P, It.Offset);
+
+  std::lock_guard<std::mutex> Lock(P.Mutex);
+  auto Start = JITProfiler::Clock::now();
+  StringRef Src = Buf->getBuffer().substr(It.Offset, It.Size);
+  ParseContext Ctx(P, Src);
+  getNextToken(Ctx);
+  bool IsDefinition = Ctx.CurTok == tok_def;
+  auto FnAST = IsDefinition ? ParseDefinition(Ctx) : ParseTopLevelExpr(Ctx);
+  if (!FnAST)
+    return make_error<StringError>("could not parse the item at offset " +
+                                       Twine(It.Offset) + " again",
+                                   inconvertibleErrorCode());
+  if (P.Profiler)
+    P.Profiler->record(JITProfiler::Parse, FnAST->getName(), Start,
+                       Src.size());
+  return FnAST;
+}
+
+Error KaleidoscopeLazyScript::run(KaleidoscopeParser &P, KaleidoscopeJIT &J,
+                                  raw_ostream &OS) {
+  size_t ChunkSize = BatchSize ? BatchSize : TopLevelExprs.size();
+  for (size_t I = 0; I < TopLevelExprs.size(); I += ChunkSize) {
+    size_t E = std::min(I + ChunkSize, TopLevelExprs.size());
+    std::vector<std::unique_ptr<FunctionAST>> Exprs;
+    for (size_t X = I; X != E; ++X) {
+      auto Expr = materialize(P, TopLevelExprs[X]);
+      if (!Expr)
+        return Expr.takeError();
+      Exprs.push_back(std::move(*Expr));
+    }
+
+    auto Results = J.evaluate(P, std::move(Exprs));
+    if (!Results)
+      return Results.takeError();
+    for (double Result : *Results)
+      OS << "Result = " << Result << "\n";
+  }
+  TopLevelExprs.clear();
+  return Error::success();
+}
+
+void KaleidoscopeLazyScript::printMemoryReport(raw_ostream &OS) const {
+  size_t NumUnmaterialized = 0;
+  uint64_t RecordBytes = 0, ProtoBytes = 0;
+  for (auto &Def : Defs)
+    if (Def.Proto) {
+      ++NumUnmaterialized;
+      RecordBytes += sizeof(Item);
+      ProtoBytes += Def.Proto->getMemoryUsage();
+    }
+
+  OS << formatv("lazy script: {0} of {1} definitions never materialized\n",
+                NumUnmaterialized, Defs.size());
+  if (!NumUnmaterialized)
+    return;
+  OS << formatv("  {0} bytes held per unmaterialized definition ({1} record, "
+                "{2} prototype)\n",
+                (RecordBytes + ProtoBytes) / NumUnmaterialized,
+                RecordBytes / NumUnmaterialized,
+                ProtoBytes / NumUnmaterialized);
+  if (NumParsedDefs)
+    OS << formatv("  {0} bytes per definition as an AST\n",
+                  ASTBytes / NumParsedDefs);
+  if (Buf)
+    OS << formatv("  plus {0} bytes of source text\n", Buf->getBufferSize());
+}
+
+//===----------------------------------------------------------------------===//
+// Top-level expression evaluation
+//===----------------------------------------------------------------------===//
+
+Expected<std::vector<double>>
+KaleidoscopeJIT::evaluate(KaleidoscopeParser &P,
+                          std::vector<std::unique_ptr<FunctionAST>> Exprs) {
+  std::vector<double> Results;
+  if (Exprs.empty())
+    return Results;
+
+  std::vector<std::string> ExprNames;
+  std::vector<SymbolStringPtr> Names;
+  SymbolLookupSet Symbols;
+  for (auto &Expr : Exprs) {
+    ExprNames.push_back(Expr->getName());
+    Names.push_back(Mangle(Expr->getName()));
+    Symbols.add(Names.back());
+  }
+
+  auto IRMod = P.codegen(std::move(Exprs), DL);
+
+  // Nothing can call a top-level expression, so its prototype is not kept.
+  {
+    std::lock_guard<std::mutex> Lock(P.Mutex);
+    for (auto &ExprName : ExprNames)
+      P.FunctionProtos.erase(ExprName);
+  }
+
+  if (!IRMod)
+    return make_error<StringError>("could not generate code for top-level "
+                                   "expression",
+                                   inconvertibleErrorCode());
+
+  // Track the expressions' code separately so that it can be freed once they
+  // have run.
+  auto RT = MainJD.createResourceTracker();
+  if (auto Err = OptimizeLayer.add(RT, std::move(*IRMod)))
+    return std::move(Err);
+
+  auto Syms = ES->lookup(makeJITDylibSearchOrder(&MainJD), std::move(Symbols));
+  if (!Syms)
+    return joinErrors(Syms.takeError(), RT->remove());
+
+  std::vector<ExecutorAddr> Addrs;
+  for (auto &Name : Names)
+    Addrs.push_back((*Syms)[Name].getAddress());
+
+  // An executor runs the whole batch in one round trip.
+  if (Executor) {
+    auto Remote = Executor->runBatch(Addrs);
+    if (!Remote)
+      return joinErrors(Remote.takeError(), RT->remove());
+    Results = std::move(*Remote);
+  } else {
+    for (auto Addr : Addrs)
+      Results.push_back(Addr.toPtr<double (*)()>()());
+  }
+
+  if (auto Err = RT->remove())
+    return std::move(Err);
+
+  // Each expression has a name of its own, so drop the names of the ones that
+  // are gone from the symbol string pool to keep it from growing.
+  Names.clear();
+  Syms->clear();
+  ES->getSymbolStringPool()->clearDeadEntries();
+  return Results;
+}
+
+//===----------------------------------------------------------------------===//
+// Function definitions
+//===----------------------------------------------------------------------===//
+
+Error KaleidoscopeJIT::addDefinitions(
+    KaleidoscopeParser &P, std::vector<std::unique_ptr<FunctionAST>> FnASTs) {
+  auto NewDefs = getNewDefinitions(FnASTs);
+  auto OldRTs = getReplacedTrackers(NewDefs, /*Patched=*/false);
+  if (!OldRTs)
+    return OldRTs.takeError();
+
+  // Generate code before anything is replaced, so that a definition that
+  // fails to compile leaves the earlier one in place.
+  std::unique_ptr<MemoryBuffer> Obj;
+  std::optional<ThreadSafeModule> IRMod;
+  if (ObjCache && FnASTs.size() == 1)
+    Obj = ObjCache->lookup(P, *FnASTs.front());
+  if (!Obj) {
+    IRMod = P.codegen(std::move(FnASTs), DL);
+    if (!IRMod)
+      return make_error<StringError>("could not generate code for definition",
+                                     inconvertibleErrorCode());
+  }
+
+  return replaceDefinitions(
+      NewDefs, *OldRTs,
+      [&](ResourceTrackerSP RT) {
+        if (Obj)
+          return ObjLinkingLayer.add(std::move(RT), std::move(Obj));
+        return OptimizeLayer.add(std::move(RT), std::move(*IRMod));
+      },
+      nullptr);
+}
+
+Error KaleidoscopeJIT::redefine(
+    ArrayRef<std::unique_ptr<FunctionAST>> FnASTs,
+    function_ref<Error(ResourceTrackerSP RT)> Define,
+    std::vector<ResourceTrackerSP> *Retired) {
+  auto NewDefs = getNewDefinitions(FnASTs);
+  auto OldRTs = getReplacedTrackers(NewDefs, /*Patched=*/Retired != nullptr);
+  if (!OldRTs)
+    return OldRTs.takeError();
+  return replaceDefinitions(NewDefs, *OldRTs, Define, Retired);
+}
+
+std::vector<KaleidoscopeJIT::NewDefinition> KaleidoscopeJIT::getNewDefinitions(
+    ArrayRef<std::unique_ptr<FunctionAST>> FnASTs) {
+  std::vector<NewDefinition> NewDefs;
+  for (auto &FnAST : FnASTs)
+    NewDefs.push_back({FnAST->getName(), FnAST->getCallees()});
+  return NewDefs;
+}
+
+Expected<SmallVector<ResourceTrackerSP, 1>>
+KaleidoscopeJIT::getReplacedTrackers(ArrayRef<NewDefinition> NewDefs,
+                                     bool Patched) {
+  auto IsRedefined = [&](StringRef Name) {
+    return any_of(NewDefs,
+                  [&](const NewDefinition &D) { return D.first == Name; });
+  };
+
+  SmallVector<ResourceTrackerSP, 1> OldRTs;
+  for (auto &D : NewDefs) {
+    auto I = Definitions.find(D.first);
+    if (I != Definitions.end() && !is_contained(OldRTs, I->second.RT))
+      OldRTs.push_back(I->second.RT);
+  }
+  if (OldRTs.empty())
+    return OldRTs;
+
+  for (auto &KV : Definitions) {
+    if (IsRedefined(KV.first()))
+      continue;
+    if (is_contained(OldRTs, KV.second.RT))
+      return make_error<StringError>(
+          "cannot redefine a function that was defined in the same batch "
+          "as '" + KV.first() + "'",
+          inconvertibleErrorCode());
+    if (Patched)
+      continue;
+    for (auto &Callee : KV.second.Callees)
+      if (Definitions.count(Callee) && IsRedefined(Callee))
+        return make_error<StringError>("cannot redefine '" + Callee +
+                                           "' while '" + KV.first() +
+                                           "' calls it",
+                                       inconvertibleErrorCode());
+  }
+  return OldRTs;
+}
+
+Error KaleidoscopeJIT::replaceDefinitions(
+    ArrayRef<NewDefinition> NewDefs, ArrayRef<ResourceTrackerSP> OldRTs,
+    function_ref<Error(ResourceTrackerSP RT)> Define,
+    std::vector<ResourceTrackerSP> *Retired) {
+  // MainJD can only hold one definition of each name, so without stubs the
+  // old code has to go first.
+  if (!Retired)
+    for (auto &OldRT : OldRTs)
+      if (auto Err = OldRT->remove()) {
+        for (auto &D : NewDefs)
+          Definitions.erase(D.first);
+        return Err;
+      }
+
+  auto RT = MainJD.createResourceTracker();
+  if (auto Err = Define(RT)) {
+    // With stubs, the old definitions are still in place and in use.
+    if (!Retired)
+      for (auto &D : NewDefs)
+        Definitions.erase(D.first);
+    return joinErrors(std::move(Err), RT->remove());
+  }
+
+  if (Retired)
+    Retired->insert(Retired->end(), OldRTs.begin(), OldRTs.end());
+  for (auto &D : NewDefs)
+    Definitions[D.first] = {RT, D.second};
+  return Error::success();
+}
+
+//===----------------------------------------------------------------------===//
+// JIT optimization pipeline
+//===----------------------------------------------------------------------===//
+
+static cl::opt<char>
+    JITOptLevel("O",
+             cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] "
+                      "(default = '-O2')"),
+             cl::Prefix, cl::init('2'));
+
+static cl::opt<std::string>
+    JITPassPipeline("passes",
+                 cl::desc("IR pass pipeline to run on each module, in "
+                          "'opt -passes=' syntax (overrides -O<n>)"),
+                 cl::init(""));
+
+static cl::opt<unsigned>
+    JITThreads("jit-threads",
+               cl::desc("Compile on a pool of this many threads (0 = one per "
+                        "hardware thread). By default code is compiled on the "
+                        "thread that looks it up"));
+
+static cl::opt<std::string>
+    JITObjectCacheDir("object-cache-dir",
+                      cl::desc("Cache compiled functions in this directory"),
+                      cl::init(""));
+
+static cl::opt<uint64_t> JITObjectCacheMaxSize(
+    "object-cache-max-size",
+    cl::desc("Size limit of the object cache in MiB (0 = unlimited)"),
+    cl::init(256));
+
+static cl::opt<bool>
+    JITProfile("jit-profile",
+               cl::desc("Record the time each function spends in each JIT "
+                        "phase (see the :profile REPL command)"),
+               cl::init(false));
+
+static cl::opt<std::string> JITProfileTrace(
+    "jit-profile-trace",
+    cl::desc("Profile as with -jit-profile and write a Chrome trace of the "
+             "JIT phases to this file on exit"),
+    cl::init(""));
+
+static cl::opt<bool>
+    JITPerfMap("perf-map",
+               cl::desc("Write JIT'd functions to /tmp/perf-<pid>.map for "
+                        "Linux perf"),
+               cl::init(false));
+
+static cl::opt<bool>
+    JITDumpFile("jitdump",
+                cl::desc("Write JIT'd functions and their code to "
+                         "/tmp/jit-<pid>.dump for 'perf inject --jit'"),
+                cl::init(false));
+
+static cl::list<std::string>
+    JITHostIR("host-ir",
+              cl::desc("Let JIT'd code inline the host functions defined in "
+                       "this LLVM IR or bitcode file"),
+              cl::value_desc("file"));
+
+static cl::opt<uint64_t> JITSlabSize(
+    "jit-slab-size",
+    cl::desc("Pack JIT'd code and data into a slab of this many MiB reserved "
+             "up front (0 = map pages for every module)"),
+    cl::init(0));
+
+static cl::opt<bool> JITOutOfProcess(
+    "jit-out-of-process",
+    cl::desc("Run JIT'd code in an executor process forked from this one"),
+    cl::init(false));
+
+static cl::opt<bool> JITLinkStats(
+    "jit-link-stats",
+    cl::desc("Count the sections, blocks and edges of linked objects"),
+    cl::init(false));
+
+static cl::opt<std::string> JITLinkStatsFile(
+    "jit-link-stats-file",
+    cl::desc("Count the sections, blocks and edges of linked objects and "
+             "write them to this file as JSON lines"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<bool> JITCallProfile(
+    "jit-call-profile",
+    cl::desc("Count the calls between JIT'd functions and, with a slab, place "
+             "functions that call each other often together"),
+    cl::init(false));
+
+static cl::opt<std::string> JITCallProfileFile(
+    "jit-call-profile-file",
+    cl::desc("Profile calls as with -jit-call-profile, starting from the "
+             "counts in this file, and write them back to it on exit"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<bool> JITCallProfileLayoutOnly(
+    "jit-call-profile-layout-only",
+    cl::desc("Place functions by the counts in -jit-call-profile-file "
+             "without counting calls or writing the file"),
+    cl::init(false));
+
+static cl::opt<bool> JITCompact(
+    "jit-compact",
+    cl::desc("Share floating point constants between JIT'd modules and drop "
+             "unreferenced code and data before allocating memory for it"),
+    cl::init(false));
+
+Expected<KaleidoscopeJITOptions> KaleidoscopeJITOptions::fromCommandLine() {
+  if (JITOptLevel < '0' || JITOptLevel > '3')
+    return make_error<StringError>("invalid optimization level -O" +
+                                       Twine(JITOptLevel.getValue()),
+                                   inconvertibleErrorCode());
+  if (JITCallProfileLayoutOnly && JITCallProfileFile.empty())
+    return make_error<StringError>(
+        "-jit-call-profile-layout-only needs a -jit-call-profile-file",
+        inconvertibleErrorCode());
+
+  KaleidoscopeJITOptions Opts;
+  Opts.OptLevel = JITOptLevel - '0';
+  Opts.Pipeline = JITPassPipeline;
+  if (JITThreads.getNumOccurrences())
+    Opts.NumCompileThreads = JITThreads;
+  Opts.ObjectCacheDir = JITObjectCacheDir;
+  Opts.ObjectCacheMaxBytes = JITObjectCacheMaxSize << 20;
+  Opts.Profile = JITProfile || !JITProfileTrace.empty();
+  Opts.ProfileTraceFile = JITProfileTrace;
+  Opts.PerfMap = JITPerfMap;
+  Opts.JITDump = JITDumpFile;
+  Opts.HostIRFiles.assign(JITHostIR.begin(), JITHostIR.end());
+  Opts.SlabBytes = JITSlabSize << 20;
+  Opts.OutOfProcess = JITOutOfProcess;
+  Opts.Compact = JITCompact;
+  Opts.LinkStats = JITLinkStats || !JITLinkStatsFile.empty();
+  Opts.LinkStatsFile = JITLinkStatsFile;
+  Opts.CallProfile = JITCallProfile || !JITCallProfileFile.empty();
+  Opts.CallProfileFile = JITCallProfileFile;
+  Opts.CallProfileLayoutOnly = JITCallProfileLayoutOnly;
+  return Opts;
+}
+
+void ThreadPoolTaskDispatcher::dispatch(std::unique_ptr<Task> T) {
+  // ThreadPool wants a copyable callable, so move the task into a shared_ptr.
+  Pool.async([T = std::shared_ptr<Task>(std::move(T))]() { T->run(); });
+}
+
+void ThreadPoolTaskDispatcher::shutdown() { Pool.wait(); }
+
+CodeGenOpt::Level KaleidoscopeJIT::getCodeGenOptLevel(unsigned OptLevel) {
+  switch (OptLevel) {
+  case 0:
+    return CodeGenOpt::None;
+  case 1:
+    return CodeGenOpt::Less;
+  case 2:
+    return CodeGenOpt::Default;
+  default:
+    return CodeGenOpt::Aggressive;
+  }
+}
+
+Error KaleidoscopeJIT::optimizeModule(Module &M, unsigned OptLevel,
+                                      StringRef Pipeline) {
+  // The default -O0 pipeline only contains always-inline and friends, none of
+  // which matter for Kaleidoscope, so skip the PassBuilder setup entirely.
+  if (OptLevel == 0 && Pipeline.empty())
+    return Error::success();
+
+  // Hand the pipeline a TargetMachine so that TTI-driven passes (e.g. the loop
+  // vectorizer) make decisions for the real host rather than a generic target.
+  // Creating one costs about as much as optimizing a small function, so they
+  // are reused (see TMPool).
+  std::unique_ptr<TargetMachine> TM;
+  {
+    std::lock_guard<std::mutex> Lock(TMPoolMutex);
+    if (!TMPool.empty()) {
+      TM = std::move(TMPool.back());
+      TMPool.pop_back();
+    }
+  }
+  if (!TM) {
+    auto NewTM = JTMB.createTargetMachine();
+    if (!NewTM)
+      return NewTM.takeError();
+    TM = std::move(*NewTM);
+  }
+  auto ReturnTM = make_scope_exit([&]() {
+    std::lock_guard<std::mutex> Lock(TMPoolMutex);
+    TMPool.push_back(std::move(TM));
+  });
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+
+  PassBuilder PB(TM.get());
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+  if (!Pipeline.empty()) {
+    if (auto Err = PB.parsePassPipeline(MPM, Pipeline))
+      return Err;
+  } else {
+    static const OptimizationLevel Levels[] = {
+        OptimizationLevel::O0, OptimizationLevel::O1, OptimizationLevel::O2,
+        OptimizationLevel::O3};
+    MPM = PB.buildPerModuleDefaultPipeline(Levels[std::min(OptLevel, 3U)]);
+  }
+
+  MPM.run(M, MAM);
+  return Error::success();
+}
+
+Expected<ThreadSafeModule>
+KaleidoscopeJIT::optimize(ThreadSafeModule TSM,
+                          const MaterializationResponsibility &R) {
+  if (auto Err = TSM.withModuleDo([&](Module &M) -> Error {
+        auto Start = JITProfiler::Clock::now();
+        if (auto Err = optimizeModule(M, Opts.OptLevel, Opts.Pipeline))
+          return Err;
+        if (Profiler)
+          Profiler->record(JITProfiler::Optimize, JITProfiler::getUnitName(M),
+                           Start, M.getInstructionCount());
+        return Error::success();
+      }))
+    return std::move(Err);
+  return TSM;
+}
+
+std::unique_ptr<IRCompileLayer::IRCompiler> KaleidoscopeJIT::createCompiler() {
+  auto Compiler = std::make_unique<ConcurrentIRCompiler>(JTMB, ObjCache.get());
+  if (Profiler)
+    return Profiler->wrapCompiler(std::move(Compiler));
+  return Compiler;
+}
+
+//===----------------------------------------------------------------------===//
+// REPL commands
+//===----------------------------------------------------------------------===//
+
+bool handleREPLCommand(KaleidoscopeJIT &J, StringRef Line, raw_ostream &OS) {
+  Line = Line.trim();
+  if (!Line.startswith(":"))
+    return false;
+
+  auto [Command, Arg] = Line.drop_front().split(' ');
+  Arg = Arg.trim();
+  if (Command == "profile") {
+    if (!J.Profiler)
+      OS << "Profiling is off; restart with -jit-profile to enable it.\n";
+    else if (Arg.empty())
+      J.Profiler->printSummary(OS);
+    else if (auto Err = J.Profiler->writeChromeTrace(Arg))
+      OS << "Error: " << toString(std::move(Err)) << "\n";
+    else
+      OS << "Wrote " << Arg << "\n";
+  } else if (Command == "linkstats") {
+    if (!J.LinkStats)
+      OS << "Link statistics are off; restart with -jit-link-stats to enable "
+            "them.\n";
+    else {
+      // Bring the file up to date too, for whoever reads it next.
+      J.LinkStats->flush();
+      J.LinkStats->printTotals(OS);
+    }
+  } else if (Command == "callprofile") {
+    if (!J.CallProfile)
+      OS << "Call profiling is off; restart with -jit-call-profile to enable "
+            "it.\n";
+    else
+      J.CallProfile->printProfile(OS);
+  } else if (Command == "compaction") {
+    if (!J.Compaction)
+      OS << "Compaction is off; restart with -jit-compact to enable it.\n";
+    else
+      J.Compaction->printStats(OS);
+  } else {
+    OS << "Unknown command :" << Command << "\n";
+  }
+  return true;
+}
+
 //===----------------------------------------------------------------------===//
 // "Library" functions that can be "extern'd" from user code.
 //===----------------------------------------------------------------------===//
@@ -3,13 +3,42 @@
 #ifndef KALEIDOSCOPE_H
 #define KALEIDOSCOPE_H
 
+#include "CallProfilePlugin.h"
+#include "CompactionPlugin.h"
+#include "DiskObjectCache.h"
+#include "HostIRLibrary.h"
+#include "JITProfiler.h"
+#include "LinkStatsPlugin.h"
+#include "PerfPlugin.h"
+#include "RemoteExecutor.h"
+#include "SlabMemoryManager.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
 #include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/ThreadPool.h"
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace llvm {
   class AllocaInst;
@@ -18,6 +47,7 @@ namespace llvm {
   class Value;
 } // end namespace llvm
 
+struct ASTWriter;
 struct CodeGenContext;
 struct KaleidoscopeJIT;
 struct KaleidoscopeParser;
@@ -25,18 +55,245 @@ class PrototypeAST;
 class ExprAST;
 
 /// FunctionAST - This class represents a function definition itself.
+///
+/// The body's expression nodes live in Arena, which is freed in one go with
+/// the FunctionAST (typically right after codegen).
 class FunctionAST {
-  std::unique_ptr<PrototypeAST> Proto;
-  std::unique_ptr<ExprAST> Body;
+  std::unique_ptr<llvm::BumpPtrAllocator> Arena;
+  std::shared_ptr<PrototypeAST> Proto; // Shared with FunctionProtos.
+  ExprAST *Body;
 
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body);
+  FunctionAST(std::unique_ptr<llvm::BumpPtrAllocator> Arena,
+              std::shared_ptr<PrototypeAST> Proto, ExprAST *Body);
   ~FunctionAST();
 
   const std::string &getName() const;
   void setName(std::string NewName);
+  const PrototypeAST &getProto() const;
+
+  /// The prototype, for sharing it with KaleidoscopeParser::FunctionProtos
+  /// rather than copying it.
+  const std::shared_ptr<PrototypeAST> &getSharedProto() const { return Proto; }
+
+  /// Approximate number of bytes that this function holds, including its
+  /// prototype and the arena with its body.
+  size_t getMemoryUsage() const;
   llvm::Function *codegen(KaleidoscopeParser &P, CodeGenContext &CGCtx);
+  void print(llvm::raw_ostream &OS) const;
+
+  /// Append this function to an AST file being written (see
+  /// KaleidoscopeASTFile).
+  void serialize(ASTWriter &W) const;
+
+  /// Names of the functions called directly from the body, as recorded by the
+  /// parser (sorted, without duplicates).
+  const std::vector<std::string> &getCallees() const { return Callees; }
+  void setCallees(std::vector<std::string> NewCallees) {
+    Callees = std::move(NewCallees);
+  }
+
+  /// Names of the variables assigned with '=' somewhere in the body, as
+  /// recorded by the parser. All other bindings are immutable.
+  llvm::ArrayRef<llvm::StringRef> getAssignedVars() const {
+    return AssignedVars;
+  }
+  void setAssignedVars(llvm::ArrayRef<llvm::StringRef> NewAssignedVars) {
+    AssignedVars = NewAssignedVars;
+  }
+
+private:
+  std::vector<std::string> Callees;
+  llvm::ArrayRef<llvm::StringRef> AssignedVars; // Allocated in Arena.
+};
+
+/// KaleidoscopeScript - A whole Kaleidoscope source file, parsed up front for
+/// batch (non-interactive) mode.
+struct KaleidoscopeScript {
+  /// Function definitions in source order, grouped into batches that are
+  /// each compiled as a single module.
+  std::vector<std::vector<std::unique_ptr<FunctionAST>>> Batches;
+
+  /// Top-level expressions in source order.
+  std::vector<std::unique_ptr<FunctionAST>> TopLevelExprs;
+
+  /// Read the file at Path ("-" for stdin). Source files are parsed with
+  /// batches of at most -batch-size items, and also saved to the file given
+  /// with -save-ast, if any. AST files written by save() are loaded with the
+  /// batches they were saved with.
+  static llvm::Expected<KaleidoscopeScript> load(KaleidoscopeParser &P,
+                                                 llvm::StringRef Path);
+
+  /// Write the script, along with the operator precedences and the extern
+  /// prototypes that P knows about, to Path as an AST file (see
+  /// KaleidoscopeASTFile). This must happen before run() consumes the
+  /// top-level expressions.
+  llvm::Error save(KaleidoscopeParser &P, llvm::StringRef Path) const;
+
+  /// Evaluate the top-level expressions with KaleidoscopeJIT::evaluate, up
+  /// to -batch-size of them at a time, and print their results to OS.
+  llvm::Error run(KaleidoscopeParser &P, KaleidoscopeJIT &J,
+                  llvm::raw_ostream &OS);
+};
+
+/// KaleidoscopeASTFile - A Kaleidoscope script in the compact binary form
+/// written by KaleidoscopeScript::save, memory-mapped so that it can be
+/// reloaded without lexing or parsing.
+///
+/// The file starts with a format version, a table of all strings in the
+/// script, the operator precedence table and the extern prototypes. Then
+/// come the script's functions, each with its batch and size up front, so
+/// that open() can index them without decoding their bodies. Expression
+/// nodes are only decoded, straight into the new FunctionAST's arena, when a
+/// function is materialized.
+class KaleidoscopeASTFile {
+public:
+  /// Bump this whenever the encoding changes; files of other versions are
+  /// rejected.
+  static constexpr uint32_t Version = 1;
+
+  /// Map the AST file at Path ("-" for stdin) and index its functions.
+  static llvm::Expected<std::unique_ptr<KaleidoscopeASTFile>>
+  open(llvm::StringRef Path);
+
+  /// Index the functions of the AST file in Buf.
+  static llvm::Expected<std::unique_ptr<KaleidoscopeASTFile>>
+  create(std::unique_ptr<llvm::MemoryBuffer> Buf);
+
+  /// Whether Buf starts like an AST file.
+  static bool isASTFile(llvm::StringRef Buf);
+
+  /// Install the file's operator precedences and the prototypes of its
+  /// externs and definitions into P, as parsing the script would. Functions
+  /// can only be materialized into P afterwards.
+  llvm::Error loadPrototypes(KaleidoscopeParser &P);
+
+  size_t getNumFunctions() const { return Functions.size(); }
+
+  /// The batch that function I was saved in, or none if it is a top-level
+  /// expression.
+  std::optional<unsigned> getBatch(size_t I) const;
+
+  /// The name that function I was saved with, without decoding the rest of
+  /// it. Only valid after loadPrototypes.
+  llvm::StringRef getName(size_t I) const;
+
+  /// Decode function I. Top-level expressions get a fresh name, like newly
+  /// parsed ones.
+  llvm::Expected<std::unique_ptr<FunctionAST>>
+  materialize(KaleidoscopeParser &P, size_t I);
+
+private:
+  struct FunctionEntry {
+    unsigned Batch; // 0 for top-level expressions, otherwise batch + 1.
+    uint64_t Offset;
+    uint64_t Size;
+  };
+
+  KaleidoscopeASTFile(std::unique_ptr<llvm::MemoryBuffer> Buf)
+      : Buf(std::move(Buf)) {}
+
+  llvm::Error index();
+
+  std::unique_ptr<llvm::MemoryBuffer> Buf;
+
+  /// The string table: slices of Buf until loadPrototypes interns them in
+  /// the parser, which the materialized ASTs refer to.
+  std::vector<llvm::StringRef> Strings;
+  KaleidoscopeParser *Parser = nullptr;
+
+  uint64_t OperatorsOffset = 0;
+  std::vector<FunctionEntry> Functions;
+};
+
+/// KaleidoscopeLazyScript - A script for batch mode that keeps the bodies of
+/// its definitions out of memory until they are compiled, for libraries with
+/// too many functions to hold all of their ASTs.
+///
+/// Loading a source file parses each item once, to find where it ends and
+/// to install its prototype, then frees the AST and only remembers where
+/// its text is. Loading an AST file just indexes it (see
+/// KaleidoscopeASTFile). Either way, what stays resident for a definition is
+/// a small record and its prototype, which is shared with the parser's
+/// FunctionProtos. materialize() parses (or decodes) the body again when the
+/// definition is compiled, and the caller frees the FunctionAST after codegen.
+///
+/// As batch mode evaluates the top-level expressions after adding all
+/// definitions, only the last definition of each function is kept. Bodies
+/// are parsed with the operator precedences in effect at the end of the
+/// script.
+class KaleidoscopeLazyScript {
+public:
+  /// Load the source or AST file at Path ("-" for stdin), grouping source
+  /// definitions into batches of at most -batch-size, and install the
+  /// prototypes and operator precedences into P.
+  static llvm::Expected<std::unique_ptr<KaleidoscopeLazyScript>>
+  load(KaleidoscopeParser &P, llvm::StringRef Path);
+
+  ~KaleidoscopeLazyScript();
+
+  size_t getNumBatches() const { return BatchEnds.size(); }
+
+  /// The definitions in batch B, as a range of indices for getName and
+  /// materialize.
+  std::pair<size_t, size_t> getBatch(size_t B) const {
+    return {B ? BatchEnds[B - 1] : 0, BatchEnds[B]};
+  }
+
+  /// The name of definition I, until it is materialized.
+  const std::string &getName(size_t I) const;
+
+  /// Parse or decode definition I, which can only be done once.
+  llvm::Expected<std::unique_ptr<FunctionAST>>
+  materialize(KaleidoscopeParser &P, size_t I);
+
+  /// Parse or decode the top-level expressions and evaluate them with
+  /// KaleidoscopeJIT::evaluate, up to -batch-size of them at a time, printing
+  /// their results to OS.
+  llvm::Error run(KaleidoscopeParser &P, KaleidoscopeJIT &J,
+                  llvm::raw_ostream &OS);
+
+  /// Print how many definitions were never materialized and how many bytes
+  /// each of them held, compared with holding their ASTs.
+  void printMemoryReport(llvm::raw_ostream &OS) const;
+
+private:
+  /// Item - A definition or top-level expression that has not been parsed
+  /// (or decoded) yet.
+  struct Item {
+    std::shared_ptr<PrototypeAST> Proto; // Null for top-level expressions,
+                                         // and once materialized.
+    uint64_t Offset; // Of the source text, or the index in the AST file.
+    uint32_t Size;   // Of the source text.
+    uint32_t Batch;
+  };
+
+  KaleidoscopeLazyScript() = default;
+
+  llvm::Error indexSource(KaleidoscopeParser &P);
+  llvm::Error indexASTFile(KaleidoscopeParser &P);
+
+  /// Append Def, dropping the earlier definition of the same function, if
+  /// any. LiveDefs maps function names to their definitions in Defs.
+  void addDefinition(Item Def, llvm::StringMap<size_t> &LiveDefs);
+
+  /// Remove the dropped definitions and find where each batch ends.
+  void finishIndex();
+
+  llvm::Expected<std::unique_ptr<FunctionAST>>
+  materialize(KaleidoscopeParser &P, const Item &It);
+
+  std::unique_ptr<llvm::MemoryBuffer> Buf;       // Null for AST files.
+  std::unique_ptr<KaleidoscopeASTFile> ASTFile; // Null for source files.
+
+  std::vector<Item> Defs; // In batch order.
+  std::vector<Item> TopLevelExprs;
+  std::vector<size_t> BatchEnds;
+
+  /// For source files, the bytes that the ASTs of the definitions took when
+  /// they were parsed for indexing.
+  uint64_t ASTBytes = 0;
+  size_t NumParsedDefs = 0;
 };
 
 struct KaleidoscopeParser {
@@ -51,57 +308,438 @@ struct KaleidoscopeParser {
 
   std::optional<ParseResult> parse(llvm::StringRef Code);
 
+  /// Parse every item in Src, putting up to BatchSize definitions in each
+  /// batch (0 = no limit). Unlike parse(), operators become usable as soon
+  /// as they are defined rather than when they are compiled.
+  llvm::Expected<KaleidoscopeScript> parseScript(llvm::StringRef Src,
+                                                 unsigned BatchSize);
+
+  /// Run just the lexer over Src and return the number of tokens, to measure
+  /// lexer throughput.
+  size_t countTokens(llvm::StringRef Src);
+
   std::optional<llvm::orc::ThreadSafeModule>
   codegen(std::unique_ptr<FunctionAST> FnAST, const llvm::DataLayout &DL);
 
-  std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+  /// Generate code for all of FnASTs into a single module.
+  std::optional<llvm::orc::ThreadSafeModule>
+  codegen(std::vector<std::unique_ptr<FunctionAST>> FnASTs,
+          const llvm::DataLayout &DL);
+
+  /// Print everything that the code generated for FnAST depends on: the
+  /// function itself and the prototypes of the functions it calls.
+  void printCodegenInputs(const FunctionAST &FnAST, llvm::raw_ostream &OS);
+
+  /// Record FnAST's prototype (and operator precedence, for binary operators)
+  /// for use by later definitions. FunctionAST::codegen does this as a side
+  /// effect, so this is only needed when codegen is skipped, e.g. because the
+  /// object came from a cache.
+  void installPrototype(const FunctionAST &FnAST);
+
+  /// FunctionProtos - The prototype of every function that code can call, by
+  /// name. Prototypes of definitions are shared with their FunctionASTs.
+  std::map<std::string, std::shared_ptr<PrototypeAST>> FunctionProtos;
+
+  /// BinopPrecedence - This holds the precedence for each binary operator that
+  /// is defined.
+  std::map<char, int> BinopPrecedence;
+
+  /// Identifiers - Interns the identifiers in parsed expressions, which are
+  /// referenced by the (arena-allocated) expression nodes.
+  llvm::BumpPtrAllocator IdentifierAlloc;
+  llvm::UniqueStringSaver Identifiers{IdentifierAlloc};
+
+  /// If set, parse and codegen times are recorded here.
+  JITProfiler *Profiler = nullptr;
+
+  /// If set, calls to the host functions registered here are generated with
+  /// the functions' IR, so that the optimizer can inline them.
+  const HostIRLibrary *HostIR = nullptr;
+
+  /// Serializes parse and codegen, which both touch FunctionProtos and
+  /// BinopPrecedence, so that codegen can run on JIT worker threads. Lexer and
+  /// parser state is per call, so separate parsers never contend.
+  std::mutex Mutex;
+};
+
+/// KaleidoscopeJITOptions - Per-instance configuration for KaleidoscopeJIT.
+struct KaleidoscopeJITOptions {
+  /// Optimization level (0-3) used to build the default pipeline and to
+  /// configure the code generator.
+  unsigned OptLevel = 2;
+
+  /// Optional new-pass-manager pipeline in `opt -passes=` syntax. If set, it
+  /// replaces the default -O<n> IR pipeline (codegen still uses OptLevel).
+  std::string Pipeline;
+
+  /// If set, materialization tasks run on a pool with this many threads (0
+  /// means one per hardware thread). Otherwise they run in place, on whichever
+  /// thread issued the lookup.
+  std::optional<unsigned> NumCompileThreads;
+
+  /// If non-empty, compiled functions are cached in this directory, which is
+  /// kept below ObjectCacheMaxBytes (0 = unlimited). See DiskObjectCache.
+  std::string ObjectCacheDir;
+  uint64_t ObjectCacheMaxBytes = 256 << 20;
+
+  /// If set, the time each function spends in each phase of the JIT is
+  /// recorded (see JITProfiler), and if ProfileTraceFile is non-empty it is
+  /// written there as a Chrome trace when the JIT is destroyed.
+  bool Profile = false;
+  std::string ProfileTraceFile;
+
+  /// If set, JIT'd functions are made known to Linux perf through a perf map
+  /// and/or a jitdump file (see PerfPlugin).
+  bool PerfMap = false;
+  bool JITDump = false;
+
+  /// IR or bitcode files whose functions are added to KaleidoscopeJIT::HostIR.
+  std::vector<std::string> HostIRFiles;
+
+  /// If non-zero, JIT'd code and data are packed into a slab of this size
+  /// reserved up front (see SlabMemoryManager). Out of process, this is how
+  /// much shared memory is reserved for them at a time.
+  uint64_t SlabBytes = 0;
+
+  /// If set, JIT'd code runs in a separate executor process (see
+  /// RemoteExecutor). Only the eager drivers support this.
+  bool OutOfProcess = false;
+
+  /// If set, duplicate constants and unreferenced blocks are dropped from
+  /// every object before it is allocated (see CompactionPlugin), and with a
+  /// slab in process, constants are shared between objects.
+  bool Compact = false;
+
+  /// If set, the sections, blocks and edges of every linked object are
+  /// counted (see LinkStatsPlugin), and if LinkStatsFile is non-empty they are
+  /// written there as JSON lines.
+  bool LinkStats = false;
+  std::string LinkStatsFile;
+
+  /// If set, calls between JIT'd functions are counted, and with a slab
+  /// the code of functions that call each other often is placed together
+  /// (see CallProfilePlugin). If CallProfileFile is non-empty, the counts
+  /// are read from it, if it exists, and written back when the JIT is
+  /// destroyed.
+  bool CallProfile = false;
+  std::string CallProfileFile;
+
+  /// If set with CallProfile, code is only placed by the counts read from
+  /// CallProfileFile: calls are not counted and the file is left as is.
+  bool CallProfileLayoutOnly = false;
+
+  /// Build options from the -O<n>, -passes, -jit-threads, -object-cache-*,
+  /// -jit-profile*, -perf-map, -jitdump, -host-ir, -jit-slab-size,
+  /// -jit-out-of-process, -jit-compact, -jit-link-stats* and
+  /// -jit-call-profile* command line flags.
+  static llvm::Expected<KaleidoscopeJITOptions> fromCommandLine();
+};
+
+/// ThreadPoolTaskDispatcher - Runs ORC tasks on a fixed-size thread pool.
+///
+/// Unlike ORC's DynamicThreadPoolTaskDispatcher this bounds the number of
+/// threads, which is only safe because Kaleidoscope materializers never block
+/// waiting on other tasks.
+class ThreadPoolTaskDispatcher : public llvm::orc::TaskDispatcher {
+public:
+  ThreadPoolTaskDispatcher(unsigned NumThreads)
+      : Pool(llvm::hardware_concurrency(NumThreads)) {}
+
+  void dispatch(std::unique_ptr<llvm::orc::Task> T) override;
+  void shutdown() override;
+
+private:
+  llvm::ThreadPool Pool;
 };
 
 struct KaleidoscopeJIT {
   std::unique_ptr<llvm::orc::ExecutionSession> ES;
 
+  /// The process that runs JIT'd code, unless it runs in this one.
+  std::unique_ptr<RemoteExecutor> Executor;
+
+  KaleidoscopeJITOptions Opts;
+  llvm::orc::JITTargetMachineBuilder JTMB;
   llvm::DataLayout DL;
   llvm::orc::MangleAndInterner Mangle;
 
+  std::unique_ptr<DiskObjectCache> ObjCache; // Null unless enabled in Opts.
+  std::unique_ptr<JITProfiler> Profiler;     // Null unless enabled in Opts.
+  // Owned by ObjLinkingLayer, if enabled in Opts.
+  CompactionPlugin *Compaction = nullptr;
+  LinkStatsPlugin *LinkStats = nullptr;
+  CallProfilePlugin *CallProfile = nullptr;
+
+  /// Host functions that JIT'd code may inline, see KaleidoscopeParser::HostIR.
+  HostIRLibrary HostIR;
+
   llvm::orc::ObjectLinkingLayer ObjLinkingLayer;
   llvm::orc::IRCompileLayer CompileLayer;
+  llvm::orc::IRTransformLayer OptimizeLayer;
 
   llvm::orc::JITDylib &MainJD;
 
-  static llvm::Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = llvm::orc::SelfExecutorProcessControl::Create();
-    if (!EPC)
-      return EPC.takeError();
+  static llvm::Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(KaleidoscopeJITOptions Opts = KaleidoscopeJITOptions()) {
+    std::unique_ptr<llvm::orc::TaskDispatcher> D;
+    if (Opts.NumCompileThreads)
+      D = std::make_unique<ThreadPoolTaskDispatcher>(*Opts.NumCompileThreads);
+
+    std::unique_ptr<RemoteExecutor> Executor;
+    std::unique_ptr<llvm::orc::ExecutorProcessControl> EPC;
+    SlabMemoryManager *SlabMM = nullptr; // Owned by EPC.
+    if (Opts.OutOfProcess) {
+      if (Opts.PerfMap || Opts.JITDump)
+        return llvm::make_error<llvm::StringError>(
+            "-perf-map and -jitdump need JIT'd code to run in process",
+            llvm::inconvertibleErrorCode());
+      if (Opts.CallProfile)
+        return llvm::make_error<llvm::StringError>(
+            "-jit-call-profile needs JIT'd code to run in process",
+            llvm::inconvertibleErrorCode());
+      auto E = RemoteExecutor::Launch(std::move(D), Opts.SlabBytes);
+      if (!E)
+        return E.takeError();
+      Executor = std::move(*E);
+      EPC = Executor->takeEPC();
+    } else {
+      std::unique_ptr<llvm::jitlink::JITLinkMemoryManager> MemMgr;
+      if (Opts.SlabBytes) {
+        auto Slab = SlabMemoryManager::Create(Opts.SlabBytes);
+        if (!Slab)
+          return Slab.takeError();
+        SlabMM = Slab->get();
+        MemMgr = std::move(*Slab);
+      }
 
-    auto ES = std::make_unique<llvm::orc::ExecutionSession>(std::move(*EPC));
+      auto SelfEPC = llvm::orc::SelfExecutorProcessControl::Create(
+          nullptr, std::move(D), std::move(MemMgr));
+      if (!SelfEPC)
+        return SelfEPC.takeError();
+      EPC = std::move(*SelfEPC);
+    }
+
+    // Until the JIT owns the session, it has to be ended on errors, which
+    // also disconnects any executor.
+    auto ES = std::make_unique<llvm::orc::ExecutionSession>(std::move(EPC));
 
     llvm::orc::JITTargetMachineBuilder JTMB(
         ES->getExecutorProcessControl().getTargetTriple());
     JTMB.setCodeModel(llvm::CodeModel::Small);
+    JTMB.setCodeGenOptLevel(getCodeGenOptLevel(Opts.OptLevel));
 
     auto DL = JTMB.getDefaultDataLayoutForTarget();
     if (!DL)
-      return DL.takeError();
+      return llvm::joinErrors(DL.takeError(), ES->endSession());
+
+    std::unique_ptr<DiskObjectCache> ObjCache;
+    if (!Opts.ObjectCacheDir.empty()) {
+      auto Cache = DiskObjectCache::Create(
+          Opts.ObjectCacheDir, Opts.ObjectCacheMaxBytes,
+          JTMB.getTargetTriple().str(), Opts.OptLevel, Opts.Pipeline);
+      if (!Cache)
+        return llvm::joinErrors(Cache.takeError(), ES->endSession());
+      ObjCache = std::move(*Cache);
+    }
+
+    std::unique_ptr<PerfPlugin> Perf;
+    if (Opts.PerfMap || Opts.JITDump) {
+      auto Plugin = PerfPlugin::Create(Opts.PerfMap, Opts.JITDump,
+                                       JTMB.getTargetTriple());
+      if (!Plugin)
+        return llvm::joinErrors(Plugin.takeError(), ES->endSession());
+      Perf = std::move(*Plugin);
+    }
+
+    std::unique_ptr<LinkStatsPlugin> LinkStats;
+    if (Opts.LinkStats) {
+      auto Plugin = LinkStatsPlugin::Create(Opts.LinkStatsFile);
+      if (!Plugin)
+        return llvm::joinErrors(Plugin.takeError(), ES->endSession());
+      LinkStats = std::move(*Plugin);
+    }
 
-    return std::unique_ptr<KaleidoscopeJIT>(
-        new KaleidoscopeJIT(std::move(ES), std::move(JTMB), std::move(*DL)));
+    std::unique_ptr<KaleidoscopeJIT> J(
+        new KaleidoscopeJIT(std::move(ES), std::move(Opts), std::move(JTMB),
+                            std::move(*DL), std::move(ObjCache)));
+    J->Executor = std::move(Executor);
+    if (J->Executor) {
+      auto &ExecutorJD = J->ES->createBareJITDylib("<executor>");
+      if (auto Err = J->Executor->addSymbolsTo(ExecutorJD, J->Mangle))
+        return std::move(Err);
+      J->MainJD.addToLinkOrder(ExecutorJD);
+    }
+    if (Perf)
+      J->ObjLinkingLayer.addPlugin(std::move(Perf));
+    if (LinkStats) {
+      J->LinkStats = LinkStats.get();
+      J->ObjLinkingLayer.addPlugin(std::move(LinkStats));
+    }
+    if (J->Opts.Compact) {
+      auto Compaction = std::make_unique<CompactionPlugin>(SlabMM);
+      J->Compaction = Compaction.get();
+      J->ObjLinkingLayer.addPlugin(std::move(Compaction));
+    }
+    if (J->Opts.CallProfile) {
+      auto CallProfile = std::make_unique<CallProfilePlugin>(
+          SlabMM, /*Instrument=*/!J->Opts.CallProfileLayoutOnly);
+      if (!J->Opts.CallProfileFile.empty() &&
+          llvm::sys::fs::exists(J->Opts.CallProfileFile))
+        if (auto Err = CallProfile->readProfile(J->Opts.CallProfileFile))
+          return std::move(Err);
+      J->CallProfile = CallProfile.get();
+      J->ObjLinkingLayer.addPlugin(std::move(CallProfile));
+    }
+    for (auto &Path : J->Opts.HostIRFiles)
+      if (auto Err = J->HostIR.addFile(Path))
+        return std::move(Err);
+    return J;
   }
 
   ~KaleidoscopeJIT() {
+    if (Profiler && !Opts.ProfileTraceFile.empty())
+      if (auto Err = Profiler->writeChromeTrace(Opts.ProfileTraceFile))
+        ES->reportError(std::move(Err));
+    if (CallProfile && !Opts.CallProfileFile.empty() &&
+        !Opts.CallProfileLayoutOnly)
+      if (auto Err = CallProfile->writeProfile(Opts.CallProfileFile))
+        ES->reportError(std::move(Err));
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
   }
 
+  /// Run either the given pass pipeline or, if Pipeline is empty, the default
+  /// -O<OptLevel> pipeline over M. This is what OptimizeLayer does to every
+  /// module, but it can also be used to optimize modules at a different level.
+  llvm::Error optimizeModule(llvm::Module &M, unsigned OptLevel,
+                             llvm::StringRef Pipeline = "");
+
+  /// Compile the top-level expressions Exprs into a single module, look up
+  /// all of their functions with one lookup (which also compiles any code
+  /// they need concurrently, given compile threads), then run them in order
+  /// and return their results. The expressions' code is removed from the JIT
+  /// again before returning.
+  llvm::Expected<std::vector<double>>
+  evaluate(KaleidoscopeParser &P,
+           std::vector<std::unique_ptr<FunctionAST>> Exprs);
+
+  /// Compile the definitions FnASTs as a single module (or, for a single
+  /// function, load its object from the cache) and add it to MainJD, replacing
+  /// any earlier definitions of the same functions as described for redefine.
+  /// Code is generated before anything is replaced, so a definition that
+  /// fails to compile leaves the earlier one in place.
+  llvm::Error addDefinitions(KaleidoscopeParser &P,
+                             std::vector<std::unique_ptr<FunctionAST>> FnASTs);
+
+  /// Add the functions in FnASTs to MainJD by calling Define with a new
+  /// ResourceTracker to add them with, replacing any earlier definitions of
+  /// those functions. Define may move the ASTs out of FnASTs.
+  ///
+  /// Code that was linked against an old definition would be left calling
+  /// freed memory, so this fails, changing nothing, if another live
+  /// definition calls a redefined function directly, or if a redefined
+  /// function shares its module with functions that are not being redefined.
+  /// MainJD can only hold one definition of a name, so otherwise the code of
+  /// the earlier definitions is removed before Define is called, and if
+  /// Define fails, the functions are left undefined. Anything else that can
+  /// fail, like generating code, should be done before.
+  ///
+  /// If Retired is given, callers reach the functions through stubs that the
+  /// caller will point at the new definitions (see HotPatcher). Then other
+  /// definitions calling them do not matter, and the old definitions may still
+  /// be running, so Define adds the new ones next to them, and once it has
+  /// succeeded the trackers of the old ones are appended to Retired for the
+  /// caller to remove later. If Define fails, whatever it added is removed
+  /// again and the old definitions stay in place.
+  llvm::Error
+  redefine(llvm::ArrayRef<std::unique_ptr<FunctionAST>> FnASTs,
+           llvm::function_ref<llvm::Error(llvm::orc::ResourceTrackerSP RT)>
+               Define,
+           std::vector<llvm::orc::ResourceTrackerSP> *Retired = nullptr);
+
+  /// Whether a function of this name was added through redefine.
+  bool isDefined(llvm::StringRef Name) const {
+    return Definitions.count(Name);
+  }
+
 private:
   KaleidoscopeJIT(std::unique_ptr<llvm::orc::ExecutionSession> ES,
-                  llvm::orc::JITTargetMachineBuilder JTMB, llvm::DataLayout DL)
-      : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-        ObjLinkingLayer(*this->ES),
-        CompileLayer(*this->ES, ObjLinkingLayer,
-                     std::make_unique<llvm::orc::ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {}
+                  KaleidoscopeJITOptions Opts,
+                  llvm::orc::JITTargetMachineBuilder JTMB, llvm::DataLayout DL,
+                  std::unique_ptr<DiskObjectCache> ObjCache)
+      : ES(std::move(ES)), Opts(std::move(Opts)), JTMB(std::move(JTMB)),
+        DL(std::move(DL)), Mangle(*this->ES, this->DL),
+        ObjCache(std::move(ObjCache)),
+        Profiler(this->Opts.Profile ? std::make_unique<JITProfiler>()
+                                    : nullptr),
+        HostIR(this->DL), ObjLinkingLayer(*this->ES),
+        CompileLayer(*this->ES, ObjLinkingLayer, createCompiler()),
+        OptimizeLayer(*this->ES, CompileLayer,
+                      [this](llvm::orc::ThreadSafeModule TSM,
+                             llvm::orc::MaterializationResponsibility &R) {
+                        return optimize(std::move(TSM), R);
+                      }),
+        MainJD(this->ES->createBareJITDylib("<main>")) {
+    if (Profiler)
+      ObjLinkingLayer.addPlugin(Profiler->createLinkPlugin());
+  }
+
+  static llvm::CodeGenOpt::Level getCodeGenOptLevel(unsigned OptLevel);
+
+  /// The compiler for CompileLayer, which records compile times if profiling.
+  std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler> createCompiler();
+
+  llvm::Expected<llvm::orc::ThreadSafeModule>
+  optimize(llvm::orc::ThreadSafeModule TSM,
+           const llvm::orc::MaterializationResponsibility &R);
+
+  /// TMPool - TargetMachines for optimizeModule. Each call takes one out for
+  /// as long as it runs, since a TargetMachine must not be used by two threads
+  /// at once, so there are as many as there were concurrent optimizations:
+  /// at most one per compile thread.
+  std::mutex TMPoolMutex;
+  std::vector<std::unique_ptr<llvm::TargetMachine>> TMPool;
+
+  /// Definition - The tracker of the module that defines a function in MainJD,
+  /// and the functions that the definition calls.
+  struct Definition {
+    llvm::orc::ResourceTrackerSP RT;
+    std::vector<std::string> Callees;
+  };
+
+  /// Definitions - Every function added through redefine, by name.
+  llvm::StringMap<Definition> Definitions;
+
+  /// NewDefinition - The name of a function being defined, and the functions
+  /// that it calls.
+  using NewDefinition = std::pair<std::string, std::vector<std::string>>;
+
+  static std::vector<NewDefinition>
+  getNewDefinitions(llvm::ArrayRef<std::unique_ptr<FunctionAST>> FnASTs);
+
+  /// Check that NewDefs can replace the definitions of the same functions as
+  /// described for redefine, and return the trackers of those definitions.
+  llvm::Expected<llvm::SmallVector<llvm::orc::ResourceTrackerSP, 1>>
+  getReplacedTrackers(llvm::ArrayRef<NewDefinition> NewDefs, bool Patched);
 
+  /// Replace the definitions tracked by OldRTs with NewDefs, which Define
+  /// adds, as described for redefine.
+  llvm::Error replaceDefinitions(
+      llvm::ArrayRef<NewDefinition> NewDefs,
+      llvm::ArrayRef<llvm::orc::ResourceTrackerSP> OldRTs,
+      llvm::function_ref<llvm::Error(llvm::orc::ResourceTrackerSP RT)> Define,
+      std::vector<llvm::orc::ResourceTrackerSP> *Retired);
 };
 
+/// Handle Line if it is a REPL command rather than Kaleidoscope code, writing
+/// any output to OS, and return whether it was one. The commands are:
+///
+///   :profile             Print the per-function JIT phase timings.
+///   :profile <file>      Write the JIT phase timings as a Chrome trace.
+///   :compaction          Print what link-time compaction saved.
+///   :linkstats           Print the link statistics.
+///   :callprofile         Print the hottest calls between functions.
+bool handleREPLCommand(KaleidoscopeJIT &J, llvm::StringRef Line,
+                       llvm::raw_ostream &OS);
 
 #endif // KALEIDOSCOPE_H
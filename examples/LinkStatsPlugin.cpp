@@ -0,0 +1,239 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "LinkStatsPlugin.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace llvm::jitlink;
+using namespace llvm::orc;
+
+/// The index of the memory protection of Sec in BytesByProt.
+static unsigned getProtIndex(const Section &Sec) {
+  return static_cast<unsigned>(Sec.getMemProt()) & 7;
+}
+
+/// The protection with index Prot, as /proc/<pid>/maps shows it.
+static std::string getProtName(unsigned Prot) {
+  std::string Name = "---";
+  if (Prot & static_cast<unsigned>(orc::MemProt::Read))
+    Name[0] = 'r';
+  if (Prot & static_cast<unsigned>(orc::MemProt::Write))
+    Name[1] = 'w';
+  if (Prot & static_cast<unsigned>(orc::MemProt::Exec))
+    Name[2] = 'x';
+  return Name;
+}
+
+Expected<std::unique_ptr<LinkStatsPlugin>>
+LinkStatsPlugin::Create(StringRef Path) {
+  std::unique_ptr<LinkStatsPlugin> P(new LinkStatsPlugin());
+  if (Path.empty())
+    return P;
+
+  P->Path = Path.str();
+  std::error_code EC;
+  P->OS = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Text);
+  if (EC)
+    return createFileError(Path, EC);
+  P->Writer = std::thread([P = P.get()]() { P->writeRecords(); });
+  return P;
+}
+
+LinkStatsPlugin::~LinkStatsPlugin() {
+  if (!Writer.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> Lock(QueueMutex);
+    Stopping = true;
+  }
+  QueueChanged.notify_all();
+  Writer.join();
+
+  if (OS->has_error()) {
+    errs() << "link stats: cannot write " << Path << ": "
+           << OS->error().message() << "\n";
+    OS->clear_error();
+  }
+}
+
+void LinkStatsPlugin::modifyPassConfig(MaterializationResponsibility &MR,
+                                       LinkGraph &G,
+                                       PassConfiguration &Config) {
+  // After allocation the graph is as big as it gets: pruned, with its stubs
+  // and GOT entries.
+  Config.PostAllocationPasses.push_back(
+      [this](LinkGraph &G) { return recordGraph(G); });
+}
+
+Error LinkStatsPlugin::recordGraph(LinkGraph &G) {
+  // Count locally first, so that the shared counters see one update each.
+  struct SectionCounts {
+    StringRef Name;
+    unsigned Prot;
+    uint64_t Blocks = 0;
+    uint64_t Bytes = 0;
+  };
+  SmallVector<SectionCounts, 8> Sections;
+  SmallDenseMap<Edge::Kind, uint64_t, 16> KindCounts;
+  SmallDenseMap<Symbol *, uint64_t, 8> ExternalCounts;
+  uint64_t GraphBlocks = 0, GraphBytes = 0, GraphEdges = 0;
+  uint64_t GraphExternalEdges = 0;
+
+  for (auto &Sec : G.sections()) {
+    SectionCounts SC{Sec.getName(), getProtIndex(Sec)};
+    for (auto *B : Sec.blocks()) {
+      ++SC.Blocks;
+      SC.Bytes += B->getSize();
+      for (auto &E : B->edges()) {
+        ++GraphEdges;
+        ++KindCounts[E.getKind()];
+        if (E.getTarget().isExternal()) {
+          ++GraphExternalEdges;
+          ++ExternalCounts[&E.getTarget()];
+        }
+      }
+    }
+    if (!SC.Blocks)
+      continue;
+    GraphBlocks += SC.Blocks;
+    GraphBytes += SC.Bytes;
+    BytesByProt[SC.Prot] += SC.Bytes;
+    Sections.push_back(SC);
+  }
+
+  ++Graphs;
+  Blocks += GraphBlocks;
+  Edges += GraphEdges;
+  ExternalSymbols += ExternalCounts.size();
+  ExternalEdges += GraphExternalEdges;
+  for (auto &[Kind, Count] : KindCounts) {
+    EdgesByKind[Kind] += Count;
+    if (!EdgeKindNames[Kind].load(std::memory_order_relaxed))
+      EdgeKindNames[Kind].store(G.getEdgeKindName(Kind),
+                                std::memory_order_relaxed);
+  }
+
+  if (!OS)
+    return Error::success();
+
+  // JSON is written a character at a time, so buffer it.
+  std::string Record;
+  raw_string_ostream RecordOS(Record);
+  RecordOS.SetBuffered();
+  json::OStream J(RecordOS);
+  J.object([&]() {
+    J.attribute("graph", G.getName());
+    J.attribute("blocks", int64_t(GraphBlocks));
+    J.attribute("bytes", int64_t(GraphBytes));
+    J.attribute("edges", int64_t(GraphEdges));
+    J.attributeArray("sections", [&]() {
+      for (auto &SC : Sections)
+        J.object([&]() {
+          J.attribute("name", SC.Name);
+          J.attribute("prot", getProtName(SC.Prot));
+          J.attribute("blocks", int64_t(SC.Blocks));
+          J.attribute("bytes", int64_t(SC.Bytes));
+        });
+    });
+    J.attributeObject("edge_kinds", [&]() {
+      for (auto &[Kind, Count] : KindCounts)
+        J.attribute(G.getEdgeKindName(Kind), int64_t(Count));
+    });
+    // How many edges refer to each external symbol.
+    J.attributeObject("externals", [&]() {
+      for (auto &[Sym, Count] : ExternalCounts)
+        J.attribute(Sym->getName(), int64_t(Count));
+    });
+  });
+  RecordOS << "\n";
+  RecordOS.flush();
+
+  // Waking the writer costs a system call, so leave it to wake up on its own
+  // unless records pile up.
+  bool WakeWriter;
+  {
+    std::lock_guard<std::mutex> Lock(QueueMutex);
+    Queue.push_back(std::move(Record));
+    ++NumQueued;
+    WakeWriter = Queue.size() == MaxQueuedRecords;
+  }
+  if (WakeWriter)
+    QueueChanged.notify_all();
+  return Error::success();
+}
+
+void LinkStatsPlugin::writeRecords() {
+  std::vector<std::string> Records;
+  std::unique_lock<std::mutex> Lock(QueueMutex);
+  while (true) {
+    QueueChanged.wait_for(Lock, WriteInterval, [&]() {
+      return Stopping || FlushTarget > NumWritten ||
+             Queue.size() >= MaxQueuedRecords;
+    });
+    if (Queue.empty()) {
+      if (Stopping)
+        return;
+      continue;
+    }
+    std::swap(Records, Queue);
+
+    Lock.unlock();
+    for (auto &Record : Records)
+      *OS << Record;
+    OS->flush();
+    Lock.lock();
+
+    NumWritten += Records.size();
+    Records.clear();
+    QueueChanged.notify_all();
+  }
+}
+
+void LinkStatsPlugin::flush() {
+  std::unique_lock<std::mutex> Lock(QueueMutex);
+  if (!Writer.joinable() || NumWritten == NumQueued)
+    return;
+  uint64_t Target = FlushTarget = NumQueued;
+  QueueChanged.notify_all();
+  QueueChanged.wait(Lock, [&]() { return NumWritten >= Target; });
+}
+
+LinkStatsPlugin::Totals LinkStatsPlugin::getTotals() const {
+  Totals T;
+  T.Graphs = Graphs;
+  T.Blocks = Blocks;
+  T.Edges = Edges;
+  T.ExternalSymbols = ExternalSymbols;
+  T.ExternalEdges = ExternalEdges;
+  for (unsigned Prot = 0; Prot != 8; ++Prot)
+    if (uint64_t Bytes = BytesByProt[Prot]) {
+      T.Bytes += Bytes;
+      T.BytesByProt.push_back({getProtName(Prot), Bytes});
+    }
+  for (unsigned Kind = 0; Kind != 256; ++Kind)
+    if (uint64_t Count = EdgesByKind[Kind]) {
+      const char *Name = EdgeKindNames[Kind];
+      T.EdgesByKind.push_back(
+          {Name ? Name : formatv("kind {0}", Kind).str(), Count});
+    }
+  return T;
+}
+
+void LinkStatsPlugin::printTotals(raw_ostream &OS) const {
+  auto T = getTotals();
+  OS << formatv("{0} graphs linked: {1} blocks, {2} bytes, {3} edges\n",
+                T.Graphs, T.Blocks, T.Bytes, T.Edges);
+  OS << formatv("{0} external symbols referred to by {1} edges\n",
+                T.ExternalSymbols, T.ExternalEdges);
+  for (auto &[Prot, Bytes] : T.BytesByProt)
+    OS << formatv("  {0,-36} {1,10} bytes\n", Prot, Bytes);
+  for (auto &[Kind, Count] : T.EdgesByKind)
+    OS << formatv("  {0,-36} {1,10} edges\n", Kind, Count);
+}
@@ -0,0 +1,117 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef LINK_STATS_PLUGIN_H
+#define LINK_STATS_PLUGIN_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/Support/Error.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+class raw_fd_ostream;
+class raw_ostream;
+} // end namespace llvm
+
+/// LinkStatsPlugin - Counts what goes into every LinkGraph the JIT links:
+/// bytes and blocks per section, edges per kind, and references to external
+/// symbols.
+///
+/// Each graph is walked once, after allocation, and its counts are added to
+/// running totals in atomic counters, which getTotals() reads at any time
+/// without holding up linking. Given a file, the plugin also writes one JSON
+/// object per graph to it, one per line, with the counts per section name
+/// and per external symbol. Records are formatted on the linking thread and
+/// written by a thread of the plugin's own, so linking never waits for I/O.
+class LinkStatsPlugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+public:
+  /// Totals - The counts of all graphs linked so far.
+  struct Totals {
+    uint64_t Graphs = 0;
+    uint64_t Blocks = 0;
+    uint64_t Bytes = 0;
+    uint64_t Edges = 0;
+    uint64_t ExternalSymbols = 0; // Referred to, summed over graphs.
+    uint64_t ExternalEdges = 0;   // Edges to external symbols.
+    /// Bytes by the memory protection of their section, e.g. "r-x".
+    std::vector<std::pair<std::string, uint64_t>> BytesByProt;
+    /// Edges by the name of their kind.
+    std::vector<std::pair<std::string, uint64_t>> EdgesByKind;
+  };
+
+  /// Create a plugin that, if Path is non-empty, also writes a record of
+  /// every graph to Path.
+  static llvm::Expected<std::unique_ptr<LinkStatsPlugin>>
+  Create(llvm::StringRef Path);
+
+  ~LinkStatsPlugin() override;
+
+  void modifyPassConfig(llvm::orc::MaterializationResponsibility &MR,
+                        llvm::jitlink::LinkGraph &G,
+                        llvm::jitlink::PassConfiguration &Config) override;
+
+  llvm::Error
+  notifyFailed(llvm::orc::MaterializationResponsibility &MR) override {
+    return llvm::Error::success();
+  }
+  llvm::Error notifyRemovingResources(llvm::orc::JITDylib &JD,
+                                      llvm::orc::ResourceKey K) override {
+    return llvm::Error::success();
+  }
+  void notifyTransferringResources(llvm::orc::JITDylib &JD,
+                                   llvm::orc::ResourceKey DstKey,
+                                   llvm::orc::ResourceKey SrcKey) override {}
+
+  Totals getTotals() const;
+  void printTotals(llvm::raw_ostream &OS) const;
+
+  /// Wait until the records of all graphs linked so far are written.
+  void flush();
+
+private:
+  LinkStatsPlugin() = default;
+
+  llvm::Error recordGraph(llvm::jitlink::LinkGraph &G);
+
+  /// The writer thread's loop.
+  void writeRecords();
+
+  std::atomic<uint64_t> Graphs{0};
+  std::atomic<uint64_t> Blocks{0};
+  std::atomic<uint64_t> Edges{0};
+  std::atomic<uint64_t> ExternalSymbols{0};
+  std::atomic<uint64_t> ExternalEdges{0};
+  std::atomic<uint64_t> BytesByProt[8] = {}; // Indexed by orc::MemProt.
+  std::atomic<uint64_t> EdgesByKind[256] = {};
+  /// The names of the edge kinds seen, which are string literals.
+  std::atomic<const char *> EdgeKindNames[256] = {};
+
+  std::string Path;
+  std::unique_ptr<llvm::raw_fd_ostream> OS; // Null unless given a Path.
+
+  /// How often the writer thread writes the records queued, at the latest.
+  static constexpr std::chrono::milliseconds WriteInterval{100};
+  /// How many queued records make the writer thread write them right away.
+  static constexpr size_t MaxQueuedRecords = 256;
+
+  std::mutex QueueMutex;
+  std::condition_variable QueueChanged;
+  std::vector<std::string> Queue; // Records not yet written.
+  uint64_t NumQueued = 0;
+  uint64_t NumWritten = 0;
+  uint64_t FlushTarget = 0; // Records flush() waits for.
+  bool Stopping = false;
+  std::thread Writer;
+};
+
+#endif // LINK_STATS_PLUGIN_H
@@ -0,0 +1,208 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "PerfPlugin.h"
+
+#include "llvm/BinaryFormat/ELF.h"
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/TargetParser/Triple.h"
+
+#include <chrono>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace llvm;
+using namespace llvm::jitlink;
+using namespace llvm::orc;
+
+// The jitdump format, as documented in the Linux sources under
+// tools/perf/Documentation/jitdump-specification.txt.
+namespace {
+enum : uint32_t {
+  JITDumpMagic = 0x4A695444, // "JiTD"
+  JITDumpVersion = 1,
+  JITDumpHeaderSize = 40,
+  JITCodeLoad = 0,
+  JITCodeClose = 3,
+};
+} // end anonymous namespace
+
+/// The ELF machine of TT, which perf needs to disassemble the code.
+static uint32_t getELFMachine(const Triple &TT) {
+  switch (TT.getArch()) {
+  case Triple::x86:
+    return ELF::EM_386;
+  case Triple::x86_64:
+    return ELF::EM_X86_64;
+  case Triple::arm:
+  case Triple::thumb:
+    return ELF::EM_ARM;
+  case Triple::aarch64:
+    return ELF::EM_AARCH64;
+  case Triple::ppc64:
+  case Triple::ppc64le:
+    return ELF::EM_PPC64;
+  case Triple::riscv64:
+    return ELF::EM_RISCV;
+  default:
+    return ELF::EM_NONE;
+  }
+}
+
+/// Timestamps in nanoseconds of CLOCK_MONOTONIC, which is what steady_clock
+/// uses on Linux and what `perf record -k mono` stamps samples with.
+static uint64_t getTimestamp() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+Expected<std::unique_ptr<PerfPlugin>>
+PerfPlugin::Create(bool PerfMap, bool JITDump, const Triple &TT) {
+  std::unique_ptr<PerfPlugin> P(new PerfPlugin());
+  auto PID = sys::Process::getProcessId();
+
+  if (PerfMap) {
+    std::string MapPath = formatv("/tmp/perf-{0}.map", PID).str();
+    std::error_code EC;
+    P->MapOS = std::make_unique<raw_fd_ostream>(MapPath, EC, sys::fs::OF_Text);
+    if (EC)
+      return createFileError(MapPath, EC);
+  }
+
+  if (JITDump) {
+#ifdef __linux__
+    P->JITDumpPath = formatv("/tmp/jit-{0}.dump", PID).str();
+    int FD;
+    if (auto EC = sys::fs::openFileForReadWrite(
+            P->JITDumpPath, FD, sys::fs::CD_CreateAlways, sys::fs::OF_None))
+      return createFileError(P->JITDumpPath, EC);
+    P->JITDumpOS =
+        std::make_unique<raw_fd_ostream>(FD, /*shouldClose=*/true);
+
+    support::endian::Writer W(*P->JITDumpOS, support::native);
+    W.write<uint32_t>(JITDumpMagic);
+    W.write<uint32_t>(JITDumpVersion);
+    W.write<uint32_t>(JITDumpHeaderSize);
+    W.write<uint32_t>(getELFMachine(TT));
+    W.write<uint32_t>(0); // Padding.
+    W.write<uint32_t>(PID);
+    W.write<uint64_t>(getTimestamp());
+    W.write<uint64_t>(0); // Flags.
+    P->JITDumpOS->flush();
+
+    // perf record finds the dump through an executable mapping of it.
+    void *Marker = ::mmap(nullptr, sys::Process::getPageSizeEstimate(),
+                          PROT_READ | PROT_EXEC, MAP_PRIVATE, FD, 0);
+    if (Marker == MAP_FAILED)
+      return createFileError(P->JITDumpPath,
+                             std::error_code(errno, std::generic_category()));
+    P->JITDumpMarker = Marker;
+#else
+    return make_error<StringError>("jitdump is only supported on Linux",
+                                   inconvertibleErrorCode());
+#endif
+  }
+
+  return P;
+}
+
+PerfPlugin::~PerfPlugin() {
+  if (!JITDumpOS)
+    return;
+  support::endian::Writer W(*JITDumpOS, support::native);
+  W.write<uint32_t>(JITCodeClose);
+  W.write<uint32_t>(16);
+  W.write<uint64_t>(getTimestamp());
+  JITDumpOS->flush();
+#ifdef __linux__
+  ::munmap(JITDumpMarker, sys::Process::getPageSizeEstimate());
+#endif
+}
+
+void PerfPlugin::modifyPassConfig(MaterializationResponsibility &MR,
+                                  LinkGraph &G, PassConfiguration &Config) {
+  // Addresses are final and the code is fixed up after the fixup passes.
+  Config.PostFixupPasses.push_back(
+      [this, &MR](LinkGraph &G) { return recordFunctions(MR, G); });
+}
+
+Error PerfPlugin::recordFunctions(MaterializationResponsibility &MR,
+                                  LinkGraph &G) {
+  std::vector<Function> Functions;
+  for (auto *Sym : G.defined_symbols()) {
+    if (!Sym->hasName() || !Sym->isCallable() || !Sym->getSize())
+      continue;
+
+    Function F{Sym->getAddress().getValue(), Sym->getSize(),
+               Sym->getName().str(), {}};
+    auto &B = Sym->getBlock();
+    if (JITDumpOS && !B.isZeroFill()) {
+      auto Code = B.getContent().slice(Sym->getOffset(), Sym->getSize());
+      F.Code.assign(Code.begin(), Code.end());
+    }
+    Functions.push_back(std::move(F));
+  }
+
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Pending[&MR] = std::move(Functions);
+  return Error::success();
+}
+
+Error PerfPlugin::notifyEmitted(MaterializationResponsibility &MR) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto I = Pending.find(&MR);
+  if (I == Pending.end())
+    return Error::success();
+  auto Functions = std::move(I->second);
+  Pending.erase(I);
+
+  // Both files are append-only: removed code keeps its entries, and the
+  // jitdump's timestamps tell perf which code was where when.
+  for (auto &F : Functions) {
+    if (MapOS)
+      writeMapEntry(*MapOS, F);
+    if (JITDumpOS)
+      writeJITDumpLoad(F);
+  }
+  if (MapOS)
+    MapOS->flush();
+  if (JITDumpOS)
+    JITDumpOS->flush();
+  return Error::success();
+}
+
+Error PerfPlugin::notifyFailed(MaterializationResponsibility &MR) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Pending.erase(&MR);
+  return Error::success();
+}
+
+void PerfPlugin::writeMapEntry(raw_ostream &OS, const Function &F) {
+  OS << formatv("{0:x-} {1:x-} {2}\n", F.Addr, F.Size, F.Name);
+}
+
+void PerfPlugin::writeJITDumpLoad(const Function &F) {
+  // Header, then pid, tid, vma, code_addr, code_size and code_index, then the
+  // name and the code.
+  uint32_t Size = 16 + 40 + F.Name.size() + 1 + F.Code.size();
+  support::endian::Writer W(*JITDumpOS, support::native);
+  W.write<uint32_t>(JITCodeLoad);
+  W.write<uint32_t>(Size);
+  W.write<uint64_t>(getTimestamp());
+  W.write<uint32_t>(sys::Process::getProcessId());
+  W.write<uint32_t>(get_threadid());
+  W.write<uint64_t>(F.Addr);
+  W.write<uint64_t>(F.Addr);
+  W.write<uint64_t>(F.Code.size());
+  W.write<uint64_t>(NextCodeIndex++);
+  *JITDumpOS << F.Name << '\0';
+  JITDumpOS->write(reinterpret_cast<const char *>(F.Code.data()),
+                   F.Code.size());
+}
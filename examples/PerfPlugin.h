@@ -0,0 +1,99 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef PERF_PLUGIN_H
+#define PERF_PLUGIN_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class Triple;
+} // end namespace llvm
+
+/// PerfPlugin - Tells Linux perf where the JIT'd functions are, so that
+/// samples in JIT'd code are attributed to Kaleidoscope functions.
+///
+/// It walks each LinkGraph once the linker has fixed up its code, and records
+/// every named function when its object has been emitted. It can write
+/// either or both of:
+///
+///  * A perf map, /tmp/perf-<pid>.map, with one "<start> <size> <name>" line
+///    per function, which `perf report` picks up without extra steps. Lines
+///    are only ever appended as code is emitted, as perf expects of a map
+///    that may be read while the process runs. The map has no notion of
+///    time, so once freed code's memory is reused (a function is redefined,
+///    or a top-level expression has run), the old and new functions at those
+///    addresses are both in the map and samples there may be misattributed.
+///
+///  * A jitdump file, /tmp/jit-<pid>.dump, with a timestamped load record
+///    and the code of every function. `perf record -k mono` notes where the
+///    file is, and `perf inject --jit` turns it into one ELF image per load,
+///    so samples are attributed to whichever code was loaded at an address
+///    when they were taken, across any number of redefinitions.
+class PerfPlugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+public:
+  /// Create a plugin that writes a perf map if PerfMap is set and a jitdump
+  /// file for code of the given target if JITDump is set.
+  static llvm::Expected<std::unique_ptr<PerfPlugin>>
+  Create(bool PerfMap, bool JITDump, const llvm::Triple &TT);
+
+  ~PerfPlugin() override;
+
+  void modifyPassConfig(llvm::orc::MaterializationResponsibility &MR,
+                        llvm::jitlink::LinkGraph &G,
+                        llvm::jitlink::PassConfiguration &Config) override;
+
+  llvm::Error
+  notifyEmitted(llvm::orc::MaterializationResponsibility &MR) override;
+  llvm::Error
+  notifyFailed(llvm::orc::MaterializationResponsibility &MR) override;
+  llvm::Error notifyRemovingResources(llvm::orc::JITDylib &JD,
+                                      llvm::orc::ResourceKey K) override {
+    return llvm::Error::success();
+  }
+  void notifyTransferringResources(llvm::orc::JITDylib &JD,
+                                   llvm::orc::ResourceKey DstKey,
+                                   llvm::orc::ResourceKey SrcKey) override {}
+
+private:
+  /// Function - A function in linked code. Code is only kept until the
+  /// function has been written to the jitdump file.
+  struct Function {
+    uint64_t Addr;
+    uint64_t Size;
+    std::string Name;
+    std::vector<uint8_t> Code;
+  };
+
+  PerfPlugin() = default;
+
+  llvm::Error recordFunctions(llvm::orc::MaterializationResponsibility &MR,
+                              llvm::jitlink::LinkGraph &G);
+  void writeMapEntry(llvm::raw_ostream &OS, const Function &F);
+  void writeJITDumpLoad(const Function &F);
+
+  std::mutex Mutex;
+
+  /// Functions of graphs being linked, until their objects are emitted.
+  llvm::DenseMap<llvm::orc::MaterializationResponsibility *,
+                 std::vector<Function>>
+      Pending;
+
+  std::unique_ptr<llvm::raw_fd_ostream> MapOS; // Null unless writing a map.
+
+  std::string JITDumpPath;
+  std::unique_ptr<llvm::raw_fd_ostream> JITDumpOS; // Null unless dumping.
+  void *JITDumpMarker = nullptr;
+  uint64_t NextCodeIndex = 0;
+};
+
+#endif // PERF_PLUGIN_H
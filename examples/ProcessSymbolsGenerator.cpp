@@ -0,0 +1,237 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "ProcessSymbolsGenerator.h"
+
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+
+#ifdef __linux__
+#include <elf.h>
+#include <link.h>
+#endif
+
+using namespace llvm;
+using namespace llvm::orc;
+
+#ifdef __linux__
+/// getLoaderCounts - Get the dynamic loader's counts of library loads and
+/// unloads, which change whenever the set of loaded libraries does. Returns
+/// false if the loader does not keep them.
+static bool getLoaderCounts(uint64_t &Adds, uint64_t &Subs) {
+  struct Counts {
+    bool Valid = false;
+    uint64_t Adds = 0, Subs = 0;
+  } C;
+  dl_iterate_phdr(
+      [](dl_phdr_info *Info, size_t Size, void *Data) {
+        auto &C = *static_cast<Counts *>(Data);
+        if (Size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(Info->dlpi_subs))
+          C = {true, Info->dlpi_adds, Info->dlpi_subs};
+        return 1; // Every library reports the same counts.
+      },
+      &C);
+  Adds = C.Adds;
+  Subs = C.Subs;
+  return C.Valid;
+}
+
+/// countGNUHashSymbols - The number of symbols in a dynamic symbol table
+/// with the given DT_GNU_HASH table: one past the end of the last hash chain.
+static size_t countGNUHashSymbols(const uint32_t *Hash) {
+  uint32_t NumBuckets = Hash[0], SymOffset = Hash[1], BloomWords = Hash[2];
+  const uint32_t *Buckets =
+      Hash + 4 + BloomWords * (sizeof(ElfW(Addr)) / sizeof(uint32_t));
+  const uint32_t *Chains = Buckets + NumBuckets;
+
+  uint32_t Last = 0;
+  for (uint32_t B = 0; B != NumBuckets; ++B)
+    Last = std::max(Last, Buckets[B]);
+  if (Last < SymOffset)
+    return SymOffset;
+  // The low bit marks the end of a chain.
+  while (!(Chains[Last - SymOffset] & 1))
+    ++Last;
+  return Last + 1;
+}
+#endif
+
+Expected<std::unique_ptr<ProcessSymbolsGenerator>>
+ProcessSymbolsGenerator::Create(char GlobalPrefix) {
+  // Make the process's own symbols available to the dlsym fallback.
+  std::string ErrMsg;
+  if (sys::DynamicLibrary::LoadLibraryPermanently(nullptr, &ErrMsg))
+    return make_error<StringError>(std::move(ErrMsg),
+                                   inconvertibleErrorCode());
+
+  std::unique_ptr<ProcessSymbolsGenerator> G(
+      new ProcessSymbolsGenerator(GlobalPrefix));
+  std::lock_guard<std::mutex> Lock(G->Mutex);
+  G->updateSnapshot(/*Rebuild=*/true);
+  return G;
+}
+
+void ProcessSymbolsGenerator::updateSnapshot(bool Rebuild) {
+#ifdef __linux__
+  auto Start = std::chrono::steady_clock::now();
+  if (Rebuild) {
+    Symbols.clear();
+    Libraries.clear();
+    FallbackNamesAlloc.Reset();
+  }
+
+  // Libraries are visited in load order, which is the order in which dlsym
+  // searches them.
+  dl_iterate_phdr(
+      [](dl_phdr_info *Info, size_t Size, void *Data) {
+        auto &G = *static_cast<ProcessSymbolsGenerator *>(Data);
+        if (!G.Libraries.insert(Info->dlpi_addr).second)
+          return 0;
+        for (unsigned I = 0; I != Info->dlpi_phnum; ++I)
+          if (Info->dlpi_phdr[I].p_type == PT_DYNAMIC)
+            G.addLibrary(Info->dlpi_addr, reinterpret_cast<const void *>(
+                                              Info->dlpi_addr +
+                                              Info->dlpi_phdr[I].p_vaddr));
+        return 0;
+      },
+      this);
+  getLoaderCounts(LoaderAdds, LoaderSubs);
+
+  S.NumSymbols = Symbols.size();
+  S.NumLibraries = Libraries.size();
+  S.SnapshotSeconds += std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - Start)
+                           .count();
+#endif
+}
+
+void ProcessSymbolsGenerator::addLibrary(uint64_t Base, const void *Dynamic) {
+#ifdef __linux__
+  const ElfW(Sym) *SymTab = nullptr;
+  const char *StrTab = nullptr;
+  const ElfW(Half) *VerSym = nullptr;
+  const uint32_t *Hash = nullptr, *GNUHash = nullptr;
+
+  // The loader relocates these addresses in most libraries, but not in all
+  // (e.g. the vDSO).
+  auto GetPtr = [&](ElfW(Addr) Addr) {
+    return reinterpret_cast<const void *>(Addr < Base ? Base + Addr : Addr);
+  };
+  for (auto *Dyn = static_cast<const ElfW(Dyn) *>(Dynamic);
+       Dyn->d_tag != DT_NULL; ++Dyn) {
+    switch (Dyn->d_tag) {
+    case DT_SYMTAB:
+      SymTab = static_cast<const ElfW(Sym) *>(GetPtr(Dyn->d_un.d_ptr));
+      break;
+    case DT_STRTAB:
+      StrTab = static_cast<const char *>(GetPtr(Dyn->d_un.d_ptr));
+      break;
+    case DT_VERSYM:
+      VerSym = static_cast<const ElfW(Half) *>(GetPtr(Dyn->d_un.d_ptr));
+      break;
+    case DT_HASH:
+      Hash = static_cast<const uint32_t *>(GetPtr(Dyn->d_un.d_ptr));
+      break;
+    case DT_GNU_HASH:
+      GNUHash = static_cast<const uint32_t *>(GetPtr(Dyn->d_un.d_ptr));
+      break;
+    }
+  }
+  if (!SymTab || !StrTab || (!Hash && !GNUHash))
+    return;
+
+  // The symbol table's size is only recorded in the hash tables.
+  size_t NumSyms = Hash ? Hash[1] : countGNUHashSymbols(GNUHash);
+  Symbols.reserve(Symbols.size() + NumSyms);
+  for (size_t I = 1; I < NumSyms; ++I) {
+    const ElfW(Sym) &Sym = SymTab[I];
+    if (Sym.st_shndx == SHN_UNDEF || !Sym.st_value)
+      continue;
+    unsigned Binding = Sym.st_info >> 4, Type = Sym.st_info & 0xf;
+    if (Binding != STB_GLOBAL && Binding != STB_WEAK &&
+        Binding != STB_GNU_UNIQUE)
+      continue;
+    // Indirect functions are left to dlsym, which calls their resolvers.
+    if (Type != STT_FUNC && Type != STT_OBJECT && Type != STT_NOTYPE &&
+        Type != STT_COMMON)
+      continue;
+    if ((Sym.st_other & 3) != STV_DEFAULT &&
+        (Sym.st_other & 3) != STV_PROTECTED)
+      continue;
+    // Hidden versions are only found by versioned lookups.
+    if (VerSym && (VerSym[I] & 0x8000))
+      continue;
+    Symbols.try_emplace(StringRef(StrTab + Sym.st_name),
+                        ExecutorAddr(Base + Sym.st_value));
+  }
+#endif
+}
+
+Error ProcessSymbolsGenerator::tryToGenerate(
+    LookupState &LS, LookupKind K, JITDylib &JD,
+    JITDylibLookupFlags JDLookupFlags, const SymbolLookupSet &LookupSet) {
+  SymbolMap NewDefs;
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+#ifdef __linux__
+    uint64_t Adds, Subs;
+    if (!getLoaderCounts(Adds, Subs) || Adds != LoaderAdds ||
+        Subs != LoaderSubs) {
+      updateSnapshot(/*Rebuild=*/Subs != LoaderSubs);
+      ++S.Rescans;
+    }
+#endif
+
+    for (auto &KV : LookupSet) {
+      StringRef Name = *KV.first;
+      if (GlobalPrefix) {
+        if (!Name.startswith(StringRef(&GlobalPrefix, 1)))
+          continue;
+        Name = Name.drop_front();
+      }
+      ++S.Lookups;
+
+      ExecutorAddr Addr;
+      auto I = Symbols.find(Name);
+      if (I != Symbols.end()) {
+        Addr = I->second;
+        ++S.Hits;
+      } else if (void *Ptr = sys::DynamicLibrary::SearchForAddressOfSymbol(
+                     Name.str())) {
+        // Cache the address, so that the next lookup of the symbol (from
+        // another JITDylib, or after it was removed) is a hit.
+        Addr = ExecutorAddr::fromPtr(Ptr);
+        Symbols[FallbackNames.save(Name)] = Addr;
+        ++S.Fallbacks;
+      } else {
+        continue;
+      }
+      NewDefs[KV.first] = {Addr, JITSymbolFlags::Exported};
+    }
+  }
+
+  if (NewDefs.empty())
+    return Error::success();
+  return JD.define(absoluteSymbols(std::move(NewDefs)));
+}
+
+ProcessSymbolsGenerator::Stats ProcessSymbolsGenerator::getStats() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return S;
+}
+
+void ProcessSymbolsGenerator::printStats(raw_ostream &OS) {
+  Stats St = getStats();
+  OS << formatv("process symbols: {0} lookups, {1} hits ({2:P1}), {3} dlsym "
+                "fallbacks\n",
+                St.Lookups, St.Hits,
+                St.Lookups ? double(St.Hits) / St.Lookups : 0.0,
+                St.Fallbacks);
+  OS << formatv("  snapshot of {0} symbols from {1} libraries, taken in "
+                "{2:f2} ms with {3} rescans\n",
+                St.NumSymbols, St.NumLibraries, St.SnapshotSeconds * 1000,
+                St.Rescans);
+}
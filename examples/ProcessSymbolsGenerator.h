@@ -0,0 +1,108 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef PROCESS_SYMBOLS_GENERATOR_H
+#define PROCESS_SYMBOLS_GENERATOR_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/StringSaver.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace llvm {
+class raw_ostream;
+} // end namespace llvm
+
+/// ProcessSymbolsGenerator - Defines the symbols that JIT'd code uses from
+/// the host process (e.g. printd, putchard or sin) in a JITDylib, by looking
+/// them up in a snapshot of the process's exported symbols.
+///
+/// EPCDynamicLibrarySearchGenerator asks the executor to dlsym each missing
+/// symbol, walking every loaded library's hash table once per symbol. This
+/// generator instead reads the dynamic symbol tables of the executable and
+/// all loaded libraries once, into a single hash table, and answers each
+/// batch of lookups from it. The names in the table point into the
+/// libraries' own string tables, so the snapshot costs no string copies.
+///
+/// Before each batch it checks whether the dynamic loader has loaded or
+/// unloaded anything since the snapshot was taken. Newly dlopen'ed
+/// libraries are added to the table, and it is rebuilt after an unload.
+/// Symbols that are not in the table, such as GNU indirect functions whose
+/// address has to be computed by a resolver, fall back to dlsym, and the
+/// addresses that dlsym finds are added to the table.
+///
+/// Only the ELF symbol tables of Linux processes are read; elsewhere every
+/// symbol goes through dlsym. As the generator reads the host process's
+/// memory, it only works for in-process executors.
+class ProcessSymbolsGenerator : public llvm::orc::DefinitionGenerator {
+public:
+  /// Stats - How the lookups made through the generator were answered.
+  struct Stats {
+    uint64_t Lookups = 0;   // Symbols that the generator was asked for.
+    uint64_t Hits = 0;      // Found in the snapshot.
+    uint64_t Fallbacks = 0; // Not in the snapshot yet, but found by dlsym.
+    uint64_t Rescans = 0;   // Updates after libraries were (un)loaded.
+    size_t NumSymbols = 0;  // Symbols in the snapshot when it was taken.
+    size_t NumLibraries = 0;
+    double SnapshotSeconds = 0; // Total time spent taking snapshots.
+  };
+
+  /// Create a generator that strips GlobalPrefix (see
+  /// DataLayout::getGlobalPrefix) from the names it is asked for, taking
+  /// the first snapshot right away.
+  static llvm::Expected<std::unique_ptr<ProcessSymbolsGenerator>>
+  Create(char GlobalPrefix);
+
+  llvm::Error
+  tryToGenerate(llvm::orc::LookupState &LS, llvm::orc::LookupKind K,
+                llvm::orc::JITDylib &JD,
+                llvm::orc::JITDylibLookupFlags JDLookupFlags,
+                const llvm::orc::SymbolLookupSet &LookupSet) override;
+
+  Stats getStats();
+
+  /// Print the stats, with the hit rate, to OS.
+  void printStats(llvm::raw_ostream &OS);
+
+private:
+  ProcessSymbolsGenerator(char GlobalPrefix) : GlobalPrefix(GlobalPrefix) {}
+
+  /// Add the exported symbols of the libraries that are not in the snapshot
+  /// yet, or of all libraries if Rebuild is set.
+  void updateSnapshot(bool Rebuild);
+
+  /// Add the symbols in the dynamic symbol table of the library loaded at
+  /// Base with the given dynamic section.
+  void addLibrary(uint64_t Base, const void *Dynamic);
+
+  char GlobalPrefix;
+
+  std::mutex Mutex;
+
+  /// The snapshot: exported symbols by name, the first definition of a name
+  /// in load order winning as it does for dlsym.
+  llvm::DenseMap<llvm::StringRef, llvm::orc::ExecutorAddr> Symbols;
+
+  /// Names of the symbols that were added to Symbols after a dlsym.
+  llvm::BumpPtrAllocator FallbackNamesAlloc;
+  llvm::StringSaver FallbackNames{FallbackNamesAlloc};
+
+  /// Base addresses of the libraries in the snapshot.
+  llvm::DenseSet<uint64_t> Libraries;
+
+  /// The dynamic loader's counts of loads and unloads when the snapshot was
+  /// last updated.
+  uint64_t LoaderAdds = 0;
+  uint64_t LoaderSubs = 0;
+
+  Stats S;
+};
+
+#endif // PROCESS_SYMBOLS_GENERATOR_H
@@ -0,0 +1,304 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "RemoteExecutor.h"
+
+#include "llvm/ADT/bit.h"
+#include "llvm/ExecutionEngine/Orc/EPCDynamicLibrarySearchGenerator.h"
+#include "llvm/ExecutionEngine/Orc/MapperJITLinkMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/MemoryMapper.h"
+#include "llvm/ExecutionEngine/Orc/Shared/OrcRTBridge.h"
+#include "llvm/ExecutionEngine/Orc/Shared/SimpleRemoteEPCUtils.h"
+#include "llvm/ExecutionEngine/Orc/Shared/WrapperFunctionUtils.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/ExecutorSharedMemoryMapperService.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleExecutorDylibManager.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleRemoteEPCServer.h"
+#include "llvm/Support/Errno.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef LLVM_ON_UNIX
+#include <dirent.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+using namespace llvm;
+using namespace llvm::orc;
+
+extern "C" double putchard(double X);
+extern "C" double printd(double X);
+
+/// The host functions that the executor makes available to JIT'd code.
+static const struct {
+  const char *Name;
+  double (*Fn)(double);
+} HostFunctions[] = {{"printd", &printd}, {"putchard", &putchard}};
+
+/// The results are the doubles' bit patterns: SPS has no floating point.
+using RunBatchSignature =
+    shared::SPSSequence<uint64_t>(shared::SPSSequence<shared::SPSExecutorAddr>);
+
+static const char RunBatchWrapperName[] = "__kaleidoscope_run_batch_wrapper";
+
+static shared::CWrapperFunctionResult runBatchWrapper(const char *ArgData,
+                                                      size_t ArgSize) {
+  return shared::WrapperFunction<RunBatchSignature>::handle(
+             ArgData, ArgSize,
+             [](std::vector<ExecutorAddr> Fns) {
+               std::vector<uint64_t> Results;
+               for (auto Fn : Fns)
+                 Results.push_back(
+                     bit_cast<uint64_t>(Fn.toPtr<double (*)()>()()));
+               return Results;
+             })
+      .release();
+}
+
+#ifdef LLVM_ON_UNIX
+
+static Error errnoError(const Twine &What) {
+  return make_error<StringError>(What + ": " + sys::StrError(),
+                                 inconvertibleErrorCode());
+}
+
+/// Close whatever the executor inherited from the driver other than its own
+/// pipes, in particular the pipes of other executors, which would otherwise
+/// not see the driver hang up.
+static void closeInheritedFDs(int InFD, int OutFD) {
+#ifdef __linux__
+  std::vector<int> FDs;
+  if (DIR *Dir = opendir("/proc/self/fd")) {
+    while (dirent *Entry = readdir(Dir)) {
+      int FD = atoi(Entry->d_name);
+      if (FD > 2 && FD != InFD && FD != OutFD && FD != dirfd(Dir))
+        FDs.push_back(FD);
+    }
+    closedir(Dir);
+  }
+  for (int FD : FDs)
+    close(FD);
+#endif
+}
+
+/// The executor's main loop, in the child process.
+[[noreturn]] static void runExecutor(int InFD, int OutFD) {
+#ifdef __linux__
+  // Die with the driver rather than keep running whatever JIT'd code is in
+  // flight.
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+  // A crash in JIT'd code, or Ctrl-C, should kill the executor outright, for
+  // the driver to report, rather than run the driver's handlers.
+  for (int Signal : {SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGINT, SIGSEGV, SIGTRAP})
+    signal(Signal, SIG_DFL);
+  closeInheritedFDs(InFD, OutFD);
+
+  auto Server = SimpleRemoteEPCServer::Create<FDSimpleRemoteEPCTransport>(
+      [](SimpleRemoteEPCServer::Setup &S) -> Error {
+        S.setDispatcher(
+            std::make_unique<SimpleRemoteEPCServer::ThreadDispatcher>());
+        S.bootstrapSymbols() =
+            SimpleRemoteEPCServer::defaultBootstrapSymbols();
+        S.bootstrapSymbols()[RunBatchWrapperName] =
+            ExecutorAddr::fromPtr(&runBatchWrapper);
+        for (auto &F : HostFunctions)
+          S.bootstrapSymbols()[F.Name] = ExecutorAddr::fromPtr(F.Fn);
+        using namespace rt_bootstrap;
+        S.services().push_back(std::make_unique<SimpleExecutorDylibManager>());
+        S.services().push_back(
+            std::make_unique<ExecutorSharedMemoryMapperService>());
+        return Error::success();
+      },
+      InFD, OutFD);
+
+  Error Err = Server ? (*Server)->waitForDisconnect() : Server.takeError();
+  int Status = 0;
+  if (Err) {
+    errs() << "kaleidoscope executor: " << toString(std::move(Err)) << "\n";
+    Status = 1;
+  }
+  // Skip the driver's exit handlers and static destructors, which are not
+  // the executor's to run.
+  fflush(nullptr);
+  _exit(Status);
+}
+
+/// Link JIT'd code into memory that the driver and the executor share,
+/// reserving SlabBytes of it at a time.
+static Expected<std::unique_ptr<jitlink::JITLinkMemoryManager>>
+createSharedMemoryManager(SimpleRemoteEPC &EPC, uint64_t SlabBytes) {
+  SharedMemoryMapper::SymbolAddrs SAs;
+  if (auto Err = EPC.getBootstrapSymbols(
+          {{SAs.Instance, rt::ExecutorSharedMemoryMapperServiceInstanceName},
+           {SAs.Reserve,
+            rt::ExecutorSharedMemoryMapperServiceReserveWrapperName},
+           {SAs.Initialize,
+            rt::ExecutorSharedMemoryMapperServiceInitializeWrapperName},
+           {SAs.Deinitialize,
+            rt::ExecutorSharedMemoryMapperServiceDeinitializeWrapperName},
+           {SAs.Release,
+            rt::ExecutorSharedMemoryMapperServiceReleaseWrapperName}}))
+    return std::move(Err);
+  return MapperJITLinkMemoryManager::CreateWithMapper<SharedMemoryMapper>(
+      SlabBytes, EPC, SAs);
+}
+
+#endif // LLVM_ON_UNIX
+
+Expected<std::unique_ptr<RemoteExecutor>>
+RemoteExecutor::Launch(std::unique_ptr<TaskDispatcher> D, uint64_t SlabBytes) {
+#ifdef LLVM_ON_UNIX
+  if (SlabBytes == 0)
+    SlabBytes = 64 << 20;
+
+  int ToExecutor[2], FromExecutor[2];
+  if (pipe(ToExecutor) != 0)
+    return errnoError("cannot create a pipe to the executor");
+  if (pipe(FromExecutor) != 0) {
+    Error Err = errnoError("cannot create a pipe from the executor");
+    close(ToExecutor[0]);
+    close(ToExecutor[1]);
+    return std::move(Err);
+  }
+
+  // Whatever is buffered would otherwise be written by both processes.
+  outs().flush();
+  errs().flush();
+  fflush(nullptr);
+
+  pid_t PID = fork();
+  if (PID == 0) {
+    close(ToExecutor[1]);
+    close(FromExecutor[0]);
+    runExecutor(ToExecutor[0], FromExecutor[1]);
+  }
+
+  close(ToExecutor[0]);
+  close(FromExecutor[1]);
+  if (PID == -1) {
+    Error Err = errnoError("cannot fork the executor");
+    close(ToExecutor[1]);
+    close(FromExecutor[0]);
+    return std::move(Err);
+  }
+
+  if (!D)
+    D = std::make_unique<DynamicThreadPoolTaskDispatcher>();
+  SimpleRemoteEPC::Setup S;
+  S.CreateMemoryManager = [SlabBytes](SimpleRemoteEPC &EPC) {
+    return createSharedMemoryManager(EPC, SlabBytes);
+  };
+  auto EPC = SimpleRemoteEPC::Create<FDSimpleRemoteEPCTransport>(
+      std::move(D), std::move(S), FromExecutor[0], ToExecutor[1]);
+  if (!EPC) {
+    kill(PID, SIGKILL);
+    waitpid(PID, nullptr, 0);
+    return EPC.takeError();
+  }
+
+  std::unique_ptr<RemoteExecutor> E(new RemoteExecutor(PID, std::move(*EPC)));
+  if (auto Err =
+          E->EPC.getBootstrapSymbols({{E->RunBatchAddr, RunBatchWrapperName}}))
+    return std::move(Err);
+  return E;
+#else
+  return make_error<StringError>("out-of-process execution is not supported "
+                                 "on this platform",
+                                 inconvertibleErrorCode());
+#endif
+}
+
+RemoteExecutor::~RemoteExecutor() {
+  if (OwnedEPC)
+    consumeError(OwnedEPC->disconnect());
+#ifdef LLVM_ON_UNIX
+  if (!Reaped)
+    waitpid(PID, nullptr, 0);
+#endif
+}
+
+std::unique_ptr<SimpleRemoteEPC> RemoteExecutor::takeEPC() {
+  assert(OwnedEPC && "EPC already taken");
+  return std::move(OwnedEPC);
+}
+
+Error RemoteExecutor::addSymbolsTo(JITDylib &JD, MangleAndInterner &Mangle) {
+  SymbolMap Symbols;
+  for (auto &F : HostFunctions) {
+    ExecutorAddr Addr;
+    if (auto Err = EPC.getBootstrapSymbols({{Addr, F.Name}}))
+      return Err;
+    Symbols[Mangle(F.Name)] = {Addr, JITSymbolFlags::Exported};
+  }
+  if (auto Err = JD.define(absoluteSymbols(std::move(Symbols))))
+    return Err;
+
+  auto G = EPCDynamicLibrarySearchGenerator::GetForTargetProcess(
+      JD.getExecutionSession());
+  if (!G)
+    return G.takeError();
+  JD.addGenerator(std::move(*G));
+  return Error::success();
+}
+
+Expected<std::vector<double>>
+RemoteExecutor::runBatch(ArrayRef<ExecutorAddr> Fns) {
+  std::vector<uint64_t> Bits;
+#ifdef LLVM_ON_UNIX
+  // Ctrl-C reaches the executor too, so that an endless loop in JIT'd code
+  // can be stopped without losing the driver.
+  struct sigaction Ignore = {}, Old;
+  Ignore.sa_handler = SIG_IGN;
+  sigaction(SIGINT, &Ignore, &Old);
+#endif
+  Error Err = EPC.callSPSWrapper<RunBatchSignature>(
+      RunBatchAddr, Bits, std::vector<ExecutorAddr>(Fns));
+#ifdef LLVM_ON_UNIX
+  sigaction(SIGINT, &Old, nullptr);
+#endif
+  if (Err)
+    return explainExit(std::move(Err));
+
+  std::vector<double> Results;
+  for (uint64_t B : Bits)
+    Results.push_back(bit_cast<double>(B));
+  return Results;
+}
+
+Error RemoteExecutor::explainExit(Error Err) {
+#ifdef LLVM_ON_UNIX
+  // The pipes are closed as the executor exits, a moment before it can be
+  // reaped, so give it a little time.
+  for (unsigned Try = 0; !Reaped && Try != 100; ++Try) {
+    if (waitpid(PID, &ExitStatus, WNOHANG) == PID)
+      Reaped = true;
+    else
+      usleep(1000);
+  }
+  if (!Reaped)
+    return Err;
+
+  std::string Exit;
+  if (WIFSIGNALED(ExitStatus)) {
+    int Signal = WTERMSIG(ExitStatus);
+    Exit = ("the executor was killed by signal " + Twine(Signal) + " (" +
+            strsignal(Signal) + ")")
+               .str();
+  }
+  else
+    Exit = ("the executor exited with status " +
+            Twine(WEXITSTATUS(ExitStatus)))
+               .str();
+  return joinErrors(make_error<StringError>(Exit, inconvertibleErrorCode()),
+                    std::move(Err));
+#else
+  return Err;
+#endif
+}
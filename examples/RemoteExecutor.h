@@ -0,0 +1,79 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef REMOTE_EXECUTOR_H
+#define REMOTE_EXECUTOR_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/Mangling.h"
+#include "llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h"
+#include "llvm/ExecutionEngine/Orc/SimpleRemoteEPC.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
+#include "llvm/Support/Error.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// RemoteExecutor - Runs JIT'd code in a child process, so that a crash in
+/// the code does not take the compiler down with it.
+///
+/// The executor is forked from the driver before the JIT starts, so it has
+/// the driver's host functions (printd, putchard) and the libraries it links
+/// against. It serves a SimpleRemoteEPC over a pair of pipes, which only
+/// carry small control messages: JIT'd code and data are linked straight
+/// into memory shared by both processes (ORC's SharedMemoryMapper), rather
+/// than being copied through the pipe.
+///
+/// Every round trip costs two context switches, so the executor also
+/// provides a wrapper function that runs a whole batch of top-level
+/// expressions and returns their results in one go (see runBatch). Symbols
+/// that JIT'd code uses from the executor are likewise looked up a batch at
+/// a time, by the EPCDynamicLibrarySearchGenerator that addSymbolsTo adds.
+///
+/// Unix only (fork). The executor dies with the driver.
+class RemoteExecutor {
+public:
+  /// Fork an executor and connect a SimpleRemoteEPC to it, which runs its
+  /// tasks on D (a DynamicThreadPoolTaskDispatcher if null). The shared
+  /// memory for JIT'd code is reserved SlabBytes at a time.
+  static llvm::Expected<std::unique_ptr<RemoteExecutor>>
+  Launch(std::unique_ptr<llvm::orc::TaskDispatcher> D, uint64_t SlabBytes);
+
+  /// Waits for the executor to exit, which it does once the EPC has been
+  /// disconnected (see ExecutionSession::endSession).
+  ~RemoteExecutor();
+
+  /// Hand over the EPC, for an ExecutionSession to own. The executor must not
+  /// outlive the session.
+  std::unique_ptr<llvm::orc::SimpleRemoteEPC> takeEPC();
+
+  /// Define the executor's host functions in JD, and add a generator that
+  /// looks up anything else JIT'd code uses in the executor's libraries.
+  llvm::Error addSymbolsTo(llvm::orc::JITDylib &JD,
+                           llvm::orc::MangleAndInterner &Mangle);
+
+  /// Call the functions at Fns, which take no arguments and return a
+  /// double, in order, in a single round trip to the executor. Meanwhile
+  /// Ctrl-C kills the executor rather than the driver.
+  llvm::Expected<std::vector<double>>
+  runBatch(llvm::ArrayRef<llvm::orc::ExecutorAddr> Fns);
+
+  int getPID() const { return PID; }
+
+private:
+  RemoteExecutor(int PID, std::unique_ptr<llvm::orc::SimpleRemoteEPC> EPC)
+      : PID(PID), OwnedEPC(std::move(EPC)), EPC(*OwnedEPC) {}
+
+  /// If the executor has exited, e.g. after Err, add how it died to Err.
+  llvm::Error explainExit(llvm::Error Err);
+
+  int PID;
+  bool Reaped = false;
+  int ExitStatus = 0; // As returned by waitpid, once Reaped.
+  std::unique_ptr<llvm::orc::SimpleRemoteEPC> OwnedEPC; // Until takeEPC().
+  llvm::orc::SimpleRemoteEPC &EPC;
+  llvm::orc::ExecutorAddr RunBatchAddr;
+};
+
+#endif // REMOTE_EXECUTOR_H
@@ -0,0 +1,455 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "SlabMemoryManager.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/ExecutionEngine/Orc/Shared/AllocationActions.h"
+#include "llvm/Support/Alignment.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace llvm;
+using namespace llvm::jitlink;
+
+class SlabMemoryManager::InFlightAlloc
+    : public JITLinkMemoryManager::InFlightAlloc {
+public:
+  InFlightAlloc(SlabMemoryManager &MemMgr, LinkGraph &G,
+                std::vector<Block> StandardBlocks,
+                std::vector<Block> FinalizeBlocks)
+      : MemMgr(MemMgr), G(G), StandardBlocks(std::move(StandardBlocks)),
+        FinalizeBlocks(std::move(FinalizeBlocks)) {}
+
+  void finalize(OnFinalizedFunction OnFinalized) override {
+    // The code was written through the other view.
+    for (auto *Blocks : {&StandardBlocks, &FinalizeBlocks})
+      for (auto &B : *Blocks)
+        if (B.Kind == Code)
+          sys::Memory::InvalidateInstructionCache(MemMgr.ExecBase + B.Offset,
+                                                  B.Size);
+
+    auto DeallocActions = orc::shared::runFinalizeActions(G.allocActions());
+    MemMgr.release(FinalizeBlocks);
+    if (!DeallocActions) {
+      MemMgr.release(StandardBlocks);
+      OnFinalized(DeallocActions.takeError());
+      return;
+    }
+
+    auto *A = new Allocation{std::move(StandardBlocks),
+                             std::move(*DeallocActions)};
+    {
+      std::lock_guard<std::mutex> Lock(MemMgr.Mutex);
+      MemMgr.Live.insert(A);
+    }
+    OnFinalized(FinalizedAlloc(orc::ExecutorAddr::fromPtr(A)));
+  }
+
+  void abandon(OnAbandonedFunction OnAbandoned) override {
+    MemMgr.release(StandardBlocks);
+    MemMgr.release(FinalizeBlocks);
+    OnAbandoned(Error::success());
+  }
+
+private:
+  SlabMemoryManager &MemMgr;
+  LinkGraph &G;
+  std::vector<Block> StandardBlocks, FinalizeBlocks;
+};
+
+Expected<std::unique_ptr<SlabMemoryManager>>
+SlabMemoryManager::Create(uint64_t SlabBytes) {
+  if (SlabBytes == 0 || SlabBytes >= (uint64_t(1) << 31))
+    return make_error<StringError>("the JIT slab must be non-empty and "
+                                   "smaller than 2GB",
+                                   inconvertibleErrorCode());
+
+  auto Fallback = InProcessMemoryManager::Create();
+  if (!Fallback)
+    return Fallback.takeError();
+
+#ifdef __linux__
+  uint64_t PageSize = sys::Process::getPageSizeEstimate();
+  SlabBytes = alignTo(SlabBytes, 4 * PageSize);
+
+  int FD = memfd_create("kaleidoscope-jit-slab", MFD_CLOEXEC);
+  if (FD < 0)
+    return errorCodeToError(std::error_code(errno, std::generic_category()));
+  auto Fail = [&]() {
+    auto EC = std::error_code(errno, std::generic_category());
+    close(FD);
+    return errorCodeToError(EC);
+  };
+  if (ftruncate(FD, SlabBytes) != 0)
+    return Fail();
+
+  void *Exec = mmap(nullptr, SlabBytes, PROT_NONE, MAP_SHARED, FD, 0);
+  if (Exec == MAP_FAILED)
+    return Fail();
+  void *Working =
+      mmap(nullptr, SlabBytes, PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+  if (Working == MAP_FAILED) {
+    munmap(Exec, SlabBytes);
+    return Fail();
+  }
+
+  std::unique_ptr<SlabMemoryManager> MemMgr(
+      new SlabMemoryManager(FD, static_cast<char *>(Exec),
+                            static_cast<char *>(Working), SlabBytes,
+                            std::move(*Fallback)));
+
+  // Half of the slab for code, a quarter each for read-only and read-write
+  // data, protected once and for all.
+  uint64_t Quarter = SlabBytes / 4;
+  const int Prots[NumArenas] = {PROT_READ | PROT_EXEC, PROT_READ,
+                                PROT_READ | PROT_WRITE};
+  const uint64_t Sizes[NumArenas] = {2 * Quarter, Quarter, Quarter};
+  uint64_t Begin = 0;
+  for (unsigned K = 0; K != NumArenas; ++K) {
+    auto &A = MemMgr->Arenas[K];
+    A.Begin = A.Top = Begin;
+    A.End = Begin + Sizes[K];
+    Begin = A.End;
+    if (mprotect(MemMgr->ExecBase + A.Begin, Sizes[K], Prots[K]) != 0)
+      return errorCodeToError(std::error_code(errno, std::generic_category()));
+  }
+  return MemMgr;
+#else
+  return make_error<StringError>("the JIT slab is only supported on Linux",
+                                 inconvertibleErrorCode());
+#endif
+}
+
+SlabMemoryManager::SlabMemoryManager(
+    int FD, char *ExecBase, char *WorkingBase, uint64_t SlabBytes,
+    std::unique_ptr<JITLinkMemoryManager> Fallback)
+    : FD(FD), ExecBase(ExecBase), WorkingBase(WorkingBase),
+      SlabBytes(SlabBytes), PageSize(sys::Process::getPageSizeEstimate()),
+      Fallback(std::move(Fallback)) {}
+
+SlabMemoryManager::~SlabMemoryManager() {
+  assert(Live.empty() && "JIT'd code is still allocated");
+#ifdef __linux__
+  munmap(ExecBase, SlabBytes);
+  munmap(WorkingBase, SlabBytes);
+  close(FD);
+#endif
+}
+
+void SlabMemoryManager::allocate(const JITLinkDylib *JD, LinkGraph &G,
+                                 OnAllocatedFunction OnAllocated) {
+  BasicLayout BL(G);
+
+  // The code that the code should go next to, as offsets into the slab.
+  std::optional<std::pair<uint64_t, uint64_t>> Neighbour;
+  if (Placement)
+    if (auto Range = Placement(G)) {
+      // The arenas do not change, so they can be read without the lock.
+      auto &A = Arenas[Code];
+      auto *Begin = Range->Start.toPtr<char *>();
+      auto *End = Range->End.toPtr<char *>();
+      if (Begin >= ExecBase + A.Begin && End <= ExecBase + A.End)
+        Neighbour = {Begin - ExecBase, End - ExecBase};
+    }
+
+  std::vector<Block> StandardBlocks, FinalizeBlocks;
+  bool Fits = true;
+  for (auto &KV : BL.segments()) {
+    auto &AG = KV.first;
+    auto &Seg = KV.second;
+    uint64_t Size = Seg.ContentSize + Seg.ZeroFillSize;
+    if (Size == 0)
+      continue;
+
+    ArenaKind K = ReadOnly;
+    if ((AG.getMemProt() & orc::MemProt::Exec) != orc::MemProt::None)
+      K = Code;
+    else if ((AG.getMemProt() & orc::MemProt::Write) != orc::MemProt::None)
+      K = ReadWrite;
+
+    Size = alignTo(Size, 16);
+    auto Offset = take(K, Size, std::max<uint64_t>(Seg.Alignment.value(), 16),
+                       K == Code ? Neighbour : std::nullopt);
+    if (!Offset) {
+      Fits = false;
+      break;
+    }
+
+    // Unlike fresh pages, reused memory is not zero.
+    Seg.Addr = orc::ExecutorAddr::fromPtr(ExecBase + *Offset);
+    Seg.WorkingMem = WorkingBase + *Offset;
+    memset(Seg.WorkingMem, 0, Size);
+    (AG.getMemLifetimePolicy() == orc::MemLifetimePolicy::Finalize
+         ? FinalizeBlocks
+         : StandardBlocks)
+        .push_back({K, *Offset, Size});
+  }
+
+  if (!Fits) {
+    release(StandardBlocks);
+    release(FinalizeBlocks);
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      ++S.Fallbacks;
+    }
+    copyConstantsInto(G);
+    Fallback->allocate(JD, G, std::move(OnAllocated));
+    return;
+  }
+
+  if (auto Err = BL.apply()) {
+    release(StandardBlocks);
+    release(FinalizeBlocks);
+    OnAllocated(std::move(Err));
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    ++S.Allocations;
+  }
+  OnAllocated(std::make_unique<InFlightAlloc>(
+      *this, G, std::move(StandardBlocks), std::move(FinalizeBlocks)));
+}
+
+void SlabMemoryManager::deallocate(std::vector<FinalizedAlloc> Allocs,
+                                   OnDeallocatedFunction OnDeallocated) {
+  std::vector<FinalizedAlloc> FallbackAllocs;
+  Error Err = Error::success();
+  for (auto &FA : Allocs) {
+    auto *A = FA.getAddress().toPtr<Allocation *>();
+    bool Ours;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Ours = Live.erase(A);
+    }
+    if (!Ours) {
+      FallbackAllocs.push_back(std::move(FA));
+      continue;
+    }
+
+    Err = joinErrors(std::move(Err),
+                     orc::shared::runDeallocActions(A->DeallocActions));
+    release(A->Blocks);
+    delete A;
+    FA.release();
+  }
+
+  if (FallbackAllocs.empty()) {
+    OnDeallocated(std::move(Err));
+    return;
+  }
+  Fallback->deallocate(
+      std::move(FallbackAllocs),
+      [Err = std::move(Err),
+       OnDeallocated = std::move(OnDeallocated)](Error FallbackErr) mutable {
+        OnDeallocated(joinErrors(std::move(Err), std::move(FallbackErr)));
+      });
+}
+
+void SlabMemoryManager::setCodePlacement(CodePlacementFunction Placement) {
+  this->Placement = std::move(Placement);
+}
+
+SlabMemoryManager::Stats SlabMemoryManager::getStats() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return S;
+}
+
+std::optional<orc::ExecutorAddr>
+SlabMemoryManager::allocateConstant(ArrayRef<char> Content,
+                                    uint64_t Alignment) {
+  uint64_t Size = alignTo(Content.size(), 16);
+  auto Offset = take(ReadOnly, Size, std::max<uint64_t>(Alignment, 16));
+  if (!Offset)
+    return std::nullopt;
+  memset(WorkingBase + *Offset, 0, Size);
+  memcpy(WorkingBase + *Offset, Content.data(), Content.size());
+  return orc::ExecutorAddr::fromPtr(ExecBase + *Offset);
+}
+
+void SlabMemoryManager::releaseConstant(orc::ExecutorAddr Addr,
+                                        uint64_t Size) {
+  uint64_t Offset = Addr.toPtr<char *>() - ExecBase;
+  release(Block{ReadOnly, Offset, alignTo(Size, 16)});
+}
+
+void SlabMemoryManager::copyConstantsInto(LinkGraph &G) {
+  auto &A = Arenas[ReadOnly];
+  auto Begin = orc::ExecutorAddr::fromPtr(ExecBase + A.Begin);
+  auto End = orc::ExecutorAddr::fromPtr(ExecBase + A.End);
+
+  // Adding the section would invalidate the block iterators.
+  std::vector<Edge *> References;
+  for (auto *B : G.blocks())
+    for (auto &E : B->edges()) {
+      auto &Target = E.getTarget();
+      if (Target.isAbsolute() && Target.getAddress() >= Begin &&
+          Target.getAddress() < End)
+        References.push_back(&E);
+    }
+  if (References.empty())
+    return;
+
+  auto &Sec = G.createSection("__kaleidoscope_slab_constants",
+                              orc::MemProt::Read);
+  DenseMap<Symbol *, Symbol *> Copies;
+  for (auto *E : References) {
+    auto &Copy = Copies[&E->getTarget()];
+    if (!Copy) {
+      auto &Target = E->getTarget();
+      const char *Content =
+          WorkingBase + (Target.getAddress().toPtr<char *>() - ExecBase);
+      auto &B = G.createContentBlock(
+          Sec, G.allocateContent(ArrayRef<char>(Content, Target.getSize())),
+          orc::ExecutorAddr(), PowerOf2Ceil(Target.getSize()), 0);
+      Copy = &G.addAnonymousSymbol(B, 0, Target.getSize(),
+                                   /*IsCallable=*/false, /*IsLive=*/true);
+    }
+    E->setTarget(*Copy);
+  }
+}
+
+std::optional<uint64_t> SlabMemoryManager::take(
+    ArenaKind K, uint64_t Size, uint64_t Alignment,
+    std::optional<std::pair<uint64_t, uint64_t>> Neighbour) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto &A = Arenas[K];
+
+  // Take [Offset, Offset + Size) out of the free range [Begin, End).
+  auto Carve = [&](uint64_t Begin, uint64_t End, uint64_t Offset) {
+    if (Offset != Begin)
+      A.Free[Begin] = Offset - Begin;
+    if (Offset + Size != End)
+      A.Free[Offset + Size] = End - (Offset + Size);
+    return Offset;
+  };
+  auto FitsAt = [&](uint64_t Begin, uint64_t End) {
+    return alignTo(Begin, Alignment) + Size <= End;
+  };
+
+  std::optional<uint64_t> Offset;
+  if (!Neighbour) {
+    // First fit among the free ranges, then the top of the arena.
+    for (auto I = A.Free.begin(), E = A.Free.end(); I != E; ++I) {
+      uint64_t Begin = I->first, End = I->first + I->second;
+      if (!FitsAt(Begin, End))
+        continue;
+      A.Free.erase(I);
+      Offset = Carve(Begin, End, alignTo(Begin, Alignment));
+      break;
+    }
+  } else {
+    // Closest fit: the first free range that fits after the neighbour, as
+    // low in it as possible, or the first before it, as high as possible.
+    // The neighbour is in use, so no free range overlaps it.
+    auto [NBegin, NEnd] = *Neighbour;
+    auto After = A.Free.lower_bound(NEnd);
+    while (After != A.Free.end() &&
+           !FitsAt(After->first, After->first + After->second))
+      ++After;
+    std::optional<uint64_t> AfterOffset;
+    if (After != A.Free.end())
+      AfterOffset = alignTo(After->first, Alignment);
+    else if (FitsAt(A.Top, A.End))
+      AfterOffset = alignTo(A.Top, Alignment);
+
+    auto Before = A.Free.lower_bound(NBegin);
+    std::optional<uint64_t> BeforeOffset;
+    while (Before != A.Free.begin()) {
+      --Before;
+      uint64_t End = Before->first + Before->second;
+      if (FitsAt(Before->first, End)) {
+        BeforeOffset = alignDown(End - Size, Alignment);
+        break;
+      }
+    }
+
+    if (BeforeOffset &&
+        (!AfterOffset ||
+         NBegin - (*BeforeOffset + Size) < *AfterOffset - NEnd)) {
+      uint64_t Begin = Before->first, End = Begin + Before->second;
+      A.Free.erase(Before);
+      Offset = Carve(Begin, End, *BeforeOffset);
+      if (NBegin - (*Offset + Size) < PageSize)
+        ++S.Placed;
+    } else if (AfterOffset) {
+      if (After != A.Free.end()) {
+        uint64_t Begin = After->first, End = Begin + After->second;
+        A.Free.erase(After);
+        Offset = Carve(Begin, End, *AfterOffset);
+      } else {
+        uint64_t Begin = A.Top;
+        A.Top = *AfterOffset + Size;
+        Offset = Carve(Begin, A.Top, *AfterOffset);
+      }
+      if (*Offset - NEnd < PageSize)
+        ++S.Placed;
+    }
+  }
+  if (!Offset) {
+    uint64_t Begin = A.Top;
+    if (!FitsAt(Begin, A.End))
+      return std::nullopt;
+    A.Top = alignTo(Begin, Alignment) + Size;
+    Offset = Carve(Begin, A.Top, alignTo(Begin, Alignment));
+  }
+
+  S.BytesInUse += Size;
+  S.PeakBytesInUse = std::max(S.PeakBytesInUse, S.BytesInUse);
+  return Offset;
+}
+
+void SlabMemoryManager::release(ArrayRef<Block> Blocks) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (auto &B : Blocks) {
+    addFreeRange(Arenas[B.Kind], B.Offset, B.Size);
+    S.BytesInUse -= B.Size;
+  }
+}
+
+void SlabMemoryManager::addFreeRange(Arena &A, uint64_t Offset,
+                                     uint64_t Size) {
+  // Merge with the neighbouring free ranges.
+  auto Next = A.Free.lower_bound(Offset);
+  if (Next != A.Free.end() && Offset + Size == Next->first) {
+    Size += Next->second;
+    Next = A.Free.erase(Next);
+  }
+  if (Next != A.Free.begin()) {
+    auto Prev = std::prev(Next);
+    if (Prev->first + Prev->second == Offset) {
+      Offset = Prev->first;
+      Size += Prev->second;
+      A.Free.erase(Prev);
+    }
+  }
+
+  uint64_t End = Offset + Size;
+  if (End == A.Top)
+    A.Top = Offset;
+  else
+    A.Free[Offset] = Size;
+
+#ifdef __linux__
+  // The pages are zero-filled again if they are reused.
+  // Nothing above the top of the arena is in use, and arenas are made of
+  // whole pages.
+  uint64_t PagesBegin = alignTo(Offset, PageSize);
+  uint64_t PagesEnd =
+      Offset == A.Top ? alignTo(End, PageSize) : alignDown(End, PageSize);
+  if (PagesBegin < PagesEnd)
+    fallocate(FD, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, PagesBegin,
+              PagesEnd - PagesBegin);
+#endif
+}
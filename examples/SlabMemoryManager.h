@@ -0,0 +1,152 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef SLAB_MEMORY_MANAGER_H
+#define SLAB_MEMORY_MANAGER_H
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/FunctionExtras.h"
+#include "llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h"
+#include "llvm/Support/Error.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+/// SlabMemoryManager - A JITLink memory manager that sub-allocates the code
+/// and data of every linked object from one address range reserved up front.
+///
+/// The default InProcessMemoryManager maps fresh pages for every object and
+/// mprotects each of its segments, so a module with one small function costs
+/// a few pages, a few syscalls and as many TLB entries. Here the range is
+/// split into an executable, a read-only and a read-write arena, each of
+/// which is protected once when the slab is created, and segments are packed
+/// into their arena at 16-byte rather than page granularity.
+///
+/// The slab is a memory file mapped twice: the linker writes through a
+/// read-write view, and code runs from a second view at the addresses it was
+/// linked for, so nothing is ever remapped or mprotected after creation.
+/// Freed pages are returned to the system. Objects that do not fit into what
+/// is left of an arena fall back to an InProcessMemoryManager, with copies of
+/// the constants they refer to in the slab (see allocateConstant), which
+/// their code may be too far away from to reach.
+///
+/// Code goes to the lowest addresses that fit, unless a placement function
+/// names other code to put it next to (see setCodePlacement).
+///
+/// Linux only (memfd_create).
+class SlabMemoryManager : public llvm::jitlink::JITLinkMemoryManager {
+public:
+  /// Stats - How much of the slab is used.
+  struct Stats {
+    uint64_t Allocations = 0; // Objects allocated in the slab.
+    uint64_t Fallbacks = 0;   // Objects that did not fit.
+    uint64_t BytesInUse = 0;
+    uint64_t PeakBytesInUse = 0;
+    /// Objects whose code went less than a page away from the code that the
+    /// placement function named (see setCodePlacement).
+    uint64_t Placed = 0;
+  };
+
+  /// CodePlacementFunction - Returns the code that the code of a graph
+  /// should go next to, if any.
+  using CodePlacementFunction = llvm::unique_function<
+      std::optional<llvm::orc::ExecutorAddrRange>(llvm::jitlink::LinkGraph &)>;
+
+  /// Create a memory manager with a slab of SlabBytes, which must be under
+  /// 2GB so that the small code model reaches everything in it.
+  static llvm::Expected<std::unique_ptr<SlabMemoryManager>>
+  Create(uint64_t SlabBytes);
+
+  ~SlabMemoryManager() override;
+
+  void allocate(const llvm::jitlink::JITLinkDylib *JD,
+                llvm::jitlink::LinkGraph &G,
+                OnAllocatedFunction OnAllocated) override;
+  using JITLinkMemoryManager::allocate;
+
+  void deallocate(std::vector<FinalizedAlloc> Allocs,
+                  OnDeallocatedFunction OnDeallocated) override;
+  using JITLinkMemoryManager::deallocate;
+
+  Stats getStats();
+
+  /// Place the code of every graph as close as possible to the code that
+  /// Placement returns for it, so that code that runs together shares cache
+  /// lines and pages. Must be set before anything is allocated.
+  void setCodePlacement(CodePlacementFunction Placement);
+
+  /// Copy Content into the read-only part of the slab, aligned to
+  /// Alignment, until it is released. Returns std::nullopt if there is
+  /// no room. Graphs refer to the copy through an absolute symbol.
+  std::optional<llvm::orc::ExecutorAddr>
+  allocateConstant(llvm::ArrayRef<char> Content, uint64_t Alignment);
+  void releaseConstant(llvm::orc::ExecutorAddr Addr, uint64_t Size);
+
+private:
+  class InFlightAlloc;
+
+  enum ArenaKind { Code, ReadOnly, ReadWrite, NumArenas };
+
+  /// Arena - The part of the slab used for one kind of segment. Offsets are
+  /// from the start of the slab.
+  struct Arena {
+    uint64_t Begin = 0, End = 0;
+    uint64_t Top = 0; // Everything from here to End is unused.
+    std::map<uint64_t, uint64_t> Free; // Free ranges below Top, by offset.
+  };
+
+  /// Block - A range of the slab handed out for one segment.
+  struct Block {
+    ArenaKind Kind;
+    uint64_t Offset;
+    uint64_t Size;
+  };
+
+  /// Allocation - A finalized object, which FinalizedAlloc points at.
+  struct Allocation {
+    std::vector<Block> Blocks;
+    std::vector<llvm::orc::shared::WrapperFunctionCall> DeallocActions;
+  };
+
+  SlabMemoryManager(int FD, char *ExecBase, char *WorkingBase,
+                    uint64_t SlabBytes,
+                    std::unique_ptr<JITLinkMemoryManager> Fallback);
+
+  /// Take Size bytes aligned to Alignment from arena K, if there is room:
+  /// the lowest that fit or, given the offsets of a Neighbour, the closest to
+  /// it.
+  std::optional<uint64_t>
+  take(ArenaKind K, uint64_t Size, uint64_t Alignment,
+       std::optional<std::pair<uint64_t, uint64_t>> Neighbour = std::nullopt);
+
+  /// Point the references in G to constants in the slab at copies of them
+  /// in a section of G's own, for G to be allocated outside the slab.
+  void copyConstantsInto(llvm::jitlink::LinkGraph &G);
+
+  /// Return the blocks to their arenas.
+  void release(llvm::ArrayRef<Block> Blocks);
+
+  /// Add [Offset, Offset + Size) to A's free ranges, and give the whole
+  /// pages in the range that results back to the system.
+  void addFreeRange(Arena &A, uint64_t Offset, uint64_t Size);
+
+  int FD;
+  char *ExecBase;    // The view that code runs from.
+  char *WorkingBase; // The read-write view that the linker writes to.
+  uint64_t SlabBytes;
+  uint64_t PageSize;
+  std::unique_ptr<JITLinkMemoryManager> Fallback;
+  CodePlacementFunction Placement;
+
+  std::mutex Mutex;
+  Arena Arenas[NumArenas];
+  llvm::DenseSet<Allocation *> Live;
+  Stats S;
+};
+
+#endif // SLAB_MEMORY_MANAGER_H
@@ -0,0 +1,151 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "SpeculationLayer.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+/// ObservingStubsManager - Forwards everything to the underlying stubs manager
+/// but reports pointer updates, which the lazy call-through manager makes the
+/// first time each function is called.
+class SpeculationLayer::ObservingStubsManager : public IndirectStubsManager {
+public:
+  ObservingStubsManager(SpeculationLayer &Layer, IndirectStubsManager &ISM)
+      : Layer(Layer), ISM(ISM) {}
+
+  Error createStub(StringRef StubName, ExecutorAddr StubAddr,
+                   JITSymbolFlags StubFlags) override {
+    return ISM.createStub(StubName, StubAddr, StubFlags);
+  }
+
+  Error createStubs(const StubInitsMap &StubInits) override {
+    return ISM.createStubs(StubInits);
+  }
+
+  ExecutorSymbolDef findStub(StringRef Name, bool ExportedStubsOnly) override {
+    return ISM.findStub(Name, ExportedStubsOnly);
+  }
+
+  ExecutorSymbolDef findPointer(StringRef Name) override {
+    return ISM.findPointer(Name);
+  }
+
+  Error updatePointer(StringRef Name, ExecutorAddr NewAddr) override {
+    Layer.notifyFirstCall(Name);
+    return ISM.updatePointer(Name, NewAddr);
+  }
+
+private:
+  SpeculationLayer &Layer;
+  IndirectStubsManager &ISM;
+};
+
+SpeculationLayer::SpeculationLayer(KaleidoscopeJIT &J, IRLayer &BaseLayer,
+                                   IndirectStubsManager &ISM)
+    : IRLayer(*J.ES, BaseLayer.getManglingOptions()), J(J),
+      BaseLayer(BaseLayer),
+      Stubs(std::make_unique<ObservingStubsManager>(*this, ISM)) {}
+
+SpeculationLayer::~SpeculationLayer() {
+  // Queued compiles reference this layer and the JIT, so let them finish.
+  Workers.wait();
+}
+
+void SpeculationLayer::addFunction(StringRef Name, StringRef ImplName,
+                                   ArrayRef<std::string> Callees) {
+  std::lock_guard<std::mutex> Lock(InfoMutex);
+  // A redefinition starts over with the new body's callees.
+  auto &Info = Functions[*J.Mangle(Name)];
+  if (Info.ImplName)
+    ImplToName.erase(Info.ImplName);
+  Info = FunctionInfo();
+  Info.ImplName = J.Mangle(ImplName);
+  for (auto &Callee : Callees)
+    if (Callee != Name)
+      Info.Callees.push_back((*J.Mangle(Callee)).str());
+  ImplToName[Info.ImplName] = (*J.Mangle(Name)).str();
+}
+
+void SpeculationLayer::emit(std::unique_ptr<MaterializationResponsibility> R,
+                            ThreadSafeModule TSM) {
+  // Queue the callees of every function body in this module before handing
+  // it on, so that they compile in parallel with it.
+  std::vector<std::string> ToSpeculate;
+  {
+    std::lock_guard<std::mutex> Lock(InfoMutex);
+    for (auto &KV : R->getSymbols()) {
+      auto NameI = ImplToName.find(KV.first);
+      if (NameI == ImplToName.end())
+        continue;
+      auto &Info = Functions[NameI->second];
+      ToSpeculate.insert(ToSpeculate.end(), Info.Callees.begin(),
+                         Info.Callees.end());
+    }
+  }
+
+  for (auto &Callee : ToSpeculate)
+    speculate(Callee);
+
+  BaseLayer.emit(std::move(R), std::move(TSM));
+}
+
+void SpeculationLayer::speculate(StringRef Name) {
+  SymbolStringPtr ImplName;
+  {
+    std::lock_guard<std::mutex> Lock(InfoMutex);
+    auto I = Functions.find(Name);
+    // Skip callees that have not been defined yet, are already being (or have
+    // been) speculated, or have already been called and compiled for real.
+    if (I == Functions.end() || I->second.State != SpecState::None ||
+        I->second.Called)
+      return;
+    I->second.State = SpecState::Pending;
+    ImplName = I->second.ImplName;
+  }
+
+  Workers.async([this, Name = Name.str(), ImplName]() {
+    // Errors are not ours to report: the real call will run into them again.
+    bool Compiled = true;
+    if (auto Sym = J.ES->lookup(&J.MainJD, ImplName); !Sym) {
+      consumeError(Sym.takeError());
+      Compiled = false;
+    }
+
+    // If the function was redefined meanwhile, its entry now describes the
+    // new body, which this compile says nothing about.
+    std::lock_guard<std::mutex> Lock(InfoMutex);
+    auto I = Functions.find(Name);
+    if (I == Functions.end() || I->second.ImplName != ImplName)
+      return;
+    I->second.State = Compiled ? SpecState::Compiled : SpecState::Failed;
+  });
+}
+
+void SpeculationLayer::notifyFirstCall(StringRef Name) {
+  std::lock_guard<std::mutex> Lock(InfoMutex);
+  auto I = Functions.find(Name);
+  if (I == Functions.end())
+    return;
+  I->second.Called = true;
+  I->second.CompiledBeforeCall = I->second.State == SpecState::Compiled;
+}
+
+SpeculationLayer::Stats SpeculationLayer::getStats() {
+  std::lock_guard<std::mutex> Lock(InfoMutex);
+  Stats S;
+  for (auto &KV : Functions) {
+    auto &Info = KV.second;
+    if (Info.State == SpecState::None)
+      continue;
+    ++S.Speculated;
+    if (Info.State == SpecState::Failed)
+      ++S.Failed;
+    else if (!Info.Called)
+      ++S.Unused;
+    else if (Info.CompiledBeforeCall)
+      ++S.Hits;
+    else
+      ++S.Late;
+  }
+  return S;
+}
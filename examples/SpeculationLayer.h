@@ -0,0 +1,88 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef SPECULATION_LAYER_H
+#define SPECULATION_LAYER_H
+
+#include "Kaleidoscope.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/Layer.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// SpeculationLayer - An IRLayer for the lazy drivers that, whenever a
+/// function body is emitted, queues compilation of the functions it calls
+/// (according to the static call graph recorded by the parser) on a pool of
+/// worker threads. By the time a callee's lazy-reexport trampoline is first
+/// hit, its body is usually compiled already and the call-through manager only
+/// has to patch the stub.
+///
+/// To tell speculation hits from wasted compiles the layer also provides an
+/// IndirectStubsManager wrapper (getStubsManager()) that should be passed to
+/// lazyReexports: the call-through manager updates a stub's pointer exactly
+/// once, when the function is first called.
+class SpeculationLayer : public llvm::orc::IRLayer {
+public:
+  struct Stats {
+    unsigned Speculated = 0; // Speculative compiles issued.
+    unsigned Hits = 0;       // Compiled before the function's first call.
+    unsigned Late = 0;       // First call arrived while still compiling.
+    unsigned Unused = 0;     // Compiled but not called (yet).
+    unsigned Failed = 0;     // Did not compile.
+  };
+
+  SpeculationLayer(KaleidoscopeJIT &J, llvm::orc::IRLayer &BaseLayer,
+                   llvm::orc::IndirectStubsManager &ISM);
+  ~SpeculationLayer();
+
+  /// Register a lazily compiled function: Name is the stub that callers use,
+  /// ImplName the symbol that holds the body, and Callees the (stub) names
+  /// of the functions called from the body. Adding a function again (when
+  /// it is redefined) replaces its callees and resets its statistics.
+  void addFunction(llvm::StringRef Name, llvm::StringRef ImplName,
+                   llvm::ArrayRef<std::string> Callees);
+
+  void emit(std::unique_ptr<llvm::orc::MaterializationResponsibility> R,
+            llvm::orc::ThreadSafeModule TSM) override;
+
+  /// The stubs manager to hand to lazyReexports.
+  llvm::orc::IndirectStubsManager &getStubsManager() { return *Stubs; }
+
+  Stats getStats();
+
+private:
+  class ObservingStubsManager;
+
+  // Failed speculations are not retried; the first call reports the error.
+  enum class SpecState { None, Pending, Compiled, Failed };
+
+  struct FunctionInfo {
+    llvm::orc::SymbolStringPtr ImplName;
+    std::vector<std::string> Callees;
+    SpecState State = SpecState::None;
+    bool Called = false;
+    bool CompiledBeforeCall = false;
+  };
+
+  void speculate(llvm::StringRef Name);
+  void notifyFirstCall(llvm::StringRef Name);
+
+  KaleidoscopeJIT &J;
+  llvm::orc::IRLayer &BaseLayer;
+  std::unique_ptr<llvm::orc::IndirectStubsManager> Stubs;
+
+  std::mutex InfoMutex;
+  llvm::StringMap<FunctionInfo> Functions;          // Keyed by stub name.
+  llvm::DenseMap<llvm::orc::SymbolStringPtr, std::string> ImplToName;
+
+  llvm::ThreadPool Workers;
+};
+
+#endif // SPECULATION_LAYER_H
@@ -0,0 +1,207 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#include "TieredCompileLayer.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+TieredCompileLayer::TieredCompileLayer(KaleidoscopeJIT &J,
+                                       IndirectStubsManager &ISM,
+                                       uint64_t Threshold)
+    : IRLayer(*J.ES, J.CompileLayer.getManglingOptions()), J(J), ISM(ISM),
+      Threshold(Threshold), TierUpThread(hardware_concurrency(1)) {
+  assert(Threshold > 0 && "Tier-up threshold must be non-zero");
+  J.ES->registerResourceManager(*this);
+}
+
+TieredCompileLayer::~TieredCompileLayer() {
+  // Tier-up jobs reference the records and the JIT, so let them finish.
+  TierUpThread.wait();
+  J.ES->deregisterResourceManager(*this);
+}
+
+void TieredCompileLayer::emit(std::unique_ptr<MaterializationResponsibility> R,
+                              ThreadSafeModule TSM) {
+  std::vector<std::string> ImplNames;
+  std::vector<std::shared_ptr<FunctionRecord>> NewRecords;
+  TSM.withModuleDo([&](Module &M) {
+    for (auto &F : M)
+      if (!F.isDeclaration() && F.getName().endswith("$impl"))
+        ImplNames.push_back(F.getName().str());
+  });
+
+  for (auto &ImplName : ImplNames) {
+    auto Rec = std::make_shared<FunctionRecord>();
+    Rec->Layer = this;
+    Rec->ImplName = ImplName;
+    Rec->StubName = StringRef(ImplName).split('$').first.str();
+
+    // Keep a copy of the unoptimized IR for this function (and declarations
+    // for everything it references) to re-optimize later, along with the
+    // host functions that it may inline (see HostIRLibrary).
+    Rec->SavedTSM = cloneToNewContext(TSM, [&](const GlobalValue &GV) {
+      return GV.getName() == ImplName || GV.hasAvailableExternallyLinkage();
+    });
+
+    TSM.withModuleDo(
+        [&](Module &M) { instrument(*M.getFunction(ImplName), *Rec); });
+
+    // The instrumented object embeds addresses from this process.
+    if (J.ObjCache)
+      J.ObjCache->forget(ImplName);
+
+    NewRecords.push_back(std::move(Rec));
+  }
+
+  if (auto Err = R->withResourceKeyDo([&](ResourceKey K) {
+        std::lock_guard<std::mutex> Lock(RecordsMutex);
+        auto &KeyRecords = Records[K];
+        for (auto &Rec : NewRecords) {
+          CurrentRecords[Rec->StubName] = Rec.get();
+          KeyRecords.push_back(Rec);
+        }
+      })) {
+    getExecutionSession().reportError(std::move(Err));
+    R->failMaterialization();
+    return;
+  }
+
+  // Tier 0: optimized as -O<n> or -passes say, like any other module.
+  J.OptimizeLayer.emit(std::move(R), std::move(TSM));
+}
+
+// Insert the following at the start of F (after its allocas):
+//
+//   %old = atomicrmw add ptr <&Rec.Count>, i64 1 monotonic
+//   %hot = icmp eq i64 %old, <Threshold - 1>
+//   br i1 %hot, label %tierup, label %entry.split
+// tierup:
+//   call void <&requestTierUp>(ptr <&Rec>)
+//   br label %entry.split
+void TieredCompileLayer::instrument(Function &F, FunctionRecord &Rec) {
+  LLVMContext &Ctx = F.getContext();
+  auto *PtrTy = PointerType::getUnqual(Ctx);
+
+  BasicBlock &Entry = F.getEntryBlock();
+  auto IP = Entry.getFirstInsertionPt();
+  while (isa<AllocaInst>(*IP))
+    ++IP;
+
+  IRBuilder<> Builder(&Entry, IP);
+  auto *CounterPtr = ConstantExpr::getIntToPtr(
+      Builder.getInt64(ExecutorAddr::fromPtr(&Rec.Count).getValue()), PtrTy);
+  Value *OldCount =
+      Builder.CreateAtomicRMW(AtomicRMWInst::Add, CounterPtr,
+                              Builder.getInt64(1), MaybeAlign(8),
+                              AtomicOrdering::Monotonic);
+  Value *IsHot =
+      Builder.CreateICmpEQ(OldCount, Builder.getInt64(Threshold - 1), "hot");
+
+  Instruction *ThenTerm = SplitBlockAndInsertIfThen(
+      IsHot, &*Builder.GetInsertPoint(), /*Unreachable=*/false,
+      MDBuilder(Ctx).createBranchWeights(1, 1000));
+
+  Builder.SetInsertPoint(ThenTerm);
+  auto *HookTy = FunctionType::get(Builder.getVoidTy(), {PtrTy}, false);
+  auto *HookPtr = ConstantExpr::getIntToPtr(
+      Builder.getInt64(ExecutorAddr::fromPtr(&requestTierUp).getValue()),
+      PtrTy);
+  auto *RecPtr = ConstantExpr::getIntToPtr(
+      Builder.getInt64(ExecutorAddr::fromPtr(&Rec).getValue()), PtrTy);
+  Builder.CreateCall(HookTy, HookPtr, {RecPtr});
+}
+
+// Called from JIT'd code on the thread that made the Threshold'th call. The
+// counter comparison fires exactly once per function, so there is no need to
+// guard against duplicate requests here.
+void TieredCompileLayer::requestTierUp(void *Ptr) {
+  auto &Rec = *static_cast<FunctionRecord *>(Ptr);
+  Rec.Layer->TierUpThread.async([Rec = Rec.shared_from_this()]() {
+    auto &Layer = *Rec->Layer;
+    if (auto Err = Layer.compileTier1(*Rec))
+      Layer.J.ES->reportError(std::move(Err));
+  });
+}
+
+Error TieredCompileLayer::compileTier1(FunctionRecord &Rec) {
+  std::string Tier1Name = Rec.ImplName + "$tier1";
+
+  ThreadSafeModule TSM = std::move(Rec.SavedTSM);
+  if (auto Err = TSM.withModuleDo([&](Module &M) {
+        M.getFunction(Rec.ImplName)->setName(Tier1Name);
+        return J.optimizeModule(M, 3);
+      }))
+    return Err;
+
+  // The tier 1 code is freed along with the function's record.
+  auto RT = J.MainJD.createResourceTracker();
+  {
+    std::lock_guard<std::mutex> Lock(RecordsMutex);
+    if (Rec.Removed)
+      return Error::success();
+    Rec.Tier1RT = RT;
+  }
+
+  if (auto Err = J.CompileLayer.add(RT, std::move(TSM)))
+    return Err;
+
+  auto Sym = J.ES->lookup(&J.MainJD, J.Mangle(Tier1Name));
+  if (!Sym)
+    return Sym.takeError();
+
+  // Leave the stub alone if the function was redefined in the meantime.
+  std::lock_guard<std::mutex> Lock(RecordsMutex);
+  if (Rec.Removed || CurrentRecords.lookup(Rec.StubName) != &Rec)
+    return Error::success();
+
+  // The stub pointer is a single aligned pointer-sized store, so threads
+  // currently calling through the stub see either the old or the new body.
+  if (auto Err = ISM.updatePointer(*J.Mangle(Rec.StubName), Sym->getAddress()))
+    return Err;
+
+  ++NumTierUps;
+  return Error::success();
+}
+
+Error TieredCompileLayer::handleRemoveResources(JITDylib &JD, ResourceKey K) {
+  std::vector<ResourceTrackerSP> Tier1RTs;
+  {
+    std::lock_guard<std::mutex> Lock(RecordsMutex);
+    auto I = Records.find(K);
+    if (I == Records.end())
+      return Error::success();
+    for (auto &Rec : I->second) {
+      Rec->Removed = true;
+      auto CurI = CurrentRecords.find(Rec->StubName);
+      if (CurI != CurrentRecords.end() && CurI->second == Rec.get())
+        CurrentRecords.erase(CurI);
+      if (Rec->Tier1RT)
+        Tier1RTs.push_back(std::move(Rec->Tier1RT));
+    }
+    Records.erase(I);
+  }
+
+  Error Err = Error::success();
+  for (auto &RT : Tier1RTs)
+    Err = joinErrors(std::move(Err), RT->remove());
+  return Err;
+}
+
+void TieredCompileLayer::handleTransferResources(JITDylib &JD,
+                                                 ResourceKey DstK,
+                                                 ResourceKey SrcK) {
+  std::lock_guard<std::mutex> Lock(RecordsMutex);
+  auto I = Records.find(SrcK);
+  if (I == Records.end())
+    return;
+  auto SrcRecords = std::move(I->second);
+  Records.erase(I);
+  auto &DstRecords = Records[DstK];
+  DstRecords.insert(DstRecords.end(), SrcRecords.begin(), SrcRecords.end());
+}
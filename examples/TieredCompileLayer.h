@@ -0,0 +1,89 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef TIERED_COMPILE_LAYER_H
+#define TIERED_COMPILE_LAYER_H
+
+#include "Kaleidoscope.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/Layer.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/// TieredCompileLayer - An IRLayer for the lazy drivers that emits every
+/// module at "tier 0" through the JIT's OptimizeLayer, i.e. at -O<n> or with
+/// the -passes pipeline (-O0 starts up fastest), with a call counter injected
+/// at the entry of each function body (<name>$impl, or <name>$<N>$impl for a
+/// redefinition, see HotPatcher).
+///
+/// When a counter reaches the threshold, the unoptimized IR saved for that
+/// body is renamed to <body>$tier1, optimized at -O3 and compiled on a
+/// background thread, and the indirect stub <name> that lazyReexports created
+/// in the given IndirectStubsManager is repointed at the new code. Callers
+/// pick up the tier 1 code on their next call through the stub.
+///
+/// Only the most recently emitted body of each function is tiered up, so a
+/// redefinition is never replaced by tier 1 code for an older body. Each
+/// body's record and tier 1 code belong to the resource tracker of the module
+/// that defined it, and are freed when that tracker is removed.
+///
+/// The counters and the tier-up hook are referenced by absolute address, so
+/// this layer only works with an in-process executor.
+class TieredCompileLayer : public llvm::orc::IRLayer,
+                           private llvm::orc::ResourceManager {
+public:
+  TieredCompileLayer(KaleidoscopeJIT &J, llvm::orc::IndirectStubsManager &ISM,
+                     uint64_t Threshold);
+  ~TieredCompileLayer();
+
+  void emit(std::unique_ptr<llvm::orc::MaterializationResponsibility> R,
+            llvm::orc::ThreadSafeModule TSM) override;
+
+  /// Number of functions that have been recompiled at tier 1.
+  unsigned getNumTierUps() const { return NumTierUps; }
+
+private:
+  struct FunctionRecord : std::enable_shared_from_this<FunctionRecord> {
+    TieredCompileLayer *Layer;
+    std::string ImplName;
+    std::string StubName;
+    llvm::orc::ThreadSafeModule SavedTSM; // Unoptimized, uninstrumented IR.
+    std::atomic<uint64_t> Count{0};
+
+    // Guarded by RecordsMutex.
+    bool Removed = false;
+    llvm::orc::ResourceTrackerSP Tier1RT;
+  };
+
+  static void requestTierUp(void *Rec);
+
+  void instrument(llvm::Function &F, FunctionRecord &Rec);
+  llvm::Error compileTier1(FunctionRecord &Rec);
+
+  llvm::Error handleRemoveResources(llvm::orc::JITDylib &JD,
+                                    llvm::orc::ResourceKey K) override;
+  void handleTransferResources(llvm::orc::JITDylib &JD,
+                               llvm::orc::ResourceKey DstK,
+                               llvm::orc::ResourceKey SrcK) override;
+
+  KaleidoscopeJIT &J;
+  llvm::orc::IndirectStubsManager &ISM;
+  uint64_t Threshold;
+
+  std::mutex RecordsMutex;
+  llvm::DenseMap<llvm::orc::ResourceKey,
+                 std::vector<std::shared_ptr<FunctionRecord>>>
+      Records;
+  llvm::StringMap<FunctionRecord *> CurrentRecords; // Keyed by stub name.
+  std::atomic<unsigned> NumTierUps{0};
+
+  llvm::ThreadPool TierUpThread;
+};
+
+#endif // TIERED_COMPILE_LAYER_H
@@ -0,0 +1,28 @@
+/* See the LICENSE file in the project root for license terms. */
+
+#ifndef BENCH_UTILS_H
+#define BENCH_UTILS_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+
+#include <cstdint>
+
+/// Current resident set size in MB, if known.
+inline double getRSSMB() {
+#ifdef __linux__
+  // The second field of /proc/self/statm is the resident size in pages.
+  if (auto Buf = llvm::MemoryBuffer::getFileAsStream("/proc/self/statm")) {
+    llvm::StringRef Resident =
+        (*Buf)->getBuffer().split(' ').second.split(' ').first;
+    uint64_t Pages;
+    if (!Resident.getAsInteger(10, Pages))
+      return double(Pages) * llvm::sys::Process::getPageSizeEstimate() /
+             (1 << 20);
+  }
+#endif
+  return 0;
+}
+
+#endif // BENCH_UTILS_H
@@ -0,0 +1,128 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Compares Kaleidoscope array kernels written as scalar for loops with the
+// same kernels written with the vector builtins (vsum, vadd).
+//
+// Usage: bench-arrays [-n=<elements>] [-repeat=<N>] [-O<n>]
+
+#include "Kaleidoscope.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::opt<unsigned>
+    NumElements("n", cl::desc("Number of elements per array"),
+                cl::init(1 << 16));
+
+static cl::opt<unsigned>
+    Repeat("repeat", cl::desc("Number of times to run each kernel"),
+           cl::init(2000));
+
+// Kaleidoscope for loops run their body once more after the end condition
+// becomes false, hence the "len(a) - 1".
+static const char *const Kernels[] = {
+    "def sumloop(a[]) var s = 0 in "
+    "(for i = 0, i < len(a) - 1 in s = s + a[i]) + s;",
+    "def sumvec(a[]) vsum(a);",
+    "def addloop(d[] a[] b[]) "
+    "for i = 0, i < len(d) - 1 in d[i] = a[i] + b[i];",
+    "def addvec(d[] a[] b[]) vadd(d, a, b);",
+};
+
+using SumFn = double (*)(double *, int64_t);
+using AddFn = double (*)(double *, int64_t, double *, int64_t, double *,
+                         int64_t);
+
+/// Run F Repeat times and return the elapsed time in seconds.
+template <typename FnT> static double timeRepeated(FnT F) {
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned R = 0; R != Repeat; ++R)
+    F();
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  return Elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope array kernels\n");
+
+  ExitOnError ExitOnErr("bench-arrays: ");
+
+  if (NumElements == 0) {
+    errs() << "bench-arrays: -n must be at least 1\n";
+    return 1;
+  }
+
+  auto J = ExitOnErr(KaleidoscopeJIT::Create(
+      ExitOnErr(KaleidoscopeJITOptions::fromCommandLine())));
+
+  KaleidoscopeParser P;
+  SymbolLookupSet Symbols;
+  for (StringRef Kernel : Kernels) {
+    auto ParseResult = P.parse(Kernel);
+    if (!ParseResult)
+      return 1;
+    std::string Name = ParseResult->FnAST->getName();
+    auto IRMod = P.codegen(std::move(ParseResult->FnAST), J->DL);
+    if (!IRMod)
+      return 1;
+    ExitOnErr(J->OptimizeLayer.add(J->MainJD, std::move(*IRMod)));
+    Symbols.add(J->Mangle(Name));
+  }
+  auto Syms = ExitOnErr(
+      J->ES->lookup(makeJITDylibSearchOrder(&J->MainJD), std::move(Symbols)));
+  auto SumLoop = Syms[J->Mangle("sumloop")].getAddress().toPtr<SumFn>();
+  auto SumVec = Syms[J->Mangle("sumvec")].getAddress().toPtr<SumFn>();
+  auto AddLoop = Syms[J->Mangle("addloop")].getAddress().toPtr<AddFn>();
+  auto AddVec = Syms[J->Mangle("addvec")].getAddress().toPtr<AddFn>();
+
+  int64_t N = NumElements;
+  std::vector<double> A(N), B(N), D(N);
+  for (int64_t I = 0; I != N; ++I) {
+    A[I] = I % 7;
+    B[I] = I % 5;
+  }
+
+  // Keep the results live so the calls cannot be dropped.
+  double Sink = 0;
+  double SumLoopTime = timeRepeated([&]() { Sink += SumLoop(A.data(), N); });
+  double SumVecTime = timeRepeated([&]() { Sink += SumVec(A.data(), N); });
+  double AddLoopTime = timeRepeated(
+      [&]() { Sink += AddLoop(D.data(), N, A.data(), N, B.data(), N); });
+  double AddVecTime = timeRepeated(
+      [&]() { Sink += AddVec(D.data(), N, A.data(), N, B.data(), N); });
+
+  // The inputs are small integers, so both sums are exact and must agree.
+  if (SumLoop(A.data(), N) != SumVec(A.data(), N)) {
+    errs() << "bench-arrays: vsum disagrees with the scalar loop\n";
+    return 1;
+  }
+
+  double MElems = double(N) * Repeat / 1e6;
+  outs() << formatv("{0,8} {1,12} {2,12} {3,12} {4,8}\n", "kernel",
+                    "loop (ms)", "vector (ms)", "Melem/s", "speedup");
+  outs() << formatv("{0,8} {1,12:f1} {2,12:f1} {3,12:f0} {4,8:f2}\n", "sum",
+                    SumLoopTime * 1000, SumVecTime * 1000, MElems / SumVecTime,
+                    SumLoopTime / SumVecTime);
+  outs() << formatv("{0,8} {1,12:f1} {2,12:f1} {3,12:f0} {4,8:f2}\n", "add",
+                    AddLoopTime * 1000, AddVecTime * 1000, MElems / AddVecTime,
+                    AddLoopTime / AddVecTime);
+  outs() << formatv("checksum: {0}\n", Sink);
+
+  return 0;
+}
@@ -0,0 +1,127 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Measures the memory cost of Kaleidoscope ASTs: heap allocations made while
+// parsing and generating code for a large script, the heap held by the parsed
+// ASTs, and peak RSS.
+//
+// Usage: bench-ast-memory [file] [-n=<defs>]
+//
+// Without an input file a program with -n definitions is generated.
+
+#include "Kaleidoscope.h"
+
+#include "llvm/IR/DataLayout.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
+
+using namespace llvm;
+
+// Count every allocation made through the global operator new.
+static std::atomic<size_t> NumAllocs(0);
+static std::atomic<size_t> NumAllocBytes(0);
+
+void *operator new(size_t Size) {
+  ++NumAllocs;
+  NumAllocBytes += Size;
+  if (void *Mem = std::malloc(Size ? Size : 1))
+    return Mem;
+  report_bad_alloc_error("operator new failed");
+}
+
+void operator delete(void *Mem) noexcept { std::free(Mem); }
+void operator delete(void *Mem, size_t) noexcept { std::free(Mem); }
+
+static cl::opt<std::string> InputFile(cl::Positional,
+                                      cl::desc("[input file]"), cl::init(""));
+
+static cl::opt<unsigned>
+    NumDefs("n",
+            cl::desc("Number of definitions to generate if no input file is "
+                     "given"),
+            cl::init(20000));
+
+static std::string generateProgram(unsigned N) {
+  std::string Src;
+  raw_string_ostream OS(Src);
+  for (unsigned I = 0; I != N; ++I)
+    OS << "def f" << I << "(x y) var s = 0, t = x * y in "
+       << "(for i = 0, i < x in s = s + i * y + f" << (I ? I - 1 : 0)
+       << "(t, i)) + s;\n";
+  return OS.str();
+}
+
+/// Peak resident set size in MB, if known.
+static double getPeakRSSMB() {
+#ifdef LLVM_ON_UNIX
+  struct rusage RU;
+  if (getrusage(RUSAGE_SELF, &RU) == 0)
+    return RU.ru_maxrss / 1024.0; // ru_maxrss is in KB on Linux.
+#endif
+  return 0;
+}
+
+/// Snapshot of the allocation counters and heap usage.
+struct MemStats {
+  size_t Allocs = NumAllocs;
+  size_t AllocBytes = NumAllocBytes;
+  size_t HeapBytes = sys::Process::GetMallocUsage();
+};
+
+static void report(StringRef Phase, const MemStats &Before) {
+  MemStats After;
+  outs() << formatv("{0,-10} {1,12} {2,14:f1} {3,14:f1}\n", Phase,
+                    After.Allocs - Before.Allocs,
+                    (After.AllocBytes - Before.AllocBytes) / 1e6,
+                    (double(After.HeapBytes) - double(Before.HeapBytes)) / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope AST memory usage\n");
+
+  ExitOnError ExitOnErr("bench-ast-memory: ");
+
+  std::string Src;
+  if (InputFile.empty())
+    Src = generateProgram(NumDefs);
+  else
+    Src = ExitOnErr(errorOrToExpected(MemoryBuffer::getFileOrSTDIN(InputFile)))
+              ->getBuffer()
+              .str();
+
+  outs() << formatv("{0,-10} {1,12} {2,14} {3,14}\n", "phase", "allocations",
+                    "allocated (MB)", "heap delta (MB)");
+
+  KaleidoscopeParser P;
+  MemStats Start;
+  auto Script = ExitOnErr(P.parseScript(Src, /*BatchSize=*/1024));
+  report("parse", Start);
+
+  // Generate code a batch at a time, dropping each module (and the batch's
+  // ASTs) as soon as it is done. The "total" heap delta is what the parser
+  // keeps after all ASTs are gone.
+  DataLayout DL("");
+  MemStats BeforeCodegen;
+  for (auto &Batch : Script.Batches)
+    if (!P.codegen(std::move(Batch), DL))
+      return 1;
+  report("codegen", BeforeCodegen);
+  report("total", Start);
+
+  outs() << formatv("source: {0:f1} MB, peak RSS: {1:f1} MB\n",
+                    Src.size() / 1e6, getPeakRSSMB());
+  return 0;
+}
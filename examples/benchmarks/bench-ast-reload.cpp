@@ -0,0 +1,148 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Compares loading a script from an AST file (see KaleidoscopeASTFile) with
+// parsing its source: the time to parse the source, to open the AST file and
+// install its prototypes, and to also materialize every function. Checks that
+// the materialized functions print the same as the parsed ones.
+//
+// Usage: bench-ast-reload [file] [-n=<defs>] [-repeat=<N>]
+//
+// Without an input file a program with -n definitions is generated.
+
+#include "Kaleidoscope.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <chrono>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFile(cl::Positional,
+                                      cl::desc("[input file]"), cl::init(""));
+
+static cl::opt<unsigned>
+    NumDefs("n",
+            cl::desc("Number of definitions to generate if no input file is "
+                     "given"),
+            cl::init(20000));
+
+static cl::opt<unsigned>
+    Repeat("repeat", cl::desc("Number of times to load the input"),
+           cl::init(10));
+
+static std::string generateProgram(unsigned N) {
+  std::string Src;
+  raw_string_ostream OS(Src);
+  OS << "def binary | 5 (a b) if a then 1 else if b then 1 else 0;\n";
+  for (unsigned I = 0; I != N; ++I)
+    OS << "def f" << I << "(x y) # definition " << I << "\n"
+       << "  var s = 0, a[4] in (for i = 0, i < x in s = s + i * y + " << I
+       << ".25) + a[1] + s | f" << (I ? I - 1 : 0) << "(s, y);\n";
+  OS << "f" << (N ? N - 1 : 0) << "(2, 3);\n";
+  return OS.str();
+}
+
+/// Run F Repeat times and return the elapsed time in seconds.
+template <typename FnT> static Expected<double> timeRepeated(FnT F) {
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned R = 0; R != Repeat; ++R)
+    if (auto Err = F())
+      return std::move(Err);
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  return Elapsed.count();
+}
+
+/// Print the definitions of Script, which do not depend on the fresh names
+/// given to top-level expressions.
+static std::string printDefinitions(const KaleidoscopeScript &Script) {
+  std::string Out;
+  raw_string_ostream OS(Out);
+  for (auto &Batch : Script.Batches)
+    for (auto &FnAST : Batch) {
+      FnAST->print(OS);
+      for (auto &Callee : FnAST->getCallees())
+        OS << ' ' << Callee;
+      for (StringRef Var : FnAST->getAssignedVars())
+        OS << " =" << Var;
+      OS << '\n';
+    }
+  return OS.str();
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope AST reload time\n");
+
+  ExitOnError ExitOnErr("bench-ast-reload: ");
+
+  std::string Src;
+  if (InputFile.empty())
+    Src = generateProgram(NumDefs);
+  else
+    Src = ExitOnErr(errorOrToExpected(MemoryBuffer::getFileOrSTDIN(InputFile)))
+              ->getBuffer()
+              .str();
+
+  SmallString<128> ASTPath;
+  if (auto EC = sys::fs::createTemporaryFile("bench-ast-reload", "kast",
+                                             ASTPath))
+    ExitOnErr(createFileError(ASTPath, EC));
+  FileRemover RemoveAST(ASTPath);
+
+  std::string Parsed;
+  {
+    KaleidoscopeParser P;
+    auto Script = ExitOnErr(P.parseScript(Src, /*BatchSize=*/1024));
+    ExitOnErr(Script.save(P, ASTPath));
+    Parsed = printDefinitions(Script);
+  }
+
+  double ParseTime = ExitOnErr(timeRepeated([&]() -> Error {
+    KaleidoscopeParser P;
+    return P.parseScript(Src, /*BatchSize=*/1024).takeError();
+  }));
+
+  double IndexTime = ExitOnErr(timeRepeated([&]() -> Error {
+    KaleidoscopeParser P;
+    auto File = KaleidoscopeASTFile::open(ASTPath);
+    if (!File)
+      return File.takeError();
+    return (*File)->loadPrototypes(P);
+  }));
+
+  double LoadTime = ExitOnErr(timeRepeated([&]() -> Error {
+    KaleidoscopeParser P;
+    return KaleidoscopeScript::load(P, ASTPath).takeError();
+  }));
+
+  KaleidoscopeParser P;
+  auto Loaded = ExitOnErr(KaleidoscopeScript::load(P, ASTPath));
+  if (printDefinitions(Loaded) != Parsed) {
+    errs() << "bench-ast-reload: loaded definitions differ from the parsed "
+              "ones\n";
+    return 1;
+  }
+
+  uint64_t ASTSize = 0;
+  ExitOnErr(errorCodeToError(sys::fs::file_size(ASTPath, ASTSize)));
+
+  outs() << formatv("{0,-10} {1,12} {2,10}\n", "phase", "time (ms)",
+                    "speedup");
+  auto Report = [&](StringRef Phase, double Time) {
+    outs() << formatv("{0,-10} {1,12:f2} {2,9:f1}x\n", Phase,
+                      Time * 1000 / Repeat, ParseTime / Time);
+  };
+  Report("parse", ParseTime);
+  Report("prototypes", IndexTime);
+  Report("load", LoadTime);
+  outs() << formatv("source: {0:f2} MB, AST file: {1:f2} MB\n",
+                    Src.size() / 1e6, ASTSize / 1e6);
+  return 0;
+}
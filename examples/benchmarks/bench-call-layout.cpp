@@ -0,0 +1,250 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Measures what laying out code by call profile (-jit-call-profile) does for
+// functions whose callees were linked earlier, with other code in between.
+// Each session links n callees, each followed by a large function that is
+// then removed again, as evaluated expressions and redefinitions are, and
+// then n callers of one callee each, all into a slab. A first session
+// records a call profile, which a second one lays out the callers by
+// without counting calls (-jit-call-profile-layout-only); a third one does
+// without a profile. Reports how far apart callers and callees are, and the
+// time per call of the callers, which call their callee twice.
+//
+// Usage: bench-call-layout [-n=<pairs>] [-rounds=<N>] [-slab-size=<MiB>]
+
+#include "Kaleidoscope.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::opt<unsigned> NumPairs("n",
+                                  cl::desc("Number of callers and callees"),
+                                  cl::init(2000));
+
+static cl::opt<unsigned> Rounds("rounds",
+                                cl::desc("Number of times to call every "
+                                         "caller"),
+                                cl::init(1000));
+
+static cl::opt<unsigned>
+    SlabSize("slab-size", cl::desc("Size of the slab in MiB"), cl::init(64));
+
+/// The terms of the functions between the callees.
+static constexpr unsigned FillerTerms = 100;
+
+/// Objects - The objects linked in every session, one function each.
+struct Objects {
+  std::vector<std::unique_ptr<MemoryBuffer>> Callees, Fillers, Callers;
+};
+
+static Expected<Objects> compileObjects() {
+  auto J = KaleidoscopeJIT::Create();
+  if (!J)
+    return J.takeError();
+  auto TM = (*J)->JTMB.createTargetMachine();
+  if (!TM)
+    return TM.takeError();
+  SimpleCompiler Compile(**TM);
+
+  KaleidoscopeParser P;
+  auto CompileDef =
+      [&](const std::string &Source,
+          std::vector<std::unique_ptr<MemoryBuffer>> &Into) -> Error {
+    auto ParseResult = P.parse(Source);
+    if (!ParseResult)
+      return make_error<StringError>("cannot parse " + Source,
+                                     inconvertibleErrorCode());
+    auto TSM = P.codegen(std::move(ParseResult->FnAST), (*J)->DL);
+    if (!TSM)
+      return make_error<StringError>("cannot compile " + Source,
+                                     inconvertibleErrorCode());
+    auto Obj = TSM->withModuleDo([&](Module &M) { return Compile(M); });
+    if (!Obj)
+      return Obj.takeError();
+    Into.push_back(std::move(*Obj));
+    return Error::success();
+  };
+
+  Objects Objs;
+  for (unsigned I = 0; I != NumPairs; ++I) {
+    std::string N = std::to_string(I);
+    if (auto Err = CompileDef("def g" + N + "(x) x * 0.5 + " + N + ";",
+                              Objs.Callees))
+      return std::move(Err);
+    std::string Filler = "def h" + N + "(x) x";
+    for (unsigned T = 1; T <= FillerTerms; ++T)
+      Filler += formatv(" + x * {0}.5", T).str();
+    if (auto Err = CompileDef(Filler + ";", Objs.Fillers))
+      return std::move(Err);
+    if (auto Err = CompileDef("def f" + N + "(x) g" + N + "(x) + g" + N +
+                                  "(x + 1);",
+                              Objs.Callers))
+      return std::move(Err);
+  }
+  return Objs;
+}
+
+struct SessionResult {
+  double MeanDistance;  // Between the starts of callers and callees.
+  double SamePage;      // The share of callers on their callee's page.
+  double NanosPerCall;  // Of the callers.
+  uint64_t Placed;      // By the call profile.
+};
+
+/// SessionKind - What a session does with the call profile.
+enum class SessionKind { Record, LayOut, Plain };
+
+/// Link Objs as described above, recording the call profile in ProfileFile
+/// or laying out code by it, as Kind says, and call every caller Rounds
+/// times.
+static Expected<SessionResult> runSession(const Objects &Objs,
+                                          SessionKind Kind,
+                                          StringRef ProfileFile) {
+  auto Opts = KaleidoscopeJITOptions::fromCommandLine();
+  if (!Opts)
+    return Opts.takeError();
+  Opts->SlabBytes = uint64_t(SlabSize) << 20;
+  if (Kind != SessionKind::Plain) {
+    Opts->CallProfile = true;
+    Opts->CallProfileFile = ProfileFile.str();
+    Opts->CallProfileLayoutOnly = Kind == SessionKind::LayOut;
+  }
+  auto J = KaleidoscopeJIT::Create(std::move(*Opts));
+  if (!J)
+    return J.takeError();
+
+  auto Link = [&](const std::unique_ptr<MemoryBuffer> &Obj, StringRef Name,
+                  ResourceTrackerSP RT = nullptr) -> Expected<ExecutorAddr> {
+    auto Buf = MemoryBuffer::getMemBuffer(Obj->getMemBufferRef(),
+                                          /*RequiresNullTerminator=*/false);
+    if (!RT)
+      RT = (*J)->MainJD.getDefaultResourceTracker();
+    if (auto Err = (*J)->ObjLinkingLayer.add(RT, std::move(Buf)))
+      return std::move(Err);
+    auto Sym = (*J)->ES->lookup({&(*J)->MainJD}, (*J)->Mangle(Name.str()));
+    if (!Sym)
+      return Sym.takeError();
+    return Sym->getAddress();
+  };
+
+  std::vector<ExecutorAddr> Callees, Callers;
+  std::vector<ResourceTrackerSP> Fillers;
+  for (unsigned I = 0; I != NumPairs; ++I) {
+    std::string N = std::to_string(I);
+    auto Callee = Link(Objs.Callees[I], "g" + N);
+    if (!Callee)
+      return Callee.takeError();
+    Callees.push_back(*Callee);
+    Fillers.push_back((*J)->MainJD.createResourceTracker());
+    if (auto Filler = Link(Objs.Fillers[I], "h" + N, Fillers.back());
+        !Filler)
+      return Filler.takeError();
+  }
+  for (auto &RT : Fillers)
+    if (auto Err = RT->remove())
+      return std::move(Err);
+  for (unsigned I = 0; I != NumPairs; ++I) {
+    auto Caller = Link(Objs.Callers[I], "f" + std::to_string(I));
+    if (!Caller)
+      return Caller.takeError();
+    Callers.push_back(*Caller);
+  }
+
+  uint64_t PageSize = sys::Process::getPageSizeEstimate();
+  double Distance = 0, SamePage = 0;
+  for (unsigned I = 0; I != NumPairs; ++I) {
+    Distance += std::llabs(int64_t(Callers[I].getValue() -
+                                   Callees[I].getValue()));
+    SamePage += Callers[I].getValue() / PageSize ==
+                Callees[I].getValue() / PageSize;
+  }
+
+  std::vector<double (*)(double)> Fns;
+  for (auto &Addr : Callers)
+    Fns.push_back(Addr.toPtr<double (*)(double)>());
+  double Sum = 0;
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned R = 0; R != Rounds; ++R)
+    for (auto *Fn : Fns)
+      Sum += Fn(R);
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  // g<I>(x) + g<I>(x + 1) is x + 0.5 + 2 * I.
+  double Expected = 0;
+  for (unsigned R = 0; R != Rounds; ++R)
+    for (unsigned I = 0; I != NumPairs; ++I)
+      Expected += R + 0.5 + 2.0 * I;
+  if (Sum != Expected)
+    return make_error<StringError>("the callers returned the wrong results",
+                                   inconvertibleErrorCode());
+
+  auto &Slab = static_cast<SlabMemoryManager &>(
+      (*J)->ES->getExecutorProcessControl().getMemMgr());
+  return SessionResult{Distance / NumPairs, SamePage / NumPairs,
+                       Elapsed.count() * 1e9 / (double(Rounds) * NumPairs),
+                       Slab.getStats().Placed};
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope call layout\n");
+
+  ExitOnError ExitOnErr("bench-call-layout: ");
+
+  if (NumPairs == 0 || Rounds == 0 || SlabSize == 0) {
+    errs() << "bench-call-layout: -n, -rounds and -slab-size must be "
+              "positive\n";
+    return 1;
+  }
+
+  auto Objs = ExitOnErr(compileObjects());
+
+  SmallString<128> ProfileFile;
+  if (auto EC = sys::fs::createTemporaryFile("bench-call-layout", "txt",
+                                             ProfileFile))
+    ExitOnErr(createFileError("temporary file", EC));
+  sys::fs::remove(ProfileFile);
+
+  ExitOnErr(runSession(Objs, SessionKind::Record, ProfileFile).takeError());
+  auto LaidOut = runSession(Objs, SessionKind::LayOut, ProfileFile);
+  sys::fs::remove(ProfileFile);
+  ExitOnErr(LaidOut.takeError());
+  auto Plain = ExitOnErr(runSession(Objs, SessionKind::Plain, ""));
+
+  if (LaidOut->Placed != NumPairs) {
+    errs() << formatv("bench-call-layout: {0} of {1} callers placed by "
+                      "the profile\n",
+                      LaidOut->Placed, NumPairs);
+    return 1;
+  }
+
+  outs() << formatv("{0,-10} {1,14} {2,10} {3,12}\n", "layout",
+                    "distance (KB)", "same page", "ns/call");
+  auto Report = [&](StringRef Name, const SessionResult &R) {
+    outs() << formatv("{0,-10} {1,14:f1} {2,9:f0}% {3,12:f2}\n", Name,
+                      R.MeanDistance / 1024, R.SamePage * 100,
+                      R.NanosPerCall);
+  };
+  Report("first fit", Plain);
+  Report("profile", *LaidOut);
+  return 0;
+}
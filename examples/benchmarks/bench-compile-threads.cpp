@@ -0,0 +1,136 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Measures how materialization throughput scales with the number of compile
+// threads given to KaleidoscopeJIT (see KaleidoscopeJITOptions::
+// NumCompileThreads).
+//
+// Usage: bench-compile-threads [file] [-n=<defs>] [-max-threads=<N>] [-O<n>]
+//
+// Each line of the input must hold one top-level item, as typed into the
+// REPL. Without an input file a program with -n definitions is generated.
+
+#include "Kaleidoscope.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <chrono>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::opt<std::string> InputFile(cl::Positional,
+                                      cl::desc("[input file]"), cl::init(""));
+
+static cl::opt<unsigned>
+    NumDefs("n",
+            cl::desc("Number of definitions to generate if no input file is "
+                     "given"),
+            cl::init(2000));
+
+static cl::opt<unsigned>
+    MaxThreads("max-threads",
+               cl::desc("Largest number of compile threads to measure "
+                        "(default = hardware concurrency)"),
+               cl::init(0));
+
+static std::string generateProgram(unsigned N) {
+  std::string Src;
+  raw_string_ostream OS(Src);
+  for (unsigned I = 0; I != N; ++I)
+    OS << "def f" << I << "(x y) var s = 0 in "
+       << "(for i = 0, i < x in s = s + i * y + " << I << ") + s;\n";
+  return OS.str();
+}
+
+/// Add every definition in Src to a fresh JIT with NumThreads compile threads,
+/// then time a single lookup that materializes all of them.
+static Expected<double> timeCompile(StringRef Src, unsigned NumThreads,
+                                    size_t &NumCompiled) {
+  auto Opts = KaleidoscopeJITOptions::fromCommandLine();
+  if (!Opts)
+    return Opts.takeError();
+  Opts->NumCompileThreads = NumThreads;
+
+  auto J = KaleidoscopeJIT::Create(std::move(*Opts));
+  if (!J)
+    return J.takeError();
+
+  KaleidoscopeParser P;
+  SymbolLookupSet Symbols;
+  SmallVector<StringRef, 0> Lines;
+  Src.split(Lines, '\n', -1, false);
+  for (auto Line : Lines) {
+    auto ParseResult = P.parse(Line);
+    if (!ParseResult || !ParseResult->TopLevelExpr.empty())
+      continue;
+
+    std::string Name = ParseResult->FnAST->getName();
+    auto IRMod = P.codegen(std::move(ParseResult->FnAST), (*J)->DL);
+    if (!IRMod)
+      continue;
+
+    if (auto Err = (*J)->OptimizeLayer.add((*J)->MainJD, std::move(*IRMod)))
+      return std::move(Err);
+    Symbols.add((*J)->Mangle(Name));
+  }
+  NumCompiled = Symbols.size();
+
+  auto Start = std::chrono::steady_clock::now();
+  if (auto Syms = (*J)->ES->lookup(makeJITDylibSearchOrder(&(*J)->MainJD),
+                                   std::move(Symbols));
+      !Syms)
+    return Syms.takeError();
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+
+  return Elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compile throughput\n");
+
+  ExitOnError ExitOnErr("bench-compile-threads: ");
+
+  std::string Src;
+  if (InputFile.empty())
+    Src = generateProgram(NumDefs);
+  else
+    Src = ExitOnErr(errorOrToExpected(MemoryBuffer::getFileOrSTDIN(InputFile)))
+              ->getBuffer()
+              .str();
+
+  unsigned Max = MaxThreads;
+  if (!Max)
+    Max = hardware_concurrency().compute_thread_count();
+
+  SmallVector<unsigned> ThreadCounts;
+  for (unsigned N = 1; N < Max; N *= 2)
+    ThreadCounts.push_back(N);
+  ThreadCounts.push_back(Max);
+
+  outs() << formatv("{0,8} {1,8} {2,12} {3,12} {4,8}\n", "threads", "defs",
+                    "time (ms)", "defs/s", "speedup");
+  double BaseTime = 0;
+  for (unsigned N : ThreadCounts) {
+    size_t NumCompiled = 0;
+    double Time = ExitOnErr(timeCompile(Src, N, NumCompiled));
+    if (!BaseTime)
+      BaseTime = Time;
+    outs() << formatv("{0,8} {1,8} {2,12:f1} {3,12:f0} {4,8:f2}\n", N,
+                      NumCompiled, Time * 1000, NumCompiled / Time,
+                      BaseTime / Time);
+  }
+
+  return 0;
+}
@@ -0,0 +1,138 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Compares a Kaleidoscope loop that calls a small host function through the
+// linker with the same loop when the function's IR is registered with
+// KaleidoscopeJIT::HostIR, so that the optimizer can inline it.
+//
+// Usage: bench-host-inline [-n=<iterations>] [-repeat=<N>] [-O<n>]
+
+#include "Kaleidoscope.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <chrono>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::opt<unsigned>
+    NumIterations("n", cl::desc("Number of loop iterations per run"),
+                  cl::init(1 << 20));
+
+static cl::opt<unsigned>
+    Repeat("repeat", cl::desc("Number of times to run the loop"),
+           cl::init(100));
+
+extern "C" double hostClamp(double X, double Lo, double Hi) {
+  return X < Lo ? Lo : (X > Hi ? Hi : X);
+}
+
+static const char HostClampIR[] = R"(
+define double @hostClamp(double %x, double %lo, double %hi) {
+  %below = fcmp olt double %x, %lo
+  %above = fcmp ogt double %x, %hi
+  %upper = select i1 %above, double %hi, double %x
+  %r = select i1 %below, double %lo, double %upper
+  ret double %r
+}
+)";
+
+static const char Kernel[] =
+    "def kernel(n) var s = 0 in "
+    "(for i = 0, i < n in s = s + hostClamp(i - 1000, 0, 100)) + s;";
+
+using KernelFn = double (*)(double);
+
+/// Compile Kernel in a JIT of its own, with hostClamp's IR if Inline is set,
+/// and return the JIT and the kernel's address.
+static Expected<std::pair<std::unique_ptr<KaleidoscopeJIT>, KernelFn>>
+compileKernel(bool Inline) {
+  auto Opts = KaleidoscopeJITOptions::fromCommandLine();
+  if (!Opts)
+    return Opts.takeError();
+  auto J = KaleidoscopeJIT::Create(std::move(*Opts));
+  if (!J)
+    return J.takeError();
+
+  SymbolMap HostSymbols;
+  HostSymbols[(*J)->Mangle("hostClamp")] = {
+      ExecutorAddr::fromPtr(&hostClamp), JITSymbolFlags::Exported};
+  if (auto Err = (*J)->MainJD.define(absoluteSymbols(std::move(HostSymbols))))
+    return std::move(Err);
+
+  KaleidoscopeParser P;
+  if (Inline) {
+    if (auto Err = (*J)->HostIR.addIR(HostClampIR, "hostClamp"))
+      return std::move(Err);
+    P.HostIR = &(*J)->HostIR;
+  }
+  P.parse("extern hostClamp(x lo hi);");
+  auto ParseResult = P.parse(Kernel);
+  if (!ParseResult)
+    return make_error<StringError>("cannot parse the kernel",
+                                   inconvertibleErrorCode());
+  auto IRMod = P.codegen(std::move(ParseResult->FnAST), (*J)->DL);
+  if (!IRMod)
+    return make_error<StringError>("cannot compile the kernel",
+                                   inconvertibleErrorCode());
+  if (auto Err = (*J)->OptimizeLayer.add((*J)->MainJD, std::move(*IRMod)))
+    return std::move(Err);
+
+  auto Sym = (*J)->ES->lookup({&(*J)->MainJD}, (*J)->Mangle("kernel"));
+  if (!Sym)
+    return Sym.takeError();
+  auto Fn = Sym->getAddress().toPtr<KernelFn>();
+  return std::make_pair(std::move(*J), Fn);
+}
+
+/// Run F Repeat times and return the elapsed time in seconds.
+template <typename FnT> static double timeRepeated(FnT F) {
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned R = 0; R != Repeat; ++R)
+    F();
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  return Elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Kaleidoscope host function inlining\n");
+
+  ExitOnError ExitOnErr("bench-host-inline: ");
+
+  auto [CallJ, Call] = ExitOnErr(compileKernel(/*Inline=*/false));
+  auto [InlineJ, Inlined] = ExitOnErr(compileKernel(/*Inline=*/true));
+
+  double N = NumIterations;
+  if (Call(N) != Inlined(N)) {
+    errs() << "bench-host-inline: the inlined kernel computes a different "
+              "result\n";
+    return 1;
+  }
+
+  // Keep the results live so the calls cannot be dropped.
+  double Sink = 0;
+  double CallTime = timeRepeated([&]() { Sink += Call(N); });
+  double InlineTime = timeRepeated([&]() { Sink += Inlined(N); });
+
+  double MIters = N * Repeat / 1e6;
+  outs() << formatv("{0,-8} {1,12} {2,12} {3,8}\n", "kernel", "time (ms)",
+                    "Miter/s", "speedup");
+  outs() << formatv("{0,-8} {1,12:f1} {2,12:f0} {3,7:f2}x\n", "call",
+                    CallTime * 1000, MIters / CallTime, 1.0);
+  outs() << formatv("{0,-8} {1,12:f1} {2,12:f0} {3,7:f2}x\n", "inlined",
+                    InlineTime * 1000, MIters / InlineTime,
+                    CallTime / InlineTime);
+  outs() << formatv("checksum: {0}\n", Sink);
+  return 0;
+}
@@ -0,0 +1,116 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Compares resolving host functions with EPCDynamicLibrarySearchGenerator,
+// which dlsyms each symbol, against ProcessSymbolsGenerator, which answers
+// lookups from a snapshot of the process's symbol tables. Each round creates
+// a fresh JITDylib (as every module with its own link order would) and looks
+// up a fixed set of libc and libm functions through it, so the generator is
+// asked for every symbol in every round.
+//
+// Usage: bench-host-symbols [-rounds=<N>]
+
+#include "Kaleidoscope.h"
+#include "ProcessSymbolsGenerator.h"
+
+#include "llvm/ExecutionEngine/Orc/EPCDynamicLibrarySearchGenerator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <chrono>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::opt<unsigned>
+    Rounds("rounds", cl::desc("Number of times to look up the host symbols"),
+           cl::init(2000));
+
+static const char *HostSymbols[] = {
+    "sin",    "cos",     "tan",    "asin",    "acos",   "atan",  "atan2",
+    "sinh",   "cosh",    "tanh",   "exp",     "exp2",   "log",   "log2",
+    "log10",  "pow",     "sqrt",   "cbrt",    "hypot",  "fmod",  "floor",
+    "ceil",   "round",   "trunc",  "fabs",    "fmin",   "fmax",  "erf",
+    "lgamma", "malloc",  "free",   "memcpy",  "memset", "qsort", "putchar",
+    "printf", "fprintf", "strlen", "strcmp",  "abort",  "exit",  "getenv",
+};
+
+/// SharedGenerator - Forwards to a generator shared by all rounds, so that
+/// the snapshot is only taken once.
+class SharedGenerator : public DefinitionGenerator {
+public:
+  SharedGenerator(DefinitionGenerator &G) : G(G) {}
+
+  Error tryToGenerate(LookupState &LS, LookupKind K, JITDylib &JD,
+                      JITDylibLookupFlags JDLookupFlags,
+                      const SymbolLookupSet &LookupSet) override {
+    return G.tryToGenerate(LS, K, JD, JDLookupFlags, LookupSet);
+  }
+
+private:
+  DefinitionGenerator &G;
+};
+
+/// Look up HostSymbols through a fresh JITDylib using G, Rounds times, and
+/// return the elapsed time in seconds.
+static Expected<double> timeLookups(KaleidoscopeJIT &J, DefinitionGenerator &G,
+                                    StringRef Name) {
+  SymbolLookupSet Names;
+  for (const char *Sym : HostSymbols)
+    Names.add(J.Mangle(Sym));
+
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned R = 0; R != Rounds; ++R) {
+    auto JD = J.ES->createJITDylib((Name + Twine(R)).str());
+    if (!JD)
+      return JD.takeError();
+    JD->addGenerator(std::make_unique<SharedGenerator>(G));
+    auto Result = J.ES->lookup(makeJITDylibSearchOrder(&*JD), Names);
+    if (!Result)
+      return Result.takeError();
+    if (Result->size() != Names.size())
+      return make_error<StringError>("missing host symbols",
+                                     inconvertibleErrorCode());
+    if (auto Err = J.ES->removeJITDylib(*JD))
+      return std::move(Err);
+  }
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  return Elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Kaleidoscope JIT host symbol resolution\n");
+
+  ExitOnError ExitOnErr("bench-host-symbols: ");
+
+  auto J = ExitOnErr(KaleidoscopeJIT::Create());
+
+  auto DLSym = ExitOnErr(EPCDynamicLibrarySearchGenerator::GetForTargetProcess(
+      *J->ES));
+  auto Snapshot =
+      ExitOnErr(ProcessSymbolsGenerator::Create(J->DL.getGlobalPrefix()));
+
+  double DLSymTime = ExitOnErr(timeLookups(*J, *DLSym, "dlsym"));
+  double SnapshotTime = ExitOnErr(timeLookups(*J, *Snapshot, "snapshot"));
+
+  size_t Lookups = size_t(Rounds) * std::size(HostSymbols);
+  outs() << formatv("{0,-10} {1,14} {2,10}\n", "generator", "ns per symbol",
+                    "speedup");
+  auto Report = [&](StringRef Generator, double Time) {
+    outs() << formatv("{0,-10} {1,14:f1} {2,9:f1}x\n", Generator,
+                      Time * 1e9 / Lookups, DLSymTime / Time);
+  };
+  Report("dlsym", DLSymTime);
+  Report("snapshot", SnapshotTime);
+  Snapshot->printStats(outs());
+  return 0;
+}
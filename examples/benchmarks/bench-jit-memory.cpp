@@ -0,0 +1,148 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Compares linking many small modules with JITLink's default memory manager,
+// which maps pages for every module, against SlabMemoryManager. The modules
+// are compiled up front, so only linking is timed: each object is added and
+// looked up on its own, as the lazy drivers do for every function. Reports
+// the link latency per module and the growth of resident memory and of the
+// number of memory mappings.
+//
+// Usage: bench-jit-memory [-n=<modules>] [-slab-size=<MiB>]
+
+#include "BenchUtils.h"
+#include "Kaleidoscope.h"
+
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <chrono>
+#include <cstdint>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::opt<unsigned> NumModules("n", cl::desc("Number of modules to link"),
+                                    cl::init(10000));
+
+static cl::opt<unsigned>
+    SlabSize("slab-size", cl::desc("Size of the slab in MiB"), cl::init(64));
+
+/// Current number of memory mappings, if known.
+static size_t getNumMappings() {
+#ifdef __linux__
+  if (auto Buf = MemoryBuffer::getFileAsStream("/proc/self/maps"))
+    return (*Buf)->getBuffer().count('\n');
+#endif
+  return 0;
+}
+
+/// Compile NumModules modules with one small function each into Objects.
+static Error
+compileObjects(std::vector<std::unique_ptr<MemoryBuffer>> &Objects) {
+  auto J = KaleidoscopeJIT::Create();
+  if (!J)
+    return J.takeError();
+  auto TM = (*J)->JTMB.createTargetMachine();
+  if (!TM)
+    return TM.takeError();
+  SimpleCompiler Compile(**TM);
+
+  KaleidoscopeParser P;
+  for (unsigned I = 0; I != NumModules; ++I) {
+    auto ParseResult = P.parse(
+        ("def f" + Twine(I) + "(x) x * " + Twine(I) + " + 1;").str());
+    if (!ParseResult)
+      return make_error<StringError>("cannot parse f" + Twine(I),
+                                     inconvertibleErrorCode());
+    auto TSM = P.codegen(std::move(ParseResult->FnAST), (*J)->DL);
+    if (!TSM)
+      return make_error<StringError>("cannot compile f" + Twine(I),
+                                     inconvertibleErrorCode());
+    auto Obj = TSM->withModuleDo([&](Module &M) { return Compile(M); });
+    if (!Obj)
+      return Obj.takeError();
+    Objects.push_back(std::move(*Obj));
+  }
+  return Error::success();
+}
+
+struct LinkResult {
+  double SecondsPerModule;
+  double RSSGrowthMB;
+  long MappingGrowth;
+};
+
+/// Link every object into a fresh JIT that uses a slab of SlabBytes (0 for
+/// the default memory manager).
+static Expected<LinkResult>
+linkObjects(ArrayRef<std::unique_ptr<MemoryBuffer>> Objects,
+            uint64_t SlabBytes) {
+  auto Opts = KaleidoscopeJITOptions::fromCommandLine();
+  if (!Opts)
+    return Opts.takeError();
+  Opts->SlabBytes = SlabBytes;
+  auto J = KaleidoscopeJIT::Create(std::move(*Opts));
+  if (!J)
+    return J.takeError();
+
+  double RSSBefore = getRSSMB();
+  size_t MappingsBefore = getNumMappings();
+  auto Start = std::chrono::steady_clock::now();
+  for (size_t I = 0; I != Objects.size(); ++I) {
+    auto Obj = MemoryBuffer::getMemBuffer(Objects[I]->getMemBufferRef(),
+                                          /*RequiresNullTerminator=*/false);
+    if (auto Err = (*J)->ObjLinkingLayer.add((*J)->MainJD, std::move(Obj)))
+      return std::move(Err);
+    auto Sym = (*J)->ES->lookup({&(*J)->MainJD},
+                                (*J)->Mangle(("f" + Twine(I)).str()));
+    if (!Sym)
+      return Sym.takeError();
+    if (I == 7 && Sym->getAddress().toPtr<double (*)(double)>()(2) != 15)
+      return make_error<StringError>("f7(2) returned the wrong result",
+                                     inconvertibleErrorCode());
+  }
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+
+  return LinkResult{Elapsed.count() / Objects.size(), getRSSMB() - RSSBefore,
+                    long(getNumMappings()) - long(MappingsBefore)};
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Kaleidoscope JIT memory manager comparison\n");
+
+  ExitOnError ExitOnErr("bench-jit-memory: ");
+
+  if (NumModules < 8) {
+    errs() << "bench-jit-memory: -n must be at least 8\n";
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<MemoryBuffer>> Objects;
+  ExitOnErr(compileObjects(Objects));
+
+  auto Default = ExitOnErr(linkObjects(Objects, 0));
+  auto Slab = ExitOnErr(linkObjects(Objects, uint64_t(SlabSize) << 20));
+
+  outs() << formatv("{0,-8} {1,16} {2,14} {3,10}\n", "memory",
+                    "link (us/module)", "RSS (MB)", "mappings");
+  auto Report = [&](StringRef Name, const LinkResult &R) {
+    outs() << formatv("{0,-8} {1,16:f1} {2,14:f1} {3,10}\n", Name,
+                      R.SecondsPerModule * 1e6, R.RSSGrowthMB,
+                      R.MappingGrowth);
+  };
+  Report("default", Default);
+  Report("slab", Slab);
+  return 0;
+}
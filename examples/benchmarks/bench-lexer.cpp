@@ -0,0 +1,92 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Measures single-threaded lexer and parser throughput in MB/s of source.
+//
+// Usage: bench-lexer [file] [-n=<defs>] [-repeat=<N>]
+//
+// Without an input file a program with -n definitions is generated.
+
+#include "Kaleidoscope.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <chrono>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFile(cl::Positional,
+                                      cl::desc("[input file]"), cl::init(""));
+
+static cl::opt<unsigned>
+    NumDefs("n",
+            cl::desc("Number of definitions to generate if no input file is "
+                     "given"),
+            cl::init(20000));
+
+static cl::opt<unsigned>
+    Repeat("repeat", cl::desc("Number of times to process the input"),
+           cl::init(20));
+
+static std::string generateProgram(unsigned N) {
+  std::string Src;
+  raw_string_ostream OS(Src);
+  for (unsigned I = 0; I != N; ++I)
+    OS << "def f" << I << "(x y) # definition " << I << "\n"
+       << "  var s = 0 in (for i = 0, i < x in s = s + i * y + " << I
+       << ".25) + s;\n";
+  return OS.str();
+}
+
+/// Run F Repeat times and return the elapsed time in seconds.
+template <typename FnT> static Expected<double> timeRepeated(FnT F) {
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned R = 0; R != Repeat; ++R)
+    if (auto Err = F())
+      return std::move(Err);
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  return Elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope lexer throughput\n");
+
+  ExitOnError ExitOnErr("bench-lexer: ");
+
+  std::string Src;
+  if (InputFile.empty())
+    Src = generateProgram(NumDefs);
+  else
+    Src = ExitOnErr(errorOrToExpected(MemoryBuffer::getFileOrSTDIN(InputFile)))
+              ->getBuffer()
+              .str();
+
+  size_t NumTokens = 0;
+  double LexTime = ExitOnErr(timeRepeated([&]() -> Error {
+    KaleidoscopeParser P;
+    NumTokens = P.countTokens(Src);
+    return Error::success();
+  }));
+
+  double ParseTime = ExitOnErr(timeRepeated([&]() -> Error {
+    KaleidoscopeParser P;
+    return P.parseScript(Src, /*BatchSize=*/0).takeError();
+  }));
+
+  double MB = double(Src.size()) * Repeat / 1e6;
+  outs() << formatv("{0,8} {1,10} {2,12} {3,10}\n", "phase", "MB", "time (ms)",
+                    "MB/s");
+  outs() << formatv("{0,8} {1,10:f2} {2,12:f1} {3,10:f1}\n", "lex", MB,
+                    LexTime * 1000, MB / LexTime);
+  outs() << formatv("{0,8} {1,10:f2} {2,12:f1} {3,10:f1}\n", "parse", MB,
+                    ParseTime * 1000, MB / ParseTime);
+  outs() << formatv("{0} tokens, {1:f1} Mtokens/s\n", NumTokens,
+                    NumTokens * double(Repeat) / LexTime / 1e6);
+
+  return 0;
+}
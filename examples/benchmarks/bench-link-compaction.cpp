@@ -0,0 +1,176 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Measures what CompactionPlugin (-jit-compact) saves when linking many small
+// modules that use the same floating point constants, as per-line modules
+// do. The modules are compiled up front and linked into a slab, each added
+// and looked up on its own, with and without compaction, and once more with
+// compaction into a slab too small for them, so that the constants of later
+// modules are copied into them instead (see SlabMemoryManager::allocate).
+// Every function is called once all are linked, to check that the constants
+// they refer to hold the right values. Reports the link latency per module,
+// the slab memory in use afterwards, the bytes that compaction dropped before
+// allocation and the modules that did not fit into the slab.
+//
+// Usage: bench-link-compaction [-n=<modules>] [-slab-size=<MiB>]
+
+#include "Kaleidoscope.h"
+
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <chrono>
+#include <cstdint>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::opt<unsigned> NumModules("n", cl::desc("Number of modules to link"),
+                                    cl::init(10000));
+
+static cl::opt<unsigned>
+    SlabSize("slab-size", cl::desc("Size of the slab in MiB"), cl::init(64));
+
+/// Compile NumModules modules with one small function each into Objects.
+/// The functions use the same two constants and one of eight others, as
+/// code typed at the REPL keeps using the same few.
+static Error
+compileObjects(std::vector<std::unique_ptr<MemoryBuffer>> &Objects) {
+  auto J = KaleidoscopeJIT::Create();
+  if (!J)
+    return J.takeError();
+  auto TM = (*J)->JTMB.createTargetMachine();
+  if (!TM)
+    return TM.takeError();
+  SimpleCompiler Compile(**TM);
+
+  KaleidoscopeParser P;
+  for (unsigned I = 0; I != NumModules; ++I) {
+    auto ParseResult = P.parse(("def f" + Twine(I) +
+                                "(x) (x + 1.5) * (x - 0.5) + " +
+                                Twine(I % 8) + ";")
+                                   .str());
+    if (!ParseResult)
+      return make_error<StringError>("cannot parse f" + Twine(I),
+                                     inconvertibleErrorCode());
+    auto TSM = P.codegen(std::move(ParseResult->FnAST), (*J)->DL);
+    if (!TSM)
+      return make_error<StringError>("cannot compile f" + Twine(I),
+                                     inconvertibleErrorCode());
+    auto Obj = TSM->withModuleDo([&](Module &M) { return Compile(M); });
+    if (!Obj)
+      return Obj.takeError();
+    Objects.push_back(std::move(*Obj));
+  }
+  return Error::success();
+}
+
+struct LinkResult {
+  double SecondsPerModule;
+  uint64_t SlabBytesInUse;
+  uint64_t Fallbacks;
+  CompactionPlugin::Stats Compaction;
+};
+
+/// Link every object into a fresh JIT with a slab of SlabBytes, compacting
+/// them if Compact is set, then check what every function returns.
+static Expected<LinkResult>
+linkObjects(ArrayRef<std::unique_ptr<MemoryBuffer>> Objects, bool Compact,
+            uint64_t SlabBytes) {
+  auto Opts = KaleidoscopeJITOptions::fromCommandLine();
+  if (!Opts)
+    return Opts.takeError();
+  Opts->SlabBytes = SlabBytes;
+  Opts->Compact = Compact;
+  auto J = KaleidoscopeJIT::Create(std::move(*Opts));
+  if (!J)
+    return J.takeError();
+
+  std::vector<double (*)(double)> Fns;
+  auto Start = std::chrono::steady_clock::now();
+  for (size_t I = 0; I != Objects.size(); ++I) {
+    auto Obj = MemoryBuffer::getMemBuffer(Objects[I]->getMemBufferRef(),
+                                          /*RequiresNullTerminator=*/false);
+    if (auto Err = (*J)->ObjLinkingLayer.add((*J)->MainJD, std::move(Obj)))
+      return std::move(Err);
+    auto Sym = (*J)->ES->lookup({&(*J)->MainJD},
+                                (*J)->Mangle(("f" + Twine(I)).str()));
+    if (!Sym)
+      return Sym.takeError();
+    Fns.push_back(Sym->getAddress().toPtr<double (*)(double)>());
+  }
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+
+  // f<I>(2) is 3.5 * 1.5 + I % 8.
+  for (size_t I = 0; I != Fns.size(); ++I)
+    if (Fns[I](2) != 5.25 + I % 8)
+      return make_error<StringError>("f" + Twine(I) +
+                                         "(2) returned the wrong result",
+                                     inconvertibleErrorCode());
+
+  // The JIT was created with a slab, so that is its memory manager.
+  auto &Slab = static_cast<SlabMemoryManager &>(
+      (*J)->ES->getExecutorProcessControl().getMemMgr());
+  auto SlabStats = Slab.getStats();
+  LinkResult R{Elapsed.count() / Objects.size(), SlabStats.BytesInUse,
+               SlabStats.Fallbacks, {}};
+  if ((*J)->Compaction)
+    R.Compaction = (*J)->Compaction->getStats();
+  return R;
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Kaleidoscope link-time compaction\n");
+
+  ExitOnError ExitOnErr("bench-link-compaction: ");
+
+  if (NumModules < 8 || SlabSize == 0) {
+    errs() << "bench-link-compaction: -n must be at least 8 and -slab-size "
+              "must be positive\n";
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<MemoryBuffer>> Objects;
+  ExitOnErr(compileObjects(Objects));
+
+  uint64_t SlabBytes = uint64_t(SlabSize) << 20;
+  auto Plain = ExitOnErr(linkObjects(Objects, /*Compact=*/false, SlabBytes));
+  auto Compacted =
+      ExitOnErr(linkObjects(Objects, /*Compact=*/true, SlabBytes));
+  // The smallest slab there is: a page each for read-only and read-write
+  // data, and two for code.
+  auto Overflowing = ExitOnErr(linkObjects(Objects, /*Compact=*/true, 1));
+
+  if (Compacted.Compaction.SharedConstants == 0 ||
+      Overflowing.Fallbacks == 0) {
+    errs() << "bench-link-compaction: no constants were shared, or every "
+              "module fit into the smallest slab\n";
+    return 1;
+  }
+
+  outs() << formatv("{0,-12} {1,16} {2,14} {3,14} {4,10} {5,10}\n",
+                    "linking", "link (us/module)", "slab (KB)",
+                    "dropped (KB)", "shared", "fallbacks");
+  auto Report = [&](StringRef Name, const LinkResult &R) {
+    outs() << formatv("{0,-12} {1,16:f1} {2,14:f1} {3,14:f1} {4,10} {5,10}\n",
+                      Name, R.SecondsPerModule * 1e6,
+                      R.SlabBytesInUse / 1024.0,
+                      R.Compaction.SavedBytes / 1024.0,
+                      R.Compaction.SharedConstants, R.Fallbacks);
+  };
+  Report("plain", Plain);
+  Report("compacted", Compacted);
+  Report("overflowing", Overflowing);
+  return 0;
+}
@@ -0,0 +1,149 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Measures what LinkStatsPlugin (-jit-link-stats) costs when linking many
+// small modules. The modules are compiled up front and linked, each added
+// and looked up on its own, without the plugin, with its counters only and
+// with a JSON-lines file as well. Reports the link latency per module and
+// checks that every module was counted and written.
+//
+// Usage: bench-link-stats [-n=<modules>]
+
+#include "Kaleidoscope.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <chrono>
+#include <cstdint>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::opt<unsigned> NumModules("n", cl::desc("Number of modules to link"),
+                                    cl::init(10000));
+
+/// Compile NumModules modules with one small function each into Objects.
+static Error
+compileObjects(std::vector<std::unique_ptr<MemoryBuffer>> &Objects) {
+  auto J = KaleidoscopeJIT::Create();
+  if (!J)
+    return J.takeError();
+  auto TM = (*J)->JTMB.createTargetMachine();
+  if (!TM)
+    return TM.takeError();
+  SimpleCompiler Compile(**TM);
+
+  KaleidoscopeParser P;
+  for (unsigned I = 0; I != NumModules; ++I) {
+    auto ParseResult = P.parse(
+        ("def f" + Twine(I) + "(x) (x + 1.5) * (x - 0.5) + " + Twine(I % 8) +
+         ";")
+            .str());
+    if (!ParseResult)
+      return make_error<StringError>("cannot parse f" + Twine(I),
+                                     inconvertibleErrorCode());
+    auto TSM = P.codegen(std::move(ParseResult->FnAST), (*J)->DL);
+    if (!TSM)
+      return make_error<StringError>("cannot compile f" + Twine(I),
+                                     inconvertibleErrorCode());
+    auto Obj = TSM->withModuleDo([&](Module &M) { return Compile(M); });
+    if (!Obj)
+      return Obj.takeError();
+    Objects.push_back(std::move(*Obj));
+  }
+  return Error::success();
+}
+
+/// Link every object into a fresh JIT, with link statistics if Stats is set
+/// and written to File if that is not empty. Returns the seconds per module.
+static Expected<double>
+linkObjects(ArrayRef<std::unique_ptr<MemoryBuffer>> Objects, bool Stats,
+            StringRef File) {
+  auto Opts = KaleidoscopeJITOptions::fromCommandLine();
+  if (!Opts)
+    return Opts.takeError();
+  Opts->LinkStats = Stats;
+  Opts->LinkStatsFile = File.str();
+  auto J = KaleidoscopeJIT::Create(std::move(*Opts));
+  if (!J)
+    return J.takeError();
+
+  auto Start = std::chrono::steady_clock::now();
+  for (size_t I = 0; I != Objects.size(); ++I) {
+    auto Obj = MemoryBuffer::getMemBuffer(Objects[I]->getMemBufferRef(),
+                                          /*RequiresNullTerminator=*/false);
+    if (auto Err = (*J)->ObjLinkingLayer.add((*J)->MainJD, std::move(Obj)))
+      return std::move(Err);
+    auto Sym = (*J)->ES->lookup({&(*J)->MainJD},
+                                (*J)->Mangle(("f" + Twine(I)).str()));
+    if (!Sym)
+      return Sym.takeError();
+  }
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+
+  if (Stats) {
+    (*J)->LinkStats->flush();
+    if ((*J)->LinkStats->getTotals().Graphs != Objects.size())
+      return make_error<StringError>("not every graph was counted",
+                                     inconvertibleErrorCode());
+  }
+  return Elapsed.count() / Objects.size();
+}
+
+/// Return the number of lines in File.
+static Expected<size_t> countLines(StringRef File) {
+  auto Buf = MemoryBuffer::getFile(File);
+  if (!Buf)
+    return createFileError(File, Buf.getError());
+  return (*Buf)->getBuffer().count('\n');
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope link statistics\n");
+
+  ExitOnError ExitOnErr("bench-link-stats: ");
+
+  if (NumModules == 0) {
+    errs() << "bench-link-stats: -n must be positive\n";
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<MemoryBuffer>> Objects;
+  ExitOnErr(compileObjects(Objects));
+
+  SmallString<128> File;
+  if (auto EC = sys::fs::createTemporaryFile("bench-link-stats", "jsonl",
+                                             File))
+    ExitOnErr(createFileError("temporary file", EC));
+
+  auto Off = ExitOnErr(linkObjects(Objects, /*Stats=*/false, ""));
+  auto Counters = ExitOnErr(linkObjects(Objects, /*Stats=*/true, ""));
+  auto JSONLines = ExitOnErr(linkObjects(Objects, /*Stats=*/true, File));
+  size_t Records = ExitOnErr(countLines(File));
+  sys::fs::remove(File);
+  if (Records != Objects.size()) {
+    errs() << formatv("bench-link-stats: {0} records written for {1} "
+                      "modules\n",
+                      Records, Objects.size());
+    return 1;
+  }
+
+  outs() << formatv("{0,-12} {1,16}\n", "statistics", "link (us/module)");
+  outs() << formatv("{0,-12} {1,16:f1}\n", "off", Off * 1e6);
+  outs() << formatv("{0,-12} {1,16:f1}\n", "counters", Counters * 1e6);
+  outs() << formatv("{0,-12} {1,16:f1}\n", "json lines", JSONLines * 1e6);
+  return 0;
+}
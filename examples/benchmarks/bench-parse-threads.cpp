@@ -0,0 +1,120 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Measures how parse throughput scales when N threads each parse the same
+// source with their own KaleidoscopeParser.
+//
+// Usage: bench-parse-threads [file] [-n=<defs>] [-max-threads=<N>]
+//                            [-repeat=<N>]
+//
+// Without an input file a program with -n definitions is generated.
+
+#include "Kaleidoscope.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFile(cl::Positional,
+                                      cl::desc("[input file]"), cl::init(""));
+
+static cl::opt<unsigned>
+    NumDefs("n",
+            cl::desc("Number of definitions to generate if no input file is "
+                     "given"),
+            cl::init(20000));
+
+static cl::opt<unsigned>
+    MaxThreads("max-threads",
+               cl::desc("Largest number of parser threads to measure "
+                        "(default = hardware concurrency)"),
+               cl::init(0));
+
+static cl::opt<unsigned>
+    Repeat("repeat", cl::desc("Number of times each thread parses the input"),
+           cl::init(5));
+
+static std::string generateProgram(unsigned N) {
+  std::string Src;
+  raw_string_ostream OS(Src);
+  for (unsigned I = 0; I != N; ++I)
+    OS << "def f" << I << "(x y) var s = 0 in "
+       << "(for i = 0, i < x in s = s + i * y + " << I << ") + s;\n";
+  return OS.str();
+}
+
+/// Parse Src Repeat times on each of NumThreads threads, each with a parser of
+/// its own, and return the elapsed wall-clock time in seconds.
+static Expected<double> timeParse(StringRef Src, unsigned NumThreads) {
+  std::mutex ErrMutex;
+  Error Err = Error::success();
+  std::vector<std::thread> Threads;
+
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned I = 0; I != NumThreads; ++I)
+    Threads.emplace_back([&]() {
+      for (unsigned R = 0; R != Repeat; ++R) {
+        KaleidoscopeParser P;
+        if (auto Script = P.parseScript(Src, /*BatchSize=*/0); !Script) {
+          std::lock_guard<std::mutex> Lock(ErrMutex);
+          Err = joinErrors(std::move(Err), Script.takeError());
+          return;
+        }
+      }
+    });
+  for (auto &T : Threads)
+    T.join();
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+
+  if (Err)
+    return std::move(Err);
+  return Elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope parse throughput\n");
+
+  ExitOnError ExitOnErr("bench-parse-threads: ");
+
+  std::string Src;
+  if (InputFile.empty())
+    Src = generateProgram(NumDefs);
+  else
+    Src = ExitOnErr(errorOrToExpected(MemoryBuffer::getFileOrSTDIN(InputFile)))
+              ->getBuffer()
+              .str();
+
+  unsigned Max = MaxThreads;
+  if (!Max)
+    Max = hardware_concurrency().compute_thread_count();
+
+  SmallVector<unsigned> ThreadCounts;
+  for (unsigned N = 1; N < Max; N *= 2)
+    ThreadCounts.push_back(N);
+  ThreadCounts.push_back(Max);
+
+  outs() << formatv("{0,8} {1,12} {2,12} {3,8}\n", "threads", "time (ms)",
+                    "MB/s", "speedup");
+  double BaseRate = 0;
+  for (unsigned N : ThreadCounts) {
+    double Time = ExitOnErr(timeParse(Src, N));
+    double Rate = double(Src.size()) * N * Repeat / Time / 1e6;
+    if (!BaseRate)
+      BaseRate = Rate;
+    outs() << formatv("{0,8} {1,12:f1} {2,12:f1} {3,8:f2}\n", N, Time * 1000,
+                      Rate, Rate / BaseRate);
+  }
+
+  return 0;
+}
@@ -0,0 +1,165 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Compares the latency of running JIT'd code in process with running it in
+// an executor process (-jit-out-of-process): a call to a trivial function,
+// the same call made -batch at a time in one round trip, and the evaluation
+// of a top-level expression end to end, which also links its code into the
+// executor's shared memory and frees it again.
+//
+// Usage: bench-remote-calls [-n=<calls>] [-batch=<N>] [-exprs=<N>]
+
+#include "Kaleidoscope.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <chrono>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::opt<unsigned> NumCalls("n", cl::desc("Number of calls to time"),
+                                  cl::init(100000));
+
+static cl::opt<unsigned>
+    BatchSize("batch", cl::desc("Number of calls per batched round trip"),
+              cl::init(100));
+
+static cl::opt<unsigned>
+    NumExprs("exprs", cl::desc("Number of top-level expressions to evaluate"),
+             cl::init(1000));
+
+struct CallResult {
+  double CallUS;
+  std::optional<double> BatchedUS; // Per call, out of process only.
+  double EvaluateUS;
+};
+
+/// Return the seconds that F takes per iteration, run Iterations times.
+template <typename FnT>
+static Expected<double> timePerIteration(unsigned Iterations, FnT F) {
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned I = 0; I != Iterations; ++I)
+    if (auto Err = F(I))
+      return std::move(Err);
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  return Elapsed.count() / Iterations;
+}
+
+static Error wrongResult(StringRef What) {
+  return make_error<StringError>(What + " returned the wrong result",
+                                 inconvertibleErrorCode());
+}
+
+/// Time calls to `one` and evaluations in a JIT that runs code in process
+/// or, if Remote is set, in an executor.
+static Expected<CallResult> timeCalls(bool Remote) {
+  auto Opts = KaleidoscopeJITOptions::fromCommandLine();
+  if (!Opts)
+    return Opts.takeError();
+  Opts->OutOfProcess = Remote;
+  auto JOrErr = KaleidoscopeJIT::Create(std::move(*Opts));
+  if (!JOrErr)
+    return JOrErr.takeError();
+  auto &J = **JOrErr;
+
+  KaleidoscopeParser P;
+  auto Def = P.parse("def one() 1;");
+  if (!Def)
+    return make_error<StringError>("cannot parse one",
+                                   inconvertibleErrorCode());
+  std::vector<std::unique_ptr<FunctionAST>> FnASTs;
+  FnASTs.push_back(std::move(Def->FnAST));
+  if (auto Err = J.addDefinitions(P, std::move(FnASTs)))
+    return std::move(Err);
+  auto Sym = J.ES->lookup({&J.MainJD}, J.Mangle("one"));
+  if (!Sym)
+    return Sym.takeError();
+  ExecutorAddr One = Sym->getAddress();
+
+  auto *OneFn = One.toPtr<double (*)()>();
+  auto Call = timePerIteration(NumCalls, [&](unsigned) -> Error {
+    if (!Remote)
+      return OneFn() == 1 ? Error::success() : wrongResult("one");
+    auto Results = J.Executor->runBatch(One);
+    if (!Results)
+      return Results.takeError();
+    return Results->front() == 1 ? Error::success() : wrongResult("one");
+  });
+  if (!Call)
+    return Call.takeError();
+  CallResult R;
+  R.CallUS = *Call * 1e6;
+
+  if (Remote) {
+    std::vector<ExecutorAddr> Batch(BatchSize, One);
+    auto RunBatch = [&](unsigned) -> Error {
+      auto Results = J.Executor->runBatch(Batch);
+      if (!Results)
+        return Results.takeError();
+      return Results->size() == BatchSize && Results->back() == 1
+                 ? Error::success()
+                 : wrongResult("a batch of one");
+    };
+    auto Batched = timePerIteration(NumCalls / BatchSize, RunBatch);
+    if (!Batched)
+      return Batched.takeError();
+    R.BatchedUS = *Batched / BatchSize * 1e6;
+  }
+
+  auto Evaluate = timePerIteration(NumExprs, [&](unsigned I) -> Error {
+    auto Expr = P.parse(("one() + " + Twine(I) + ";").str());
+    if (!Expr)
+      return make_error<StringError>("cannot parse an expression",
+                                     inconvertibleErrorCode());
+    std::vector<std::unique_ptr<FunctionAST>> Exprs;
+    Exprs.push_back(std::move(Expr->FnAST));
+    auto Results = J.evaluate(P, std::move(Exprs));
+    if (!Results)
+      return Results.takeError();
+    return Results->front() == 1 + I ? Error::success()
+                                     : wrongResult("an expression");
+  });
+  if (!Evaluate)
+    return Evaluate.takeError();
+  R.EvaluateUS = *Evaluate * 1e6;
+  return R;
+}
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Kaleidoscope remote call latency\n");
+
+  ExitOnError ExitOnErr("bench-remote-calls: ");
+
+  if (BatchSize == 0 || NumCalls < BatchSize || NumExprs == 0) {
+    errs() << "bench-remote-calls: -n must be at least -batch, and -batch "
+              "and -exprs must be positive\n";
+    return 1;
+  }
+
+  // The executor is forked first, while this process has no other threads.
+  auto Remote = ExitOnErr(timeCalls(/*Remote=*/true));
+  auto InProcess = ExitOnErr(timeCalls(/*Remote=*/false));
+
+  outs() << formatv("{0,-10} {1,10} {2,18} {3,14}\n", "executor",
+                    "call (us)", "batched (us/call)", "evaluate (us)");
+  auto Report = [&](StringRef Name, const CallResult &R) {
+    std::string Batched =
+        R.BatchedUS ? formatv("{0:f3}", *R.BatchedUS).str() : "-";
+    outs() << formatv("{0,-10} {1,10:f3} {2,18} {3,14:f1}\n", Name, R.CallUS,
+                      Batched, R.EvaluateUS);
+  };
+  Report("in-process", InProcess);
+  Report("remote", Remote);
+  return 0;
+}
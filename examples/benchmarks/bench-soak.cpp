@@ -0,0 +1,131 @@
+/* See the LICENSE file in the project root for license terms. */
+
+// Soak test for a long-running REPL: evaluates -n top-level expressions one
+// at a time, redefining the function they call every -redefine-every
+// evaluations, and samples resident set size and heap usage along the way.
+// Fails if RSS grows by more than -max-rss-growth MB after the first sample.
+//
+// Usage: bench-soak [-n=<evaluations>] [-redefine-every=<N>] [-samples=<N>]
+//                   [-max-rss-growth=<MB>] [-O<n>]
+
+#include "BenchUtils.h"
+#include "Kaleidoscope.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::opt<unsigned>
+    NumEvals("n", cl::desc("Number of top-level expressions to evaluate"),
+             cl::init(1000000));
+
+static cl::opt<unsigned> RedefineEvery(
+    "redefine-every",
+    cl::desc("Redefine the called function after this many evaluations "
+             "(0 = never)"),
+    cl::init(1000));
+
+static cl::opt<unsigned>
+    Samples("samples", cl::desc("Number of memory samples to report"),
+            cl::init(10));
+
+static cl::opt<unsigned> MaxRSSGrowth(
+    "max-rss-growth",
+    cl::desc("Fail if RSS grows by more than this many MB after the first "
+             "sample"),
+    cl::init(32));
+
+int main(int argc, char *argv[]) {
+  InitLLVM X(argc, argv);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Kaleidoscope JIT memory soak test\n");
+
+  ExitOnError ExitOnErr("bench-soak: ");
+
+  if (Samples == 0) {
+    errs() << "bench-soak: -samples must be at least 1\n";
+    return 1;
+  }
+
+  auto J = ExitOnErr(KaleidoscopeJIT::Create(
+      ExitOnErr(KaleidoscopeJITOptions::fromCommandLine())));
+
+  KaleidoscopeParser P;
+
+  // Each version of scale multiplies by its version number, so stale code
+  // shows up as a wrong result.
+  unsigned Version = 0;
+  auto Redefine = [&]() -> Error {
+    ++Version;
+    auto ParseResult = P.parse(formatv("def scale(x) x * {0};", Version).str());
+    if (!ParseResult)
+      return make_error<StringError>("could not parse definition",
+                                     inconvertibleErrorCode());
+    std::vector<std::unique_ptr<FunctionAST>> FnASTs;
+    FnASTs.push_back(std::move(ParseResult->FnAST));
+    return J->addDefinitions(P, std::move(FnASTs));
+  };
+  ExitOnErr(Redefine());
+
+  outs() << formatv("{0,12} {1,10} {2,10}\n", "evaluations", "RSS (MB)",
+                    "heap (MB)");
+
+  unsigned SampleEvery = std::max(1u, NumEvals / Samples);
+  double FirstRSS = 0, LastRSS = 0;
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned I = 1; I <= NumEvals; ++I) {
+    if (RedefineEvery && I % RedefineEvery == 0)
+      ExitOnErr(Redefine());
+
+    auto ParseResult = P.parse(formatv("scale({0}) + 1;", I).str());
+    if (!ParseResult)
+      return 1;
+    std::vector<std::unique_ptr<FunctionAST>> Exprs;
+    Exprs.push_back(std::move(ParseResult->FnAST));
+    double Result = ExitOnErr(J->evaluate(P, std::move(Exprs))).front();
+
+    double Expected = double(I) * Version + 1;
+    if (Result != Expected) {
+      errs() << formatv("bench-soak: scale({0}) + 1 = {1}, expected {2}\n", I,
+                        Result, Expected);
+      return 1;
+    }
+
+    if (I % SampleEvery == 0) {
+      LastRSS = getRSSMB();
+      if (!FirstRSS)
+        FirstRSS = LastRSS;
+      outs() << formatv("{0,12} {1,10:f1} {2,10:f1}\n", I, LastRSS,
+                        sys::Process::GetMallocUsage() / double(1 << 20));
+    }
+  }
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+
+  double Growth = LastRSS - FirstRSS;
+  outs() << formatv("{0} evaluations, {1} redefinitions, {2:f0} "
+                    "evaluations/s\n",
+                    NumEvals, Version - 1, NumEvals / Elapsed.count());
+  outs() << formatv("RSS growth after first sample: {0:f1} MB\n", Growth);
+
+  if (Growth > MaxRSSGrowth) {
+    errs() << formatv("bench-soak: RSS grew by {0:f1} MB (limit {1} MB)\n",
+                      Growth, unsigned(MaxRSSGrowth));
+    return 1;
+  }
+  return 0;
+}
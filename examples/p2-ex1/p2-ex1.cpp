@@ -3,12 +3,18 @@
 #include "Kaleidoscope.h"
 
 #include "llvm/LineEditor/LineEditor.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/InitLLVM.h"
 #include "llvm/Support/TargetSelect.h"
 
 using namespace llvm;
 using namespace llvm::orc;
 
+static cl::opt<std::string>
+    ScriptFile(cl::Positional,
+               cl::desc("[script file to run in batch mode, - for stdin]"),
+               cl::init(""));
+
 int main(int argc, char *argv[]) {
   InitLLVM X(argc, argv);
 
@@ -16,43 +22,55 @@ int main(int argc, char *argv[]) {
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
 
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope REPL\n");
+
   ExitOnError ExitOnErr("kaleidoscope: ");
 
-  std::unique_ptr<KaleidoscopeJIT> J = ExitOnErr(KaleidoscopeJIT::Create());
+  std::unique_ptr<KaleidoscopeJIT> J = ExitOnErr(KaleidoscopeJIT::Create(
+      ExitOnErr(KaleidoscopeJITOptions::fromCommandLine())));
 
   KaleidoscopeParser P;
+  P.Profiler = J->Profiler.get();
+  P.HostIR = &J->HostIR;
+
+  // In batch mode, compile the script a batch of definitions at a time, then
+  // evaluate its top-level expressions.
+  if (!ScriptFile.empty()) {
+    auto Script = ExitOnErr(KaleidoscopeScript::load(P, ScriptFile));
+    for (auto &Batch : Script.Batches)
+      ExitOnErr(J->addDefinitions(P, std::move(Batch)));
+    ExitOnErr(Script.run(P, *J, outs()));
+    return 0;
+  }
 
   llvm::LineEditor LE("kaleidoscope");
   while (auto Line = LE.readLine()) {
+    if (handleREPLCommand(*J, *Line, outs()))
+      continue;
+
     auto ParseResult = P.parse(*Line);
     if (!ParseResult)
       continue;
 
-    // If the parser generated a function then CodeGen it to LLVM IR and add
-    // it to the JIT.
-    // dbgs() << "Compiling " << ParseResult->FnAST->getName() << "\n";
-    auto IRMod = P.codegen(std::move(ParseResult->FnAST), J->DL);
-    if (!IRMod)
+    // Top-level expressions are compiled, run and freed right away.
+    if (!ParseResult->TopLevelExpr.empty()) {
+      std::vector<std::unique_ptr<FunctionAST>> Exprs;
+      Exprs.push_back(std::move(ParseResult->FnAST));
+      auto Results = J->evaluate(P, std::move(Exprs));
+      if (!Results) {
+        errs() << "Error: " << toString(Results.takeError()) << "\n";
         continue;
-
-    ExitOnErr(J->CompileLayer.add(J->MainJD, std::move(*IRMod)));
-
-
-    // If this wasn't a top-level expression then just continue.
-    if (ParseResult->TopLevelExpr.empty())
-      continue;
-
-    // If this was a top-level expression then look it up and run it.
-    Expected<ExecutorSymbolDef> ExprSym =
-      J->ES->lookup(&J->MainJD, J->Mangle(ParseResult->TopLevelExpr));
-    if (!ExprSym) {
-      errs() << "Error: " << toString(ExprSym.takeError()) << "\n";
+      }
+      outs() << "Result = " << Results->front() << "\n";
       continue;
     }
 
-    double (*Expr)() = ExprSym->getAddress().toPtr<double (*)()>();
-    double Result = Expr();
-    outs() << "Result = " << Result << "\n";
+    // If the parser generated a function then CodeGen it to LLVM IR and add
+    // it to the JIT, replacing any earlier definition.
+    std::vector<std::unique_ptr<FunctionAST>> FnASTs;
+    FnASTs.push_back(std::move(ParseResult->FnAST));
+    if (auto Err = J->addDefinitions(P, std::move(FnASTs)))
+      errs() << "Error: " << toString(std::move(Err)) << "\n";
   }
 
   return 0;
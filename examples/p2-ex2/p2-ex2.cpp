@@ -3,27 +3,36 @@
 #include "Kaleidoscope.h"
 
 #include "llvm/LineEditor/LineEditor.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/InitLLVM.h"
 #include "llvm/Support/TargetSelect.h"
 
+#include <set>
+
 using namespace llvm;
 using namespace llvm::orc;
 
 class KaleidoscopeASTMU : public MaterializationUnit {
 public:
   KaleidoscopeASTMU(KaleidoscopeParser &P, KaleidoscopeJIT &J,
-                    std::unique_ptr<FunctionAST> FnAST)
-    : MaterializationUnit(getInterface(J, *FnAST)),
-      P(P), J(J), FnAST(std::move(FnAST)) {}
+                    std::vector<std::unique_ptr<FunctionAST>> FnASTs)
+    : MaterializationUnit(getInterface(J, FnASTs)),
+      P(P), J(J), FnASTs(std::move(FnASTs)) {}
 
   StringRef getName() const override {
     return "KaleidoscopeASTMU";
   }
 
   void materialize(std::unique_ptr<MaterializationResponsibility> R) override {
-    // dbgs() << "Compiling " << FnAST->getName() << "\n";
-    if (auto IRMod = P.codegen(std::move(FnAST), J.DL))
-      J.CompileLayer.emit(std::move(R), std::move(*IRMod));
+    // dbgs() << "Compiling " << FnASTs.front()->getName() << "\n";
+    if (J.ObjCache && FnASTs.size() == 1)
+      if (auto Obj = J.ObjCache->lookup(P, *FnASTs.front())) {
+        J.ObjLinkingLayer.emit(std::move(R), std::move(Obj));
+        return;
+      }
+
+    if (auto IRMod = P.codegen(std::move(FnASTs), J.DL))
+      J.OptimizeLayer.emit(std::move(R), std::move(*IRMod));
     else
       R->failMaterialization();
   }
@@ -31,22 +40,104 @@ public:
 private:
 
   static MaterializationUnit::Interface
-  getInterface(KaleidoscopeJIT &J, FunctionAST &FnAST) {
+  getInterface(KaleidoscopeJIT &J,
+               const std::vector<std::unique_ptr<FunctionAST>> &FnASTs) {
+    SymbolFlagsMap Symbols;
+    for (auto &FnAST : FnASTs)
+      Symbols[J.Mangle(FnAST->getName())] =
+          JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    return { std::move(Symbols), nullptr };
+  }
+
+  // Redefinitions go through KaleidoscopeJIT::redefine, which removes the old
+  // unit first, so this only happens if a definition is overridden some other
+  // way before it is compiled. Drop its AST.
+  void discard(const JITDylib &JD, const SymbolStringPtr &Sym) override {
+    erase_if(FnASTs, [&](const std::unique_ptr<FunctionAST> &FnAST) {
+      return J.Mangle(FnAST->getName()) == Sym;
+    });
+  }
+
+  KaleidoscopeParser &P;
+  KaleidoscopeJIT &J;
+  std::vector<std::unique_ptr<FunctionAST>> FnASTs;
+};
+
+/// KaleidoscopeLazyMU - Like KaleidoscopeASTMU, but for a batch of a
+/// KaleidoscopeLazyScript, whose ASTs only exist from materialization until
+/// codegen.
+class KaleidoscopeLazyMU : public MaterializationUnit {
+public:
+  KaleidoscopeLazyMU(KaleidoscopeParser &P, KaleidoscopeJIT &J,
+                     KaleidoscopeLazyScript &Script, size_t Batch)
+    : MaterializationUnit(getInterface(J, Script, Script.getBatch(Batch))),
+      P(P), J(J), Script(Script), Defs(Script.getBatch(Batch)) {}
+
+  StringRef getName() const override {
+    return "KaleidoscopeLazyMU";
+  }
+
+  void materialize(std::unique_ptr<MaterializationResponsibility> R) override {
+    std::vector<std::unique_ptr<FunctionAST>> FnASTs;
+    for (size_t I = Defs.first; I != Defs.second; ++I) {
+      if (Discarded.count(I))
+        continue;
+      auto FnAST = Script.materialize(P, I);
+      if (!FnAST) {
+        J.ES->reportError(FnAST.takeError());
+        R->failMaterialization();
+        return;
+      }
+      FnASTs.push_back(std::move(*FnAST));
+    }
+
+    if (J.ObjCache && FnASTs.size() == 1)
+      if (auto Obj = J.ObjCache->lookup(P, *FnASTs.front())) {
+        J.ObjLinkingLayer.emit(std::move(R), std::move(Obj));
+        return;
+      }
+
+    if (auto IRMod = P.codegen(std::move(FnASTs), J.DL))
+      J.OptimizeLayer.emit(std::move(R), std::move(*IRMod));
+    else
+      R->failMaterialization();
+  }
+
+private:
+  static MaterializationUnit::Interface
+  getInterface(KaleidoscopeJIT &J, const KaleidoscopeLazyScript &Script,
+               std::pair<size_t, size_t> Defs) {
     SymbolFlagsMap Symbols;
-    Symbols[J.Mangle(FnAST.getName())] =
-        JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    for (size_t I = Defs.first; I != Defs.second; ++I)
+      Symbols[J.Mangle(Script.getName(I))] =
+          JITSymbolFlags::Exported | JITSymbolFlags::Callable;
     return { std::move(Symbols), nullptr };
   }
 
   void discard(const JITDylib &JD, const SymbolStringPtr &Sym) override {
-    llvm_unreachable("Kaleidoscope functions are not overridable");
+    for (size_t I = Defs.first; I != Defs.second; ++I)
+      if (!Discarded.count(I) && J.Mangle(Script.getName(I)) == Sym)
+        Discarded.insert(I);
   }
 
   KaleidoscopeParser &P;
   KaleidoscopeJIT &J;
-  std::unique_ptr<FunctionAST> FnAST;
+  KaleidoscopeLazyScript &Script;
+  std::pair<size_t, size_t> Defs;
+  std::set<size_t> Discarded;
 };
 
+static cl::opt<bool> LeanLazy(
+    "lean-lazy",
+    cl::desc("In batch mode, only keep the prototypes of definitions in "
+             "memory, parse each body again when it is compiled, and report "
+             "the memory held by the definitions that never were"));
+
+static cl::opt<std::string>
+    ScriptFile(cl::Positional,
+               cl::desc("[script file to run in batch mode, - for stdin]"),
+               cl::init(""));
+
 int main(int argc, char *argv[]) {
   InitLLVM X(argc, argv);
 
@@ -54,38 +145,80 @@ int main(int argc, char *argv[]) {
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
 
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope REPL\n");
+
   ExitOnError ExitOnErr("kaleidoscope: ");
 
-  std::unique_ptr<KaleidoscopeJIT> J = ExitOnErr(KaleidoscopeJIT::Create());
+  std::unique_ptr<KaleidoscopeJIT> J = ExitOnErr(KaleidoscopeJIT::Create(
+      ExitOnErr(KaleidoscopeJITOptions::fromCommandLine())));
 
   KaleidoscopeParser P;
+  P.Profiler = J->Profiler.get();
+  P.HostIR = &J->HostIR;
+
+  // In batch mode, add the script a batch of definitions at a time, then
+  // evaluate its top-level expressions.
+  if (!ScriptFile.empty() && LeanLazy) {
+    auto Script = ExitOnErr(KaleidoscopeLazyScript::load(P, ScriptFile));
+    for (size_t B = 0, E = Script->getNumBatches(); B != E; ++B)
+      ExitOnErr(J->MainJD.define(
+          std::make_unique<KaleidoscopeLazyMU>(P, *J, *Script, B)));
+    ExitOnErr(Script->run(P, *J, outs()));
+    Script->printMemoryReport(errs());
+    return 0;
+  }
+
+  if (!ScriptFile.empty()) {
+    auto Script = ExitOnErr(KaleidoscopeScript::load(P, ScriptFile));
+    for (auto &Batch : Script.Batches)
+      ExitOnErr(J->redefine(Batch, [&](ResourceTrackerSP RT) {
+        return J->MainJD.define(
+            std::make_unique<KaleidoscopeASTMU>(P, *J, std::move(Batch)),
+            std::move(RT));
+      }));
+    ExitOnErr(Script.run(P, *J, outs()));
+    return 0;
+  }
 
   llvm::LineEditor LE("kaleidoscope");
   while (auto Line = LE.readLine()) {
+    if (handleREPLCommand(*J, *Line, outs()))
+      continue;
+
     auto ParseResult = P.parse(*Line);
     if (!ParseResult)
       continue;
 
-    // If the parser generated a function then add the AST to the JIT.
-    ExitOnErr(J->MainJD.define(
-        std::make_unique<KaleidoscopeASTMU>(P, *J,
-                                            std::move(ParseResult->FnAST))));
-
-    // If this wasn't a top-level expression then just continue.
-    if (ParseResult->TopLevelExpr.empty())
+    // Top-level expressions are compiled, run and freed right away.
+    if (!ParseResult->TopLevelExpr.empty()) {
+      std::vector<std::unique_ptr<FunctionAST>> Exprs;
+      Exprs.push_back(std::move(ParseResult->FnAST));
+      auto Results = J->evaluate(P, std::move(Exprs));
+      if (!Results) {
+        errs() << "Error: " << toString(Results.takeError()) << "\n";
+        continue;
+      }
+      outs() << "Result = " << Results->front() << "\n";
       continue;
+    }
 
-    // If this was a top-level expression then look it up and run it.
-    Expected<ExecutorSymbolDef> ExprSym =
-      J->ES->lookup(&J->MainJD, J->Mangle(ParseResult->TopLevelExpr));
-    if (!ExprSym) {
-      errs() << "Error: " << toString(ExprSym.takeError()) << "\n";
+    // If the parser generated a function then add the AST to the JIT,
+    // replacing any earlier definition. A redefinition is code-generated
+    // right away, so that one that fails leaves the earlier definition in
+    // place.
+    std::vector<std::unique_ptr<FunctionAST>> FnASTs;
+    FnASTs.push_back(std::move(ParseResult->FnAST));
+    if (J->isDefined(FnASTs.front()->getName())) {
+      if (auto Err = J->addDefinitions(P, std::move(FnASTs)))
+        errs() << "Error: " << toString(std::move(Err)) << "\n";
       continue;
     }
-
-    double (*Expr)() = ExprSym->getAddress().toPtr<double (*)()>();
-    double Result = Expr();
-    outs() << "Result = " << Result << "\n";
+    if (auto Err = J->redefine(FnASTs, [&](ResourceTrackerSP RT) {
+          return J->MainJD.define(
+              std::make_unique<KaleidoscopeASTMU>(P, *J, std::move(FnASTs)),
+              std::move(RT));
+        }))
+      errs() << "Error: " << toString(std::move(Err)) << "\n";
   }
 
   return 0;
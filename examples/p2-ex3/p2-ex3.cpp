@@ -1,10 +1,14 @@
 /* See the LICENSE file in the project root for license terms. */
 
+#include "HotPatcher.h"
 #include "Kaleidoscope.h"
+#include "SpeculationLayer.h"
+#include "TieredCompileLayer.h"
 
 #include "llvm/ADT/ScopeExit.h"
 #include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/LineEditor/LineEditor.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/InitLLVM.h"
 #include "llvm/Support/TargetSelect.h"
 
@@ -16,18 +20,24 @@ using namespace llvm::orc;
 class KaleidoscopeASTMU : public MaterializationUnit {
 public:
   KaleidoscopeASTMU(KaleidoscopeParser &P, KaleidoscopeJIT &J,
-                    std::unique_ptr<FunctionAST> FnAST)
-    : MaterializationUnit(getInterface(J, *FnAST)),
-      P(P), J(J), FnAST(std::move(FnAST)) {}
+                    IRLayer &BaseLayer, std::vector<std::unique_ptr<FunctionAST>> FnASTs)
+    : MaterializationUnit(getInterface(J, FnASTs)),
+      P(P), J(J), BaseLayer(BaseLayer), FnASTs(std::move(FnASTs)) {}
 
   StringRef getName() const override {
     return "KaleidoscopeASTMU";
   }
 
   void materialize(std::unique_ptr<MaterializationResponsibility> R) override {
-    // dbgs() << "Compiling " << FnAST->getName() << "\n";
-    if (auto IRMod = P.codegen(std::move(FnAST), J.DL))
-      J.CompileLayer.emit(std::move(R), std::move(*IRMod));
+    // dbgs() << "Compiling " << FnASTs.front()->getName() << "\n";
+    if (J.ObjCache && FnASTs.size() == 1)
+      if (auto Obj = J.ObjCache->lookup(P, *FnASTs.front())) {
+        J.ObjLinkingLayer.emit(std::move(R), std::move(Obj));
+        return;
+      }
+
+    if (auto IRMod = P.codegen(std::move(FnASTs), J.DL))
+      BaseLayer.emit(std::move(R), std::move(*IRMod));
     else
       R->failMaterialization();
   }
@@ -35,22 +45,47 @@ public:
 private:
 
   static MaterializationUnit::Interface
-  getInterface(KaleidoscopeJIT &J, FunctionAST &FnAST) {
+  getInterface(KaleidoscopeJIT &J,
+               const std::vector<std::unique_ptr<FunctionAST>> &FnASTs) {
     SymbolFlagsMap Symbols;
-    Symbols[J.Mangle(FnAST.getName())] =
-        JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    for (auto &FnAST : FnASTs)
+      Symbols[J.Mangle(FnAST->getName())] =
+          JITSymbolFlags::Exported | JITSymbolFlags::Callable;
     return { std::move(Symbols), nullptr };
   }
 
+  // Redefinitions go through KaleidoscopeJIT::redefine, which removes the old
+  // unit first, so this only happens if a definition is overridden some other
+  // way before it is compiled. Drop its AST.
   void discard(const JITDylib &JD, const SymbolStringPtr &Sym) override {
-    llvm_unreachable("Kaleidoscope functions are not overridable");
+    erase_if(FnASTs, [&](const std::unique_ptr<FunctionAST> &FnAST) {
+      return J.Mangle(FnAST->getName()) == Sym;
+    });
   }
 
   KaleidoscopeParser &P;
   KaleidoscopeJIT &J;
-  std::unique_ptr<FunctionAST> FnAST;
+  IRLayer &BaseLayer;
+  std::vector<std::unique_ptr<FunctionAST>> FnASTs;
 };
 
+static cl::opt<unsigned> TierUpThreshold(
+    "tier-up-threshold",
+    cl::desc("Emit functions at -O<n> and recompile them at -O3 after this "
+             "many calls (0 = disable tiering)"),
+    cl::init(0));
+
+static cl::opt<bool> Speculate(
+    "speculate",
+    cl::desc("Compile the callees of each function on worker threads as soon "
+             "as the function itself is compiled"),
+    cl::init(false));
+
+static cl::opt<std::string>
+    ScriptFile(cl::Positional,
+               cl::desc("[script file to run in batch mode, - for stdin]"),
+               cl::init(""));
+
 double handleLazyCompileFailure() {
   return std::numeric_limits<double>::signaling_NaN();
 }
@@ -62,11 +97,23 @@ int main(int argc, char *argv[]) {
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
 
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope REPL\n");
+
   ExitOnError ExitOnErr("kaleidoscope: ");
 
-  std::unique_ptr<KaleidoscopeJIT> J = ExitOnErr(KaleidoscopeJIT::Create());
+  // Lazy compilation re-enters the JIT from JIT'd code, which needs both to
+  // be in the same process.
+  auto Opts = ExitOnErr(KaleidoscopeJITOptions::fromCommandLine());
+  if (Opts.OutOfProcess)
+    ExitOnErr(make_error<StringError>("-jit-out-of-process is not supported "
+                                      "with lazy compilation",
+                                      inconvertibleErrorCode()));
+  std::unique_ptr<KaleidoscopeJIT> J =
+      ExitOnErr(KaleidoscopeJIT::Create(std::move(Opts)));
 
   KaleidoscopeParser P;
+  P.Profiler = J->Profiler.get();
+  P.HostIR = &J->HostIR;
 
   auto EPCIU =
     ExitOnErr(EPCIndirectionUtils::Create(J->ES->getExecutorProcessControl()));
@@ -80,47 +127,136 @@ int main(int argc, char *argv[]) {
   ExitOnErr(setUpInProcessLCTMReentryViaEPCIU(*EPCIU));
   auto ISM = EPCIU->createIndirectStubsManager();
 
+  // With tiering enabled, function bodies go to the TieredCompileLayer instead
+  // of being optimized up front.
+  std::unique_ptr<TieredCompileLayer> TierLayer;
+  if (TierUpThreshold)
+    TierLayer = std::make_unique<TieredCompileLayer>(*J, *ISM, TierUpThreshold);
+  IRLayer &BaseLayer =
+      TierLayer ? static_cast<IRLayer &>(*TierLayer) : J->OptimizeLayer;
+
+  // With speculation enabled, function bodies go through the SpeculationLayer
+  // first and the lazy reexports use its stubs manager so that it can tell
+  // when each function is first called.
+  std::unique_ptr<SpeculationLayer> SpecLayer;
+  if (Speculate)
+    SpecLayer = std::make_unique<SpeculationLayer>(*J, BaseLayer, *ISM);
+  IRLayer &ASTLayer =
+      SpecLayer ? static_cast<IRLayer &>(*SpecLayer) : BaseLayer;
+  IndirectStubsManager &Stubs = SpecLayer ? SpecLayer->getStubsManager() : *ISM;
+
+  auto PrintStats = make_scope_exit([&]() {
+    if (TierLayer)
+      errs() << TierLayer->getNumTierUps() << " function(s) tiered up\n";
+
+    if (SpecLayer) {
+      auto Stats = SpecLayer->getStats();
+      errs() << "speculation: " << Stats.Speculated << " compiled, "
+             << Stats.Hits << " hit, " << Stats.Late << " late, "
+             << Stats.Unused << " unused, " << Stats.Failed << " failed\n";
+    }
+  });
+
+  // Redefinitions are compiled in the background and patched into the
+  // existing stubs, see HotPatcher.
+  HotPatcher Patcher(*J, *ISM);
+
+  // Add FnASTs to the JIT as a single lazily compiled module. For each
+  // function <func-name>
+  //   (1) rename the function in the AST to <func-name>$impl
+  //   (2) Create lazy-reexport map from <func-name> to <func-name>$impl
+  // then (3) add the ASTs and lazy-reexports to the JIT
+  //
+  // A function that already has a stub is being redefined: its new body gets
+  // a name of its own, and instead of (2) the Patcher points the stub at it
+  // once it is compiled.
+  auto AddToJIT =
+      [&](std::vector<std::unique_ptr<FunctionAST>> FnASTs) -> Error {
+    std::vector<ResourceTrackerSP> OldRTs;
+    SymbolAliasMap ReExports;
+    std::vector<std::pair<SymbolStringPtr, SymbolStringPtr>> Patches;
+    ResourceTrackerSP NewRT;
+    auto Define = [&](ResourceTrackerSP RT) -> Error {
+      NewRT = RT;
+      for (auto &FnAST : FnASTs) {
+        std::string FnImplName = Patcher.getImplName(FnAST->getName());
+        if (SpecLayer)
+          SpecLayer->addFunction(FnAST->getName(), FnImplName,
+                                 FnAST->getCallees());
+        auto Name = J->Mangle(FnAST->getName());
+        auto ImplName = J->Mangle(FnImplName);
+        if (Patcher.hasStub(*Name))
+          Patches.push_back({Name, ImplName});
+        else
+          ReExports[Name] = {ImplName, JITSymbolFlags::Exported |
+                                          JITSymbolFlags::Callable};
+        FnAST->setName(std::move(FnImplName));
+      }
+      if (auto Err = J->MainJD.define(
+              std::make_unique<KaleidoscopeASTMU>(P, *J, ASTLayer,
+                                                  std::move(FnASTs)),
+              RT))
+        return Err;
+      // The stubs outlive the definitions, so they are not tracked by RT.
+      if (ReExports.empty())
+        return Error::success();
+      return J->MainJD.define(
+          lazyReexports(LCTM, Stubs, J->MainJD, std::move(ReExports)));
+    };
+    if (auto Err = J->redefine(FnASTs, Define, &OldRTs))
+      return Err;
+
+    if (!Patches.empty())
+      Patcher.patch(std::move(Patches), std::move(OldRTs),
+                    std::move(NewRT));
+    return Error::success();
+  };
+
+  // In batch mode, add the script a batch of definitions at a time, then
+  // evaluate its top-level expressions.
+  if (!ScriptFile.empty()) {
+    auto Script = ExitOnErr(KaleidoscopeScript::load(P, ScriptFile));
+    for (auto &Batch : Script.Batches)
+      ExitOnErr(AddToJIT(std::move(Batch)));
+    Patcher.wait();
+    ExitOnErr(Patcher.releaseRetired());
+    ExitOnErr(Script.run(P, *J, outs()));
+    return 0;
+  }
+
   llvm::LineEditor LE("kaleidoscope");
   while (auto Line = LE.readLine()) {
-    auto ParseResult = P.parse(*Line);
-    if (!ParseResult)
+    // No JIT'd code runs between REPL commands, so the bodies that
+    // redefinitions replaced can go.
+    ExitOnErr(Patcher.releaseRetired());
+
+    if (handleREPLCommand(*J, *Line, outs()))
       continue;
 
-    // If the parser generated a function <func-name> then
-    //   (1) rename the function in the AST to <func-name>$impl
-    //   (2) Create lazy-reexport map from <func-name> to <func-name>$impl
-    //   (3) add the AST and lazy-reexports to the JIT
-    std::string FnImplName = ParseResult->FnAST->getName() + "$impl";
-    SymbolAliasMap ReExports({
-        { J->Mangle(ParseResult->FnAST->getName()),
-          { J->Mangle(FnImplName),
-            JITSymbolFlags::Exported | JITSymbolFlags::Callable }
-        }
-      });
-    ParseResult->FnAST->setName(std::move(FnImplName));
-
-    ExitOnErr(J->MainJD.define(
-        std::make_unique<KaleidoscopeASTMU>(P, *J,
-                                            std::move(ParseResult->FnAST))));
-
-    ExitOnErr(J->MainJD.define(
-          lazyReexports(LCTM, *ISM, J->MainJD, std::move(ReExports))));
-
-    // If this wasn't a top-level expression then just continue.
-    if (ParseResult->TopLevelExpr.empty())
+    auto ParseResult = P.parse(*Line);
+    if (!ParseResult)
       continue;
 
-    // If this was a top-level expression then look it up and run it.
-    Expected<ExecutorSymbolDef> ExprSym =
-      J->ES->lookup(&J->MainJD, J->Mangle(ParseResult->TopLevelExpr));
-    if (!ExprSym) {
-      errs() << "Error: " << toString(ExprSym.takeError()) << "\n";
+    // Top-level expressions are compiled, run and freed right away, once
+    // the redefinitions entered before them have been patched in.
+    if (!ParseResult->TopLevelExpr.empty()) {
+      Patcher.wait();
+      std::vector<std::unique_ptr<FunctionAST>> Exprs;
+      Exprs.push_back(std::move(ParseResult->FnAST));
+      auto Results = J->evaluate(P, std::move(Exprs));
+      if (!Results) {
+        errs() << "Error: " << toString(Results.takeError()) << "\n";
+        continue;
+      }
+      outs() << "Result = " << Results->front() << "\n";
       continue;
     }
 
-    double (*Expr)() = ExprSym->getAddress().toPtr<double (*)()>();
-    double Result = Expr();
-    outs() << "Result = " << Result << "\n";
+    // If the parser generated a function then add it to the JIT.
+    std::vector<std::unique_ptr<FunctionAST>> FnASTs;
+    FnASTs.push_back(std::move(ParseResult->FnAST));
+    if (auto Err = AddToJIT(std::move(FnASTs)))
+      errs() << "Error: " << toString(std::move(Err)) << "\n";
   }
 
   return 0;